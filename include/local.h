@@ -10,7 +10,11 @@
 #ifndef LOCAL_H
 #define LOCAL_H
 
-    struct priv_rpigrafx_called {
+#include <stddef.h>
+#include <stdint.h>
+#include "rpigrafx.h"
+
+    extern struct priv_rpigrafx_called {
         int main, mmal, dispmanx;
     } priv_rpigrafx_called;
 
@@ -29,4 +33,562 @@
     int priv_rpigrafx_dispmanx_init();
     int priv_rpigrafx_dispmanx_finalize();
 
+    /* pool.c */
+    struct priv_rpigrafx_pool;
+
+    int priv_rpigrafx_pool_create(struct priv_rpigrafx_pool **poolp,
+                                  int num_threads, const _Bool set_affinity);
+    void priv_rpigrafx_pool_destroy(struct priv_rpigrafx_pool *pool);
+    int priv_rpigrafx_pool_num_threads(const struct priv_rpigrafx_pool *pool);
+    void priv_rpigrafx_pool_run(struct priv_rpigrafx_pool *pool,
+                                void (*func)(void *arg, const int idx,
+                                             const int num),
+                                void *arg);
+
+    /* pipeline.c */
+    struct priv_rpigrafx_pipeline;
+
+    /*
+     * Called from the pipeline thread. Non-zero return values stop the
+     * thread. get_input and get_output wait until one is available, or return
+     * RPIGRAFX_TIMED_OUT after a bounded time so that the thread can quit.
+     */
+    struct priv_rpigrafx_pipeline_ops {
+        int (*get_input)(void *user, void **inputp);
+        int (*get_output)(void *user, void **outputp);
+        int (*process)(void *user, void *input, void *output);
+        void (*release_input)(void *user, void *input);
+        /* Hand a processed output to the consumer. */
+        int (*put_output)(void *user, void *output);
+        /* Give back an output which has not been processed. */
+        void (*release_output)(void *user, void *output);
+    };
+
+    int priv_rpigrafx_pipeline_create(struct priv_rpigrafx_pipeline **plp,
+                                 const struct priv_rpigrafx_pipeline_ops *ops,
+                                 void *user);
+    void priv_rpigrafx_pipeline_destroy(struct priv_rpigrafx_pipeline *pl);
+    int priv_rpigrafx_pipeline_status(struct priv_rpigrafx_pipeline *pl);
+    uint64_t priv_rpigrafx_pipeline_num_frames(
+                                            struct priv_rpigrafx_pipeline *pl);
+    void priv_rpigrafx_pipeline_lock(struct priv_rpigrafx_pipeline *pl);
+    void priv_rpigrafx_pipeline_unlock(struct priv_rpigrafx_pipeline *pl);
+
+    /* ae.c */
+#define PRIV_RPIGRAFX_AE_GRID_WIDTH  16
+#define PRIV_RPIGRAFX_AE_GRID_HEIGHT 12
+
+    struct priv_rpigrafx_raw_job;
+
+    /*
+     * Mean luminance of each cell of a coarse grid over a raw frame, from 0
+     * at the black level to 1 at full scale.
+     */
+    struct priv_rpigrafx_ae_grid {
+        float luma[PRIV_RPIGRAFX_AE_GRID_HEIGHT][PRIV_RPIGRAFX_AE_GRID_WIDTH];
+    };
+
+    struct priv_rpigrafx_ae {
+        rpigrafx_ae_mode_t mode;
+        rpigrafx_ae_metering_t metering;
+        /* Metered luminance to reach, in (0, 1). */
+        float target;
+        float weights[PRIV_RPIGRAFX_AE_GRID_HEIGHT]
+                     [PRIV_RPIGRAFX_AE_GRID_WIDTH];
+        /* Settings for the next frames. */
+        float exposure_us, gain;
+        /* Metered luminance of the last run, and whether it is on target. */
+        float luma;
+        _Bool is_converged;
+    };
+
+    /*
+     * Gather the grid from the raw frame of job, using its source, size,
+     * Bayer pattern and black level only. lines must hold 2 * job->width
+     * samples if job->is_dpcm.
+     */
+    void priv_rpigrafx_ae_gather(struct priv_rpigrafx_ae_grid *grid,
+                                 const struct priv_rpigrafx_raw_job *job,
+                                 uint16_t *lines);
+    void priv_rpigrafx_ae_init(struct priv_rpigrafx_ae *ae,
+                               const rpigrafx_ae_mode_t mode,
+                               const rpigrafx_ae_metering_t metering,
+                               const float target);
+    void priv_rpigrafx_ae_set_mode(struct priv_rpigrafx_ae *ae,
+                                   const rpigrafx_ae_mode_t mode,
+                                   const rpigrafx_ae_metering_t metering,
+                                   const float target);
+    float priv_rpigrafx_ae_metered_luma(const struct priv_rpigrafx_ae *ae,
+                                const struct priv_rpigrafx_ae_grid *grid);
+    /*
+     * Correct the exposure and gain of ae from the grid of a frame taken
+     * with md, or with those of ae if md is not valid, within
+     * max_exposure_us and max_gain. Return whether they changed.
+     */
+    _Bool priv_rpigrafx_ae_update(struct priv_rpigrafx_ae *ae,
+                                  const struct priv_rpigrafx_ae_grid *grid,
+                                  const rpigrafx_rawcam_metadata_t *md,
+                                  const float max_exposure_us,
+                                  const float max_gain);
+
+    /* tuner.c */
+    struct priv_rpigrafx_tuner;
+
+    /* Statistics of a frame for the tuner. */
+    struct priv_rpigrafx_tuner_stats {
+        uint32_t num_saturated;
+        rpigrafx_rawcam_metadata_t metadata;
+        /* Gathered only for RPIGRAFX_AE_MODE_MEAN. */
+        _Bool has_grid;
+        struct priv_rpigrafx_ae_grid grid;
+    };
+
+    /* Called from the tuner thread. Non-zero return values stop the thread. */
+    struct priv_rpigrafx_tuner_ops {
+        /* Write the manual settings to the sensor. */
+        int (*update)(void *user);
+        int (*tune)(void *user, const struct priv_rpigrafx_tuner_stats *stats);
+    };
+
+    /*
+     * Run the tuner on the statistics of every interval-th frame, or of
+     * earlier ones if the number of saturated samples changes by more than
+     * change of it, or never for 0.
+     */
+    int priv_rpigrafx_tuner_create(struct priv_rpigrafx_tuner **tnp,
+                                   const struct priv_rpigrafx_tuner_ops *ops,
+                                   void *user,
+                                   const int interval, const float change);
+    void priv_rpigrafx_tuner_destroy(struct priv_rpigrafx_tuner *tn);
+    int priv_rpigrafx_tuner_status(struct priv_rpigrafx_tuner *tn);
+    void priv_rpigrafx_tuner_set_cadence(struct priv_rpigrafx_tuner *tn,
+                                         const int interval,
+                                         const float change);
+    /* Never blocks on the thread. */
+    void priv_rpigrafx_tuner_post(struct priv_rpigrafx_tuner *tn,
+                        const struct priv_rpigrafx_tuner_stats *stats);
+    void priv_rpigrafx_tuner_update(struct priv_rpigrafx_tuner *tn,
+                                    const _Bool is_enabled);
+    /* Runs so far, and the last and longest times from post to the end. */
+    void priv_rpigrafx_tuner_get_stats(struct priv_rpigrafx_tuner *tn,
+                                       uint64_t *num_runsp, float *latency_usp,
+                                       float *max_latency_usp);
+    void priv_rpigrafx_tuner_lock(struct priv_rpigrafx_tuner *tn);
+    void priv_rpigrafx_tuner_unlock(struct priv_rpigrafx_tuner *tn);
+
+    /* dispatch.c */
+    /*
+     * Lock-free ring of a single producer and a single consumer thread. The
+     * indices run freely and are masked by size - 1.
+     */
+    struct priv_rpigrafx_spsc {
+        void **items;
+        uint32_t mask;
+        /* Advanced only by the consumer and the producer respectively. */
+        uint32_t head, tail;
+    };
+
+    int priv_rpigrafx_spsc_init(struct priv_rpigrafx_spsc *q,
+                                const uint32_t size);
+    void priv_rpigrafx_spsc_free(struct priv_rpigrafx_spsc *q);
+    _Bool priv_rpigrafx_spsc_push(struct priv_rpigrafx_spsc *q, void *item);
+    void* priv_rpigrafx_spsc_pop(struct priv_rpigrafx_spsc *q);
+
+    struct priv_rpigrafx_dispatcher;
+
+    /* Called from the dispatcher thread, and release also on destroy. */
+    struct priv_rpigrafx_dispatcher_ops {
+        void (*deliver)(void *user, int channel, void *item);
+        /* Give back an item which is not delivered. */
+        void (*release)(void *user, int channel, void *item);
+    };
+
+    /* Each of the num_channels channels holds up to depth items. */
+    int priv_rpigrafx_dispatcher_create(
+                            struct priv_rpigrafx_dispatcher **dpp,
+                            const struct priv_rpigrafx_dispatcher_ops *ops,
+                            void *user, const int num_channels,
+                            const uint32_t depth);
+    void priv_rpigrafx_dispatcher_destroy(struct priv_rpigrafx_dispatcher *dp);
+    _Bool priv_rpigrafx_dispatcher_post(struct priv_rpigrafx_dispatcher *dp,
+                                        const int channel, void *item);
+    _Bool priv_rpigrafx_dispatcher_is_current(
+                                        struct priv_rpigrafx_dispatcher *dp);
+    void priv_rpigrafx_dispatcher_get_stats(
+                                        struct priv_rpigrafx_dispatcher *dp,
+                                        const int channel,
+                                        uint64_t *num_deliveredp,
+                                        uint64_t *num_droppedp);
+
+    /* awb.c */
+    /*
+     * Sums and maxima of R, G and B over sampled pixels which have no
+     * saturated channel, in the output bit depth.
+     */
+    struct priv_rpigrafx_awb_stats {
+        uint64_t sum_r, sum_g, sum_b;
+        uint32_t max_r, max_g, max_b;
+        uint32_t num_samples;
+    };
+
+    struct priv_rpigrafx_awb {
+        rpigrafx_awb_mode_t mode;
+        /* Weight of each new estimate, in (0, 1]. */
+        float smoothing;
+        /* Gains to process the next frame with. */
+        float gain_r, gain_g, gain_b;
+        /* Gains of RPIGRAFX_AWB_MODE_OFF. */
+        float default_gain_r, default_gain_g, default_gain_b;
+        /* Gamma of the output which the statistics are gathered from. */
+        float gamma;
+    };
+
+    void priv_rpigrafx_awb_init(struct priv_rpigrafx_awb *awb,
+                                const rpigrafx_awb_mode_t mode,
+                                const float smoothing, const float gain_r,
+                                const float gain_g, const float gain_b);
+    void priv_rpigrafx_awb_set_mode(struct priv_rpigrafx_awb *awb,
+                                    const rpigrafx_awb_mode_t mode,
+                                    const float smoothing);
+    void priv_rpigrafx_awb_update(struct priv_rpigrafx_awb *awb,
+                                  const struct priv_rpigrafx_awb_stats *stats);
+    void priv_rpigrafx_awb_stats_clear(struct priv_rpigrafx_awb_stats *stats);
+    void priv_rpigrafx_awb_stats_merge(struct priv_rpigrafx_awb_stats *dst,
+                                  const struct priv_rpigrafx_awb_stats *src);
+
+    /* tone.c */
+#define PRIV_RPIGRAFX_TONE_MAX_BITS 12
+    /*
+     * Gains are applied as out = min((in * k) >> GAIN_SHIFT, maxv), where k
+     * also scales nbits-bit samples to out_bits-bit ones.
+     */
+#define PRIV_RPIGRAFX_TONE_GAIN_SHIFT 16
+
+    /*
+     * Per-channel maps from raw samples to output ones: gain, clamping, and
+     * gamma (out = maxv * (in / maxv) ^ (1 / gamma)).
+     */
+    struct priv_rpigrafx_tone {
+        /* Parameters which the tables were built for. */
+        float gain_r, gain_g, gain_b, gamma;
+        unsigned nbits, out_bits;
+        _Bool is_built;
+        uint64_t num_builds;
+
+        /*
+         * With gamma 1 the map is done by multiplying with k_{r,g,b}, which
+         * vectorizes, and lut_{r,g,b} are not built.
+         */
+        _Bool is_linear;
+        uint32_t k_r, k_g, k_b;
+        int32_t maxv;
+        /* From nbits-bit samples to out_bits-bit ones. */
+        uint16_t lut_r[1 << PRIV_RPIGRAFX_TONE_MAX_BITS],
+                 lut_g[1 << PRIV_RPIGRAFX_TONE_MAX_BITS],
+                 lut_b[1 << PRIV_RPIGRAFX_TONE_MAX_BITS];
+        /* From the upper 8 bits of samples to 8 bits, for the fused kernel. */
+        uint8_t lut8_r[256], lut8_g[256], lut8_b[256];
+    };
+
+    void priv_rpigrafx_tone_init(struct priv_rpigrafx_tone *tone);
+    uint32_t priv_rpigrafx_tone_gain_to_fixed(const float gain,
+                                              const unsigned nbits,
+                                              const unsigned out_bits);
+    /* Rebuild the maps if the parameters changed. Return whether rebuilt. */
+    _Bool priv_rpigrafx_tone_update(struct priv_rpigrafx_tone *tone,
+                                    const float gain_r, const float gain_g,
+                                    const float gain_b, const float gamma,
+                                    const unsigned nbits,
+                                    const unsigned out_bits);
+
+    /* calib.c */
+    struct priv_rpigrafx_calib {
+        /* Black level in black_level_bits-bit units. */
+        unsigned black_level, black_level_bits;
+        /*
+         * Lens shading gains of R, G and B on a grid_width x grid_height grid,
+         * or 0 x 0 and NULL.
+         */
+        int grid_width, grid_height;
+        float *grid[3];
+        /*
+         * Defective pixels as num_defects pairs of x and y in the frames as
+         * received, or 0 and NULL.
+         */
+        int num_defects;
+        uint16_t *defects;
+    };
+
+    /*
+     * Gains in the calibration map are in this fixed point, below 8 so that
+     * they fit in int16_t. Samples of up to this many bits are supported.
+     */
+#define PRIV_RPIGRAFX_CALIB_SHIFT 12
+
+    /*
+     * A calibration prepared for frames of width x height with nbits-bit
+     * samples. Samples are corrected as
+     * min(((in - black) * gain) >> PRIV_RPIGRAFX_CALIB_SHIFT, max), where
+     * gain also brings black..max back to 0..max.
+     */
+    struct priv_rpigrafx_calib_map {
+        int32_t width, height;
+        unsigned nbits;
+        rpigrafx_bayer_pattern_t bayer_pattern;
+        uint16_t black;
+        /*
+         * Whether the calibration had a lens shading grid. All gains are the
+         * same otherwise.
+         */
+        _Bool has_grid;
+        int grid_height;
+        /*
+         * Grid rows expanded to width, for even and for odd lines, each
+         * followed by a copy of its last row.
+         */
+        uint16_t *rows;
+        /*
+         * x of the defective pixels of line y are defect_x[defect_index[y]]
+         * to defect_x[defect_index[y + 1] - 1], in increasing order. Both are
+         * NULL if there are none.
+         */
+        uint32_t *defect_index;
+        uint16_t *defect_x;
+    };
+
+    void priv_rpigrafx_calib_init(struct priv_rpigrafx_calib *calib);
+    void priv_rpigrafx_calib_free(struct priv_rpigrafx_calib *calib);
+    int priv_rpigrafx_calib_load(struct priv_rpigrafx_calib *calib,
+                                 const char *path);
+    void priv_rpigrafx_calib_map_init(struct priv_rpigrafx_calib_map *map);
+    void priv_rpigrafx_calib_map_free(struct priv_rpigrafx_calib_map *map);
+    int priv_rpigrafx_calib_map_build(struct priv_rpigrafx_calib_map *map,
+                                   const struct priv_rpigrafx_calib *calib,
+                                   const int32_t width, const int32_t height,
+                                   const unsigned nbits,
+                                   const rpigrafx_bayer_pattern_t
+                                                               bayer_pattern);
+    /*
+     * Gains of line y are row0 + (((row1 - row0) * fy) >> 15), where rows are
+     * width long and fy is in [0, 32768).
+     */
+    void priv_rpigrafx_calib_map_rows(
+                                  const struct priv_rpigrafx_calib_map *map,
+                                  const int32_t y, const uint16_t **row0p,
+                                  const uint16_t **row1p, int32_t *fyp);
+
+    /* dpcm.c */
+    void priv_rpigrafx_dpcm10_decode_line(uint16_t *dst, const uint8_t *src,
+                                          const int32_t width);
+
+    /* imx219.c */
+#define PRIV_RPIGRAFX_IMX219_WIDTH  3280
+#define PRIV_RPIGRAFX_IMX219_HEIGHT 2464
+#define PRIV_RPIGRAFX_IMX219_MAX_REGS 16
+
+    struct priv_rpigrafx_imx219_reg {
+        uint16_t addr;
+        uint8_t value;
+    };
+
+    /* Readout of the IMX219 for frames of out_width x out_height. */
+    struct priv_rpigrafx_imx219_geometry {
+        rpigrafx_rawcam_imx219_binning_mode_t mode;
+        /* Binning factor in both directions: 1, 2 or 4. */
+        int bin;
+        /* Window on the pixel array, which is read out and binned. */
+        int32_t x, y, width, height;
+        /* Size of the frames sent, i.e. of the rawcam output. */
+        int32_t out_width, out_height;
+        /* Fewest lines per frame, with the minimum blanking. */
+        int32_t frame_length;
+    };
+
+    /* Return 0 for unknown modes. */
+    int priv_rpigrafx_imx219_binning_factor(
+                        const rpigrafx_rawcam_imx219_binning_mode_t mode);
+    int priv_rpigrafx_imx219_geometry(
+                        struct priv_rpigrafx_imx219_geometry *geom,
+                        const rpigrafx_rawcam_imx219_binning_mode_t mode,
+                        const int32_t x, const int32_t y,
+                        const int32_t out_width, const int32_t out_height);
+    /*
+     * Frame timing, exposure and gains of the IMX219. Lines last line_length
+     * pixels at pixel_rate pixels/s.
+     */
+    struct priv_rpigrafx_imx219_timing {
+        double pixel_rate;
+        int32_t line_length;
+        /* In lines. frame_length is never below min_frame_length. */
+        int32_t min_frame_length, frame_length;
+        /* 0 leaves the exposure to the tuner. */
+        int32_t exposure_lines;
+        _Bool is_manual_gain;
+        uint8_t analog_gain;
+        uint16_t digital_gain;
+    };
+
+    /* Fill regs with the binning and output size of geom. */
+    int priv_rpigrafx_imx219_window_regs(struct priv_rpigrafx_imx219_reg
+                                        regs[PRIV_RPIGRAFX_IMX219_MAX_REGS],
+                        const struct priv_rpigrafx_imx219_geometry *geom);
+    /* Frames as fast as geom allows, with the tuner of librpicam. */
+    void priv_rpigrafx_imx219_timing_init(
+                        struct priv_rpigrafx_imx219_timing *t,
+                        const float exck_freq,
+                        const struct priv_rpigrafx_imx219_geometry *geom);
+    /*
+     * The setters take 0 for the default, and return the effective frame
+     * period and exposure in us, and gain. Exposure is limited by the frame.
+     */
+    float priv_rpigrafx_imx219_set_framerate(
+                        struct priv_rpigrafx_imx219_timing *t,
+                        const float framerate);
+    float priv_rpigrafx_imx219_set_exposure(
+                        struct priv_rpigrafx_imx219_timing *t,
+                        const float exposure_us);
+    float priv_rpigrafx_imx219_set_gain(struct priv_rpigrafx_imx219_timing *t,
+                                        const float gain);
+    float priv_rpigrafx_imx219_frame_period(
+                        const struct priv_rpigrafx_imx219_timing *t);
+    float priv_rpigrafx_imx219_exposure(
+                        const struct priv_rpigrafx_imx219_timing *t);
+    float priv_rpigrafx_imx219_gain(
+                        const struct priv_rpigrafx_imx219_timing *t);
+    /* Fill regs with the timing of t. Return the number of them. */
+    int priv_rpigrafx_imx219_timing_regs(struct priv_rpigrafx_imx219_reg *regs,
+                        const struct priv_rpigrafx_imx219_timing *t);
+    /*
+     * Parse the embedded data lines of a frame, stride bytes apart or a
+     * single line if stride is 0, in the bits per pixel of the frame. Times
+     * are converted with the clocks of t. Return non-zero and leave
+     * md->is_valid unset if the data is malformed or misses registers.
+     */
+    int priv_rpigrafx_imx219_parse_embedded(rpigrafx_rawcam_metadata_t *md,
+                        const uint8_t *data, const size_t length,
+                        const size_t stride, const unsigned nbits,
+                        const struct priv_rpigrafx_imx219_timing *t);
+    int priv_rpigrafx_imx219_write_regs(const struct priv_rpigrafx_imx219_reg
+                                                                        *regs,
+                                        const int num_regs);
+
+    /* raw.c */
+    struct priv_rpigrafx_raw_scratch {
+        void *base;
+        size_t size;
+        uint64_t num_allocs;
+    };
+
+    int priv_rpigrafx_raw_scratch_reserve(struct priv_rpigrafx_raw_scratch *sp,
+                                          const size_t size);
+    void priv_rpigrafx_raw_scratch_free(struct priv_rpigrafx_raw_scratch *sp);
+    struct priv_rpigrafx_raw_job {
+        /* Packed raw frame. */
+        const uint8_t *src;
+        int32_t src_stride;
+        unsigned nbits;
+        int32_t width, height;
+        rpigrafx_bayer_pattern_t bayer_pattern;
+        /*
+         * src is compressed to 8 bits per sample with 10-8-10 DPCM, as the
+         * IMX219 sends it in its 8-bit mode. nbits must then be 10, the
+         * depth of the decoded samples.
+         */
+        _Bool is_dpcm;
+
+        rpigrafx_demosaic_mode_t demosaic_mode;
+        /*
+         * Demosaic each 2x2 Bayer quad into a pixel instead. dst is then
+         * width / 2 x height / 2 and demosaic_mode is not used.
+         */
+        _Bool superpixel;
+        /*
+         * Maps built for nbits and the bit depth of encoding, or NULL to map
+         * with gain_{r,g,b} only, building the maps on each call.
+         */
+        const struct priv_rpigrafx_tone *tone;
+        float gain_r, gain_g, gain_b;
+        /*
+         * Black level and lens shading correction built for width, height
+         * and nbits, applied before the tone maps, or NULL. Its defective
+         * pixels are replaced from their neighbors before that.
+         */
+        const struct priv_rpigrafx_calib_map *calib;
+        /*
+         * Replace samples which stand out from their neighbors on the line by
+         * more than this, in nbits-bit units, before the calibration. 0
+         * disables it.
+         */
+        uint16_t dpc_threshold;
+
+        /*
+         * Output frame in encoding: MMAL_ENCODING_RGB24,
+         * RPIGRAFX_ENCODING_RGB48, RPIGRAFX_ENCODING_RGB16P,
+         * MMAL_ENCODING_I420 or MMAL_ENCODING_NV12. dst_stride is in bytes;
+         * planes of RGB16P are height lines each.
+         */
+        MMAL_FOURCC_T encoding;
+        uint8_t *dst;
+        int32_t dst_stride;
+        /*
+         * For I420 and NV12, dst is the Y plane and these are the U (Cb) and
+         * V (Cr) planes, which are dst_chroma_stride bytes per line. For NV12
+         * they are interleaved, so dst_cr is dst_cb + 1.
+         */
+        uint8_t *dst_cb, *dst_cr;
+        int32_t dst_chroma_stride;
+
+        /*
+         * Number of samples of dst which are saturated, i.e. 255 when scaled
+         * to 8 bits, summed over R, G and B, or NULL. Only every sat_step-th
+         * 2x2 Bayer quad in both directions is counted (0 and 1 mean all)
+         * and the count is scaled up to the whole frame.
+         */
+        uint32_t *num_saturated;
+        int sat_step;
+
+        /*
+         * White balance statistics of dst, or NULL, gathered on every
+         * awb_step-th 2x2 Bayer quad in both directions.
+         */
+        struct priv_rpigrafx_awb_stats *awb_stats;
+        int awb_step;
+
+        /*
+         * Histograms of dst scaled to 8 bits, or NULL. These cost much more
+         * than num_saturated. Both count sensor pixels, so a superpixel
+         * counts four times.
+         */
+        uint32_t *hist_r, *hist_g, *hist_b;
+    };
+
+    int32_t priv_rpigrafx_raw_stride(const int32_t width, const unsigned nbits);
+    int priv_rpigrafx_bayer_channel(const rpigrafx_bayer_pattern_t pattern,
+                                    const int32_t x, const int32_t y);
+    size_t priv_rpigrafx_raw_scratch_size(const int32_t width,
+                                          const int num_threads);
+    int priv_rpigrafx_raw_process(const struct priv_rpigrafx_raw_job *job,
+                                  void *scratch,
+                                  struct priv_rpigrafx_pool *pool);
+
+    /* unpack.c */
+    struct priv_rpigrafx_unpacker {
+        const char *name;
+        void (*raw10_to_raw8)(uint8_t *dst, const uint8_t *src,
+                              const int32_t width);
+        void (*raw10_to_raw16)(uint16_t *dst, const uint8_t *src,
+                               const int32_t width);
+        void (*raw12_to_raw8)(uint8_t *dst, const uint8_t *src,
+                              const int32_t width);
+        void (*raw12_to_raw16)(uint16_t *dst, const uint8_t *src,
+                               const int32_t width);
+    };
+
+    extern const struct priv_rpigrafx_unpacker *priv_rpigrafx_unpacker;
+
+    void priv_rpigrafx_unpack_init();
+    int priv_rpigrafx_unpack_num_variants();
+    const struct priv_rpigrafx_unpacker *priv_rpigrafx_unpack_variant(
+                                                                  const int i);
+
 #endif /* LOCAL_H */
@@ -14,10 +14,22 @@
 #include <bcm_host.h>
 #include <interface/mmal/mmal.h>
 
+    /*
+     * Encodings of rawcam frames which are demosaiced on the CPU and handed to
+     * the user directly, bypassing the isp. The samples are 16-bit and keep
+     * the bit depth of the raw from the camera (LSB-aligned). RGB48 is
+     * interleaved R, G and B. RGB16P is planar: the R, G and B planes of
+     * width * height samples each. Lines are not padded.
+     */
+#define RPIGRAFX_ENCODING_RGB48  MMAL_FOURCC('R', 'G', '4', '8')
+#define RPIGRAFX_ENCODING_RGB16P MMAL_FOURCC('R', 'G', 'P', '6')
+
     struct callback_context {
         MMAL_STATUS_T status;
         MMAL_BUFFER_HEADER_T *header;
         _Bool is_header_passed_to_render;
+        /* Frame of the host-side encodings above, or NULL. */
+        void *host_frame;
     };
 
     typedef struct {
@@ -36,6 +48,11 @@
         RPIGRAFX_RAWCAM_CAMERA_MODEL_IMX219
     } rpigrafx_rawcam_camera_model_t;
 
+    /*
+     * Color filter order of the top-left 2x2 pixels of raw frames as they are
+     * received. Flipping the sensor changes it: the IMX219 gives RGGB, GRBG
+     * when flipped horizontally, GBRG vertically and BGGR both.
+     */
     typedef enum {
         RPIGRAFX_BAYER_PATTERN_BGGR,
         RPIGRAFX_BAYER_PATTERN_GRBG,
@@ -43,10 +60,100 @@
         RPIGRAFX_BAYER_PATTERN_RGGB
     } rpigrafx_bayer_pattern_t;
 
+    /*
+     * Binning of the IMX219 in both directions. The sensor bins pixels of
+     * the same color, so frames keep the Bayer pattern at 1/2 or 1/4 of the
+     * size: 1640x1232 or 820x616 at most. 2X2 and 4X4 bin after the ADC;
+     * 2X2_ANALOG bins before it (the special binning of the datasheet).
+     */
     typedef enum {
-        RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE
+        RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE,
+        RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2,
+        RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2_ANALOG,
+        RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_4X4
     } rpigrafx_rawcam_imx219_binning_mode_t;
 
+    typedef enum {
+        /* Fastest. Each 2x2 Bayer quad gives the same R and B. */
+        RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+        RPIGRAFX_DEMOSAIC_MODE_BILINEAR,
+        /* Gradient-corrected bilinear (Malvar-He-Cutler). Best quality. */
+        RPIGRAFX_DEMOSAIC_MODE_EDGE_AWARE
+    } rpigrafx_demosaic_mode_t;
+
+    typedef enum {
+        /* Fixed gains of the camera model. */
+        RPIGRAFX_AWB_MODE_OFF,
+        /* Make the mean of the scene gray. Default. */
+        RPIGRAFX_AWB_MODE_GRAY_WORLD,
+        /* Make the brightest unsaturated color white. */
+        RPIGRAFX_AWB_MODE_WHITE_PATCH
+    } rpigrafx_awb_mode_t;
+
+    typedef enum {
+        /* The tuner of librpicam, which backs off on saturation. Default. */
+        RPIGRAFX_AE_MODE_HEURISTIC,
+        /* Bring the metered mean luminance to a target. Converges faster. */
+        RPIGRAFX_AE_MODE_MEAN
+    } rpigrafx_ae_mode_t;
+
+    /* Weights of the luminance grid of RPIGRAFX_AE_MODE_MEAN. */
+    typedef enum {
+        /* The whole frame equally. Default. */
+        RPIGRAFX_AE_METERING_AVERAGE,
+        /* The center four times as much as the corners. */
+        RPIGRAFX_AE_METERING_CENTER,
+        /* The central quarter of the width and third of the height only. */
+        RPIGRAFX_AE_METERING_SPOT
+    } rpigrafx_ae_metering_t;
+
+    typedef struct {
+        /* Number of frames processed by the CPU. */
+        uint64_t num_frames;
+        /* Number of allocations of the scratch buffers in total. */
+        uint64_t num_scratch_allocs;
+        /* Number of them done while capturing frames. 0 in steady state. */
+        uint64_t num_frame_allocs;
+        /*
+         * Number of saturated R, G and B samples in the last frame, estimated
+         * on the grid set by rpigrafx_config_rawcam_stats.
+         */
+        uint32_t num_saturated;
+        /* White balance gains which the last frame was processed with. */
+        float gain_r, gain_g, gain_b;
+        /* Number of times the tone maps were built. */
+        uint64_t num_tone_builds;
+        /*
+         * Number of runs of the tuner, and the last and longest times from
+         * the end of a frame to the end of the run on it.
+         */
+        uint64_t num_tuner_runs;
+        float tuner_latency_us, max_tuner_latency_us;
+        /*
+         * For RPIGRAFX_AE_MODE_MEAN, the metered luminance of the last run
+         * and whether it is on the target, or as close as the sensor allows.
+         */
+        float ae_luma;
+        _Bool is_ae_converged;
+        /* Frames which rpigrafx_finish_config dropped waiting for it. */
+        uint32_t num_ae_wait_frames;
+    } rpigrafx_rawcam_stats_t;
+
+    /*
+     * State of the sensor for a rawcam frame, as the sensor reports it in the
+     * embedded data lines sent with the frame.
+     */
+    typedef struct {
+        /* Whether the fields below but pts were reported. */
+        _Bool is_valid;
+        /* Counted by the sensor, modulo 256. */
+        uint32_t frame_count;
+        float frame_period_us, exposure_us;
+        float analog_gain, digital_gain;
+        /* Of the raw frame in us, or MMAL_TIME_UNKNOWN. */
+        int64_t pts;
+    } rpigrafx_rawcam_metadata_t;
+
     int rpigrafx_init()     __attribute__((constructor));
     int rpigrafx_finalize() __attribute__((destructor));
 
@@ -64,13 +171,134 @@
                                const uint32_t data_lanes,
                                const uint32_t nbits_of_raw_from_camera,
                                const rpigrafx_bayer_pattern_t bayer_pattern,
+                               const rpigrafx_demosaic_mode_t demosaic_mode,
                                rpigrafx_frame_config_t *fcp);
+    /*
+     * x and y are the top left of the window read out of the pixel array.
+     * With binning, rpigrafx_finish_config fits frames to the binned array
+     * instead of the whole one, which needs less CSI-2 bandwidth and CPU
+     * time per frame.
+     */
     int rpigrafx_config_rawcam_imx219(const float exck_freq,
                                       uint_least16_t x, uint_least16_t y,
                                       _Bool orient_hori, _Bool orient_vert,
                                       rpigrafx_rawcam_imx219_binning_mode_t
                                                                    binning_mode,
                                       rpigrafx_frame_config_t *fcp);
+    /*
+     * Read out only the window of width x height at (x, y) of the pixel
+     * array, in unbinned pixels, instead of fitting frames to the whole one.
+     * The rawcam output gets the size of the binned window, which the isps
+     * scale to each frame, and the sensor sends only its lines, at a frame
+     * rate which rises as height shrinks. Host-side frames must have the
+     * binned size. All must be even, and multiples of 4 or 8 with 2x2 or 4x4
+     * binning. Overrides x and y of rpigrafx_config_rawcam_imx219; 0 for
+     * width and height removes it. Takes effect on rpigrafx_finish_config.
+     */
+    int rpigrafx_config_rawcam_roi(const int32_t x, const int32_t y,
+                                   const int32_t width, const int32_t height,
+                                   rpigrafx_frame_config_t *fcp);
+    /*
+     * Load the black level, lens shading and defective pixel calibration of
+     * rawcam from path, or remove it if path is NULL. There is none by
+     * default, which keeps the fastest path; the IMX219 needs black_level
+     * 64 10. See src/calib.c for the format. Takes effect on
+     * rpigrafx_finish_config, and fails after it.
+     */
+    int rpigrafx_config_rawcam_calibration(const char *path,
+                                           rpigrafx_frame_config_t *fcp);
+    /*
+     * Defective-pixel correction of rawcam. Pixels listed with defect in the
+     * calibration are always replaced. With threshold in (0, 1), a sample is
+     * also replaced if it is above or below all of its neighbors on the line
+     * by more than threshold of the full scale, e.g. 0.1 for hot pixels; 0
+     * (default) disables it. Both run while unpacking, before the black
+     * level, so hot pixels are not counted as saturated. Takes effect on the
+     * next frame.
+     */
+    int rpigrafx_config_rawcam_defect_correction(const float threshold,
+                                                 rpigrafx_frame_config_t *fcp);
+    /*
+     * Tone mapping of rawcam. White balance gains, clamping and
+     * out = max * (in / max) ^ (1 / gamma) are baked into per-channel tables,
+     * which are rebuilt only when the gains or gamma change. gamma is in
+     * [0.1, 10]; 1 (default) keeps the output linear. Gamma is applied
+     * before demosaicing. Takes effect on the next frame.
+     */
+    int rpigrafx_config_rawcam_tone(const float gamma,
+                                    rpigrafx_frame_config_t *fcp);
+    /*
+     * Encoding which the CPU writes rawcam frames in for the splitter and the
+     * isps: MMAL_ENCODING_RGB24 (default), or MMAL_ENCODING_I420 or
+     * MMAL_ENCODING_NV12 in BT.601 limited range, which move half as many
+     * bytes through the VideoCore. The color is converted while demosaicing.
+     * Call after rpigrafx_config_rawcam. Takes effect on
+     * rpigrafx_finish_config, and fails after it.
+     */
+    int rpigrafx_config_rawcam_splitter_encoding(const MMAL_FOURCC_T encoding,
+                                                rpigrafx_frame_config_t *fcp);
+    /*
+     * Number of threads which process rawcam frames on the CPU, including
+     * the one calling rpigrafx_capture_next_frame. 0 (default) means the
+     * number of online CPUs. If set_affinity is set, the workers are bound to
+     * CPUs. Takes effect on rpigrafx_finish_config, and fails after it.
+     */
+    int rpigrafx_config_rawcam_workers(const int num_workers,
+                                       const _Bool set_affinity,
+                                       rpigrafx_frame_config_t *fcp);
+    /*
+     * Capture and process rawcam frames on a background thread. Then
+     * rpigrafx_capture_next_frame returns the newest frame finished by the isp
+     * instead of processing one itself, and older ones are dropped. Can't be
+     * used with host-side encodings. Takes effect on rpigrafx_finish_config,
+     * and fails after it.
+     */
+    int rpigrafx_config_rawcam_pipelined(const _Bool is_pipelined,
+                                         rpigrafx_frame_config_t *fcp);
+    /*
+     * The tuner uses the number of saturated samples, which is counted while
+     * processing on every saturation_step-th 2x2 Bayer quad horizontally and
+     * vertically (1 by default for all). Full histograms are computed only
+     * if is_histogram_enabled is set. Takes effect on the next frame.
+     */
+    int rpigrafx_config_rawcam_stats(const int saturation_step,
+                                     const _Bool is_histogram_enabled,
+                                     rpigrafx_frame_config_t *fcp);
+    /*
+     * The tuner of rawcam runs on a thread of its own, which never delays
+     * frames, on the statistics of every interval-th frame (1 by default),
+     * or of earlier ones if the number of saturated samples changes by more
+     * than change of it (0, never, by default). If the sensor reports its
+     * state, the tuner also waits up to 3 frames for it to show the last
+     * settings. Takes effect on the next frame.
+     */
+    int rpigrafx_config_rawcam_tuner(const int interval, const float change,
+                                     rpigrafx_frame_config_t *fcp);
+    /*
+     * Automatic exposure of rawcam, run by the tuner. RPIGRAFX_AE_MODE_MEAN
+     * scales exposure times gain so that the mean luminance of the raw frame,
+     * weighted by metering and from 0 at black to 1 at full scale, becomes
+     * target (0.18 by default). Takes effect on the next frame.
+     */
+    int rpigrafx_config_rawcam_ae(const rpigrafx_ae_mode_t mode,
+                                  const rpigrafx_ae_metering_t metering,
+                                  const float target,
+                                  rpigrafx_frame_config_t *fcp);
+    /*
+     * Make rpigrafx_finish_config capture and drop frames of all the outputs
+     * of the camera until RPIGRAFX_AE_MODE_MEAN converges, or max_frames
+     * frames (0, not waiting, by default). It is not an error if it doesn't.
+     */
+    int rpigrafx_config_rawcam_ae_wait(const int max_frames,
+                                       rpigrafx_frame_config_t *fcp);
+    /*
+     * White balance of rawcam. The gains are estimated from a sparse grid of
+     * each frame and applied to the next one; smoothing in (0, 1] is the
+     * weight of each new estimate (0.25 by default).
+     */
+    int rpigrafx_config_rawcam_awb(const rpigrafx_awb_mode_t mode,
+                                   const float smoothing,
+                                   rpigrafx_frame_config_t *fcp);
     int rpigrafx_config_camera_port(const int32_t camera_number,
                                     const rpigrafx_camera_port_t camera_port);
     int rpigrafx_config_camera_frame_render(const _Bool is_fullscreen,
@@ -78,16 +306,81 @@
                                             const int32_t width, const int32_t height,
                                             const int32_t layer,
                                             rpigrafx_frame_config_t *fcp);
+    /*
+     * Deliver the frames of fcp to callback on a library thread, which serves
+     * all the outputs with callbacks, instead of capturing them with
+     * rpigrafx_capture_next_frame. In the callback, the frame can be got,
+     * rendered and queried as a captured one, and it is freed on return. A
+     * callback which is slower than the camera gets only the newest frames.
+     * Rawcam needs the pipelined mode for this.
+     */
+    typedef void (*rpigrafx_frame_callback_t)(rpigrafx_frame_config_t *fcp,
+                                              void *user);
+    int rpigrafx_config_frame_callback(const rpigrafx_frame_callback_t callback,
+                                       void *user,
+                                       rpigrafx_frame_config_t *fcp);
+    /* Frames delivered to the callback of fcp and dropped so far. */
+    int rpigrafx_get_frame_callback_stats(rpigrafx_frame_config_t *fcp,
+                                          uint64_t *num_deliveredp,
+                                          uint64_t *num_droppedp);
     int rpigrafx_finish_config();
 
     void rpigrafx_set_verbose(const int verbose);
 
     int rpigrafx_capture_next_frame(rpigrafx_frame_config_t *fcp);
+    /*
+     * rpigrafx_capture_next_frame, but giving up after timeout_ms ms with
+     * RPIGRAFX_TIMED_OUT and no frame. The next call works as usual. A frame
+     * which comes late is dropped for rawcam when both it and the frame of
+     * the next call have a known pts, which tells them apart. Otherwise, and
+     * for the other cameras, it may be returned by the next call.
+     */
+#define RPIGRAFX_TIMED_OUT 2
+    int rpigrafx_capture_next_frame_timeout(rpigrafx_frame_config_t *fcp,
+                                            const int timeout_ms);
     void* rpigrafx_get_frame(rpigrafx_frame_config_t *fcp);
     int rpigrafx_free_frame(rpigrafx_frame_config_t *fcp);
     /*void* rpigrafx_get_output_buffer(rpigrafx_frame_config_t *fcp);*/
     /*void* rpigrafx_get_input_buffer(rpigrafx_frame_config_t *fcp);*/
     int rpigrafx_register_frame_pool_to_qmkl(rpigrafx_frame_config_t *fcp);
+    int rpigrafx_get_rawcam_stats(rpigrafx_frame_config_t *fcp,
+                                  rpigrafx_rawcam_stats_t *statsp);
+    /*
+     * Histograms of the last frame scaled to 8 bits, counting sensor pixels.
+     * Needs rpigrafx_config_rawcam_stats with is_histogram_enabled.
+     */
+    int rpigrafx_get_rawcam_histogram(rpigrafx_frame_config_t *fcp,
+                                      uint32_t hist_r[256],
+                                      uint32_t hist_g[256],
+                                      uint32_t hist_b[256]);
+    /*
+     * Metadata of the frame returned by the last rpigrafx_capture_next_frame
+     * of fcp. is_valid is unset if the sensor sent no embedded data with it.
+     */
+    int rpigrafx_get_rawcam_metadata(rpigrafx_frame_config_t *fcp,
+                                     rpigrafx_rawcam_metadata_t *metadatap);
+
+    /*
+     * Manual control of the rawcam sensor after rpigrafx_finish_config. The
+     * settings are written to the sensor by the thread of the tuner without
+     * stopping frames, and take effect at a frame boundary. The effective
+     * values are returned in the pointers unless they are NULL.
+     *
+     * framerate is in frames/s, and 0 (default) is the fastest the window
+     * allows; the frame period in us is returned. exposure_us is limited by
+     * the frame period. gain is the total of the analog and digital gains,
+     * from 1 up to 10.7 in analog and 16 more in digital. Setting exposure_us
+     * or gain stops the tuner, which keeps the last value of the other; set
+     * both to 0 (default) to restart it.
+     */
+    int rpigrafx_set_rawcam_framerate(const float framerate,
+                                      float *frame_period_usp,
+                                      rpigrafx_frame_config_t *fcp);
+    int rpigrafx_set_rawcam_exposure(const float exposure_us,
+                                     float *exposure_usp,
+                                     rpigrafx_frame_config_t *fcp);
+    int rpigrafx_set_rawcam_gain(const float gain, float *gainp,
+                                 rpigrafx_frame_config_t *fcp);
 
     int rpigrafx_render_frame(rpigrafx_frame_config_t *fcp);
 
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Mean-luminance automatic exposure.
+ *
+ * The luminance is measured on the raw frame, before white balance and the
+ * tone maps, so it is linear in exposure times gain. Each run scales their
+ * product by target / metered luminance, which lands on the target in one
+ * step on a linear scene. The step is limited to MAX_STEP each way, which is
+ * also taken when the frame is mostly clipped and measures too dark. Cells
+ * which are clipped stay so when the exposure is raised, which is modeled, and
+ * are brighter than they measure when it is lowered, so the step is doubled
+ * in log scale then.
+ *
+ * The product is taken from the frame's own metadata if the sensor reports
+ * it, so a run on a frame exposed before the last settings reached the sensor
+ * is still right. Without metadata it is taken from the last settings, and
+ * the step is halved in log scale to damp the overshoot of such frames.
+ */
+
+/* Quads sampled per cell in each direction. */
+#define SAMPLES_PER_CELL 8
+/* Largest change of exposure times gain of a run, either way. */
+#define MAX_STEP 8.0f
+/* Luminance below which a frame is treated as black. */
+#define MIN_LUMA 1e-3f
+/* Above this most of the frame is clipped and the full step is taken. */
+#define MAX_LUMA 0.9f
+/* Cells at least this bright are clipped. */
+#define CLIPPED_LUMA 0.98f
+#define NUM_BISECTIONS 16
+/* Relative errors below this are not corrected, so that still scenes hold. */
+#define DEADBAND 0.03f
+/* Relative error within which the exposure is converged. */
+#define TOLERANCE 0.1f
+#define MIN_EXPOSURE_US 10.0f
+#define MIN_GAIN 1.0f
+/* Exposure and gain which the first frames are taken with. */
+#define INITIAL_EXPOSURE_US 10000.0f
+#define INITIAL_GAIN 1.0f
+
+/* Rec. 601 luma of linear R, G and B; G is split over the two G of a quad. */
+static const float luma_weights[3] = {0.299f, 0.587f / 2, 0.114f};
+
+static uint32_t sample(const uint8_t *line, const uint16_t *decoded,
+                       const int32_t x, const unsigned nbits)
+{
+    const uint8_t *g;
+
+    if (decoded != NULL)
+        return decoded[x];
+    switch (nbits) {
+        case 10:
+            g = line + x / 4 * 5;
+            return (g[x % 4] << 2) | ((g[4] >> (x % 4 * 2)) & 3);
+        case 12:
+            g = line + x / 2 * 3;
+            return (g[x % 2] << 4) | ((g[2] >> (x % 2 * 4)) & 0xf);
+        default:
+            return line[x];
+    }
+}
+
+void priv_rpigrafx_ae_gather(struct priv_rpigrafx_ae_grid *grid,
+                             const struct priv_rpigrafx_raw_job *job,
+                             uint16_t *lines)
+{
+    const int32_t qw = job->width / 2, qh = job->height / 2;
+    const int32_t step_x = (qw / (PRIV_RPIGRAFX_AE_GRID_WIDTH
+                                  * SAMPLES_PER_CELL) > 1)
+                           ? qw / (PRIV_RPIGRAFX_AE_GRID_WIDTH
+                                   * SAMPLES_PER_CELL) : 1,
+                  step_y = (qh / (PRIV_RPIGRAFX_AE_GRID_HEIGHT
+                                  * SAMPLES_PER_CELL) > 1)
+                           ? qh / (PRIV_RPIGRAFX_AE_GRID_HEIGHT
+                                   * SAMPLES_PER_CELL) : 1;
+    const uint32_t maxv = (1u << job->nbits) - 1,
+                   black = (job->calib != NULL) ? job->calib->black : 0;
+    float sum[PRIV_RPIGRAFX_AE_GRID_HEIGHT][PRIV_RPIGRAFX_AE_GRID_WIDTH];
+    uint32_t count[PRIV_RPIGRAFX_AE_GRID_HEIGHT][PRIV_RPIGRAFX_AE_GRID_WIDTH];
+    int32_t qx, qy;
+    int cx, cy;
+
+    memset(sum, 0, sizeof(sum));
+    memset(count, 0, sizeof(count));
+    for (qy = step_y / 2; qy < qh; qy += step_y) {
+        const int32_t y = qy * 2;
+        const uint8_t *l[2] = {
+            job->src + (size_t) y * job->src_stride,
+            job->src + (size_t) (y + 1) * job->src_stride
+        };
+        const uint16_t *d[2] = {NULL, NULL};
+
+        cy = (int64_t) y * PRIV_RPIGRAFX_AE_GRID_HEIGHT / job->height;
+        if (job->is_dpcm) {
+            priv_rpigrafx_dpcm10_decode_line(lines, l[0], job->width);
+            priv_rpigrafx_dpcm10_decode_line(lines + job->width, l[1],
+                                             job->width);
+            d[0] = lines;
+            d[1] = lines + job->width;
+        }
+        for (qx = step_x / 2; qx < qw; qx += step_x) {
+            const int32_t x = qx * 2;
+            float luma = 0;
+            int dx, dy;
+
+            for (dy = 0; dy < 2; dy ++) {
+                for (dx = 0; dx < 2; dx ++) {
+                    const uint32_t v = sample(l[dy], d[dy], x + dx,
+                                              job->nbits);
+                    const int c = priv_rpigrafx_bayer_channel(
+                                        job->bayer_pattern, x + dx, y + dy);
+                    luma += luma_weights[c] * ((v > black) ? v - black : 0);
+                }
+            }
+            cx = (int64_t) x * PRIV_RPIGRAFX_AE_GRID_WIDTH / job->width;
+            sum[cy][cx] += luma;
+            count[cy][cx] ++;
+        }
+    }
+
+    for (cy = 0; cy < PRIV_RPIGRAFX_AE_GRID_HEIGHT; cy ++)
+        for (cx = 0; cx < PRIV_RPIGRAFX_AE_GRID_WIDTH; cx ++)
+            grid->luma[cy][cx] = (count[cy][cx] == 0) ? 0
+                               : sum[cy][cx] / count[cy][cx]
+                                 / (maxv - black);
+}
+
+/*
+ * Average weighs all cells equally. Center weighs the center four times as
+ * much as the corners, falling off linearly. Spot uses the central 4x4 cells
+ * only.
+ */
+static float metering_weight(const rpigrafx_ae_metering_t metering,
+                             const int cx, const int cy)
+{
+    const float hx = PRIV_RPIGRAFX_AE_GRID_WIDTH / 2.0f,
+                hy = PRIV_RPIGRAFX_AE_GRID_HEIGHT / 2.0f,
+                u = (cx + 0.5f - hx) / hx, v = (cy + 0.5f - hy) / hy;
+    float r;
+
+    switch (metering) {
+        case RPIGRAFX_AE_METERING_CENTER:
+            r = sqrtf((u * u + v * v) / 2);
+            return 1 + 3 * (1 - r);
+        case RPIGRAFX_AE_METERING_SPOT:
+            return (fabsf(cx + 0.5f - hx) < 2 && fabsf(cy + 0.5f - hy) < 2)
+                   ? 1 : 0;
+        default:
+            return 1;
+    }
+}
+
+void priv_rpigrafx_ae_init(struct priv_rpigrafx_ae *ae,
+                           const rpigrafx_ae_mode_t mode,
+                           const rpigrafx_ae_metering_t metering,
+                           const float target)
+{
+    priv_rpigrafx_ae_set_mode(ae, mode, metering, target);
+    ae->exposure_us = INITIAL_EXPOSURE_US;
+    ae->gain = INITIAL_GAIN;
+    ae->luma = 0;
+    ae->is_converged = 0;
+}
+
+void priv_rpigrafx_ae_set_mode(struct priv_rpigrafx_ae *ae,
+                               const rpigrafx_ae_mode_t mode,
+                               const rpigrafx_ae_metering_t metering,
+                               const float target)
+{
+    int cx, cy;
+
+    ae->mode = mode;
+    ae->metering = metering;
+    ae->target = target;
+    for (cy = 0; cy < PRIV_RPIGRAFX_AE_GRID_HEIGHT; cy ++)
+        for (cx = 0; cx < PRIV_RPIGRAFX_AE_GRID_WIDTH; cx ++)
+            ae->weights[cy][cx] = metering_weight(metering, cx, cy);
+    ae->is_converged = 0;
+}
+
+/* Metered luminance of the grid if exposure times gain is scaled by k. */
+static float metered_luma(const struct priv_rpigrafx_ae *ae,
+                          const struct priv_rpigrafx_ae_grid *grid,
+                          const float k)
+{
+    float sum = 0, sum_weights = 0;
+    int cx, cy;
+
+    for (cy = 0; cy < PRIV_RPIGRAFX_AE_GRID_HEIGHT; cy ++) {
+        for (cx = 0; cx < PRIV_RPIGRAFX_AE_GRID_WIDTH; cx ++) {
+            const float l = k * grid->luma[cy][cx];
+            sum += ae->weights[cy][cx] * ((l < 1) ? l : 1);
+            sum_weights += ae->weights[cy][cx];
+        }
+    }
+    return (sum_weights > 0) ? sum / sum_weights : 0;
+}
+
+float priv_rpigrafx_ae_metered_luma(const struct priv_rpigrafx_ae *ae,
+                                    const struct priv_rpigrafx_ae_grid *grid)
+{
+    return metered_luma(ae, grid, 1);
+}
+
+/* Scale of exposure times gain which brings luma of grid to the target. */
+static float correction(const struct priv_rpigrafx_ae *ae,
+                        const struct priv_rpigrafx_ae_grid *grid,
+                        const float luma)
+{
+    float ratio, lo = 1, hi = MAX_STEP;
+    _Bool is_clipped = 0;
+    int cx, cy, i;
+
+    if (luma < MIN_LUMA)
+        return MAX_STEP;
+    if (luma > MAX_LUMA)
+        return 1 / MAX_STEP;
+    ratio = ae->target / luma;
+    for (cy = 0; cy < PRIV_RPIGRAFX_AE_GRID_HEIGHT; cy ++)
+        for (cx = 0; cx < PRIV_RPIGRAFX_AE_GRID_WIDTH; cx ++)
+            is_clipped |= ae->weights[cy][cx] > 0
+                          && grid->luma[cy][cx] >= CLIPPED_LUMA;
+    if (!is_clipped || fabsf(ratio - 1) < DEADBAND)
+        return ratio;
+    if (ratio < 1)
+        return ratio * ratio;
+    if (metered_luma(ae, grid, hi) < ae->target)
+        return hi;
+    for (i = 0; i < NUM_BISECTIONS; i ++) {
+        const float k = (lo + hi) / 2;
+        if (metered_luma(ae, grid, k) < ae->target)
+            lo = k;
+        else
+            hi = k;
+    }
+    return (lo + hi) / 2;
+}
+
+_Bool priv_rpigrafx_ae_update(struct priv_rpigrafx_ae *ae,
+                              const struct priv_rpigrafx_ae_grid *grid,
+                              const rpigrafx_rawcam_metadata_t *md,
+                              const float max_exposure_us,
+                              const float max_gain)
+{
+    const float min_total = MIN_EXPOSURE_US * MIN_GAIN,
+                max_total = max_exposure_us * max_gain;
+    float luma, ratio, total, exposure_us, gain;
+
+    if (ae->mode != RPIGRAFX_AE_MODE_MEAN)
+        return 0;
+
+    luma = ae->luma = priv_rpigrafx_ae_metered_luma(ae, grid);
+    ratio = correction(ae, grid, luma);
+    ae->is_converged = fabsf(ae->target / luma - 1) < TOLERANCE;
+    if (fabsf(ratio - 1) < DEADBAND)
+        return 0;
+    ratio = (ratio > MAX_STEP) ? MAX_STEP
+          : (ratio < 1 / MAX_STEP) ? 1 / MAX_STEP : ratio;
+
+    if (md->is_valid && md->exposure_us > 0) {
+        total = md->exposure_us * md->analog_gain * md->digital_gain;
+    } else {
+        total = ae->exposure_us * ae->gain;
+        ratio = sqrtf(ratio);
+    }
+    total *= ratio;
+    /* Nothing more can be done at the limits. */
+    if (total >= max_total) {
+        total = max_total;
+        ae->is_converged |= ratio > 1;
+    } else if (total <= min_total) {
+        total = min_total;
+        ae->is_converged |= ratio < 1;
+    }
+
+    /* Exposure first, which adds no noise, then gain. */
+    exposure_us = (total > max_exposure_us) ? max_exposure_us : total;
+    if (exposure_us < MIN_EXPOSURE_US)
+        exposure_us = MIN_EXPOSURE_US;
+    gain = total / exposure_us;
+    gain = (gain < MIN_GAIN) ? MIN_GAIN : (gain > max_gain) ? max_gain : gain;
+
+    if (exposure_us == ae->exposure_us && gain == ae->gain)
+        return 0;
+    ae->exposure_us = exposure_us;
+    ae->gain = gain;
+    return !0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Automatic white balance.
+ *
+ * The statistics are gathered by priv_rpigrafx_raw_process from a frame which
+ * was processed with the gains of awb, so each estimate corrects those gains.
+ * G is the reference and keeps its gain; exposure is the tuner's business.
+ * With a gamma, ratios of output values are raised to it to get the ratios
+ * of the linear values, which is exact for white patch and for flat gray.
+ */
+
+#define MIN_GAIN 0.125f
+#define MAX_GAIN 8.0f
+/* Fewer unsaturated samples than this give no estimate. */
+#define MIN_SAMPLES 64
+/*
+ * Relative corrections smaller than this are noise and are ignored, so that
+ * the gains and the tone maps built from them stay put on a still scene.
+ */
+#define DEADBAND 0.005f
+
+void priv_rpigrafx_awb_init(struct priv_rpigrafx_awb *awb,
+                            const rpigrafx_awb_mode_t mode,
+                            const float smoothing, const float gain_r,
+                            const float gain_g, const float gain_b)
+{
+    awb->mode = mode;
+    awb->smoothing = smoothing;
+    awb->gamma = 1;
+    awb->default_gain_r = awb->gain_r = gain_r;
+    awb->default_gain_g = awb->gain_g = gain_g;
+    awb->default_gain_b = awb->gain_b = gain_b;
+}
+
+void priv_rpigrafx_awb_set_mode(struct priv_rpigrafx_awb *awb,
+                                const rpigrafx_awb_mode_t mode,
+                                const float smoothing)
+{
+    awb->mode = mode;
+    awb->smoothing = smoothing;
+    if (mode == RPIGRAFX_AWB_MODE_OFF) {
+        awb->gain_r = awb->default_gain_r;
+        awb->gain_g = awb->default_gain_g;
+        awb->gain_b = awb->default_gain_b;
+    }
+}
+
+static float clamp_gain(const float gain)
+{
+    return (gain < MIN_GAIN) ? MIN_GAIN : (gain > MAX_GAIN) ? MAX_GAIN : gain;
+}
+
+/* Move gain toward gain * ratio by the smoothing factor. */
+static float smooth_gain(const float gain, const float ratio,
+                         const float smoothing)
+{
+    if (fabsf(ratio - 1) < DEADBAND)
+        return gain;
+    return clamp_gain(gain + smoothing * (gain * ratio - gain));
+}
+
+void priv_rpigrafx_awb_update(struct priv_rpigrafx_awb *awb,
+                              const struct priv_rpigrafx_awb_stats *stats)
+{
+    float ratio_r, ratio_b;
+
+    if (awb->mode == RPIGRAFX_AWB_MODE_OFF || stats->num_samples < MIN_SAMPLES)
+        return;
+
+    switch (awb->mode) {
+        case RPIGRAFX_AWB_MODE_GRAY_WORLD:
+            /* The means of R, G and B should be equal. */
+            if (stats->sum_r == 0 || stats->sum_g == 0 || stats->sum_b == 0)
+                return;
+            ratio_r = (float) stats->sum_g / stats->sum_r;
+            ratio_b = (float) stats->sum_g / stats->sum_b;
+            break;
+        case RPIGRAFX_AWB_MODE_WHITE_PATCH:
+            /* The brightest unsaturated R, G and B should be equal. */
+            if (stats->max_r == 0 || stats->max_g == 0 || stats->max_b == 0)
+                return;
+            ratio_r = (float) stats->max_g / stats->max_r;
+            ratio_b = (float) stats->max_g / stats->max_b;
+            break;
+        default:
+            return;
+    }
+    if (awb->gamma != 1) {
+        ratio_r = powf(ratio_r, awb->gamma);
+        ratio_b = powf(ratio_b, awb->gamma);
+    }
+
+    awb->gain_r = smooth_gain(awb->gain_r, ratio_r, awb->smoothing);
+    awb->gain_b = smooth_gain(awb->gain_b, ratio_b, awb->smoothing);
+}
+
+void priv_rpigrafx_awb_stats_clear(struct priv_rpigrafx_awb_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+void priv_rpigrafx_awb_stats_merge(struct priv_rpigrafx_awb_stats *dst,
+                                   const struct priv_rpigrafx_awb_stats *src)
+{
+    dst->sum_r += src->sum_r;
+    dst->sum_g += src->sum_g;
+    dst->sum_b += src->sum_b;
+    dst->num_samples += src->num_samples;
+    if (src->max_r > dst->max_r)
+        dst->max_r = src->max_r;
+    if (src->max_g > dst->max_g)
+        dst->max_g = src->max_g;
+    if (src->max_b > dst->max_b)
+        dst->max_b = src->max_b;
+}
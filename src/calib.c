@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Sensor calibration: black level, lens shading and defective pixels.
+ *
+ * The calibration is read from a text file of keywords followed by numbers,
+ * separated by any whitespace, where # starts a comment:
+ *
+ *   black_level <level> <bits>
+ *   grid <width> <height>
+ *   r <width * height gains, row by row>
+ *   g <...>
+ *   b <...>
+ *   defect <x> <y>
+ *
+ * black_level is in bits-bit units, e.g. 64 10 for the IMX219. grid and the
+ * r, g and b gains are optional, but must all be given if one is. The grid
+ * points are spread evenly from the first to the last pixel of the frame in
+ * both directions. defect may be given any number of times, once for each
+ * defective pixel, at its position in the frames as the sensor sends them.
+ * Defects outside the frame are ignored when the map is built.
+ *
+ * For processing, the grid is expanded to the frame width once by
+ * priv_rpigrafx_calib_map_build, so that each line only blends two expanded
+ * rows while it is corrected. Gains and blending weights are kept within 16
+ * bits so that the correction runs on 16-bit multiply-high lanes, which is
+ * why gains are limited to below 8 including the black level normalization.
+ */
+
+#define MAX_GRID_SIZE 256
+#define MAX_DEFECTS 65536
+
+void priv_rpigrafx_calib_init(struct priv_rpigrafx_calib *calib)
+{
+    calib->black_level = 0;
+    calib->black_level_bits = 8;
+    calib->grid_width = calib->grid_height = 0;
+    calib->grid[0] = calib->grid[1] = calib->grid[2] = NULL;
+    calib->num_defects = 0;
+    calib->defects = NULL;
+}
+
+void priv_rpigrafx_calib_free(struct priv_rpigrafx_calib *calib)
+{
+    free(calib->grid[0]);
+    free(calib->grid[1]);
+    free(calib->grid[2]);
+    free(calib->defects);
+    priv_rpigrafx_calib_init(calib);
+}
+
+/* Read the next token, skipping comments. Return 0 at the end of file. */
+static int read_token(FILE *fp, char *buf, const size_t size)
+{
+    int c;
+    size_t n = 0;
+
+    for (; ; ) {
+        while ((c = fgetc(fp)) == ' ' || c == '\t' || c == '\n' || c == '\r')
+            ;
+        if (c != '#')
+            break;
+        while ((c = fgetc(fp)) != '\n' && c != EOF)
+            ;
+    }
+    while (c != EOF && c != ' ' && c != '\t' && c != '\n' && c != '\r'
+            && c != '#') {
+        if (n + 1 < size)
+            buf[n ++] = c;
+        c = fgetc(fp);
+    }
+    if (c == '#')
+        ungetc(c, fp);
+    buf[n] = '\0';
+    return n != 0;
+}
+
+static int read_long(FILE *fp, long *vp)
+{
+    char buf[64], *end;
+
+    if (!read_token(fp, buf, sizeof(buf)))
+        return 1;
+    *vp = strtol(buf, &end, 10);
+    return *end != '\0';
+}
+
+static int read_float(FILE *fp, float *vp)
+{
+    char buf[64], *end;
+
+    if (!read_token(fp, buf, sizeof(buf)))
+        return 1;
+    *vp = strtof(buf, &end);
+    return *end != '\0';
+}
+
+int priv_rpigrafx_calib_load(struct priv_rpigrafx_calib *calib,
+                             const char *path)
+{
+    struct priv_rpigrafx_calib c;
+    FILE *fp;
+    char key[64];
+    int ret = 0;
+
+    priv_rpigrafx_calib_init(&c);
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        print_error("Failed to open %s", path);
+        ret = 1;
+        goto end;
+    }
+
+    while (read_token(fp, key, sizeof(key))) {
+        if (!strcmp(key, "black_level")) {
+            long level, bits;
+            if (read_long(fp, &level) || read_long(fp, &bits)
+                    || bits < 8 || bits > 16 || level < 0
+                    || level >= (1L << bits)) {
+                print_error("%s: Invalid black_level", path);
+                ret = 1;
+                goto end;
+            }
+            c.black_level = level;
+            c.black_level_bits = bits;
+        } else if (!strcmp(key, "grid")) {
+            long w, h;
+            if (c.grid_width != 0 || read_long(fp, &w) || read_long(fp, &h)
+                    || w < 2 || h < 2
+                    || w > MAX_GRID_SIZE || h > MAX_GRID_SIZE) {
+                print_error("%s: Invalid grid", path);
+                ret = 1;
+                goto end;
+            }
+            c.grid_width = w;
+            c.grid_height = h;
+        } else if (!strcmp(key, "r") || !strcmp(key, "g")
+                   || !strcmp(key, "b")) {
+            const int ch = (key[0] == 'r') ? 0 : (key[0] == 'g') ? 1 : 2;
+            const int n = c.grid_width * c.grid_height;
+            int k;
+            if (n == 0 || c.grid[ch] != NULL) {
+                print_error("%s: %s must follow grid and be given once",
+                            path, key);
+                ret = 1;
+                goto end;
+            }
+            c.grid[ch] = malloc(sizeof(float) * n);
+            if (c.grid[ch] == NULL) {
+                print_error("Failed to allocate the grid");
+                ret = 1;
+                goto end;
+            }
+            for (k = 0; k < n; k ++) {
+                if (read_float(fp, &c.grid[ch][k])
+                        || !(c.grid[ch][k] > 0 && c.grid[ch][k] < 8)) {
+                    print_error("%s: Invalid gain %d of %s", path, k, key);
+                    ret = 1;
+                    goto end;
+                }
+            }
+        } else if (!strcmp(key, "defect")) {
+            long x, y;
+            uint16_t *p;
+            if (read_long(fp, &x) || read_long(fp, &y) || x < 0 || y < 0
+                    || x > UINT16_MAX || y > UINT16_MAX) {
+                print_error("%s: Invalid defect", path);
+                ret = 1;
+                goto end;
+            }
+            if (c.num_defects == MAX_DEFECTS) {
+                print_error("%s: Too many defects", path);
+                ret = 1;
+                goto end;
+            }
+            p = realloc(c.defects, sizeof(uint16_t) * 2 * (c.num_defects + 1));
+            if (p == NULL) {
+                print_error("Failed to allocate the defects");
+                ret = 1;
+                goto end;
+            }
+            c.defects = p;
+            c.defects[2 * c.num_defects] = x;
+            c.defects[2 * c.num_defects + 1] = y;
+            c.num_defects ++;
+        } else {
+            print_error("%s: Unknown keyword: %s", path, key);
+            ret = 1;
+            goto end;
+        }
+    }
+    if (c.grid_width != 0
+            && (c.grid[0] == NULL || c.grid[1] == NULL || c.grid[2] == NULL)) {
+        print_error("%s: r, g and b must all be given with grid", path);
+        ret = 1;
+        goto end;
+    }
+
+    priv_rpigrafx_calib_free(calib);
+    memcpy(calib, &c, sizeof(c));
+    priv_rpigrafx_calib_init(&c);
+
+end:
+    if (fp != NULL)
+        fclose(fp);
+    priv_rpigrafx_calib_free(&c);
+    return ret;
+}
+
+void priv_rpigrafx_calib_map_init(struct priv_rpigrafx_calib_map *map)
+{
+    map->rows = NULL;
+    map->defect_index = NULL;
+    map->defect_x = NULL;
+    map->width = map->height = 0;
+}
+
+void priv_rpigrafx_calib_map_free(struct priv_rpigrafx_calib_map *map)
+{
+    free(map->rows);
+    free(map->defect_index);
+    free(map->defect_x);
+    priv_rpigrafx_calib_map_init(map);
+}
+
+static int compare_uint32(const void *a, const void *b)
+{
+    const uint32_t u = *(const uint32_t*) a, v = *(const uint32_t*) b;
+    return (u > v) - (u < v);
+}
+
+/* Sort the defects within the frame by line and index them by line. */
+static int build_defects(struct priv_rpigrafx_calib_map *map,
+                         const struct priv_rpigrafx_calib *calib,
+                         const int32_t width, const int32_t height)
+{
+    uint32_t *keys = NULL, k = 0;
+    int i, n = 0;
+    int32_t y;
+    int ret = 0;
+
+    if (calib->num_defects == 0)
+        goto end;
+    keys = malloc(sizeof(uint32_t) * calib->num_defects);
+    if (keys == NULL) {
+        print_error("Failed to allocate the defects");
+        ret = 1;
+        goto end;
+    }
+    for (i = 0; i < calib->num_defects; i ++) {
+        const uint32_t x = calib->defects[2 * i],
+                       yy = calib->defects[2 * i + 1];
+        if (x < (uint32_t) width && yy < (uint32_t) height)
+            keys[n ++] = yy << 16 | x;
+    }
+    if (n == 0)
+        goto end;
+    qsort(keys, n, sizeof(keys[0]), compare_uint32);
+
+    map->defect_index = malloc(sizeof(uint32_t) * (height + 1));
+    map->defect_x = malloc(sizeof(uint16_t) * n);
+    if (map->defect_index == NULL || map->defect_x == NULL) {
+        print_error("Failed to allocate the defects");
+        ret = 1;
+        goto end;
+    }
+    /* Defects given twice are stored once. */
+    for (i = 0, y = 0; i < n; i ++) {
+        if (i > 0 && keys[i] == keys[i - 1])
+            continue;
+        for (; y <= (int32_t) (keys[i] >> 16); y ++)
+            map->defect_index[y] = k;
+        map->defect_x[k ++] = keys[i] & 0xffff;
+    }
+    for (; y <= height; y ++)
+        map->defect_index[y] = k;
+
+end:
+    free(keys);
+    return ret;
+}
+
+int priv_rpigrafx_calib_map_build(struct priv_rpigrafx_calib_map *map,
+                                  const struct priv_rpigrafx_calib *calib,
+                                  const int32_t width, const int32_t height,
+                                  const unsigned nbits,
+                                  const rpigrafx_bayer_pattern_t bayer_pattern)
+{
+    const int32_t maxv = (1 << nbits) - 1;
+    const int has_grid = calib->grid_width != 0;
+    const int gw = has_grid ? calib->grid_width : 2,
+              gh = has_grid ? calib->grid_height : 2;
+    uint32_t black;
+    float norm;
+    int parity, j;
+    int32_t x;
+    int ret = 0;
+
+    priv_rpigrafx_calib_map_free(map);
+
+    if (width < 2 || height < 2) {
+        print_error("Invalid size: %dx%d", width, height);
+        ret = 1;
+        goto end;
+    }
+    if (nbits > PRIV_RPIGRAFX_CALIB_SHIFT) {
+        print_error("Invalid bits: %u", nbits);
+        ret = 1;
+        goto end;
+    }
+    /* Round the black level to nbits. */
+    if (calib->black_level_bits >= nbits)
+        black = (calib->black_level + (1u << (calib->black_level_bits - nbits)
+                                       >> 1))
+                >> (calib->black_level_bits - nbits);
+    else
+        black = calib->black_level << (nbits - calib->black_level_bits);
+    if (black >= (uint32_t) maxv) {
+        print_error("Black level is too high: %u", black);
+        ret = 1;
+        goto end;
+    }
+    /* Bring black..maxv back to 0..maxv. */
+    norm = (float) maxv / (maxv - black);
+
+    /* The last row is repeated so that the last line can blend with it. */
+    map->rows = malloc(sizeof(uint16_t) * 2 * (gh + 1) * width);
+    if (map->rows == NULL) {
+        print_error("Failed to allocate the calibration map");
+        ret = 1;
+        goto end;
+    }
+
+    /* Rows are stored for each parity of lines. */
+    for (parity = 0; parity < 2; parity ++) {
+        for (j = 0; j < gh; j ++) {
+            uint16_t *row = map->rows + (parity * (gh + 1) + j) * width;
+            for (x = 0; x < width; x ++) {
+                const int ch = priv_rpigrafx_bayer_channel(bayer_pattern, x,
+                                                           parity);
+                const float *g = has_grid ? calib->grid[ch] + j * gw : NULL;
+                const float gx = (float) x * (gw - 1) / (width - 1);
+                int i = gx;
+                float v;
+                if (i >= gw - 1)
+                    i = gw - 2;
+                v = (g == NULL) ? 1
+                    : g[i] + (g[i + 1] - g[i]) * (gx - i);
+                v = v * norm * (1 << PRIV_RPIGRAFX_CALIB_SHIFT) + 0.5f;
+                row[x] = (v >= INT16_MAX) ? INT16_MAX : (uint16_t) v;
+            }
+        }
+        memcpy(map->rows + (parity * (gh + 1) + gh) * width,
+               map->rows + (parity * (gh + 1) + gh - 1) * width,
+               sizeof(uint16_t) * width);
+    }
+
+    if ((ret = build_defects(map, calib, width, height))) {
+        priv_rpigrafx_calib_map_free(map);
+        goto end;
+    }
+
+    map->width = width;
+    map->height = height;
+    map->nbits = nbits;
+    map->bayer_pattern = bayer_pattern;
+    map->black = black;
+    map->has_grid = has_grid;
+    map->grid_height = gh;
+
+end:
+    return ret;
+}
+
+void priv_rpigrafx_calib_map_rows(const struct priv_rpigrafx_calib_map *map,
+                                  const int32_t y, const uint16_t **row0p,
+                                  const uint16_t **row1p, int32_t *fyp)
+{
+    const int gh = map->grid_height;
+    /* Position of y on the grid in 1/32768. */
+    const int32_t pos = (int32_t) ((int64_t) y * (gh - 1) * 32768
+                                   / (map->height - 1)),
+                  j = pos >> 15;
+
+    *row0p = map->rows + ((y & 1) * (gh + 1) + j) * map->width;
+    *row1p = *row0p + map->width;
+    *fyp = pos & 32767;
+}
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Asynchronous delivery of frames.
+ *
+ * Producers, i.e. MMAL callbacks, post items to channels without blocking or
+ * taking a lock, and a single thread delivers them to the users of all the
+ * channels. Each channel is a lock-free ring of a single producer and a
+ * single consumer. When the thread gets behind, it delivers only the newest
+ * item of a channel and gives the older ones back, as the pipelined rawcam
+ * keeps only the newest frame. Producers never give items back themselves:
+ * a post to a full ring fails and the producer keeps the item, so the rings
+ * are to be sized to hold all the items which can be in flight.
+ */
+
+int priv_rpigrafx_spsc_init(struct priv_rpigrafx_spsc *q, const uint32_t size)
+{
+    int ret = 0;
+
+    if (size == 0 || (size & (size - 1)) != 0) {
+        print_error("Size of the ring must be a power of two: %u", size);
+        ret = 1;
+        goto end;
+    }
+    q->items = malloc(size * sizeof(*q->items));
+    if (q->items == NULL) {
+        print_error("Failed to allocate ring");
+        ret = 1;
+        goto end;
+    }
+    q->mask = size - 1;
+    q->head = q->tail = 0;
+
+end:
+    return ret;
+}
+
+void priv_rpigrafx_spsc_free(struct priv_rpigrafx_spsc *q)
+{
+    free(q->items);
+    q->items = NULL;
+}
+
+/* Called only from the producer. Return zero if q is full. */
+_Bool priv_rpigrafx_spsc_push(struct priv_rpigrafx_spsc *q, void *item)
+{
+    const uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED),
+                   head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    if (tail - head > q->mask)
+        return 0;
+    q->items[tail & q->mask] = item;
+    /* Publish the item before the new tail. */
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return !0;
+}
+
+/* Called only from the consumer. Return NULL if q is empty. */
+void* priv_rpigrafx_spsc_pop(struct priv_rpigrafx_spsc *q)
+{
+    const uint32_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED),
+                   tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    void *item;
+
+    if (head == tail)
+        return NULL;
+    item = q->items[head & q->mask];
+    /* Hand the slot back to the producer after reading it. */
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+struct channel {
+    struct priv_rpigrafx_spsc queue;
+    /* Counted by the thread after the ops return, and read by others. */
+    uint64_t num_delivered, num_dropped;
+};
+
+struct priv_rpigrafx_dispatcher {
+    const struct priv_rpigrafx_dispatcher_ops *ops;
+    void *user;
+    pthread_t thread;
+    /* Posted once per item and on quit. */
+    sem_t sem;
+    _Bool has_sem, has_thread, quit;
+    int num_channels;
+    struct channel *channels;
+};
+
+static void drop(struct priv_rpigrafx_dispatcher *dp, const int channel,
+                 void *item)
+{
+    dp->ops->release(dp->user, channel, item);
+    __atomic_add_fetch(&dp->channels[channel].num_dropped, 1,
+                       __ATOMIC_RELEASE);
+}
+
+static void* dispatcher_main(void *arg)
+{
+    struct priv_rpigrafx_dispatcher *dp = arg;
+    int k;
+
+    for (; ; ) {
+        if (sem_wait(&dp->sem)) {
+            if (errno == EINTR)
+                continue;
+            print_error("Failed to wait for items: %s", strerror(errno));
+            break;
+        }
+        if (__atomic_load_n(&dp->quit, __ATOMIC_ACQUIRE))
+            break;
+
+        for (k = 0; k < dp->num_channels; k ++) {
+            struct channel *ch = &dp->channels[k];
+            void *item = NULL, *newer = NULL;
+
+            if ((item = priv_rpigrafx_spsc_pop(&ch->queue)) == NULL)
+                continue;
+            while ((newer = priv_rpigrafx_spsc_pop(&ch->queue)) != NULL) {
+                drop(dp, k, item);
+                item = newer;
+            }
+            dp->ops->deliver(dp->user, k, item);
+            __atomic_add_fetch(&ch->num_delivered, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    return NULL;
+}
+
+int priv_rpigrafx_dispatcher_create(struct priv_rpigrafx_dispatcher **dpp,
+                                const struct priv_rpigrafx_dispatcher_ops *ops,
+                                    void *user, const int num_channels,
+                                    const uint32_t depth)
+{
+    struct priv_rpigrafx_dispatcher *dp = NULL;
+    int k, reti;
+    int ret = 0;
+
+    dp = calloc(1, sizeof(*dp));
+    if (dp == NULL) {
+        print_error("Failed to allocate dispatcher");
+        ret = 1;
+        goto end;
+    }
+    dp->ops = ops;
+    dp->user = user;
+    dp->num_channels = num_channels;
+    dp->channels = calloc(num_channels, sizeof(*dp->channels));
+    if (dp->channels == NULL) {
+        print_error("Failed to allocate dispatcher channels");
+        ret = 1;
+        goto end;
+    }
+    for (k = 0; k < num_channels; k ++)
+        if ((ret = priv_rpigrafx_spsc_init(&dp->channels[k].queue, depth)))
+            goto end;
+    if (sem_init(&dp->sem, 0, 0)) {
+        print_error("Failed to initialize semaphore: %s", strerror(errno));
+        ret = 1;
+        goto end;
+    }
+    dp->has_sem = !0;
+
+    reti = pthread_create(&dp->thread, NULL, dispatcher_main, dp);
+    if (reti) {
+        print_error("Failed to create dispatcher thread: %s", strerror(reti));
+        ret = 1;
+        goto end;
+    }
+    dp->has_thread = !0;
+
+end:
+    if (ret) {
+        priv_rpigrafx_dispatcher_destroy(dp);
+        dp = NULL;
+    }
+    *dpp = dp;
+    return ret;
+}
+
+/*
+ * Stop the thread and free dp, giving back the items which are not delivered.
+ * This returns after the thread finishes the item it is delivering. Nothing
+ * may post to dp any more.
+ */
+void priv_rpigrafx_dispatcher_destroy(struct priv_rpigrafx_dispatcher *dp)
+{
+    int k;
+
+    if (dp == NULL)
+        return;
+
+    if (dp->has_thread) {
+        __atomic_store_n(&dp->quit, !0, __ATOMIC_RELEASE);
+        sem_post(&dp->sem);
+        pthread_join(dp->thread, NULL);
+    }
+    if (dp->has_sem)
+        sem_destroy(&dp->sem);
+    for (k = 0; k < dp->num_channels && dp->channels != NULL; k ++) {
+        struct channel *ch = &dp->channels[k];
+        void *item = NULL;
+
+        if (ch->queue.items != NULL)
+            while ((item = priv_rpigrafx_spsc_pop(&ch->queue)) != NULL)
+                drop(dp, k, item);
+        priv_rpigrafx_spsc_free(&ch->queue);
+    }
+    free(dp->channels);
+    free(dp);
+}
+
+/*
+ * Post item to channel. Return zero with item still the caller's if the
+ * channel is full. This never blocks, and only one thread at a time may post
+ * to each channel.
+ */
+_Bool priv_rpigrafx_dispatcher_post(struct priv_rpigrafx_dispatcher *dp,
+                                    const int channel, void *item)
+{
+    if (!priv_rpigrafx_spsc_push(&dp->channels[channel].queue, item))
+        return 0;
+    sem_post(&dp->sem);
+    return !0;
+}
+
+/* Return non-zero if called from the thread of dp, e.g. from the ops. */
+_Bool priv_rpigrafx_dispatcher_is_current(struct priv_rpigrafx_dispatcher *dp)
+{
+    return pthread_equal(pthread_self(), dp->thread);
+}
+
+void priv_rpigrafx_dispatcher_get_stats(struct priv_rpigrafx_dispatcher *dp,
+                                        const int channel,
+                                        uint64_t *num_deliveredp,
+                                        uint64_t *num_droppedp)
+{
+    const struct channel *ch = &dp->channels[channel];
+
+    *num_deliveredp = __atomic_load_n(&ch->num_delivered, __ATOMIC_ACQUIRE);
+    *num_droppedp = __atomic_load_n(&ch->num_dropped, __ATOMIC_ACQUIRE);
+}
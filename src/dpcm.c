@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <stdint.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Decoder of MIPI CSI-2 10-8-10 DPCM/PCM compressed raw lines with
+ * Predictor1, which is what the IMX219 sends in its 8-bit (comp_enable) mode.
+ *
+ * The first two samples of a line are PCM of the upper 8 bits. Each of the
+ * others is coded against the decoded sample two before it, i.e. the previous
+ * one of the same color:
+ *
+ *   00sxxxxx  DPCM1: difference of 0..31, exact
+ *   010sxxxx  DPCM2: difference of 32..63 in steps of 2
+ *   011sxxxx  DPCM3: difference of 64..127 in steps of 4
+ *   1xxxxxxx  PCM:   upper 7 bits of the sample
+ *
+ * where s is the sign of the difference. Decoded samples are off by at most
+ * 2 from the original ones in DPCM and 4 in PCM, which is used only at strong
+ * edges. Differences of DPCM codes are looked up from delta; each sample
+ * depends on the previous one of its color, so the line is decoded as two
+ * interleaved chains rather than in vector lanes.
+ */
+
+static const int16_t delta[128] = {
+       0,    1,    2,    3,    4,    5,    6,    7,
+       8,    9,   10,   11,   12,   13,   14,   15,
+      16,   17,   18,   19,   20,   21,   22,   23,
+      24,   25,   26,   27,   28,   29,   30,   31,
+       0,   -1,   -2,   -3,   -4,   -5,   -6,   -7,
+      -8,   -9,  -10,  -11,  -12,  -13,  -14,  -15,
+     -16,  -17,  -18,  -19,  -20,  -21,  -22,  -23,
+     -24,  -25,  -26,  -27,  -28,  -29,  -30,  -31,
+      32,   34,   36,   38,   40,   42,   44,   46,
+      48,   50,   52,   54,   56,   58,   60,   62,
+     -32,  -34,  -36,  -38,  -40,  -42,  -44,  -46,
+     -48,  -50,  -52,  -54,  -56,  -58,  -60,  -62,
+      65,   69,   73,   77,   81,   85,   89,   93,
+      97,  101,  105,  109,  113,  117,  121,  125,
+     -65,  -69,  -73,  -77,  -81,  -85,  -89,  -93,
+     -97, -101, -105, -109, -113, -117, -121, -125,
+};
+
+/* Without branches, as PCM codes come at unpredictable edges. */
+static inline int32_t decode(const uint8_t c, const int32_t pred)
+{
+    const int32_t pcm = (c & 0x7f) << 3,
+                  d = pred + delta[c & 0x7f],
+                  v = (d < 0) ? 0 : (d > 1023) ? 1023 : d;
+
+    return (c & 0x80) ? pcm + 4 - (pcm > pred) : v;
+}
+
+void priv_rpigrafx_dpcm10_decode_line(uint16_t *restrict dst,
+                                      const uint8_t *restrict src,
+                                      const int32_t width)
+{
+    int32_t p0, p1, x;
+
+    if (width < 2) {
+        if (width == 1)
+            dst[0] = src[0] * 4 + 2;
+        return;
+    }
+    dst[0] = p0 = src[0] * 4 + 2;
+    dst[1] = p1 = src[1] * 4 + 2;
+    for (x = 2; x + 1 < width; x += 2) {
+        dst[x]     = p0 = decode(src[x], p0);
+        dst[x + 1] = p1 = decode(src[x + 1], p1);
+    }
+    if (x < width)
+        dst[x] = decode(src[x], p0);
+}
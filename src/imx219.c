@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Registers of the IMX219 which librpicam does not set.
+ *
+ * librpicam opens the sensor and reads out a window of the pixel array at
+ * full resolution. Binning is set on top of that: the sensor then bins the
+ * window by the factor in both directions and sends frames of the window
+ * size divided by it, which takes fewer lines of CSI-2 time and fewer bytes
+ * for the CPU. The Bayer pattern is kept, as same-color pixels are binned.
+ *
+ * The frame length is cut to the lines sent plus the minimum vertical
+ * blanking, so that a shorter window or binning raises the frame rate, unless
+ * a lower frame rate is set. Exposure and gains are written only when they are
+ * set manually; otherwise they are left to the tuner of librpicam.
+ *
+ * The registers are written to the sensor over i2c-dev under the grouped
+ * parameter hold, so that they take effect together at a frame boundary.
+ *
+ * The sensor reports the registers a frame was captured with in the embedded
+ * data lines before it, in the SMIA format: each line starts with 0x0a and
+ * continues with pairs of a tag and a byte. 0xaa and 0xa5 set the high and
+ * low byte of a register address, 0x5a gives the value of the register and
+ * 0x55 skips it, both moving on to the next address, and 0x07 ends the line.
+ * In RAW10 every fifth byte holds the low bits of the four before it and is
+ * not part of the data.
+ */
+
+#define I2C_DEVICE "/dev/i2c-0"
+#define I2C_ADDR   0x10
+
+#define REG_FRAME_COUNT            0x0005
+#define REG_GROUPED_PARAMETER_HOLD 0x0104
+#define REG_ANALOG_GAIN            0x0157
+#define REG_DIGITAL_GAIN           0x0158
+#define REG_COARSE_INTEGRATION     0x015a
+#define REG_FRM_LENGTH             0x0160
+#define REG_LINE_LENGTH            0x0162
+#define REG_X_OUTPUT_SIZE          0x016c
+#define REG_Y_OUTPUT_SIZE          0x016e
+#define REG_BINNING_MODE_H         0x0174
+#define REG_BINNING_MODE_V         0x0175
+
+/* In lines. */
+#define MIN_VERTICAL_BLANKING 32
+#define MAX_FRAME_LENGTH      0xffff
+/* The coarse integration time must be this many lines shorter than frames. */
+#define INTEGRATION_MARGIN    4
+/* In pixels; the shortest for the whole width of the array. */
+#define LINE_LENGTH 3448
+
+/*
+ * The video timing PLL as librpicam sets it: EXCK / 3 * 57, divided by 5 for
+ * the pixel clock, with two pixels per clock.
+ */
+#define PREPLL_DIV        3
+#define PLL_MULTIPLIER   57
+#define VT_PIX_CLK_DIV    5
+#define PIXELS_PER_CLOCK  2
+
+#define EMBEDDED_LINE_START    0x0a
+#define EMBEDDED_TAG_ADDR_HIGH 0xaa
+#define EMBEDDED_TAG_ADDR_LOW  0xa5
+#define EMBEDDED_TAG_VALUE     0x5a
+#define EMBEDDED_TAG_SKIP      0x55
+#define EMBEDDED_TAG_LINE_END  0x07
+
+/* Analog gain is 256 / (256 - code). Digital gain is in 1/256. */
+#define MAX_ANALOG_GAIN_CODE 232
+#define MIN_DIGITAL_GAIN     0x0100
+#define MAX_DIGITAL_GAIN     0x0fff
+
+int priv_rpigrafx_imx219_binning_factor(
+                        const rpigrafx_rawcam_imx219_binning_mode_t mode)
+{
+    switch (mode) {
+        case RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE:
+            return 1;
+        case RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2:
+        case RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2_ANALOG:
+            return 2;
+        case RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_4X4:
+            return 4;
+    }
+    return 0;
+}
+
+int priv_rpigrafx_imx219_geometry(struct priv_rpigrafx_imx219_geometry *geom,
+                        const rpigrafx_rawcam_imx219_binning_mode_t mode,
+                        const int32_t x, const int32_t y,
+                        const int32_t out_width, const int32_t out_height)
+{
+    const int bin = priv_rpigrafx_imx219_binning_factor(mode);
+    int ret = 0;
+
+    if (bin == 0) {
+        print_error("Unknown binning mode: %d", mode);
+        ret = 1;
+        goto end;
+    }
+    if (out_width <= 0 || out_height <= 0
+            || out_width % 2 != 0 || out_height % 2 != 0) {
+        print_error("Invalid size: %dx%d", out_width, out_height);
+        ret = 1;
+        goto end;
+    }
+    if (x < 0 || y < 0 || x + out_width * bin > PRIV_RPIGRAFX_IMX219_WIDTH
+            || y + out_height * bin > PRIV_RPIGRAFX_IMX219_HEIGHT) {
+        print_error("Frames of %dx%d binned by %d from (%d, %d) exceed "
+                    "the sensor", out_width, out_height, bin, x, y);
+        ret = 1;
+        goto end;
+    }
+
+    geom->mode = mode;
+    geom->bin = bin;
+    geom->x = x;
+    geom->y = y;
+    geom->width = out_width * bin;
+    geom->height = out_height * bin;
+    geom->out_width = out_width;
+    geom->out_height = out_height;
+    geom->frame_length = out_height + MIN_VERTICAL_BLANKING;
+
+end:
+    return ret;
+}
+
+static int put_reg16(struct priv_rpigrafx_imx219_reg *regs, int n,
+                     const uint16_t addr, const uint16_t value)
+{
+    regs[n].addr = addr;
+    regs[n ++].value = value >> 8;
+    regs[n].addr = addr + 1;
+    regs[n ++].value = value & 0xff;
+    return n;
+}
+
+int priv_rpigrafx_imx219_window_regs(struct priv_rpigrafx_imx219_reg
+                                        regs[PRIV_RPIGRAFX_IMX219_MAX_REGS],
+                        const struct priv_rpigrafx_imx219_geometry *geom)
+{
+    uint8_t v = 0;
+    int n = 0;
+
+    switch (geom->mode) {
+        case RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE:
+            v = 0;
+            break;
+        case RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2:
+            v = 1;
+            break;
+        case RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_4X4:
+            v = 2;
+            break;
+        case RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2_ANALOG:
+            /* The "special" binning of the datasheet. */
+            v = 3;
+            break;
+    }
+    regs[n].addr = REG_BINNING_MODE_H;
+    regs[n ++].value = v;
+    regs[n].addr = REG_BINNING_MODE_V;
+    regs[n ++].value = v;
+    n = put_reg16(regs, n, REG_X_OUTPUT_SIZE, geom->out_width);
+    n = put_reg16(regs, n, REG_Y_OUTPUT_SIZE, geom->out_height);
+    return n;
+}
+
+void priv_rpigrafx_imx219_timing_init(struct priv_rpigrafx_imx219_timing *t,
+                        const float exck_freq,
+                        const struct priv_rpigrafx_imx219_geometry *geom)
+{
+    t->pixel_rate = (double) exck_freq * 1e6 / PREPLL_DIV * PLL_MULTIPLIER
+                    / VT_PIX_CLK_DIV * PIXELS_PER_CLOCK;
+    t->line_length = LINE_LENGTH;
+    t->min_frame_length = t->frame_length = geom->frame_length;
+    t->exposure_lines = 0;
+    t->is_manual_gain = 0;
+    t->analog_gain = 0;
+    t->digital_gain = MIN_DIGITAL_GAIN;
+}
+
+/* In us. */
+static float lines_to_time(const struct priv_rpigrafx_imx219_timing *t,
+                           const int32_t lines)
+{
+    return (double) lines * t->line_length / t->pixel_rate * 1e6;
+}
+
+static int32_t coarse_integration(const struct priv_rpigrafx_imx219_timing *t)
+{
+    const int32_t max = t->frame_length - INTEGRATION_MARGIN;
+
+    return (t->exposure_lines > max) ? max : t->exposure_lines;
+}
+
+float priv_rpigrafx_imx219_frame_period(
+                        const struct priv_rpigrafx_imx219_timing *t)
+{
+    return lines_to_time(t, t->frame_length);
+}
+
+float priv_rpigrafx_imx219_exposure(
+                        const struct priv_rpigrafx_imx219_timing *t)
+{
+    if (t->exposure_lines == 0)
+        return 0;
+    return lines_to_time(t, coarse_integration(t));
+}
+
+float priv_rpigrafx_imx219_gain(const struct priv_rpigrafx_imx219_timing *t)
+{
+    if (!t->is_manual_gain)
+        return 0;
+    return 256.0f / (256 - t->analog_gain) * t->digital_gain
+           / MIN_DIGITAL_GAIN;
+}
+
+float priv_rpigrafx_imx219_set_framerate(
+                        struct priv_rpigrafx_imx219_timing *t,
+                        const float framerate)
+{
+    t->frame_length = t->min_frame_length;
+    if (framerate > 0) {
+        const double lines = t->pixel_rate / t->line_length / framerate;
+        if (lines >= MAX_FRAME_LENGTH)
+            t->frame_length = MAX_FRAME_LENGTH;
+        else if (lines > t->min_frame_length)
+            t->frame_length = lround(lines);
+    }
+    return priv_rpigrafx_imx219_frame_period(t);
+}
+
+float priv_rpigrafx_imx219_set_exposure(
+                        struct priv_rpigrafx_imx219_timing *t,
+                        const float exposure_us)
+{
+    t->exposure_lines = 0;
+    if (exposure_us > 0) {
+        const double lines = exposure_us * 1e-6 * t->pixel_rate
+                             / t->line_length;
+        t->exposure_lines = (lines >= MAX_FRAME_LENGTH) ? MAX_FRAME_LENGTH
+                          : (lines < 1) ? 1 : lround(lines);
+    }
+    return priv_rpigrafx_imx219_exposure(t);
+}
+
+float priv_rpigrafx_imx219_set_gain(struct priv_rpigrafx_imx219_timing *t,
+                                    const float gain)
+{
+    t->is_manual_gain = gain > 0;
+    if (t->is_manual_gain) {
+        /* As much of it in analog as possible, the rest in digital. */
+        const long code = (gain <= 1) ? 0 : lround(256 - 256 / gain);
+        float analog;
+        long digital;
+
+        t->analog_gain = (code > MAX_ANALOG_GAIN_CODE) ? MAX_ANALOG_GAIN_CODE
+                                                       : code;
+        analog = 256.0f / (256 - t->analog_gain);
+        digital = lround(gain / analog * MIN_DIGITAL_GAIN);
+        t->digital_gain = (digital < MIN_DIGITAL_GAIN) ? MIN_DIGITAL_GAIN
+                        : (digital > MAX_DIGITAL_GAIN) ? MAX_DIGITAL_GAIN
+                        : digital;
+    }
+    return priv_rpigrafx_imx219_gain(t);
+}
+
+int priv_rpigrafx_imx219_timing_regs(struct priv_rpigrafx_imx219_reg *regs,
+                        const struct priv_rpigrafx_imx219_timing *t)
+{
+    int n = 0;
+
+    n = put_reg16(regs, n, REG_FRM_LENGTH, t->frame_length);
+    n = put_reg16(regs, n, REG_LINE_LENGTH, t->line_length);
+    if (t->exposure_lines != 0)
+        n = put_reg16(regs, n, REG_COARSE_INTEGRATION, coarse_integration(t));
+    if (t->is_manual_gain) {
+        regs[n].addr = REG_ANALOG_GAIN;
+        regs[n ++].value = t->analog_gain;
+        n = put_reg16(regs, n, REG_DIGITAL_GAIN, t->digital_gain);
+    }
+    return n;
+}
+
+/* Registers reported in the metadata, in the order of the fields below. */
+static const uint16_t embedded_regs[] = {
+    REG_FRAME_COUNT,
+    REG_ANALOG_GAIN,
+    REG_DIGITAL_GAIN, REG_DIGITAL_GAIN + 1,
+    REG_COARSE_INTEGRATION, REG_COARSE_INTEGRATION + 1,
+    REG_FRM_LENGTH, REG_FRM_LENGTH + 1,
+    REG_LINE_LENGTH, REG_LINE_LENGTH + 1,
+};
+#define NUM_EMBEDDED_REGS (sizeof(embedded_regs) / sizeof(embedded_regs[0]))
+
+/* The next data byte of line at *kp, or -1 at the end. */
+static int embedded_byte(const uint8_t *line, const size_t len,
+                         const unsigned nbits, size_t *kp)
+{
+    if (nbits == 10 && *kp % 5 == 4)
+        (*kp) ++;
+    if (*kp >= len)
+        return -1;
+    return line[(*kp) ++];
+}
+
+/*
+ * Record the registers of embedded_regs found in line into values and found.
+ * Return non-zero if the line is malformed.
+ */
+static int parse_embedded_line(const uint8_t *line, const size_t len,
+                               const unsigned nbits,
+                               uint8_t values[NUM_EMBEDDED_REGS],
+                               uint32_t *foundp)
+{
+    size_t k = 0;
+    uint16_t addr = 0;
+    unsigned r;
+
+    if (embedded_byte(line, len, nbits, &k) != EMBEDDED_LINE_START)
+        return 1;
+    for (; ; ) {
+        const int tag = embedded_byte(line, len, nbits, &k);
+        const int data = embedded_byte(line, len, nbits, &k);
+
+        if (tag == -1 || data == -1)
+            return 1;
+        switch (tag) {
+            case EMBEDDED_TAG_ADDR_HIGH:
+                addr = (addr & 0x00ff) | data << 8;
+                break;
+            case EMBEDDED_TAG_ADDR_LOW:
+                addr = (addr & 0xff00) | data;
+                break;
+            case EMBEDDED_TAG_VALUE:
+                for (r = 0; r < NUM_EMBEDDED_REGS; r ++) {
+                    if (embedded_regs[r] == addr) {
+                        values[r] = data;
+                        *foundp |= 1u << r;
+                    }
+                }
+                addr ++;
+                break;
+            case EMBEDDED_TAG_SKIP:
+                addr ++;
+                break;
+            case EMBEDDED_TAG_LINE_END:
+                return 0;
+            default:
+                return 1;
+        }
+    }
+}
+
+int priv_rpigrafx_imx219_parse_embedded(rpigrafx_rawcam_metadata_t *md,
+                        const uint8_t *data, const size_t length,
+                        const size_t stride, const unsigned nbits,
+                        const struct priv_rpigrafx_imx219_timing *t)
+{
+    uint8_t v[NUM_EMBEDDED_REGS];
+    uint32_t found = 0;
+    size_t offset;
+    int ret = 0;
+
+    md->is_valid = 0;
+    for (offset = 0; offset < length; offset += stride) {
+        const size_t len = (stride == 0 || length - offset < stride)
+                           ? length - offset : stride;
+        if ((ret = parse_embedded_line(data + offset, len, nbits, v, &found)))
+            goto end;
+        if (stride == 0 || found == (1u << NUM_EMBEDDED_REGS) - 1)
+            break;
+    }
+    if (found != (1u << NUM_EMBEDDED_REGS) - 1) {
+        ret = 1;
+        goto end;
+    }
+
+    md->frame_count = v[0];
+    md->analog_gain = 256.0f / (256 - v[1]);
+    md->digital_gain = (float) (v[2] << 8 | v[3]) / MIN_DIGITAL_GAIN;
+    md->exposure_us = lines_to_time(t, v[4] << 8 | v[5]);
+    md->frame_period_us = (double) (v[6] << 8 | v[7]) * (v[8] << 8 | v[9])
+                          / t->pixel_rate * 1e6;
+    md->is_valid = !0;
+
+end:
+    return ret;
+}
+
+static int write_reg(const int fd, const uint16_t addr, const uint8_t value)
+{
+    const uint8_t buf[3] = {addr >> 8, addr & 0xff, value};
+
+    if (write(fd, buf, sizeof(buf)) != (ssize_t) sizeof(buf)) {
+        print_error("Failed to write 0x%02x to register 0x%04x: %s",
+                    value, addr, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+int priv_rpigrafx_imx219_write_regs(const struct priv_rpigrafx_imx219_reg
+                                                                        *regs,
+                                    const int num_regs)
+{
+    int fd, k;
+    int ret = 0;
+
+    fd = open(I2C_DEVICE, O_RDWR);
+    if (fd == -1) {
+        print_error("Failed to open %s: %s", I2C_DEVICE, strerror(errno));
+        ret = 1;
+        goto end;
+    }
+    if (ioctl(fd, I2C_SLAVE, I2C_ADDR) == -1) {
+        print_error("Failed to set the address of IMX219: %s",
+                    strerror(errno));
+        ret = 1;
+        goto end;
+    }
+
+    if ((ret = write_reg(fd, REG_GROUPED_PARAMETER_HOLD, 1)))
+        goto end;
+    for (k = 0; k < num_regs; k ++)
+        if ((ret = write_reg(fd, regs[k].addr, regs[k].value)))
+            break;
+    /* Release the hold even if a write failed. */
+    ret |= write_reg(fd, REG_GROUPED_PARAMETER_HOLD, 0);
+
+end:
+    if (fd != -1)
+        close(fd);
+    return ret;
+}
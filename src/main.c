@@ -25,6 +25,8 @@ int rpigrafx_init()
     if (priv_rpigrafx_called.main != 0)
         goto end;
 
+    priv_rpigrafx_unpack_init();
+
     ret = priv_rpigrafx_mmal_init();
     if (ret) {
         print_error("Initializing mmal failed: 0x%08x", ret);
@@ -7,6 +7,7 @@
  * software. If not, contact the copyright holder above.
  */
 
+#include <time.h>
 #include <interface/mmal/mmal.h>
 #include <interface/mmal/util/mmal_util.h>
 #include <interface/mmal/util/mmal_util_params.h>
@@ -34,6 +35,19 @@
 #define NUM_SPLITTER_OUTPUTS 4
 #define CAMERA_PREVIEW_PORT 0
 #define CAMERA_CAPTURE_PORT 2
+/* Splitter input and isp output buffers in the pipelined rawcam mode. */
+#define PIPELINE_NUM_BUFFERS 3
+/* The pipeline thread checks whether to quit this often while it waits. */
+#define PIPELINE_POLL_MS 100
+/* White balance statistics are gathered on every AWB_STEP-th Bayer quad. */
+#define AWB_STEP 8
+#define AWB_DEFAULT_SMOOTHING 0.25f
+/* Mid gray. */
+#define AE_DEFAULT_TARGET 0.18f
+/* Highest gain which RPIGRAFX_AE_MODE_MEAN sets, all analog on the IMX219. */
+#define AE_MAX_GAIN 8.0f
+/* Metadata of this many last rawcam frames is kept to match isp outputs. */
+#define NUM_METADATA (PIPELINE_NUM_BUFFERS + 2)
 
 static int32_t num_cameras = 0;
 
@@ -151,7 +165,10 @@ static MMAL_CONNECTION_T *conn_isps_renders[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
 
 static struct cameras_config {
     _Bool is_used;
+    /* Size of the frame which the splitter receives. */
     int32_t width, height;
+    /* Size of the frame from the camera. Differs only for rawcam. */
+    int32_t raw_width, raw_height;
     int32_t max_width, max_height;
     unsigned camera_output_port_index;
     _Bool use_camera_capture_port;
@@ -163,24 +180,128 @@ static struct cameras_config {
         int32_t width, height;
         MMAL_FOURCC_T encoding;
         _Bool is_zero_copy_rendering;
+        /*
+         * The frame is produced on the CPU in a host-side encoding and the
+         * splitter output, isp and render are not used.
+         */
+        _Bool is_host;
+        /* Frames go to callback instead of the user if it is not NULL. */
+        rpigrafx_frame_callback_t callback;
+        void *callback_user;
+        rpigrafx_frame_config_t callback_fc;
+        /*
+         * A capture of rawcam timed out after sending its frame, which is to
+         * be dropped when it comes.
+         */
+        _Bool has_late_frame;
     } isp[NUM_SPLITTER_OUTPUTS];
     struct render_config {
         MMAL_DISPLAYREGION_T region;
     } render[NUM_SPLITTER_OUTPUTS];
 
     _Bool is_rawcam;
+    /*
+     * The components are set up by rpigrafx_finish_config, after which the
+     * settings which take effect on it can't be changed.
+     */
+    _Bool is_set_up;
 #ifdef IMPL_RAWCAM
     MMAL_FOURCC_T raw_encoding;
+    rpigrafx_bayer_pattern_t bayer_pattern;
+    rpigrafx_demosaic_mode_t demosaic_mode;
+    /* Each 2x2 Bayer quad becomes a pixel; raw_{width,height} are twice. */
+    _Bool use_superpixel;
     rpigrafx_rawcam_camera_model_t rawcam_camera_model;
     unsigned nbits_of_raw_from_camera;
+    /*
+     * The camera compresses RAW10 to 8 bits with DPCM, which is decoded on
+     * the CPU. See rawcam_nbits.
+     */
+    _Bool is_dpcm;
+    rpigrafx_rawcam_imx219_binning_mode_t imx219_binning_mode;
+    /*
+     * Window of the pixel array which is read out, or roi_width == 0 to fit
+     * the frames in the whole array.
+     */
+    int32_t roi_x, roi_y, roi_width, roi_height;
+    /*
+     * Timing of the IMX219 once it is open. The rpigrafx_set_rawcam_*
+     * functions change it under the lock of the tuner, whose thread writes
+     * it to the sensor.
+     */
+    _Bool has_imx219_timing;
+    struct priv_rpigrafx_imx219_timing imx219_timing;
+    /* Runs the tuner off the thread processing frames. */
+    struct priv_rpigrafx_tuner *tuner;
+    int tuner_interval;
+    float tuner_change;
+    /*
+     * Automatic exposure, under the lock of the tuner, and frames which
+     * rpigrafx_finish_config waits at most for it to converge.
+     */
+    struct priv_rpigrafx_ae ae;
+    int ae_wait_frames;
+    /*
+     * Metadata from the side info of the frame to come and of the frame being
+     * processed. Used only by the thread processing frames.
+     */
+    rpigrafx_rawcam_metadata_t next_metadata, frame_metadata;
+    /* Of the last frames processed, under the lock of the pipeline. */
+    rpigrafx_rawcam_metadata_t metadata[NUM_METADATA];
+    int metadata_idx;
     MMAL_PARAMETER_CAMERA_RX_CONFIG_T rx_cfg;
     union {
         struct rpicam_imx219_config imx219;
     } rpicam_config;
+    /* Threads for the CPU-side raw processing. 0 is the number of CPUs. */
+    int num_workers;
+    _Bool set_worker_affinity;
+    struct priv_rpigrafx_pool *pool;
+    /* Intermediate buffers for the CPU-side raw processing. */
+    struct priv_rpigrafx_raw_scratch scratch;
+    /*
+     * Capture and process raw frames on a background thread. The stats are
+     * then updated there under the lock of the pipeline.
+     */
+    _Bool is_pipelined;
+    struct priv_rpigrafx_pipeline *pipeline;
+    rpigrafx_rawcam_stats_t rawcam_stats;
+    /* Grid of the saturation count; histograms only if enabled. */
+    int saturation_step;
+    _Bool is_histogram_enabled;
+    uint32_t hist[3][256];
+    struct priv_rpigrafx_awb awb;
+    float gamma;
+    /* Tone maps for 8-bit output and for host-side encodings. */
+    struct priv_rpigrafx_tone tone[2];
+    /* Black level and lens shading; the map is built for the raw frame. */
+    _Bool has_calib;
+    struct priv_rpigrafx_calib calib;
+    struct priv_rpigrafx_calib_map calib_map;
+    /* Dynamic defect correction threshold in full scale, or 0. */
+    float dpc_threshold;
+    /* Encoding which the CPU writes into the splitter and the isps read. */
+    MMAL_FOURCC_T splitter_encoding;
 #endif /* IMPL_RAWCAM */
 } cameras_config[MAX_CAMERAS];
 static struct callback_context *ctxs[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
 
+/*
+ * user_data of the isp-render connections. Their callbacks keep only the
+ * newest frame on the connection if keeps_newest, and post the frames to the
+ * dispatcher instead if channel is not negative and it is running.
+ */
+static struct conn_user {
+    _Bool keeps_newest;
+    int channel;
+} conn_users[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
+
+/*
+ * Delivers the frames of all the outputs with callbacks. It is set after all
+ * the cameras are set up and read by the connection callbacks.
+ */
+static struct priv_rpigrafx_dispatcher *dispatcher = NULL;
+
 #define WARN_HEADER(pre, header, post) \
     do { \
         if (header != NULL) { \
@@ -193,11 +314,55 @@ static struct callback_context *ctxs[MAX_CAMERAS][NUM_SPLITTER_OUTPUTS];
        } \
     } while (0)
 
+static _Bool is_host_encoding(const MMAL_FOURCC_T encoding)
+{
+    switch (encoding) {
+        case RPIGRAFX_ENCODING_RGB48:
+        case RPIGRAFX_ENCODING_RGB16P:
+            return !0;
+        default:
+            return 0;
+    }
+}
+
+static _Bool is_yuv_encoding(const MMAL_FOURCC_T encoding)
+{
+    return encoding == MMAL_ENCODING_I420 || encoding == MMAL_ENCODING_NV12;
+}
+
+/* The CPU converts rawcam frames to YUV in BT.601 limited range. */
+static void config_color_space(MMAL_PORT_T *port,
+                               const MMAL_FOURCC_T encoding)
+{
+    if (is_yuv_encoding(encoding))
+        port->format->es->video.color_space = MMAL_COLOR_SPACE_ITUR_BT601;
+}
+
+#ifdef IMPL_RAWCAM
+/* Bits of the raw samples of camera cfg as they are processed. */
+static unsigned rawcam_nbits(const struct cameras_config *cfg)
+{
+    return cfg->is_dpcm ? 10 : cfg->nbits_of_raw_from_camera;
+}
+
+/* Binning factor of the sensor of camera cfg in both directions. */
+static int rawcam_binning(const struct cameras_config *cfg)
+{
+    switch (cfg->rawcam_camera_model) {
+        case RPIGRAFX_RAWCAM_CAMERA_MODEL_IMX219:
+            return priv_rpigrafx_imx219_binning_factor(
+                                                   cfg->imx219_binning_mode);
+    }
+    return 1;
+}
+#endif /* IMPL_RAWCAM */
+
 static MMAL_STATUS_T config_port(MMAL_PORT_T *port,
                                  const MMAL_FOURCC_T encoding,
                                  const int32_t width, const int32_t height)
 {
     port->format->encoding = encoding;
+    config_color_space(port, encoding);
     port->format->es->video.width  = VCOS_ALIGN_UP(width,  32);
     port->format->es->video.height = VCOS_ALIGN_UP(height, 16);
     port->format->es->video.crop.x = 0;
@@ -215,6 +380,7 @@ static MMAL_STATUS_T config_port_crop(MMAL_PORT_T *port,
                                       const int32_t crop_height)
 {
     port->format->encoding = encoding;
+    config_color_space(port, encoding);
     port->format->es->video.width  = VCOS_ALIGN_UP(actual_width,  32);
     port->format->es->video.height = VCOS_ALIGN_UP(actual_height, 16);
     port->format->es->video.crop.x = 0;
@@ -238,6 +404,39 @@ int priv_rpigrafx_mmal_init()
         cp_cameras[i] = NULL;
         cfg->is_used = 0;
         cfg->is_rawcam = 0;
+        cfg->is_set_up = 0;
+#ifdef IMPL_RAWCAM
+        cfg->num_workers = 0;
+        cfg->set_worker_affinity = 0;
+        cfg->pool = NULL;
+        cfg->is_pipelined = 0;
+        cfg->pipeline = NULL;
+        cfg->saturation_step = 1;
+        cfg->is_histogram_enabled = 0;
+        priv_rpigrafx_awb_init(&cfg->awb, RPIGRAFX_AWB_MODE_OFF,
+                               AWB_DEFAULT_SMOOTHING, 1.0, 1.0, 1.0);
+        cfg->gamma = 1;
+        priv_rpigrafx_tone_init(&cfg->tone[0]);
+        priv_rpigrafx_tone_init(&cfg->tone[1]);
+        cfg->has_calib = 0;
+        priv_rpigrafx_calib_init(&cfg->calib);
+        priv_rpigrafx_calib_map_init(&cfg->calib_map);
+        cfg->dpc_threshold = 0;
+        cfg->splitter_encoding = MMAL_ENCODING_RGB24;
+        cfg->has_imx219_timing = 0;
+        cfg->tuner = NULL;
+        cfg->tuner_interval = 1;
+        cfg->tuner_change = 0;
+        priv_rpigrafx_ae_init(&cfg->ae, RPIGRAFX_AE_MODE_HEURISTIC,
+                              RPIGRAFX_AE_METERING_AVERAGE, AE_DEFAULT_TARGET);
+        cfg->ae_wait_frames = 0;
+        for (j = 0; j < NUM_METADATA; j ++) {
+            cfg->metadata[j].is_valid = 0;
+            cfg->metadata[j].pts = MMAL_TIME_UNKNOWN;
+        }
+        cfg->metadata_idx = 0;
+        cfg->next_metadata.is_valid = 0;
+#endif /* IMPL_RAWCAM */
         if ((ret = rpigrafx_config_camera_port(i,
                                                RPIGRAFX_CAMERA_PORT_PREVIEW)))
             goto end;
@@ -249,6 +448,10 @@ int priv_rpigrafx_mmal_init()
         for (j = 0; j < NUM_SPLITTER_OUTPUTS; j ++) {
             cp_isps[i][j] = NULL;
             conn_splitters_isps[i][j] = NULL;
+            cfg->isp[j].callback = NULL;
+            cfg->isp[j].has_late_frame = 0;
+            conn_users[i][j].keeps_newest = 0;
+            conn_users[i][j].channel = -1;
         }
     }
 
@@ -318,6 +521,22 @@ int priv_rpigrafx_mmal_finalize()
     if (priv_rpigrafx_called.mmal != 1)
         goto skip;
 
+    /*
+     * Make the connection callbacks stop posting before destroying the
+     * dispatcher. Disabling the connections waits for the callbacks running.
+     */
+    if (dispatcher != NULL) {
+        struct priv_rpigrafx_dispatcher *dp = dispatcher;
+
+        __atomic_store_n(&dispatcher, NULL, __ATOMIC_RELEASE);
+        for (i = 0; i < MAX_CAMERAS; i ++)
+            for (j = 0; j < NUM_SPLITTER_OUTPUTS; j ++)
+                if (conn_users[i][j].channel >= 0
+                        && conn_isps_renders[i][j] != NULL)
+                    mmal_connection_disable(conn_isps_renders[i][j]);
+        priv_rpigrafx_dispatcher_destroy(dp);
+    }
+
     for (i = 0; i < MAX_CAMERAS; i ++) {
         struct cameras_config *cfg = &cameras_config[i];
         cp_cameras[i] = cp_splitters[i] = NULL;
@@ -325,9 +544,30 @@ int priv_rpigrafx_mmal_finalize()
             cp_isps[i][j] = NULL;
         cfg->width  = -1;
         cfg->height = -1;
+        cfg->raw_width  = -1;
+        cfg->raw_height = -1;
         cfg->max_width  = -1;
         cfg->max_height = -1;
+        cfg->is_set_up = 0;
         cfg->splitter.next_output_idx = 0;
+        for (j = 0; j < NUM_SPLITTER_OUTPUTS; j ++) {
+            if (ctxs[i][j] != NULL) {
+                free(ctxs[i][j]->host_frame);
+                ctxs[i][j]->host_frame = NULL;
+            }
+        }
+#ifdef IMPL_RAWCAM
+        priv_rpigrafx_pipeline_destroy(cfg->pipeline);
+        cfg->pipeline = NULL;
+        /* After the pipeline, which posts to it. */
+        priv_rpigrafx_tuner_destroy(cfg->tuner);
+        cfg->tuner = NULL;
+        priv_rpigrafx_pool_destroy(cfg->pool);
+        cfg->pool = NULL;
+        priv_rpigrafx_raw_scratch_free(&cfg->scratch);
+        priv_rpigrafx_calib_map_free(&cfg->calib_map);
+        priv_rpigrafx_calib_free(&cfg->calib);
+#endif /* IMPL_RAWCAM */
     }
 
 skip:
@@ -344,9 +584,54 @@ static void callback_control(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *header)
 
 static void callback_conn(MMAL_CONNECTION_T *conn)
 {
+    const struct conn_user *cu = conn->user_data;
+    struct priv_rpigrafx_dispatcher *dp = NULL;
+    MMAL_BUFFER_HEADER_T *header = NULL;
+
     if (priv_rpigrafx_verbose)
         print_error("Called by a connection %s between %s and %s",
                     conn->name, conn->out->name, conn->in->name);
+
+    /* user_data is set only on isp-render connections. */
+    if (cu == NULL || (!cu->keeps_newest && cu->channel < 0))
+        return;
+
+    if (cu->channel >= 0)
+        dp = __atomic_load_n(&dispatcher, __ATOMIC_ACQUIRE);
+    if (dp != NULL) {
+        /*
+         * Hand the finished frames to the dispatcher thread. This is also
+         * called when the thread releases a frame, but only the MMAL thread
+         * may post to the channel.
+         */
+        if (!priv_rpigrafx_dispatcher_is_current(dp)) {
+            while ((header = mmal_queue_get(conn->queue)) != NULL) {
+                if (header->length == 0) {
+                    mmal_buffer_header_release(header);
+                    continue;
+                }
+                /* The ring holds the whole pool, so this can't fail. */
+                if (!priv_rpigrafx_dispatcher_post(dp, cu->channel, header)) {
+                    print_error("Ring of %s is full", conn->name);
+                    mmal_queue_put_back(conn->queue, header);
+                    break;
+                }
+            }
+        }
+    } else {
+        /*
+         * Keep only the newest finished frame so that the isp always has
+         * buffers to output to and the pipeline thread does not stall on a
+         * slow user, or on the dispatcher which is yet to start.
+         */
+        while (mmal_queue_length(conn->queue) > 1) {
+            if ((header = mmal_queue_get(conn->queue)) == NULL)
+                break;
+            mmal_buffer_header_release(header);
+        }
+    }
+    while ((header = mmal_queue_get(conn->pool->queue)) != NULL)
+        mmal_port_send_buffer(conn->out, header);
 }
 
 int rpigrafx_config_camera_frame(const int32_t camera_number,
@@ -401,6 +686,7 @@ int rpigrafx_config_camera_frame(const int32_t camera_number,
     cfg->isp[idx].height = height;
     cfg->isp[idx].encoding = encoding;
     cfg->isp[idx].is_zero_copy_rendering = is_zero_copy_rendering;
+    cfg->isp[idx].is_host = is_host_encoding(encoding);
 
     ctx = malloc(sizeof(*ctx));
     if (ctx == NULL) {
@@ -411,6 +697,7 @@ int rpigrafx_config_camera_frame(const int32_t camera_number,
     ctx->status = MMAL_SUCCESS;
     ctx->header = NULL;
     ctx->is_header_passed_to_render = 0;
+    ctx->host_frame = NULL;
     ctxs[camera_number][idx] = ctx;
 
     fcp->camera_number = camera_number;
@@ -422,6 +709,24 @@ end:
     return ret;
 }
 
+#ifdef IMPL_RAWCAM
+
+/*
+ * Fail if camera i is already set up, for the settings named what which take
+ * effect on rpigrafx_finish_config.
+ */
+static int check_not_set_up(const int i, const char *what)
+{
+    if (cameras_config[i].is_set_up) {
+        print_error("%s of camera %d must be configured before "
+                    "rpigrafx_finish_config", what, i);
+        return 1;
+    }
+    return 0;
+}
+
+#endif /* IMPL_RAWCAM */
+
 int rpigrafx_config_rawcam(const rpigrafx_rawcam_camera_model_t camera_model,
                            const MMAL_CAMERA_RX_CONFIG_DECODE decode,
                            const MMAL_CAMERA_RX_CONFIG_ENCODE encode,
@@ -430,6 +735,7 @@ int rpigrafx_config_rawcam(const rpigrafx_rawcam_camera_model_t camera_model,
                            const uint32_t data_lanes,
                            const uint32_t nbits_of_raw_from_camera,
                            const rpigrafx_bayer_pattern_t bayer_pattern,
+                           const rpigrafx_demosaic_mode_t demosaic_mode,
                            rpigrafx_frame_config_t *fcp)
 {
 #ifdef IMPL_RAWCAM
@@ -505,6 +811,31 @@ int rpigrafx_config_rawcam(const rpigrafx_rawcam_camera_model_t camera_model,
             goto end;
     }
 
+    switch (bayer_pattern) {
+        case RPIGRAFX_BAYER_PATTERN_BGGR:
+        case RPIGRAFX_BAYER_PATTERN_GRBG:
+        case RPIGRAFX_BAYER_PATTERN_GBRG:
+        case RPIGRAFX_BAYER_PATTERN_RGGB:
+            break;
+        default:
+            print_error("Unknown rpigrafx_bayer_pattern_t value: %d",
+                        bayer_pattern);
+            ret = 1;
+            goto end;
+    }
+
+    switch (demosaic_mode) {
+        case RPIGRAFX_DEMOSAIC_MODE_NEAREST:
+        case RPIGRAFX_DEMOSAIC_MODE_BILINEAR:
+        case RPIGRAFX_DEMOSAIC_MODE_EDGE_AWARE:
+            break;
+        default:
+            print_error("Unknown rpigrafx_demosaic_mode_t value: %d",
+                        demosaic_mode);
+            ret = 1;
+            goto end;
+    }
+
     rx_cfg.decode     = decode;
     rx_cfg.encode     = encode;
     rx_cfg.unpack     = unpack;
@@ -513,9 +844,20 @@ int rpigrafx_config_rawcam(const rpigrafx_rawcam_camera_model_t camera_model,
     rx_cfg.image_id   = image_id;
     memcpy(&cfg->rx_cfg, &rx_cfg, sizeof(rx_cfg));
     cfg->nbits_of_raw_from_camera = nbits_of_raw_from_camera;
+    cfg->is_dpcm = 0;
+    cfg->imx219_binning_mode = RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE;
+    cfg->roi_x = cfg->roi_y = cfg->roi_width = cfg->roi_height = 0;
     cfg->rawcam_camera_model = camera_model;
     cfg->is_rawcam = !0;
     cfg->raw_encoding = encoding;
+    cfg->bayer_pattern = bayer_pattern;
+    cfg->demosaic_mode = demosaic_mode;
+    switch (camera_model) {
+        case RPIGRAFX_RAWCAM_CAMERA_MODEL_IMX219:
+            priv_rpigrafx_awb_init(&cfg->awb, RPIGRAFX_AWB_MODE_GRAY_WORLD,
+                                   AWB_DEFAULT_SMOOTHING, 1.55, 1.0, 1.5);
+            break;
+    }
 
 end:
     return ret;
@@ -530,6 +872,7 @@ end:
     MMAL_PARAM_UNUSED(data_lanes);
     MMAL_PARAM_UNUSED(nbits_of_raw_from_camera);
     MMAL_PARAM_UNUSED(bayer_pattern);
+    MMAL_PARAM_UNUSED(demosaic_mode);
     MMAL_PARAM_UNUSED(fcp);
 
     print_error("librpicam and librpiraw is needed to use rawcam");
@@ -568,6 +911,7 @@ int rpigrafx_config_rawcam_imx219(const float exck_freq,
     imx219.vert_orientation = orient_vert;
     switch (cfg->nbits_of_raw_from_camera) {
         case 8:
+            /* RAW10 compressed with DPCM, unless the receiver decodes it. */
             imx219.comp_enable = !0;
             break;
         case 10:
@@ -578,13 +922,17 @@ int rpigrafx_config_rawcam_imx219(const float exck_freq,
             ret = 1;
             goto end;
     }
-    switch (binning_mode) {
-        case RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE:
-            /* Keep the defaults. */
-            break;
+    /* Set on top of librpicam in setup_cp_camera_rawcam. */
+    if (priv_rpigrafx_imx219_binning_factor(binning_mode) == 0) {
+        print_error("Unknown binning mode: %d", binning_mode);
+        ret = 1;
+        goto end;
     }
 
     memcpy(&cfg->rpicam_config.imx219, &imx219, sizeof(imx219));
+    cfg->imx219_binning_mode = binning_mode;
+    cfg->is_dpcm = imx219.comp_enable
+                   && cfg->rx_cfg.decode == MMAL_CAMERA_RX_CONFIG_DECODE_NONE;
 
 end:
     return ret;
@@ -605,155 +953,724 @@ end:
 #endif /* IMPL_RAWCAM */
 }
 
-int rpigrafx_config_camera_port(const int32_t camera_number,
-                                const rpigrafx_camera_port_t camera_port)
+int rpigrafx_config_rawcam_roi(const int32_t x, const int32_t y,
+                               const int32_t width, const int32_t height,
+                               rpigrafx_frame_config_t *fcp)
 {
-    struct cameras_config *cfg = &cameras_config[camera_number];
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
     int ret = 0;
 
-    switch (camera_port) {
-        case RPIGRAFX_CAMERA_PORT_PREVIEW:
-            cfg->camera_output_port_index = CAMERA_PREVIEW_PORT;
-            cfg->use_camera_capture_port = 0;
-            break;
-        case RPIGRAFX_CAMERA_PORT_CAPTURE:
-            cfg->camera_output_port_index = CAMERA_CAPTURE_PORT;
-            cfg->use_camera_capture_port = !0;
-            break;
-        default:
-            print_error("Unknown rpigrafx_camera_port_t value: %d\n",
-                        camera_port);
-            ret = 1;
-            goto end;
-            break;
+    if (!cfg->is_rawcam) {
+        print_error("Camera %d is not configured for rawcam",
+                    fcp->camera_number);
+        ret = 1;
+        goto end;
+    }
+    if (width == 0 && height == 0) {
+        cfg->roi_x = cfg->roi_y = cfg->roi_width = cfg->roi_height = 0;
+        goto end;
+    }
+    if (x < 0 || y < 0 || width <= 0 || height <= 0
+            || x % 2 != 0 || y % 2 != 0 || width % 2 != 0 || height % 2 != 0) {
+        print_error("Invalid ROI: %dx%d at (%d, %d)", width, height, x, y);
+        ret = 1;
+        goto end;
+    }
+    if (x + width > cfg->max_width || y + height > cfg->max_height) {
+        print_error("ROI of %dx%d at (%d, %d) exceeds the sensor (%dx%d)",
+                    width, height, x, y, cfg->max_width, cfg->max_height);
+        ret = 1;
+        goto end;
     }
 
+    cfg->roi_x = x;
+    cfg->roi_y = y;
+    cfg->roi_width = width;
+    cfg->roi_height = height;
+
 end:
     return ret;
-}
 
-int rpigrafx_config_camera_frame_render(const _Bool is_fullscreen,
-                           const int32_t x, const int32_t y,
-                           const int32_t width, const int32_t height,
-                           const int32_t layer,
-                           rpigrafx_frame_config_t *fcp)
-{
-    MMAL_DISPLAYREGION_T region = {
-        .fullscreen = is_fullscreen,
-        .dest_rect = {
-            .x = x, .y = y,
-            .width = width, .height = height
-        },
-        .layer = layer,
-        .set =   MMAL_DISPLAY_SET_FULLSCREEN
-               | MMAL_DISPLAY_SET_DEST_RECT
-               | MMAL_DISPLAY_SET_LAYER
-    };
-    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
-    int ret = 0;
+#else /* IMPL_RAWCAM */
 
-    memcpy(&cfg->render[fcp->splitter_output_port_index].region,
-           &region, sizeof(region));
+    MMAL_PARAM_UNUSED(x);
+    MMAL_PARAM_UNUSED(y);
+    MMAL_PARAM_UNUSED(width);
+    MMAL_PARAM_UNUSED(height);
+    MMAL_PARAM_UNUSED(fcp);
 
-    return ret;
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
 }
 
-static int setup_cp_camera_rawcam(const int i,
-                                  const int32_t width, const int32_t height)
+int rpigrafx_config_rawcam_calibration(const char *path,
+                                       rpigrafx_frame_config_t *fcp)
 {
 #ifdef IMPL_RAWCAM
 
-    struct cameras_config *cfg = &cameras_config[i];
-    MMAL_STATUS_T status;
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
     int ret = 0;
 
-    status = mmal_wrapper_create(&cpw_rawcams[i], "vc.ril.rawcam");
-    if (status != MMAL_SUCCESS) {
-        print_error("Creating rawcam component of camera %d failed: 0x%08x",
-                    i, status);
-        ret = 1;
+    /* The map is built for the raw frame when the camera is set up. */
+    if ((ret = check_not_set_up(fcp->camera_number, "Calibration")))
+        goto end;
+    if (path == NULL) {
+        priv_rpigrafx_calib_free(&cfg->calib);
+        cfg->has_calib = 0;
         goto end;
     }
+    if ((ret = priv_rpigrafx_calib_load(&cfg->calib, path)))
+        goto end;
+    cfg->has_calib = !0;
 
-    switch (cfg->rawcam_camera_model) {
-        case RPIGRAFX_RAWCAM_CAMERA_MODEL_IMX219: {
-            struct rpicam_imx219_config *stp = &cfg->rpicam_config.imx219;
-            stp->width = width;
-            stp->height = height;
-            if ((ret = rpicam_imx219_open(stp)))
-                goto end;
-            break;
-        }
-    }
+end:
+    return ret;
 
-    {
-        MMAL_PORT_T *output = mmal_util_get_port(cpw_rawcams[i]->component,
-                                                 MMAL_PORT_TYPE_OUTPUT, 0);
-        MMAL_PARAMETER_CAMERA_RX_CONFIG_T rx_cfg = {
-            .hdr = {
-                .id = MMAL_PARAMETER_CAMERA_RX_CONFIG,
-                .size = sizeof(rx_cfg)
-            }
-        };
-        MMAL_FOURCC_T encoding = cfg->raw_encoding;
+#else /* IMPL_RAWCAM */
 
-        if (output == NULL) {
-            print_error("Getting output %d of camera %d failed", 0, i);
-            ret = 1;
-            goto end;
-        }
+    MMAL_PARAM_UNUSED(path);
+    MMAL_PARAM_UNUSED(fcp);
 
-        status = config_port(output, encoding, width, height);
-        if (status != MMAL_SUCCESS) {
-            print_error("Setting format of camera %d failed: 0x%08x",
-                        i, status);
-            ret = 1;
-            goto end;
-        }
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
 
-        status = mmal_port_parameter_get(output, &rx_cfg.hdr);
-        if (status != MMAL_SUCCESS) {
-            print_error("Getting rx_cfg of rawcam %d failed: 0x%08x",
-                        i, status);
-            ret = 1;
-            goto end;
-        }
+#endif /* IMPL_RAWCAM */
+}
 
-        /* Use default values for encode_block_length and embedded_data_lines. */
-        rx_cfg.decode     = cfg->rx_cfg.decode;
-        rx_cfg.encode     = cfg->rx_cfg.encode;
-        rx_cfg.unpack     = cfg->rx_cfg.unpack;
-        rx_cfg.pack       = cfg->rx_cfg.pack;
-        rx_cfg.data_lanes = cfg->rx_cfg.data_lanes;
-        rx_cfg.image_id   = cfg->rx_cfg.image_id;
-        status = mmal_port_parameter_set(output, &rx_cfg.hdr);
-        if (status != MMAL_SUCCESS) {
-            print_error("Setting rx_cfg of rawcam %d failed: 0x%08x",
-                        i, status);
-            ret = 1;
-            goto end;
-        }
+int rpigrafx_config_rawcam_defect_correction(const float threshold,
+                                             rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
 
-        status = mmal_wrapper_port_enable(output,
-                                          MMAL_WRAPPER_FLAG_PAYLOAD_ALLOCATE);
-        if (status != MMAL_SUCCESS) {
-            print_error("Enabling rawcam component of camera %d failed: 0x%08x",
-                        i, status);
-            ret = 1;
-            goto end;
-        }
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
 
-        MMAL_BUFFER_HEADER_T *header = NULL;
-        while ((header = mmal_queue_get(cpw_rawcams[i]->output_pool[0]->queue)) != NULL)
-            mmal_port_send_buffer(output, header);
+    if (!(threshold >= 0 && threshold < 1)) {
+        print_error("Threshold must be in [0, 1): %f", threshold);
+        ret = 1;
+        goto end;
     }
 
+    priv_rpigrafx_pipeline_lock(cfg->pipeline);
+    cfg->dpc_threshold = threshold;
+    priv_rpigrafx_pipeline_unlock(cfg->pipeline);
+
 end:
     return ret;
 
 #else /* IMPL_RAWCAM */
 
-    MMAL_PARAM_UNUSED(i);
+    MMAL_PARAM_UNUSED(threshold);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_config_rawcam_tone(const float gamma,
+                                rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
+
+    if (!(gamma >= 0.1f && gamma <= 10)) {
+        print_error("Gamma must be in [0.1, 10]: %f", gamma);
+        ret = 1;
+        goto end;
+    }
+
+    priv_rpigrafx_pipeline_lock(cfg->pipeline);
+    cfg->gamma = gamma;
+    cfg->awb.gamma = gamma;
+    priv_rpigrafx_pipeline_unlock(cfg->pipeline);
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(gamma);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_config_rawcam_splitter_encoding(const MMAL_FOURCC_T encoding,
+                                             rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
+
+    if (!cfg->is_rawcam) {
+        print_error("Camera %d is not configured for rawcam",
+                    fcp->camera_number);
+        ret = 1;
+        goto end;
+    }
+    /* The buffers of the splitter are allocated for the encoding. */
+    if ((ret = check_not_set_up(fcp->camera_number, "Splitter encoding")))
+        goto end;
+    switch (encoding) {
+        case MMAL_ENCODING_RGB24:
+        case MMAL_ENCODING_I420:
+        case MMAL_ENCODING_NV12:
+            break;
+        default:
+            print_error("Unsupported splitter encoding: 0x%08x", encoding);
+            ret = 1;
+            goto end;
+    }
+    cfg->splitter_encoding = encoding;
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(encoding);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_config_rawcam_workers(const int num_workers,
+                                   const _Bool set_affinity,
+                                   rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
+
+    /* The pool of the workers is created when the camera is set up. */
+    if ((ret = check_not_set_up(fcp->camera_number, "Workers")))
+        goto end;
+    if (num_workers < 0) {
+        print_error("Invalid number of workers: %d", num_workers);
+        ret = 1;
+        goto end;
+    }
+
+    cfg->num_workers = num_workers;
+    cfg->set_worker_affinity = set_affinity;
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(num_workers);
+    MMAL_PARAM_UNUSED(set_affinity);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_config_rawcam_pipelined(const _Bool is_pipelined,
+                                     rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
+
+    /*
+     * Only the thread of the pipeline, which is created when the camera is
+     * set up, may take the frames of rawcam then.
+     */
+    if ((ret = check_not_set_up(fcp->camera_number, "Pipelined mode")))
+        goto end;
+    cfg->is_pipelined = is_pipelined;
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(is_pipelined);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_config_rawcam_stats(const int saturation_step,
+                                 const _Bool is_histogram_enabled,
+                                 rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
+
+    if (saturation_step < 1) {
+        print_error("Invalid saturation step: %d", saturation_step);
+        ret = 1;
+        goto end;
+    }
+
+    priv_rpigrafx_pipeline_lock(cfg->pipeline);
+    cfg->saturation_step = saturation_step;
+    cfg->is_histogram_enabled = is_histogram_enabled;
+    memset(cfg->hist, 0, sizeof(cfg->hist));
+    priv_rpigrafx_pipeline_unlock(cfg->pipeline);
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(saturation_step);
+    MMAL_PARAM_UNUSED(is_histogram_enabled);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_config_rawcam_tuner(const int interval, const float change,
+                                 rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
+
+    if (interval < 1) {
+        print_error("Interval must be at least 1: %d", interval);
+        ret = 1;
+        goto end;
+    }
+    if (!(change >= 0)) {
+        print_error("Change must not be negative: %f", change);
+        ret = 1;
+        goto end;
+    }
+
+    cfg->tuner_interval = interval;
+    cfg->tuner_change = change;
+    priv_rpigrafx_tuner_set_cadence(cfg->tuner, interval, change);
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(interval);
+    MMAL_PARAM_UNUSED(change);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_config_rawcam_ae(const rpigrafx_ae_mode_t mode,
+                              const rpigrafx_ae_metering_t metering,
+                              const float target,
+                              rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
+
+    switch (mode) {
+        case RPIGRAFX_AE_MODE_HEURISTIC:
+        case RPIGRAFX_AE_MODE_MEAN:
+            break;
+        default:
+            print_error("Unknown rpigrafx_ae_mode_t value: %d", mode);
+            ret = 1;
+            goto end;
+    }
+    switch (metering) {
+        case RPIGRAFX_AE_METERING_AVERAGE:
+        case RPIGRAFX_AE_METERING_CENTER:
+        case RPIGRAFX_AE_METERING_SPOT:
+            break;
+        default:
+            print_error("Unknown rpigrafx_ae_metering_t value: %d", metering);
+            ret = 1;
+            goto end;
+    }
+    if (!(target > 0 && target < 1)) {
+        print_error("Target must be in (0, 1): %f", target);
+        ret = 1;
+        goto end;
+    }
+
+    priv_rpigrafx_tuner_lock(cfg->tuner);
+    priv_rpigrafx_ae_set_mode(&cfg->ae, mode, metering, target);
+    priv_rpigrafx_tuner_unlock(cfg->tuner);
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(mode);
+    MMAL_PARAM_UNUSED(metering);
+    MMAL_PARAM_UNUSED(target);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_config_rawcam_ae_wait(const int max_frames,
+                                   rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
+
+    if (max_frames < 0) {
+        print_error("Frames must not be negative: %d", max_frames);
+        ret = 1;
+        goto end;
+    }
+
+    cfg->ae_wait_frames = max_frames;
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(max_frames);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_config_rawcam_awb(const rpigrafx_awb_mode_t mode,
+                               const float smoothing,
+                               rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
+
+    switch (mode) {
+        case RPIGRAFX_AWB_MODE_OFF:
+        case RPIGRAFX_AWB_MODE_GRAY_WORLD:
+        case RPIGRAFX_AWB_MODE_WHITE_PATCH:
+            break;
+        default:
+            print_error("Unknown rpigrafx_awb_mode_t value: %d", mode);
+            ret = 1;
+            goto end;
+    }
+    if (!(smoothing > 0 && smoothing <= 1)) {
+        print_error("Smoothing must be in (0, 1]: %f", smoothing);
+        ret = 1;
+        goto end;
+    }
+
+    priv_rpigrafx_pipeline_lock(cfg->pipeline);
+    priv_rpigrafx_awb_set_mode(&cfg->awb, mode, smoothing);
+    priv_rpigrafx_pipeline_unlock(cfg->pipeline);
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(mode);
+    MMAL_PARAM_UNUSED(smoothing);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_config_camera_port(const int32_t camera_number,
+                                const rpigrafx_camera_port_t camera_port)
+{
+    struct cameras_config *cfg = &cameras_config[camera_number];
+    int ret = 0;
+
+    switch (camera_port) {
+        case RPIGRAFX_CAMERA_PORT_PREVIEW:
+            cfg->camera_output_port_index = CAMERA_PREVIEW_PORT;
+            cfg->use_camera_capture_port = 0;
+            break;
+        case RPIGRAFX_CAMERA_PORT_CAPTURE:
+            cfg->camera_output_port_index = CAMERA_CAPTURE_PORT;
+            cfg->use_camera_capture_port = !0;
+            break;
+        default:
+            print_error("Unknown rpigrafx_camera_port_t value: %d\n",
+                        camera_port);
+            ret = 1;
+            goto end;
+            break;
+    }
+
+end:
+    return ret;
+}
+
+int rpigrafx_config_camera_frame_render(const _Bool is_fullscreen,
+                           const int32_t x, const int32_t y,
+                           const int32_t width, const int32_t height,
+                           const int32_t layer,
+                           rpigrafx_frame_config_t *fcp)
+{
+    MMAL_DISPLAYREGION_T region = {
+        .fullscreen = is_fullscreen,
+        .dest_rect = {
+            .x = x, .y = y,
+            .width = width, .height = height
+        },
+        .layer = layer,
+        .set =   MMAL_DISPLAY_SET_FULLSCREEN
+               | MMAL_DISPLAY_SET_DEST_RECT
+               | MMAL_DISPLAY_SET_LAYER
+    };
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
+
+    memcpy(&cfg->render[fcp->splitter_output_port_index].region,
+           &region, sizeof(region));
+
+    return ret;
+}
+
+int rpigrafx_config_frame_callback(const rpigrafx_frame_callback_t callback,
+                                   void *user, rpigrafx_frame_config_t *fcp)
+{
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    struct isp_config *icfg = &cfg->isp[fcp->splitter_output_port_index];
+    int ret = 0;
+
+    if (dispatcher != NULL) {
+        print_error("Callbacks must be configured before "
+                    "rpigrafx_finish_config");
+        ret = 1;
+        goto end;
+    }
+
+    icfg->callback = callback;
+    icfg->callback_user = user;
+    memcpy(&icfg->callback_fc, fcp, sizeof(*fcp));
+
+end:
+    return ret;
+}
+
+int rpigrafx_get_frame_callback_stats(rpigrafx_frame_config_t *fcp,
+                                      uint64_t *num_deliveredp,
+                                      uint64_t *num_droppedp)
+{
+    const int i = fcp->camera_number, j = fcp->splitter_output_port_index;
+    int ret = 0;
+
+    if (cameras_config[i].isp[j].callback == NULL) {
+        print_error("Output %d,%d has no callback", i, j);
+        ret = 1;
+        goto end;
+    }
+
+    *num_deliveredp = *num_droppedp = 0;
+    if (dispatcher != NULL)
+        priv_rpigrafx_dispatcher_get_stats(dispatcher,
+                                           i * NUM_SPLITTER_OUTPUTS + j,
+                                           num_deliveredp, num_droppedp);
+
+end:
+    return ret;
+}
+
+#ifdef IMPL_RAWCAM
+/*
+ * Timing to write to the IMX219 of cfg: the manual settings, and for those
+ * which are not set, the exposure and gain of RPIGRAFX_AE_MODE_MEAN. Called
+ * under the lock of the tuner, or before it is created.
+ */
+static void imx219_timing_with_ae(const struct cameras_config *cfg,
+                                  struct priv_rpigrafx_imx219_timing *t)
+{
+    memcpy(t, &cfg->imx219_timing, sizeof(*t));
+    if (cfg->ae.mode != RPIGRAFX_AE_MODE_MEAN)
+        return;
+    if (t->exposure_lines == 0)
+        priv_rpigrafx_imx219_set_exposure(t, cfg->ae.exposure_us);
+    if (!t->is_manual_gain)
+        priv_rpigrafx_imx219_set_gain(t, cfg->ae.gain);
+}
+#endif /* IMPL_RAWCAM */
+
+static int setup_cp_camera_rawcam(const int i,
+                                  const int32_t width, const int32_t height)
+{
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[i];
+    MMAL_STATUS_T status;
+    int ret = 0;
+
+    status = mmal_wrapper_create(&cpw_rawcams[i], "vc.ril.rawcam");
+    if (status != MMAL_SUCCESS) {
+        print_error("Creating rawcam component of camera %d failed: 0x%08x",
+                    i, status);
+        ret = 1;
+        goto end;
+    }
+
+    switch (cfg->rawcam_camera_model) {
+        case RPIGRAFX_RAWCAM_CAMERA_MODEL_IMX219: {
+            struct rpicam_imx219_config *stp = &cfg->rpicam_config.imx219;
+            struct priv_rpigrafx_imx219_geometry geom;
+            struct priv_rpigrafx_imx219_reg
+                                        regs[PRIV_RPIGRAFX_IMX219_MAX_REGS];
+            struct priv_rpigrafx_imx219_timing timing;
+            int n;
+            if (cfg->roi_width != 0) {
+                stp->x = cfg->roi_x;
+                stp->y = cfg->roi_y;
+            }
+            if ((ret = priv_rpigrafx_imx219_geometry(&geom,
+                                              cfg->imx219_binning_mode,
+                                              stp->x, stp->y, width, height)))
+                goto end;
+            /* librpicam reads out the window, which is then binned. */
+            stp->width = geom.width;
+            stp->height = geom.height;
+            if ((ret = rpicam_imx219_open(stp)))
+                goto end;
+            priv_rpigrafx_imx219_timing_init(&cfg->imx219_timing,
+                        (float) stp->exck_freq.num / stp->exck_freq.den,
+                        &geom);
+            /* The first frames are taken with the initial settings of AE. */
+            imx219_timing_with_ae(cfg, &timing);
+            n = priv_rpigrafx_imx219_window_regs(regs, &geom);
+            n += priv_rpigrafx_imx219_timing_regs(regs + n, &timing);
+            if ((ret = priv_rpigrafx_imx219_write_regs(regs, n)))
+                goto end;
+            cfg->has_imx219_timing = !0;
+            break;
+        }
+    }
+
+    {
+        MMAL_PORT_T *output = mmal_util_get_port(cpw_rawcams[i]->component,
+                                                 MMAL_PORT_TYPE_OUTPUT, 0);
+        MMAL_PARAMETER_CAMERA_RX_CONFIG_T rx_cfg = {
+            .hdr = {
+                .id = MMAL_PARAMETER_CAMERA_RX_CONFIG,
+                .size = sizeof(rx_cfg)
+            }
+        };
+        MMAL_FOURCC_T encoding = cfg->raw_encoding;
+
+        if (output == NULL) {
+            print_error("Getting output %d of camera %d failed", 0, i);
+            ret = 1;
+            goto end;
+        }
+
+        status = config_port(output, encoding, width, height);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting format of camera %d failed: 0x%08x",
+                        i, status);
+            ret = 1;
+            goto end;
+        }
+
+        status = mmal_port_parameter_get(output, &rx_cfg.hdr);
+        if (status != MMAL_SUCCESS) {
+            print_error("Getting rx_cfg of rawcam %d failed: 0x%08x",
+                        i, status);
+            ret = 1;
+            goto end;
+        }
+
+        /* Use default values for encode_block_length and embedded_data_lines. */
+        rx_cfg.decode     = cfg->rx_cfg.decode;
+        rx_cfg.encode     = cfg->rx_cfg.encode;
+        rx_cfg.unpack     = cfg->rx_cfg.unpack;
+        rx_cfg.pack       = cfg->rx_cfg.pack;
+        rx_cfg.data_lanes = cfg->rx_cfg.data_lanes;
+        rx_cfg.image_id   = cfg->rx_cfg.image_id;
+        status = mmal_port_parameter_set(output, &rx_cfg.hdr);
+        if (status != MMAL_SUCCESS) {
+            print_error("Setting rx_cfg of rawcam %d failed: 0x%08x",
+                        i, status);
+            ret = 1;
+            goto end;
+        }
+
+        status = mmal_wrapper_port_enable(output,
+                                          MMAL_WRAPPER_FLAG_PAYLOAD_ALLOCATE);
+        if (status != MMAL_SUCCESS) {
+            print_error("Enabling rawcam component of camera %d failed: 0x%08x",
+                        i, status);
+            ret = 1;
+            goto end;
+        }
+
+        MMAL_BUFFER_HEADER_T *header = NULL;
+        while ((header = mmal_queue_get(cpw_rawcams[i]->output_pool[0]->queue)) != NULL)
+            mmal_port_send_buffer(output, header);
+    }
+
+    if ((ret = priv_rpigrafx_pool_create(&cfg->pool, cfg->num_workers,
+                                         cfg->set_worker_affinity)))
+        goto end;
+    if ((ret = priv_rpigrafx_raw_scratch_reserve(&cfg->scratch,
+                    priv_rpigrafx_raw_scratch_size(width,
+                                priv_rpigrafx_pool_num_threads(cfg->pool)))))
+        goto end;
+    if (cfg->has_calib)
+        if ((ret = priv_rpigrafx_calib_map_build(&cfg->calib_map, &cfg->calib,
+                                            width, height,
+                                            rawcam_nbits(cfg),
+                                            cfg->bayer_pattern)))
+            goto end;
+    memset(&cfg->rawcam_stats, 0, sizeof(cfg->rawcam_stats));
+    cfg->rawcam_stats.num_scratch_allocs = cfg->scratch.num_allocs;
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(i);
     MMAL_PARAM_UNUSED(width);
     MMAL_PARAM_UNUSED(height);
 
@@ -939,6 +1856,18 @@ end:
     return ret;
 }
 
+/* Encoding of the frames which go through the splitter to the isps. */
+static MMAL_FOURCC_T splitter_encoding(const int i)
+{
+#ifdef IMPL_RAWCAM
+    if (cameras_config[i].is_rawcam)
+        return cameras_config[i].splitter_encoding;
+#else /* IMPL_RAWCAM */
+    MMAL_PARAM_UNUSED(i);
+#endif /* IMPL_RAWCAM */
+    return MMAL_ENCODING_RGB24;
+}
+
 static int setup_cp_splitter(const int i, const int len,
                              const int32_t width, const int32_t height,
                              const _Bool is_rawcam)
@@ -997,7 +1926,7 @@ static int setup_cp_splitter(const int i, const int len,
             goto end;
         }
 
-        status = config_port(input, MMAL_ENCODING_RGB24, width, height);
+        status = config_port(input, splitter_encoding(i), width, height);
         if (status != MMAL_SUCCESS) {
             print_error("Setting format of " \
                         "splitter %d input failed: 0x%08x", i, status);
@@ -1018,6 +1947,12 @@ static int setup_cp_splitter(const int i, const int len,
         }
 
         if (is_rawcam) {
+#ifdef IMPL_RAWCAM
+            /* Let the pipeline thread fill a buffer while others are used. */
+            if (cfg->is_pipelined)
+                input->buffer_num = MMAL_MAX(input->buffer_num_recommended,
+                                             PIPELINE_NUM_BUFFERS);
+#endif /* IMPL_RAWCAM */
             status = mmal_wrapper_port_enable(input,
                                             MMAL_WRAPPER_FLAG_PAYLOAD_ALLOCATE);
             if (status != MMAL_SUCCESS) {
@@ -1035,13 +1970,16 @@ static int setup_cp_splitter(const int i, const int len,
         const int32_t output_width  = cfg->isp[j].width,
                       output_height = cfg->isp[j].height;
 
+        if (cfg->isp[j].is_host)
+            continue;
+
         if (output == NULL) {
             print_error("Getting output port of splitter %d,%d failed", i, j);
             ret = 1;
             goto end;
         }
 
-        status = config_port_crop(output, MMAL_ENCODING_RGB24,
+        status = config_port_crop(output, splitter_encoding(i),
                                   width, height,
                                   output_width  * (width  / output_width ),
                                   output_height * (height / output_height));
@@ -1119,7 +2057,7 @@ static int setup_cp_isp(const int i, const int j,
             goto end;
         }
 
-        status = config_port_crop(input, MMAL_ENCODING_RGB24, width, height,
+        status = config_port_crop(input, splitter_encoding(i), width, height,
                                   output_width  * (width  / output_width ),
                                   output_height * (height / output_height));
         if (status != MMAL_SUCCESS) {
@@ -1156,6 +2094,16 @@ static int setup_cp_isp(const int i, const int j,
             ret = 1;
             goto end;
         }
+#ifdef IMPL_RAWCAM
+        /* Keep a finished frame queued while the user holds another. */
+        if (cfg->is_pipelined)
+            output->buffer_num = MMAL_MAX(output->buffer_num_recommended,
+                                          PIPELINE_NUM_BUFFERS);
+#endif /* IMPL_RAWCAM */
+        /* Likewise while the callback holds one. */
+        if (cfg->isp[j].callback != NULL)
+            output->buffer_num = MMAL_MAX(output->buffer_num,
+                                          PIPELINE_NUM_BUFFERS);
 
         status = mmal_port_parameter_set_boolean(output,
                                                  MMAL_PARAMETER_ZERO_COPY,
@@ -1253,8 +2201,437 @@ static int setup_cp_render(const int i, const int j)
     }
     status = mmal_component_enable(cp_renders[i][j]);
     if (status != MMAL_SUCCESS) {
-        print_error("Enabling render component %d,%d failed: 0x%08x",
-                    i, j, status);
+        print_error("Enabling render component %d,%d failed: 0x%08x",
+                    i, j, status);
+        ret = 1;
+        goto end;
+    }
+
+end:
+    return ret;
+}
+
+static int connect_ports(const int i, const int len)
+{
+    int j;
+    struct cameras_config *cfg = &cameras_config[i];
+    MMAL_STATUS_T status;
+    int ret = 0;
+
+    if (cfg->use_camera_capture_port) {
+        /* Connect camera preview port to null for AWB processing. */
+        status = mmal_connection_create(&conn_camera_nulls[i],
+                                        cp_cameras[i]->
+                                                    output[CAMERA_PREVIEW_PORT],
+                                        cp_nulls[i]->input[1],
+                                        MMAL_CONNECTION_FLAG_TUNNELLING);
+        if (status != MMAL_SUCCESS) {
+            print_error("Connecting " \
+                        "camera and null ports %d failed: 0x%08x", i, status);
+            ret = 1;
+            goto end;
+        }
+    }
+
+    if (!cfg->is_rawcam) {
+        status = mmal_connection_create(&conn_camera_splitters[i],
+                                        cp_cameras[i]->
+                                          output[cfg->camera_output_port_index],
+                                        cp_splitters[i]->input[0],
+                                        MMAL_CONNECTION_FLAG_TUNNELLING);
+        if (status != MMAL_SUCCESS) {
+            print_error("Connecting " \
+                        "camera and splitter ports %d failed: 0x%08x", i, status);
+            ret = 1;
+            goto end;
+        }
+    }
+
+    for (j = 0; j < len; j ++) {
+        if (cfg->isp[j].is_host)
+            continue;
+        if (!cfg->is_rawcam)
+            status = mmal_connection_create(&conn_splitters_isps[i][j],
+                                            cp_splitters[i]->output[j],
+                                            cp_isps[i][j]->input[0],
+                                            MMAL_CONNECTION_FLAG_TUNNELLING);
+        else
+            status = mmal_connection_create(&conn_splitters_isps[i][j],
+                                            cpw_splitters[i]->output[j],
+                                            cp_isps[i][j]->input[0],
+                                            MMAL_CONNECTION_FLAG_TUNNELLING);
+        if (status != MMAL_SUCCESS) {
+            print_error("Connecting "
+                        "splitter and isp ports %d,%d failed: 0x%08x",
+                        i, j, status);
+            ret = 1;
+            goto end;
+        }
+        status = mmal_connection_create(&conn_isps_renders[i][j],
+                                        cp_isps[i][j]->output[0],
+                                        cp_renders[i][j]->input[0],
+                                        0);
+        if (status != MMAL_SUCCESS) {
+            print_error("Connecting "
+                        "isp and render ports %d,%d failed: 0x%08x",
+                        i, j, status);
+            ret = 1;
+            goto end;
+        }
+    }
+
+    for (j = 0; j < len; j ++) {
+        if (cfg->isp[j].is_host)
+            continue;
+        conn_isps_renders[i][j]->callback = callback_conn;
+        conn_users[i][j].channel = -1;
+        if (cfg->isp[j].callback != NULL)
+            conn_users[i][j].channel = i * NUM_SPLITTER_OUTPUTS + j;
+#ifdef IMPL_RAWCAM
+        conn_users[i][j].keeps_newest = cfg->is_pipelined;
+#endif /* IMPL_RAWCAM */
+        conn_isps_renders[i][j]->user_data = &conn_users[i][j];
+        status = mmal_connection_enable(conn_isps_renders[i][j]);
+        if (status != MMAL_SUCCESS) {
+            print_error("Enabling connection between "
+                        "splitter and isp %d,%d failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+        conn_splitters_isps[i][j]->callback = callback_conn;
+        status = mmal_connection_enable(conn_splitters_isps[i][j]);
+        if (status != MMAL_SUCCESS) {
+            print_error("Enabling connection between "
+                        "splitter and isp %d,%d failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+    }
+    if (cfg->use_camera_capture_port) {
+        conn_camera_nulls[i]->callback = callback_conn;
+        status = mmal_connection_enable(conn_camera_nulls[i]);
+        if (status != MMAL_SUCCESS) {
+            print_error("Enabling connection between "
+                        "camera and null %d,%d failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+    }
+    if (!cfg->is_rawcam) {
+        conn_camera_splitters[i]->callback = callback_conn;
+        status = mmal_connection_enable(conn_camera_splitters[i]);
+        if (status != MMAL_SUCCESS) {
+            print_error("Enabling connection between "
+                        "camera and splitter %d,%d failed: 0x%08x", i, j, status);
+            ret = 1;
+            goto end;
+        }
+    }
+
+    for (j = 0; j < len; j ++) {
+        MMAL_BUFFER_HEADER_T *header = NULL;
+        MMAL_CONNECTION_T *conn = conn_isps_renders[i][j];
+        if (cfg->isp[j].is_host)
+            continue;
+        while ((header = mmal_queue_get(conn->pool->queue)) != NULL) {
+            status = mmal_port_send_buffer(conn->out, header);
+            if (status != MMAL_SUCCESS) {
+                print_error("Sending pool buffer to "
+                            "isp-render conn %d,%d failed: 0x%08x", status);
+                ret = 1;
+                goto end;
+            }
+        }
+    }
+
+end:
+    return ret;
+}
+
+/* In us on the monotonic clock. */
+static int64_t get_time_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/*
+ * Wait for a header on queue until deadline_us of get_time_us, or forever if
+ * deadline_us is negative. Return NULL if the deadline passed.
+ */
+static MMAL_BUFFER_HEADER_T *queue_wait_until(MMAL_QUEUE_T *queue,
+                                              const int64_t deadline_us)
+{
+    int64_t left_us;
+
+    if (deadline_us < 0)
+        return mmal_queue_wait(queue);
+    left_us = deadline_us - get_time_us();
+    if (left_us < 0)
+        left_us = 0;
+    return mmal_queue_timedwait(queue, (left_us + 999) / 1000);
+}
+
+#ifdef IMPL_RAWCAM
+
+/*
+ * Parse the side info of camera i, which has the embedded data lines of the
+ * frame to come, into next_metadata.
+ */
+static void rawcam_parse_side_info(const int i, MMAL_BUFFER_HEADER_T *header)
+{
+    struct cameras_config *cfg = &cameras_config[i];
+    rpigrafx_rawcam_metadata_t *md = &cfg->next_metadata;
+
+    md->is_valid = 0;
+    md->pts = header->pts;
+    switch (cfg->rawcam_camera_model) {
+        case RPIGRAFX_RAWCAM_CAMERA_MODEL_IMX219:
+            if (priv_rpigrafx_imx219_parse_embedded(md,
+                        header->data + header->offset, header->length,
+                        priv_rpigrafx_raw_stride(cfg->raw_width,
+                                            cfg->nbits_of_raw_from_camera),
+                        cfg->nbits_of_raw_from_camera, &cfg->imx219_timing)
+                    && priv_rpigrafx_verbose)
+                print_error("Malformed embedded data of camera %d", i);
+            break;
+    }
+}
+
+/*
+ * Hand the empty buffers to rawcam and wait for a full image buffer of camera
+ * i until deadline_us as in queue_wait_until. Its metadata is put in
+ * frame_metadata. Return RPIGRAFX_TIMED_OUT and NULL if the deadline passed.
+ */
+static int rawcam_get_full(const int i, MMAL_BUFFER_HEADER_T **headerp,
+                           const int64_t deadline_us)
+{
+    struct cameras_config *cfg = &cameras_config[i];
+    MMAL_PORT_T *output = cpw_rawcams[i]->output[0];
+    MMAL_BUFFER_HEADER_T *header = NULL;
+    MMAL_STATUS_T status;
+    int ret = 0;
+
+    for (; ; ) {
+        while ((status = mmal_wrapper_buffer_get_empty(output, &header, 0))
+                == MMAL_SUCCESS) {
+            status = mmal_port_send_buffer(output, header);
+            if (status != MMAL_SUCCESS) {
+                print_error("Failed to send empty buffer to rawcam: 0x%08x",
+                            status);
+                header = NULL;
+                ret = 1;
+                goto end;
+            }
+        }
+        if (status != MMAL_EAGAIN) {
+            print_error("Failed to get empty header: 0x%08x", status);
+            header = NULL;
+            ret = 1;
+            goto end;
+        }
+
+        status = mmal_wrapper_buffer_get_full(output, &header,
+                                (deadline_us < 0) ? MMAL_WRAPPER_FLAG_WAIT : 0);
+        if (status == MMAL_EAGAIN) {
+            /* The wrapper queues full buffers here. */
+            header = queue_wait_until(cpw_rawcams[i]->output_queue[0],
+                                      deadline_us);
+            if (header == NULL) {
+                ret = RPIGRAFX_TIMED_OUT;
+                goto end;
+            }
+        } else if (status != MMAL_SUCCESS) {
+            print_error("Failed to get full header from rawcam: 0x%08x",
+                        status);
+            header = NULL;
+            ret = 1;
+            goto end;
+        }
+
+        if (header->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO) {
+            rawcam_parse_side_info(i, header);
+            mmal_buffer_header_release(header);
+            continue;
+        }
+        break;
+    }
+
+    /* The side info belongs to this frame only if their times match. */
+    memcpy(&cfg->frame_metadata, &cfg->next_metadata,
+           sizeof(cfg->frame_metadata));
+    if (cfg->frame_metadata.pts != header->pts
+            && cfg->frame_metadata.pts != MMAL_TIME_UNKNOWN
+            && header->pts != MMAL_TIME_UNKNOWN)
+        cfg->frame_metadata.is_valid = 0;
+    cfg->frame_metadata.pts = header->pts;
+    cfg->next_metadata.is_valid = 0;
+
+end:
+    *headerp = header;
+    return ret;
+}
+
+/*
+ * Process a raw frame of camera i into dst and post its statistics to the
+ * tuner.
+ */
+static int rawcam_process(const int i, const uint8_t *src,
+                          const MMAL_FOURCC_T encoding,
+                          uint8_t *dst, const int32_t dst_stride)
+{
+    struct cameras_config *cfg = &cameras_config[i];
+    struct priv_rpigrafx_tone *tone = &cfg->tone[is_host_encoding(encoding)];
+    uint32_t num_saturated = 0, hist[3][256];
+    struct priv_rpigrafx_awb_stats awb_stats;
+    struct priv_rpigrafx_raw_job job = {
+        .src = src,
+        .src_stride = priv_rpigrafx_raw_stride(cfg->raw_width,
+                                               cfg->nbits_of_raw_from_camera),
+        .nbits = rawcam_nbits(cfg),
+        .is_dpcm = cfg->is_dpcm,
+        .width = cfg->raw_width,
+        .height = cfg->raw_height,
+        .bayer_pattern = cfg->bayer_pattern,
+        .demosaic_mode = cfg->demosaic_mode,
+        .superpixel = cfg->use_superpixel,
+        .calib = cfg->has_calib ? &cfg->calib_map : NULL,
+        .encoding = encoding,
+        .dst = dst,
+        .dst_stride = dst_stride,
+        .num_saturated = &num_saturated,
+        .awb_step = AWB_STEP
+    };
+    const uint64_t num_allocs = cfg->scratch.num_allocs;
+    struct priv_rpigrafx_tuner_stats tuner_stats;
+    float gamma;
+    _Bool is_tone_built, is_ae_mean;
+    int ret = 0;
+
+    /* The chroma planes follow the Y plane of the MMAL frame. */
+    if (is_yuv_encoding(encoding)) {
+        const int32_t luma_height = VCOS_ALIGN_UP(cfg->height, 16);
+        job.dst_cb = dst + (size_t) dst_stride * luma_height;
+        if (encoding == MMAL_ENCODING_NV12) {
+            job.dst_cr = job.dst_cb + 1;
+            job.dst_chroma_stride = dst_stride;
+        } else {
+            job.dst_cr = job.dst_cb + (size_t) dst_stride / 2 * luma_height / 2;
+            job.dst_chroma_stride = dst_stride / 2;
+        }
+    }
+
+    priv_rpigrafx_pipeline_lock(cfg->pipeline);
+    job.gain_r = cfg->awb.gain_r;
+    job.gain_g = cfg->awb.gain_g;
+    job.gain_b = cfg->awb.gain_b;
+    gamma = cfg->gamma;
+    /* Not rounded down to 0, which would disable the correction. */
+    if (cfg->dpc_threshold > 0) {
+        const float t = cfg->dpc_threshold * ((1u << job.nbits) - 1) + 0.5f;
+        job.dpc_threshold = (t >= 1) ? (uint16_t) t : 1;
+    }
+    if (cfg->awb.mode != RPIGRAFX_AWB_MODE_OFF)
+        job.awb_stats = &awb_stats;
+    job.sat_step = cfg->saturation_step;
+    if (cfg->is_histogram_enabled) {
+        job.hist_r = hist[0];
+        job.hist_g = hist[1];
+        job.hist_b = hist[2];
+    }
+    priv_rpigrafx_pipeline_unlock(cfg->pipeline);
+    priv_rpigrafx_tuner_lock(cfg->tuner);
+    is_ae_mean = cfg->ae.mode == RPIGRAFX_AE_MODE_MEAN;
+    priv_rpigrafx_tuner_unlock(cfg->tuner);
+
+    /*
+     * Only this thread uses the maps, and they are rebuilt only when AWB or
+     * the gamma changes.
+     */
+    is_tone_built = priv_rpigrafx_tone_update(tone, job.gain_r, job.gain_g,
+                                    job.gain_b, gamma, job.nbits,
+                                    is_host_encoding(encoding) ? job.nbits : 8);
+    job.tone = tone;
+
+    ret = priv_rpigrafx_raw_scratch_reserve(&cfg->scratch,
+                    priv_rpigrafx_raw_scratch_size(cfg->raw_width,
+                                priv_rpigrafx_pool_num_threads(cfg->pool)));
+    priv_rpigrafx_pipeline_lock(cfg->pipeline);
+    cfg->rawcam_stats.num_frame_allocs += cfg->scratch.num_allocs - num_allocs;
+    cfg->rawcam_stats.num_scratch_allocs = cfg->scratch.num_allocs;
+    cfg->rawcam_stats.num_tone_builds += is_tone_built;
+    priv_rpigrafx_pipeline_unlock(cfg->pipeline);
+    if (ret)
+        goto end;
+
+    ret = priv_rpigrafx_raw_process(&job, cfg->scratch.base, cfg->pool);
+    if (ret) {
+        print_error("priv_rpigrafx_raw_process: %d", ret);
+        goto end;
+    }
+
+    if ((ret = priv_rpigrafx_tuner_status(cfg->tuner))) {
+        print_error("Tuner of camera %d has stopped", i);
+        goto end;
+    }
+    tuner_stats.num_saturated = num_saturated;
+    memcpy(&tuner_stats.metadata, &cfg->frame_metadata,
+           sizeof(tuner_stats.metadata));
+    /* The scratch is free again for decoding lines of the raw frame. */
+    tuner_stats.has_grid = is_ae_mean;
+    if (is_ae_mean)
+        priv_rpigrafx_ae_gather(&tuner_stats.grid, &job, cfg->scratch.base);
+    priv_rpigrafx_tuner_post(cfg->tuner, &tuner_stats);
+    priv_rpigrafx_pipeline_lock(cfg->pipeline);
+    cfg->rawcam_stats.num_frames ++;
+    cfg->rawcam_stats.num_saturated = num_saturated;
+    cfg->rawcam_stats.gain_r = job.gain_r;
+    cfg->rawcam_stats.gain_g = job.gain_g;
+    cfg->rawcam_stats.gain_b = job.gain_b;
+    /* The gains for the next frame. */
+    if (job.awb_stats != NULL)
+        priv_rpigrafx_awb_update(&cfg->awb, &awb_stats);
+    if (job.hist_r != NULL)
+        memcpy(cfg->hist, hist, sizeof(hist));
+    cfg->metadata_idx = (cfg->metadata_idx + 1) % NUM_METADATA;
+    memcpy(&cfg->metadata[cfg->metadata_idx], &cfg->frame_metadata,
+           sizeof(cfg->frame_metadata));
+    priv_rpigrafx_pipeline_unlock(cfg->pipeline);
+
+end:
+    return ret;
+}
+
+static int32_t splitter_input_stride(const int i)
+{
+    const struct cameras_config *cfg = &cameras_config[i];
+
+    /* Of the Y plane for YUV. */
+    if (is_yuv_encoding(cfg->splitter_encoding))
+        return ALIGN_UP(cfg->width, 32);
+    return ALIGN_UP(cfg->width, 32) * 3;
+}
+
+static int rawcam_send_to_splitter(const int i, MMAL_BUFFER_HEADER_T *header)
+{
+    struct cameras_config *cfg = &cameras_config[i];
+    MMAL_STATUS_T status;
+    int ret = 0;
+
+    if (is_yuv_encoding(cfg->splitter_encoding))
+        header->length = splitter_input_stride(i)
+                         * VCOS_ALIGN_UP(cfg->height, 16) * 3 / 2;
+    else
+        /* xxx: stride * height * 3 ? */
+        header->length = cfg->width * cfg->height * 3;
+    header->flags = MMAL_BUFFER_HEADER_FLAG_EOS;
+    /* Passed on to the isp outputs to find the metadata of them. */
+    header->pts = cfg->frame_metadata.pts;
+    status = mmal_port_send_buffer(cpw_splitters[i]->input[0], header);
+    if (status != MMAL_SUCCESS) {
+        print_error("Failed to send buffer to splitter: 0x%08x", status);
+        mmal_buffer_header_release(header);
         ret = 1;
         goto end;
     }
@@ -1263,125 +2640,233 @@ end:
     return ret;
 }
 
-static int connect_ports(const int i, const int len)
+/*
+ * Pipelined rawcam: the pipeline thread moves raw frames to splitter input
+ * buffers and rpigrafx_capture_next_frame only picks up isp outputs. user is
+ * the cameras_config of the camera.
+ */
+
+static int pipeline_camera_number(void *user)
+{
+    return (struct cameras_config*) user - cameras_config;
+}
+
+static int pipeline_get_input(void *user, void **inputp)
+{
+    MMAL_BUFFER_HEADER_T *header = NULL;
+    const int ret = rawcam_get_full(pipeline_camera_number(user), &header,
+                                    get_time_us() + PIPELINE_POLL_MS * 1000);
+
+    *inputp = header;
+    return ret;
+}
+
+static int pipeline_get_output(void *user, void **outputp)
+{
+    const int i = pipeline_camera_number(user);
+    MMAL_BUFFER_HEADER_T *header = NULL;
+
+    header = queue_wait_until(cpw_splitters[i]->input_pool[0]->queue,
+                              get_time_us() + PIPELINE_POLL_MS * 1000);
+    *outputp = header;
+    return (header == NULL) ? RPIGRAFX_TIMED_OUT : 0;
+}
+
+static int pipeline_process(void *user, void *input, void *output)
+{
+    const int i = pipeline_camera_number(user);
+
+    return rawcam_process(i, ((MMAL_BUFFER_HEADER_T*) input)->data,
+                          cameras_config[i].splitter_encoding,
+                          ((MMAL_BUFFER_HEADER_T*) output)->data,
+                          splitter_input_stride(i));
+}
+
+static int pipeline_put_output(void *user, void *output)
+{
+    return rawcam_send_to_splitter(pipeline_camera_number(user), output);
+}
+
+static void pipeline_release(void *user, void *header)
+{
+    MMAL_PARAM_UNUSED(user);
+    mmal_buffer_header_release(header);
+}
+
+static const struct priv_rpigrafx_pipeline_ops rawcam_pipeline_ops = {
+    .get_input = pipeline_get_input,
+    .get_output = pipeline_get_output,
+    .process = pipeline_process,
+    .release_input = pipeline_release,
+    .put_output = pipeline_put_output,
+    .release_output = pipeline_release,
+};
+
+/*
+ * Tuner of rawcam: its thread does all the I2C writes to the sensor after
+ * it is open. user is the cameras_config of the camera.
+ */
+
+static int tuner_update(void *user)
+{
+    struct cameras_config *cfg = user;
+    struct priv_rpigrafx_imx219_timing timing;
+    struct priv_rpigrafx_imx219_reg regs[PRIV_RPIGRAFX_IMX219_MAX_REGS];
+
+    priv_rpigrafx_tuner_lock(cfg->tuner);
+    imx219_timing_with_ae(cfg, &timing);
+    priv_rpigrafx_tuner_unlock(cfg->tuner);
+    return priv_rpigrafx_imx219_write_regs(regs,
+                            priv_rpigrafx_imx219_timing_regs(regs, &timing));
+}
+
+static int tuner_tune(void *user, const struct priv_rpigrafx_tuner_stats *stats)
+{
+    struct cameras_config *cfg = user;
+    struct priv_rpigrafx_imx219_timing timing;
+    struct priv_rpigrafx_imx219_reg regs[PRIV_RPIGRAFX_IMX219_MAX_REGS];
+    float max_exposure_us;
+    _Bool is_changed;
+
+    priv_rpigrafx_tuner_lock(cfg->tuner);
+    if (cfg->ae.mode != RPIGRAFX_AE_MODE_MEAN) {
+        priv_rpigrafx_tuner_unlock(cfg->tuner);
+        return rpicam_imx219_tuner(RPICAM_IMX219_TUNER_METHOD_HEURISTIC,
+                                   &cfg->rpicam_config.imx219,
+                                   stats->num_saturated);
+    }
+    /* Posted before the mode was changed. */
+    if (!stats->has_grid) {
+        priv_rpigrafx_tuner_unlock(cfg->tuner);
+        return 0;
+    }
+    /* As long as the frame period allows. */
+    memcpy(&timing, &cfg->imx219_timing, sizeof(timing));
+    max_exposure_us = priv_rpigrafx_imx219_set_exposure(&timing,
+                            priv_rpigrafx_imx219_frame_period(&timing));
+    is_changed = priv_rpigrafx_ae_update(&cfg->ae, &stats->grid,
+                                         &stats->metadata, max_exposure_us,
+                                         AE_MAX_GAIN);
+    imx219_timing_with_ae(cfg, &timing);
+    priv_rpigrafx_tuner_unlock(cfg->tuner);
+
+    if (!is_changed)
+        return 0;
+    return priv_rpigrafx_imx219_write_regs(regs,
+                            priv_rpigrafx_imx219_timing_regs(regs, &timing));
+}
+
+static const struct priv_rpigrafx_tuner_ops rawcam_tuner_ops = {
+    .update = tuner_update,
+    .tune = tuner_tune,
+};
+
+/*
+ * Capture and drop frames of all the len outputs of camera i until the mean
+ * AE converges, or for ae_wait_frames frames.
+ */
+static int wait_ae_converged(const int i, const int len)
 {
-    int j;
     struct cameras_config *cfg = &cameras_config[i];
-    MMAL_STATUS_T status;
+    _Bool is_converged = 0;
+    int n, j;
     int ret = 0;
 
-    if (cfg->use_camera_capture_port) {
-        /* Connect camera preview port to null for AWB processing. */
-        status = mmal_connection_create(&conn_camera_nulls[i],
-                                        cp_cameras[i]->
-                                                    output[CAMERA_PREVIEW_PORT],
-                                        cp_nulls[i]->input[1],
-                                        MMAL_CONNECTION_FLAG_TUNNELLING);
-        if (status != MMAL_SUCCESS) {
-            print_error("Connecting " \
-                        "camera and null ports %d failed: 0x%08x", i, status);
-            ret = 1;
-            goto end;
-        }
+    if (cfg->ae.mode != RPIGRAFX_AE_MODE_MEAN) {
+        print_error("Waiting for AE of camera %d needs "
+                    "RPIGRAFX_AE_MODE_MEAN", i);
+        ret = 1;
+        goto end;
     }
 
-    if (!cfg->is_rawcam) {
-        status = mmal_connection_create(&conn_camera_splitters[i],
-                                        cp_cameras[i]->
-                                          output[cfg->camera_output_port_index],
-                                        cp_splitters[i]->input[0],
-                                        MMAL_CONNECTION_FLAG_TUNNELLING);
-        if (status != MMAL_SUCCESS) {
-            print_error("Connecting " \
-                        "camera and splitter ports %d failed: 0x%08x", i, status);
-            ret = 1;
-            goto end;
+    for (n = 0; n < cfg->ae_wait_frames && !is_converged; n ++) {
+        for (j = 0; j < len; j ++) {
+            rpigrafx_frame_config_t fc = {
+                .camera_number = i,
+                .splitter_output_port_index = j,
+                .is_zero_copy_rendering = 0,
+                .ctx = ctxs[i][j]
+            };
+            if ((ret = rpigrafx_capture_next_frame(&fc)))
+                goto end;
+            if ((ret = rpigrafx_free_frame(&fc)))
+                goto end;
         }
+        priv_rpigrafx_tuner_lock(cfg->tuner);
+        is_converged = cfg->ae.is_converged;
+        priv_rpigrafx_tuner_unlock(cfg->tuner);
     }
 
-    for (j = 0; j < len; j ++) {
-        if (!cfg->is_rawcam)
-            status = mmal_connection_create(&conn_splitters_isps[i][j],
-                                            cp_splitters[i]->output[j],
-                                            cp_isps[i][j]->input[0],
-                                            MMAL_CONNECTION_FLAG_TUNNELLING);
-        else
-            status = mmal_connection_create(&conn_splitters_isps[i][j],
-                                            cpw_splitters[i]->output[j],
-                                            cp_isps[i][j]->input[0],
-                                            MMAL_CONNECTION_FLAG_TUNNELLING);
-        if (status != MMAL_SUCCESS) {
-            print_error("Connecting "
-                        "splitter and isp ports %d,%d failed: 0x%08x",
-                        i, j, status);
-            ret = 1;
-            goto end;
-        }
-        status = mmal_connection_create(&conn_isps_renders[i][j],
-                                        cp_isps[i][j]->output[0],
-                                        cp_renders[i][j]->input[0],
-                                        0);
-        if (status != MMAL_SUCCESS) {
-            print_error("Connecting "
-                        "isp and render ports %d,%d failed: 0x%08x",
-                        i, j, status);
-            ret = 1;
-            goto end;
-        }
-    }
+    priv_rpigrafx_pipeline_lock(cfg->pipeline);
+    cfg->rawcam_stats.num_ae_wait_frames = n;
+    priv_rpigrafx_pipeline_unlock(cfg->pipeline);
 
-    for (j = 0; j < len; j ++) {
-        conn_isps_renders[i][j]->callback = callback_conn;
-        status = mmal_connection_enable(conn_isps_renders[i][j]);
-        if (status != MMAL_SUCCESS) {
-            print_error("Enabling connection between "
-                        "splitter and isp %d,%d failed: 0x%08x", i, j, status);
-            ret = 1;
-            goto end;
-        }
-        conn_splitters_isps[i][j]->callback = callback_conn;
-        status = mmal_connection_enable(conn_splitters_isps[i][j]);
-        if (status != MMAL_SUCCESS) {
-            print_error("Enabling connection between "
-                        "splitter and isp %d,%d failed: 0x%08x", i, j, status);
-            ret = 1;
-            goto end;
-        }
+end:
+    return ret;
+}
+
+#endif /* IMPL_RAWCAM */
+
+/*
+ * Dispatcher of the frame callbacks. Channel i * NUM_SPLITTER_OUTPUTS + j is
+ * output j of camera i, whose ctx holds the frame during the callback.
+ */
+
+static void dispatcher_deliver(void *user, int channel, void *item)
+{
+    const int i = channel / NUM_SPLITTER_OUTPUTS,
+              j = channel % NUM_SPLITTER_OUTPUTS;
+    struct isp_config *icfg = &cameras_config[i].isp[j];
+    struct callback_context *ctx = ctxs[i][j];
+
+    MMAL_PARAM_UNUSED(user);
+
+    ctx->header = item;
+    ctx->is_header_passed_to_render = 0;
+    icfg->callback(&icfg->callback_fc, icfg->callback_user);
+    /* Does nothing if the callback has rendered the frame. */
+    rpigrafx_free_frame(&icfg->callback_fc);
+    ctx->header = NULL;
+    ctx->is_header_passed_to_render = 0;
+}
+
+static void dispatcher_release(void *user, int channel, void *item)
+{
+    MMAL_PARAM_UNUSED(user);
+    MMAL_PARAM_UNUSED(channel);
+    mmal_buffer_header_release(item);
+}
+
+static const struct priv_rpigrafx_dispatcher_ops frame_dispatcher_ops = {
+    .deliver = dispatcher_deliver,
+    .release = dispatcher_release,
+};
+
+/* Check that the frames of output j of camera i can go to its callback. */
+static int check_frame_callback(const int i, const int j)
+{
+    const struct cameras_config *cfg = &cameras_config[i];
+    int ret = 0;
+
+    if (cfg->isp[j].is_host) {
+        print_error("Frames of camera %d,%d in host-side encodings "
+                    "can't be delivered to callbacks", i, j);
+        ret = 1;
+        goto end;
     }
     if (cfg->use_camera_capture_port) {
-        conn_camera_nulls[i]->callback = callback_conn;
-        status = mmal_connection_enable(conn_camera_nulls[i]);
-        if (status != MMAL_SUCCESS) {
-            print_error("Enabling connection between "
-                        "camera and null %d,%d failed: 0x%08x", i, j, status);
-            ret = 1;
-            goto end;
-        }
-    }
-    if (!cfg->is_rawcam) {
-        conn_camera_splitters[i]->callback = callback_conn;
-        status = mmal_connection_enable(conn_camera_splitters[i]);
-        if (status != MMAL_SUCCESS) {
-            print_error("Enabling connection between "
-                        "camera and splitter %d,%d failed: 0x%08x", i, j, status);
-            ret = 1;
-            goto end;
-        }
+        print_error("Frames of the capture port of camera %d "
+                    "can't be delivered to callbacks", i);
+        ret = 1;
+        goto end;
     }
-
-    for (j = 0; j < len; j ++) {
-        MMAL_BUFFER_HEADER_T *header = NULL;
-        MMAL_CONNECTION_T *conn = conn_isps_renders[i][j];
-        while ((header = mmal_queue_get(conn->pool->queue)) != NULL) {
-            status = mmal_port_send_buffer(conn->out, header);
-            if (status != MMAL_SUCCESS) {
-                print_error("Sending pool buffer to "
-                            "isp-render conn %d,%d failed: 0x%08x", status);
-                ret = 1;
-                goto end;
-            }
-        }
+#ifdef IMPL_RAWCAM
+    if (cfg->is_rawcam && !cfg->is_pipelined) {
+        print_error("Callbacks of rawcam %d need the pipelined mode", i);
+        ret = 1;
+        goto end;
     }
+#endif /* IMPL_RAWCAM */
 
 end:
     return ret;
@@ -1390,12 +2875,15 @@ end:
 int rpigrafx_finish_config()
 {
     int i, j;
+    _Bool has_callbacks = 0;
     int ret = 0;
 
     for (i = 0; i < num_cameras; i ++) {
         int len;
         /* Maximum width/height of the requested frames. */
         int32_t max_width, max_height;
+        /* Size of the frames in host-side encodings, if any. */
+        int32_t host_width, host_height;
         struct cameras_config *cfg = &cameras_config[i];
 
         if (!cfg->is_used)
@@ -1403,62 +2891,257 @@ int rpigrafx_finish_config()
 
         len = cfg->splitter.next_output_idx;
 
+        for (j = 0; j < len; j ++) {
+            if (cfg->isp[j].callback == NULL)
+                continue;
+            if ((ret = check_frame_callback(i, j)))
+                goto end;
+            has_callbacks = !0;
+        }
+
         max_width = max_height = 0;
+        host_width = host_height = 0;
         for (j = 0; j < len; j ++) {
+            if (cfg->isp[j].is_host) {
+                if (!cfg->is_rawcam) {
+                    print_error("Encoding 0x%08x of camera %d,%d "
+                                "is supported only for rawcam",
+                                cfg->isp[j].encoding, i, j);
+                    ret = 1;
+                    goto end;
+                }
+                if (host_width != 0 && (host_width  != cfg->isp[j].width
+                                     || host_height != cfg->isp[j].height)) {
+                    print_error("Host-side frames of camera %d "
+                                "must have the same size", i);
+                    ret = 1;
+                    goto end;
+                }
+                host_width  = cfg->isp[j].width;
+                host_height = cfg->isp[j].height;
+                continue;
+            }
             max_width  = MMAL_MAX(max_width,  cfg->isp[j].width);
             max_height = MMAL_MAX(max_height, cfg->isp[j].height);
         }
+#ifdef IMPL_RAWCAM
+        if (host_width != 0 && cfg->is_pipelined) {
+            print_error("Host-side frames of camera %d "
+                        "can't be used in the pipelined mode", i);
+            ret = 1;
+            goto end;
+        }
+#endif /* IMPL_RAWCAM */
+        /* Host-side frames are not resized, so the raw frame has their size. */
+        if (host_width != 0) {
+            if (max_width > host_width || max_height > host_height) {
+                print_error("Frames of camera %d must not be larger than "
+                            "the host-side ones (%dx%d)",
+                            i, host_width, host_height);
+                ret = 1;
+                goto end;
+            }
+            max_width  = host_width;
+            max_height = host_height;
+        }
+        cfg->raw_width  = max_width;
+        cfg->raw_height = max_height;
 #ifdef IMPL_RAWCAM
         if (cfg->is_rawcam) {
-            switch (cfg->rawcam_camera_model) {
-                case RPIGRAFX_RAWCAM_CAMERA_MODEL_IMX219: {
-                    const int32_t mag = MMAL_MIN(cfg->max_width  / max_width,
-                                                 cfg->max_height / max_height);
-                    max_width  *= mag;
-                    max_height *= mag;
-                    break;
+            const int32_t out_width = max_width, out_height = max_height;
+            /*
+             * The sensor sends frames of up to the binned pixel array, or of
+             * the binned ROI if any.
+             */
+            const int bin = rawcam_binning(cfg);
+            const _Bool has_roi = cfg->roi_width != 0;
+            int32_t sensor_width  = cfg->max_width  / bin,
+                    sensor_height = cfg->max_height / bin;
+
+            if (has_roi) {
+                if (cfg->roi_width  % (2 * bin) != 0
+                        || cfg->roi_height % (2 * bin) != 0) {
+                    print_error("ROI of camera %d must be a multiple of %d "
+                                "in size with its binning", i, 2 * bin);
+                    ret = 1;
+                    goto end;
                 }
+                sensor_width  = cfg->roi_width  / bin;
+                sensor_height = cfg->roi_height / bin;
             }
+            if (out_width > sensor_width || out_height > sensor_height) {
+                print_error("Frames of camera %d must not be larger than "
+                            "the binned %s (%dx%d)", i,
+                            has_roi ? "ROI" : "sensor",
+                            sensor_width, sensor_height);
+                ret = 1;
+                goto end;
+            }
+            if (has_roi && host_width != 0 && (host_width != sensor_width
+                                           || host_height != sensor_height)) {
+                print_error("Host-side frames of camera %d must have "
+                            "the size of the binned ROI (%dx%d)",
+                            i, sensor_width, sensor_height);
+                ret = 1;
+                goto end;
+            }
+            /*
+             * When every frame fits in half the sensor, demosaic each 2x2
+             * Bayer quad into a pixel. The CPU and the splitter then handle a
+             * quarter of the pixels of the raw frame.
+             */
+            cfg->use_superpixel = 2 * out_width  <= sensor_width
+                               && 2 * out_height <= sensor_height;
+            if (host_width == 0) {
+                if (has_roi) {
+                    /* Read out the whole ROI; the isps scale it. */
+                    max_width  = sensor_width;
+                    max_height = sensor_height;
+                } else {
+                    switch (cfg->rawcam_camera_model) {
+                        case RPIGRAFX_RAWCAM_CAMERA_MODEL_IMX219: {
+                            const int32_t mag =
+                                    MMAL_MIN(sensor_width  / max_width,
+                                             sensor_height / max_height);
+                            max_width  *= mag;
+                            max_height *= mag;
+                            break;
+                        }
+                    }
+                }
+                /* Keep the field of view and halve the processed size. */
+                if (cfg->use_superpixel) {
+                    const int32_t w = max_width / 2 & ~1,
+                                  h = max_height / 2 & ~1;
+                    if (w >= out_width && h >= out_height) {
+                        max_width  = w;
+                        max_height = h;
+                    } else {
+                        cfg->use_superpixel = 0;
+                    }
+                }
+            }
+            cfg->raw_width  = max_width  << cfg->use_superpixel;
+            cfg->raw_height = max_height << cfg->use_superpixel;
         }
 #endif /* IMPL_RAWCAM */
         cfg->width = max_width;
         cfg->height = max_height;
 
+        cfg->is_set_up = !0;
         if (cfg->is_rawcam) {
-            if ((ret = setup_cp_camera_rawcam(i, max_width, max_height)))
+            if ((ret = setup_cp_camera_rawcam(i, cfg->raw_width,
+                                              cfg->raw_height)))
                 goto end;
         } else {
             if ((ret = setup_cp_camera(i, max_width, max_height,
                                        cfg->use_camera_capture_port)))
                 goto end;
         }
-        if ((ret = setup_cp_splitter(i, len, max_width, max_height,
-                                     cfg->is_rawcam)))
-            goto end;
-        if (cfg->use_camera_capture_port)
-            if ((ret = setup_cp_null(i, max_width, max_height)))
+        if ((ret = setup_cp_splitter(i, len, max_width, max_height,
+                                     cfg->is_rawcam)))
+            goto end;
+        if (cfg->use_camera_capture_port)
+            if ((ret = setup_cp_null(i, max_width, max_height)))
+                goto end;
+        for (j = 0; j < len; j ++) {
+            if (cfg->isp[j].is_host)
+                continue;
+            if ((ret = setup_cp_isp(i, j, max_width, max_height)))
+                goto end;
+            if ((ret = setup_cp_render(i, j)))
+                goto end;
+        }
+        if ((ret = connect_ports(i, len)))
+            goto end;
+
+        for (j = 0; j < len; j ++) {
+            struct callback_context *ctx = ctxs[i][j];
+            if (!cfg->isp[j].is_host)
+                continue;
+            /* Both RGB48 and RGB16P are 6 bytes per pixel. */
+            ctx->host_frame = malloc((size_t) max_width * max_height * 6);
+            if (ctx->host_frame == NULL) {
+                print_error("Failed to allocate host-side frame %d,%d", i, j);
+                ret = 1;
+                goto end;
+            }
+        }
+#ifdef IMPL_RAWCAM
+        if (cfg->is_rawcam)
+            if ((ret = priv_rpigrafx_tuner_create(&cfg->tuner,
+                                                  &rawcam_tuner_ops, cfg,
+                                                  cfg->tuner_interval,
+                                                  cfg->tuner_change)))
                 goto end;
-        for (j = 0; j < len; j ++) {
-            if ((ret = setup_cp_isp(i, j, max_width, max_height)))
+        if (cfg->is_rawcam && cfg->is_pipelined)
+            if ((ret = priv_rpigrafx_pipeline_create(&cfg->pipeline,
+                                                     &rawcam_pipeline_ops,
+                                                     cfg)))
                 goto end;
-            if ((ret = setup_cp_render(i, j)))
+        if (cfg->is_rawcam && cfg->ae_wait_frames > 0)
+            if ((ret = wait_ae_converged(i, len)))
                 goto end;
+#endif /* IMPL_RAWCAM */
+    }
+
+    /*
+     * Until now, the outputs with callbacks kept only their newest frame, as
+     * the pipelined rawcam does, and could be captured to wait for the AE.
+     */
+    if (has_callbacks) {
+        struct priv_rpigrafx_dispatcher *dp = NULL;
+        /*
+         * Every frame in a ring is a buffer of the pool of its connection, so
+         * rings which hold the largest pool never fill.
+         */
+        uint32_t depth = 1;
+
+        for (i = 0; i < num_cameras; i ++) {
+            for (j = 0; j < NUM_SPLITTER_OUTPUTS; j ++) {
+                const MMAL_CONNECTION_T *conn = conn_isps_renders[i][j];
+                if (conn_users[i][j].channel < 0 || conn == NULL)
+                    continue;
+                while (depth < conn->out->buffer_num
+                        || depth < conn->in->buffer_num)
+                    depth *= 2;
+            }
         }
-        if ((ret = connect_ports(i, len)))
+        if ((ret = priv_rpigrafx_dispatcher_create(&dp,
+                                           &frame_dispatcher_ops, NULL,
+                                           MAX_CAMERAS * NUM_SPLITTER_OUTPUTS,
+                                           depth)))
             goto end;
+        __atomic_store_n(&dispatcher, dp, __ATOMIC_RELEASE);
     }
 
 end:
     return ret;
 }
 
-int rpigrafx_capture_next_frame(rpigrafx_frame_config_t *fcp)
+/*
+ * Capture the next frame of fcp, waiting until deadline_us as in
+ * queue_wait_until. If it passes, return RPIGRAFX_TIMED_OUT with no frame
+ * and anything acquired given back, so that the next call starts afresh.
+ */
+static int capture_next_frame(rpigrafx_frame_config_t *fcp,
+                              const int64_t deadline_us)
 {
     struct callback_context *ctx = fcp->ctx;
     struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    struct isp_config *icfg = &cfg->isp[fcp->splitter_output_port_index];
     int ret = 0;
     MMAL_BUFFER_HEADER_T *header = NULL;
     MMAL_STATUS_T status;
+    /* Of the raw frame sent to the splitter by this call, if any. */
+    int64_t pts = MMAL_TIME_UNKNOWN;
+
+    if (icfg->callback != NULL && dispatcher != NULL) {
+        print_error("Frames of camera %d,%d are delivered to its callback",
+                    fcp->camera_number, fcp->splitter_output_port_index);
+        ret = 1;
+        goto end;
+    }
 
     if (cfg->use_camera_capture_port) {
         status = mmal_port_parameter_set_boolean(cp_cameras[fcp->camera_number]
@@ -1482,133 +3165,58 @@ int rpigrafx_capture_next_frame(rpigrafx_frame_config_t *fcp)
     }
 
 #ifdef IMPL_RAWCAM
-    if (cfg->is_rawcam) {
-        const int32_t width = cfg->width,
-                      height = cfg->height,
-                      /* Stride in header->data. */
-                      stride = ALIGN_UP(width, 32),
-                      raw_width = rpiraw_width_raw8_to_raw10_rpi(width);
-        for (; ; ) {
-            MMAL_PORT_T *output = cpw_rawcams[fcp->camera_number]->output[0],
-                        *input = cpw_splitters[fcp->camera_number]->input[0];
-            MMAL_QUEUE_T *input_queue = cpw_splitters[fcp->camera_number]->
-                                                           input_pool[0]->queue;
-            uint8_t *raw8 = NULL;
-
-            for (; ; ) {
-                _Bool exit_loop = 0;
-                status = mmal_wrapper_buffer_get_empty(output, &header, 0);
-                switch (status) {
-                    case MMAL_SUCCESS:
-                        status = mmal_port_send_buffer(output, header);
-                        if (status != MMAL_SUCCESS) {
-                            print_error("Failed to send empty buffer to rawcam:"
-                                        " 0x%08x", status);
-                            ret = 1;
-                            goto end;
-                        }
-                        break;
-                    case MMAL_EAGAIN:
-                        exit_loop = !0;
-                        break;
-                    default:
-                        print_error("Failed to get empty header: 0x%08x",
-                                    status);
-                        ret = 1;
-                        goto end;
-                }
-                if (exit_loop)
-                    break;
-            }
-
-            status = mmal_wrapper_buffer_get_full(output, &header,
-                                                  MMAL_WRAPPER_FLAG_WAIT);
-            if (status != MMAL_SUCCESS) {
-                print_error("Failed to get full header from rawcam: 0x%08x",
-                            status);
-                ret = 1;
-                goto end;
-            }
+    if (cfg->is_rawcam && cfg->is_pipelined) {
+        if ((ret = priv_rpigrafx_pipeline_status(cfg->pipeline))) {
+            print_error("Pipeline of camera %d has stopped",
+                        fcp->camera_number);
+            goto end;
+        }
+    } else if (cfg->is_rawcam) {
+        const int i = fcp->camera_number;
+        MMAL_BUFFER_HEADER_T *header_raw = NULL;
 
-            /* Raw info etc... */
-            if (header->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO) {
-                mmal_buffer_header_release(header);
-                continue;
-            }
+        if ((ret = rawcam_get_full(i, &header_raw, deadline_us)))
+            goto end;
 
-            raw8 = malloc(width * height);
-            if (raw8 == NULL) {
-                print_error("Failed to allocate raw8: %s", strerror(errno));
-                ret = 1;
-                goto end;
-            }
+        /* The frame goes directly into ctx->host_frame. */
+        if (icfg->is_host) {
+            ret = rawcam_process(i, header_raw->data, icfg->encoding,
+                                 ctx->host_frame, cfg->width
+                                 * (icfg->encoding == RPIGRAFX_ENCODING_RGB48
+                                    ? 6 : 2));
+            mmal_buffer_header_release(header_raw);
+            goto end;
+        }
 
-            /* xxx: Add stride argument to this call. */
-            ret = rpiraw_convert_raw10_to_raw8(raw8, header->data,
-                                               width, height, raw_width);
-            if (ret) {
-                print_error("rpiraw_convert_raw10_to_raw8: %d", ret);
+        /* Process the raw frame directly into the splitter input buffer. */
+        header = queue_wait_until(cpw_splitters[i]->input_pool[0]->queue,
+                                  deadline_us);
+        if (header == NULL) {
+            /* The raw frame is dropped. */
+            mmal_buffer_header_release(header_raw);
+            if (deadline_us >= 0) {
+                ret = RPIGRAFX_TIMED_OUT;
                 goto end;
             }
-
+            print_error("Failed to wait for header from rawcam");
+            ret = 1;
+            goto end;
+        }
+        ret = rawcam_process(i, header_raw->data, cfg->splitter_encoding,
+                             header->data, splitter_input_stride(i));
+        mmal_buffer_header_release(header_raw);
+        if (ret) {
             mmal_buffer_header_release(header);
-
-            header = mmal_queue_wait(input_queue);
-            if (header == NULL) {
-                print_error("Failed to wait for header from rawcam");
-                ret = 1;
-                goto end;
-            }
-
-            if (cfg->rawcam_camera_model == RPIGRAFX_RAWCAM_CAMERA_MODEL_IMX219) {
-                ret = rpiraw_raw8bggr_component_gain(raw8, width, raw8, width,
-                                               width, height, 1.55, 1.0, 1.5);
-                if (ret) {
-                    print_error("rpiraw_raw8bggr_component_gain: %d", ret);
-                    goto end;
-                }
-            }
-            ret = rpiraw_raw8bggr_to_rgb888_nearest_neighbor(header->data,
-                                                             stride,
-                                                             raw8,
-                                                             width, width,
-                                                             height);
-            if (ret) {
-                print_error("rpiraw_raw8bggr_to_rgb888_nearest_neighbor: %d",
-                            ret);
-                goto end;
-            }
-
-            free(raw8);
-
-            {
-                uint32_t hist_r[256], hist_g[256], hist_b[256], sum = 0;
-                ret = rpiraw_calc_histogram_rgb888(hist_r, hist_g, hist_b,
-                                                   header->data,
-                                                   stride, width, height);
-                sum = hist_r[255] + hist_g[255] + hist_b[255];
-                ret = rpicam_imx219_tuner(RPICAM_IMX219_TUNER_METHOD_HEURISTIC,
-                                          &cfg->rpicam_config.imx219, sum);
-            }
-
-            /*
-             * Wait! The header here is not the one the user requested. We pass
-             * it to the splitter and wait for the isp to crop them.
-             */
-
-            /* xxx: stride * height * 3 ? */
-            header->length = width * height * 3;
-            header->flags = MMAL_BUFFER_HEADER_FLAG_EOS;
-            status = mmal_port_send_buffer(input, header);
-            if (status != MMAL_SUCCESS) {
-                print_error("Failed to send buffer to splitter: 0x%08x",
-                            status);
-                ret = 1;
-                goto end;
-            }
-
-            break;
+            goto end;
         }
+
+        /*
+         * Wait! The header here is not the one the user requested. We pass
+         * it to the splitter and wait for the isp to crop them.
+         */
+        pts = cfg->frame_metadata.pts;
+        if ((ret = rawcam_send_to_splitter(i, header)))
+            goto end;
     }
 #endif /* IMPL_RAWCAM */
 
@@ -1624,7 +3232,13 @@ int rpigrafx_capture_next_frame(rpigrafx_frame_config_t *fcp)
             mmal_port_send_buffer(conn->out, header);
         }
 
-        header = mmal_queue_wait(conn->queue);
+        header = queue_wait_until(conn->queue, deadline_us);
+        if (header == NULL) {
+            if (pts != MMAL_TIME_UNKNOWN)
+                icfg->has_late_frame = !0;
+            ret = RPIGRAFX_TIMED_OUT;
+            goto end;
+        }
         if (priv_rpigrafx_verbose)
             WARN_HEADER("Got header ", header, " from conn->queue");
         /*
@@ -1637,15 +3251,62 @@ int rpigrafx_capture_next_frame(rpigrafx_frame_config_t *fcp)
             mmal_buffer_header_release(header);
             continue;
         }
+        /*
+         * The frame of a call which timed out can come before the frame sent
+         * by this one, which is told apart by its time. Otherwise, frames
+         * sent by the calls for the other outputs are returned as before.
+         */
+        if (icfg->has_late_frame && pts != MMAL_TIME_UNKNOWN
+                && header->pts != MMAL_TIME_UNKNOWN && header->pts != pts) {
+            mmal_buffer_header_release(header);
+            continue;
+        }
+#ifdef IMPL_RAWCAM
+        /*
+         * The pipeline thread may have finished several frames since the
+         * last call. Return the newest one and give the others back.
+         */
+        if (cfg->is_pipelined) {
+            MMAL_BUFFER_HEADER_T *newer = NULL;
+
+            while ((newer = mmal_queue_get(conn->queue)) != NULL) {
+                if (newer->length == 0) {
+                    mmal_buffer_header_release(newer);
+                    continue;
+                }
+                mmal_buffer_header_release(header);
+                header = newer;
+            }
+            while ((newer = mmal_queue_get(conn->pool->queue)) != NULL)
+                mmal_port_send_buffer(conn->out, newer);
+        }
+#endif /* IMPL_RAWCAM */
         break;
     }
 
+    icfg->has_late_frame = 0;
     ctx->header = header;
 
 end:
     return ret;
 }
 
+int rpigrafx_capture_next_frame(rpigrafx_frame_config_t *fcp)
+{
+    return capture_next_frame(fcp, -1);
+}
+
+int rpigrafx_capture_next_frame_timeout(rpigrafx_frame_config_t *fcp,
+                                        const int timeout_ms)
+{
+    if (timeout_ms < 0) {
+        print_error("Timeout must not be negative: %d", timeout_ms);
+        return 1;
+    }
+    return capture_next_frame(fcp,
+                              get_time_us() + (int64_t) timeout_ms * 1000);
+}
+
 void* rpigrafx_get_frame(rpigrafx_frame_config_t *fcp)
 {
     struct callback_context *ctx = fcp->ctx;
@@ -1658,6 +3319,10 @@ void* rpigrafx_get_frame(rpigrafx_frame_config_t *fcp)
         ret = NULL;
         goto end;
     }
+    if (ctx->host_frame != NULL) {
+        ret = ctx->host_frame;
+        goto end;
+    }
     if (ctx->header == NULL) {
         print_error("Output buffer of isp %d,%d is NULL",
                     fcp->camera_number, fcp->splitter_output_port_index);
@@ -1688,6 +3353,237 @@ int rpigrafx_free_frame(rpigrafx_frame_config_t *fcp)
     return ret;
 }
 
+int rpigrafx_get_rawcam_stats(rpigrafx_frame_config_t *fcp,
+                              rpigrafx_rawcam_stats_t *statsp)
+{
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
+
+    if (!cfg->is_rawcam) {
+        print_error("Camera %d is not rawcam", fcp->camera_number);
+        ret = 1;
+        goto end;
+    }
+
+    priv_rpigrafx_pipeline_lock(cfg->pipeline);
+    memcpy(statsp, &cfg->rawcam_stats, sizeof(*statsp));
+    priv_rpigrafx_pipeline_unlock(cfg->pipeline);
+    priv_rpigrafx_tuner_get_stats(cfg->tuner, &statsp->num_tuner_runs,
+                                  &statsp->tuner_latency_us,
+                                  &statsp->max_tuner_latency_us);
+    priv_rpigrafx_tuner_lock(cfg->tuner);
+    statsp->ae_luma = cfg->ae.luma;
+    statsp->is_ae_converged = cfg->ae.is_converged;
+    priv_rpigrafx_tuner_unlock(cfg->tuner);
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(fcp);
+    MMAL_PARAM_UNUSED(statsp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_get_rawcam_histogram(rpigrafx_frame_config_t *fcp,
+                                  uint32_t hist_r[256], uint32_t hist_g[256],
+                                  uint32_t hist_b[256])
+{
+#ifdef IMPL_RAWCAM
+
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int ret = 0;
+
+    if (!cfg->is_rawcam || !cfg->is_histogram_enabled) {
+        print_error("Histograms of camera %d are not enabled",
+                    fcp->camera_number);
+        ret = 1;
+        goto end;
+    }
+
+    priv_rpigrafx_pipeline_lock(cfg->pipeline);
+    memcpy(hist_r, cfg->hist[0], sizeof(cfg->hist[0]));
+    memcpy(hist_g, cfg->hist[1], sizeof(cfg->hist[1]));
+    memcpy(hist_b, cfg->hist[2], sizeof(cfg->hist[2]));
+    priv_rpigrafx_pipeline_unlock(cfg->pipeline);
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(fcp);
+    MMAL_PARAM_UNUSED(hist_r);
+    MMAL_PARAM_UNUSED(hist_g);
+    MMAL_PARAM_UNUSED(hist_b);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_get_rawcam_metadata(rpigrafx_frame_config_t *fcp,
+                                 rpigrafx_rawcam_metadata_t *metadatap)
+{
+#ifdef IMPL_RAWCAM
+
+    struct callback_context *ctx = fcp->ctx;
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    int k, idx;
+    int ret = 0;
+
+    if (!cfg->is_rawcam) {
+        print_error("Camera %d is not configured for rawcam",
+                    fcp->camera_number);
+        ret = 1;
+        goto end;
+    }
+
+    /* The newest frame, or the one the isp output came from. */
+    priv_rpigrafx_pipeline_lock(cfg->pipeline);
+    idx = cfg->metadata_idx;
+    if (ctx->header != NULL && ctx->header->pts != MMAL_TIME_UNKNOWN) {
+        for (k = 0; k < NUM_METADATA; k ++) {
+            if (cfg->metadata[k].pts == ctx->header->pts) {
+                idx = k;
+                break;
+            }
+        }
+    }
+    memcpy(metadatap, &cfg->metadata[idx], sizeof(*metadatap));
+    priv_rpigrafx_pipeline_unlock(cfg->pipeline);
+
+end:
+    return ret;
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(fcp);
+    MMAL_PARAM_UNUSED(metadatap);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+#ifdef IMPL_RAWCAM
+/*
+ * Change the timing of the IMX219 of fcp with set, to be written to the sensor
+ * by the tuner thread, and return the effective value of set in *valuep.
+ */
+static int set_imx219_timing(rpigrafx_frame_config_t *fcp,
+                             float (*set)(struct priv_rpigrafx_imx219_timing*,
+                                          const float),
+                             const float value, float *valuep)
+{
+    struct cameras_config *cfg = &cameras_config[fcp->camera_number];
+    float effective;
+    _Bool is_auto;
+    int ret = 0;
+
+    if (!cfg->has_imx219_timing) {
+        print_error("IMX219 of camera %d is not open; "
+                    "call rpigrafx_finish_config first", fcp->camera_number);
+        ret = 1;
+        goto end;
+    }
+
+    priv_rpigrafx_tuner_lock(cfg->tuner);
+    effective = set(&cfg->imx219_timing, value);
+    /* The tuner would overwrite the manual exposure and gain. */
+    is_auto = cfg->imx219_timing.exposure_lines == 0
+              && !cfg->imx219_timing.is_manual_gain;
+    priv_rpigrafx_tuner_unlock(cfg->tuner);
+    priv_rpigrafx_tuner_update(cfg->tuner, is_auto);
+    if (valuep != NULL)
+        *valuep = effective;
+
+end:
+    return ret;
+}
+#endif /* IMPL_RAWCAM */
+
+int rpigrafx_set_rawcam_framerate(const float framerate,
+                                  float *frame_period_usp,
+                                  rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
+
+    if (!(framerate >= 0)) {
+        print_error("Frame rate must not be negative: %f", framerate);
+        return 1;
+    }
+    return set_imx219_timing(fcp, priv_rpigrafx_imx219_set_framerate,
+                             framerate, frame_period_usp);
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(framerate);
+    MMAL_PARAM_UNUSED(frame_period_usp);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_set_rawcam_exposure(const float exposure_us, float *exposure_usp,
+                                 rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
+
+    if (!(exposure_us >= 0)) {
+        print_error("Exposure must not be negative: %f", exposure_us);
+        return 1;
+    }
+    return set_imx219_timing(fcp, priv_rpigrafx_imx219_set_exposure,
+                             exposure_us, exposure_usp);
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(exposure_us);
+    MMAL_PARAM_UNUSED(exposure_usp);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
+int rpigrafx_set_rawcam_gain(const float gain, float *gainp,
+                             rpigrafx_frame_config_t *fcp)
+{
+#ifdef IMPL_RAWCAM
+
+    if (!(gain == 0 || gain >= 1)) {
+        print_error("Gain must be 0 or at least 1: %f", gain);
+        return 1;
+    }
+    return set_imx219_timing(fcp, priv_rpigrafx_imx219_set_gain, gain, gainp);
+
+#else /* IMPL_RAWCAM */
+
+    MMAL_PARAM_UNUSED(gain);
+    MMAL_PARAM_UNUSED(gainp);
+    MMAL_PARAM_UNUSED(fcp);
+
+    print_error("librpicam and librpiraw is needed to use rawcam");
+    return 1;
+
+#endif /* IMPL_RAWCAM */
+}
+
 int rpigrafx_render_frame(rpigrafx_frame_config_t *fcp)
 {
     struct callback_context *ctx = fcp->ctx;
@@ -1701,6 +3597,11 @@ int rpigrafx_render_frame(rpigrafx_frame_config_t *fcp)
         ret = 1;
         goto end;
     }
+    if (ctx->host_frame != NULL) {
+        print_error("Frames in host-side encodings can't be rendered");
+        ret = 1;
+        goto end;
+    }
 
     status = mmal_port_send_buffer(conn_isps_renders[fcp->camera_number]
                                           [fcp->splitter_output_port_index]->in,
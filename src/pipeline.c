@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Background processing thread.
+ *
+ * The thread repeatedly waits for a captured frame and for an output buffer,
+ * processes the frame into the buffer and hands the buffer on, so that
+ * capturing frame N + 1 overlaps with processing frame N and with whatever
+ * the user does with frame N - 1. The frame source and the output buffers are
+ * abstracted by priv_rpigrafx_pipeline_ops so that this can be tested without
+ * MMAL.
+ */
+
+struct priv_rpigrafx_pipeline {
+    const struct priv_rpigrafx_pipeline_ops *ops;
+    void *user;
+    pthread_t thread;
+
+    /* Protects the members below and whatever the ops share with users. */
+    pthread_mutex_t mutex;
+    _Bool quit, is_running;
+    int ret;
+    uint64_t num_frames;
+};
+
+static _Bool should_quit(struct priv_rpigrafx_pipeline *pl)
+{
+    _Bool quit;
+
+    pthread_mutex_lock(&pl->mutex);
+    quit = pl->quit;
+    pthread_mutex_unlock(&pl->mutex);
+    return quit;
+}
+
+static void* pipeline_main(void *arg)
+{
+    struct priv_rpigrafx_pipeline *pl = arg;
+    const struct priv_rpigrafx_pipeline_ops *ops = pl->ops;
+    int ret = 0;
+
+    while (!should_quit(pl)) {
+        void *input = NULL, *output = NULL;
+
+        /* The waits time out now and then so that the thread can quit. */
+        ret = ops->get_input(pl->user, &input);
+        if (ret == RPIGRAFX_TIMED_OUT) {
+            ret = 0;
+            continue;
+        } else if (ret)
+            break;
+        /* The frame may have been waited for long. */
+        if (should_quit(pl)) {
+            ops->release_input(pl->user, input);
+            break;
+        }
+        while ((ret = ops->get_output(pl->user, &output))
+                    == RPIGRAFX_TIMED_OUT && !should_quit(pl))
+            ;
+        if (ret) {
+            ops->release_input(pl->user, input);
+            if (ret == RPIGRAFX_TIMED_OUT)
+                ret = 0;
+            break;
+        }
+        ret = ops->process(pl->user, input, output);
+        ops->release_input(pl->user, input);
+        if (ret) {
+            ops->release_output(pl->user, output);
+            break;
+        }
+        if ((ret = ops->put_output(pl->user, output)))
+            break;
+
+        pthread_mutex_lock(&pl->mutex);
+        pl->num_frames ++;
+        pthread_mutex_unlock(&pl->mutex);
+    }
+
+    pthread_mutex_lock(&pl->mutex);
+    pl->ret = ret;
+    pl->is_running = 0;
+    pthread_mutex_unlock(&pl->mutex);
+    if (ret)
+        print_error("Pipeline stopped: %d", ret);
+
+    return NULL;
+}
+
+int priv_rpigrafx_pipeline_create(struct priv_rpigrafx_pipeline **plp,
+                                  const struct priv_rpigrafx_pipeline_ops *ops,
+                                  void *user)
+{
+    struct priv_rpigrafx_pipeline *pl = NULL;
+    int reti;
+    int ret = 0;
+
+    pl = calloc(1, sizeof(*pl));
+    if (pl == NULL) {
+        print_error("Failed to allocate pipeline");
+        ret = 1;
+        goto end;
+    }
+    pl->ops = ops;
+    pl->user = user;
+    pl->is_running = !0;
+    pthread_mutex_init(&pl->mutex, NULL);
+
+    /* The ops may use *plp, e.g. for priv_rpigrafx_pipeline_lock. */
+    *plp = pl;
+    reti = pthread_create(&pl->thread, NULL, pipeline_main, pl);
+    if (reti) {
+        print_error("Failed to create pipeline thread: %s", strerror(reti));
+        pthread_mutex_destroy(&pl->mutex);
+        free(pl);
+        pl = NULL;
+        ret = 1;
+        goto end;
+    }
+
+end:
+    *plp = pl;
+    return ret;
+}
+
+/*
+ * Stop the thread and free pl. This returns after the thread finishes the
+ * frame it is processing, or after the wait of the ops times out.
+ */
+void priv_rpigrafx_pipeline_destroy(struct priv_rpigrafx_pipeline *pl)
+{
+    if (pl == NULL)
+        return;
+
+    pthread_mutex_lock(&pl->mutex);
+    pl->quit = !0;
+    pthread_mutex_unlock(&pl->mutex);
+    pthread_join(pl->thread, NULL);
+    pthread_mutex_destroy(&pl->mutex);
+    free(pl);
+}
+
+/* Return non-zero if the thread has stopped because of an error. */
+int priv_rpigrafx_pipeline_status(struct priv_rpigrafx_pipeline *pl)
+{
+    int ret;
+
+    pthread_mutex_lock(&pl->mutex);
+    ret = pl->is_running ? 0 : (pl->ret ? pl->ret : 1);
+    pthread_mutex_unlock(&pl->mutex);
+    return ret;
+}
+
+uint64_t priv_rpigrafx_pipeline_num_frames(struct priv_rpigrafx_pipeline *pl)
+{
+    uint64_t num_frames;
+
+    pthread_mutex_lock(&pl->mutex);
+    num_frames = pl->num_frames;
+    pthread_mutex_unlock(&pl->mutex);
+    return num_frames;
+}
+
+/*
+ * Serialize access to state which the ops update from the thread, such as
+ * statistics. pl may be NULL, in which case these do nothing.
+ */
+void priv_rpigrafx_pipeline_lock(struct priv_rpigrafx_pipeline *pl)
+{
+    if (pl != NULL)
+        pthread_mutex_lock(&pl->mutex);
+}
+
+void priv_rpigrafx_pipeline_unlock(struct priv_rpigrafx_pipeline *pl)
+{
+    if (pl != NULL)
+        pthread_mutex_unlock(&pl->mutex);
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Persistent worker pool.
+ *
+ * priv_rpigrafx_pool_run calls func(arg, i, n) for every i in [0, n), where n
+ * is the number of threads of the pool, and returns when all of them are done.
+ * The calling thread does i = 0, so a pool of n threads has n - 1 workers,
+ * which sleep on a condition variable between runs.
+ */
+
+struct worker {
+    struct priv_rpigrafx_pool *pool;
+    pthread_t thread;
+    int idx;
+};
+
+struct priv_rpigrafx_pool {
+    int num_threads;
+    struct worker *workers;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_start, cond_done;
+    /* Incremented on each run. */
+    uint64_t generation;
+    int num_running;
+    _Bool quit;
+
+    void (*func)(void *arg, const int idx, const int num);
+    void *arg;
+};
+
+static void* worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct priv_rpigrafx_pool *pool = w->pool;
+    uint64_t generation = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (; ; ) {
+        while (!pool->quit && pool->generation == generation)
+            pthread_cond_wait(&pool->cond_start, &pool->mutex);
+        if (pool->quit)
+            break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+
+        pool->func(pool->arg, w->idx, pool->num_threads);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (-- pool->num_running == 0)
+            pthread_cond_signal(&pool->cond_done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/*
+ * Create a pool of num_threads threads. If num_threads is 0, the number of
+ * online CPUs is used. If set_affinity is set, worker i is bound to CPU i.
+ */
+int priv_rpigrafx_pool_create(struct priv_rpigrafx_pool **poolp,
+                              int num_threads, const _Bool set_affinity)
+{
+    struct priv_rpigrafx_pool *pool = NULL;
+    const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, reti;
+    int ret = 0;
+
+    if (num_threads == 0)
+        num_threads = (num_cpus > 0) ? num_cpus : 1;
+    if (num_threads < 0) {
+        print_error("Invalid number of threads: %d", num_threads);
+        ret = 1;
+        goto end;
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        print_error("Failed to allocate pool");
+        ret = 1;
+        goto end;
+    }
+    pool->workers = calloc(num_threads, sizeof(*pool->workers));
+    if (pool->workers == NULL) {
+        print_error("Failed to allocate workers");
+        free(pool);
+        pool = NULL;
+        ret = 1;
+        goto end;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond_start, NULL);
+    pthread_cond_init(&pool->cond_done, NULL);
+
+    /* Worker 0 is the calling thread. */
+    pool->num_threads = 1;
+    for (i = 1; i < num_threads; i ++) {
+        struct worker *w = &pool->workers[i];
+
+        w->pool = pool;
+        w->idx = i;
+        reti = pthread_create(&w->thread, NULL, worker_main, w);
+        if (reti) {
+            print_error("Failed to create worker %d: %s", i, strerror(reti));
+            priv_rpigrafx_pool_destroy(pool);
+            pool = NULL;
+            ret = 1;
+            goto end;
+        }
+        pool->num_threads ++;
+
+        if (set_affinity && num_cpus > 0) {
+            cpu_set_t set;
+
+            CPU_ZERO(&set);
+            CPU_SET(i % num_cpus, &set);
+            reti = pthread_setaffinity_np(w->thread, sizeof(set), &set);
+            if (reti)
+                print_error("Failed to set affinity of worker %d: %s",
+                            i, strerror(reti));
+        }
+    }
+
+end:
+    *poolp = pool;
+    return ret;
+}
+
+void priv_rpigrafx_pool_destroy(struct priv_rpigrafx_pool *pool)
+{
+    int i;
+
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = !0;
+    pthread_cond_broadcast(&pool->cond_start);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i = 1; i < pool->num_threads; i ++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    pthread_cond_destroy(&pool->cond_done);
+    pthread_cond_destroy(&pool->cond_start);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->workers);
+    free(pool);
+}
+
+/* pool may be NULL, which is a pool of only the calling thread. */
+int priv_rpigrafx_pool_num_threads(const struct priv_rpigrafx_pool *pool)
+{
+    return (pool == NULL) ? 1 : pool->num_threads;
+}
+
+void priv_rpigrafx_pool_run(struct priv_rpigrafx_pool *pool,
+                            void (*func)(void *arg, const int idx,
+                                         const int num),
+                            void *arg)
+{
+    if (pool == NULL || pool->num_threads == 1) {
+        func(arg, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->func = func;
+    pool->arg = arg;
+    pool->num_running = pool->num_threads - 1;
+    pool->generation ++;
+    pthread_cond_broadcast(&pool->cond_start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    func(arg, 0, pool->num_threads);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->num_running != 0)
+        pthread_cond_wait(&pool->cond_done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
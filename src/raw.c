@@ -0,0 +1,1636 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Software raw image processing for rawcam.
+ *
+ * These functions don't depend on MMAL so that they can be tested on hosts
+ * which don't have the Raspberry Pi firmware.
+ */
+
+/*
+ * Scratch arena for intermediate buffers. It is allocated once at config time,
+ * page-aligned and prefaulted so that capturing frames doesn't touch the heap
+ * nor take page faults. num_allocs counts the (re)allocations.
+ */
+int priv_rpigrafx_raw_scratch_reserve(struct priv_rpigrafx_raw_scratch *sp,
+                                      const size_t size)
+{
+    void *base = NULL;
+    long page_size;
+    int reti;
+    int ret = 0;
+
+    if (size == 0 || (sp->base != NULL && sp->size >= size))
+        goto end;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0)
+        page_size = 4096;
+
+    reti = posix_memalign(&base, page_size, size);
+    if (reti) {
+        print_error("Failed to allocate scratch of %zu bytes: %s",
+                    size, strerror(reti));
+        ret = 1;
+        goto end;
+    }
+    /* Prefault. */
+    memset(base, 0, size);
+
+    free(sp->base);
+    sp->base = base;
+    sp->size = size;
+    sp->num_allocs ++;
+
+end:
+    return ret;
+}
+
+void priv_rpigrafx_raw_scratch_free(struct priv_rpigrafx_raw_scratch *sp)
+{
+    free(sp->base);
+    sp->base = NULL;
+    sp->size = 0;
+}
+
+/*
+ * Stride in bytes of packed raw lines as rawcam outputs them: nbits bits per
+ * pixel, aligned to 32 bytes.
+ */
+int32_t priv_rpigrafx_raw_stride(const int32_t width, const unsigned nbits)
+{
+    return ALIGN_UP((width * nbits + 7) / 8, 32);
+}
+
+/*
+ * Bayer patterns are told apart by the position (bx, by) of B in the 2x2
+ * quads, which start at even lines and columns. R is diagonal to B and G is
+ * on the other two. Flipping a frame horizontally flips bx, and vertically
+ * by.
+ */
+static int bayer_bx(const rpigrafx_bayer_pattern_t pattern)
+{
+    return pattern == RPIGRAFX_BAYER_PATTERN_GBRG
+           || pattern == RPIGRAFX_BAYER_PATTERN_RGGB;
+}
+
+static int bayer_by(const rpigrafx_bayer_pattern_t pattern)
+{
+    return pattern == RPIGRAFX_BAYER_PATTERN_GRBG
+           || pattern == RPIGRAFX_BAYER_PATTERN_RGGB;
+}
+
+/* Channel of pixel (x, y) in pattern: 0 for R, 1 for G and 2 for B. */
+int priv_rpigrafx_bayer_channel(const rpigrafx_bayer_pattern_t pattern,
+                                const int32_t x, const int32_t y)
+{
+    const int bx = bayer_bx(pattern), by = bayer_by(pattern);
+
+    if ((x & 1) != ((y & 1) ^ by ^ bx))
+        return 1;
+    return ((y & 1) == by) ? 2 : 0;
+}
+
+/*
+ * Saturation counting. Lines are counted right after they are written, so
+ * they are still in the cache. On a grid, every step-th 2x2 Bayer quad in
+ * both directions is counted, which is unit x unit output pixels: 2 normally
+ * and 1 for superpixels. Sampling whole quads keeps all the CFA colors in the
+ * sample. The loops for step 1 are separate so that they vectorize.
+ */
+
+static _Bool is_sat_line(const int32_t y, const int step, const int unit)
+{
+    return y / unit % step == 0;
+}
+
+static uint32_t count_saturated_rgb888(const uint8_t *line,
+                                       const int32_t width, const int step)
+{
+    uint32_t n = 0;
+    int32_t i, j;
+
+    if (step == 1) {
+        for (i = 0; i < width * 3; i ++)
+            n += line[i] == 255;
+    } else {
+        for (i = 0; i < width; i += 2 * step)
+            for (j = i * 3; j < i * 3 + 6; j ++)
+                n += line[j] == 255;
+    }
+    return n;
+}
+
+static uint32_t count_saturated_planar(const uint16_t *pr, const uint16_t *pg,
+                                       const uint16_t *pb, const int32_t width,
+                                       const int step, const int unit,
+                                       const uint16_t thr)
+{
+    uint32_t n = 0;
+    int32_t i, j;
+
+    if (step == 1) {
+        for (i = 0; i < width; i ++)
+            n += (pr[i] >= thr) + (pg[i] >= thr) + (pb[i] >= thr);
+    } else {
+        for (i = 0; i < width; i += unit * step)
+            for (j = i; j < i + unit; j ++)
+                n += (pr[j] >= thr) + (pg[j] >= thr) + (pb[j] >= thr);
+    }
+    return n;
+}
+
+/*
+ * White balance statistics are gathered on the same grid, skipping pixels
+ * which have a saturated channel. The sums are kept in a local copy: the
+ * lines are uint8_t, which may alias *st, and storing to it on every pixel
+ * would cost as much as the kernel. Saturation is data-dependent, so the
+ * masking is branchless.
+ */
+#define GATHER_AWB_PIXEL(s, r, g, b, thr) \
+    do { \
+        const uint32_t ok_ = ((r) < (thr)) & ((g) < (thr)) & ((b) < (thr)), \
+                       mask_ = -ok_, r_ = (r) & mask_, g_ = (g) & mask_, \
+                       b_ = (b) & mask_; \
+        (s).sum_r += r_; \
+        (s).sum_g += g_; \
+        (s).sum_b += b_; \
+        (s).max_r = (r_ > (s).max_r) ? r_ : (s).max_r; \
+        (s).max_g = (g_ > (s).max_g) ? g_ : (s).max_g; \
+        (s).max_b = (b_ > (s).max_b) ? b_ : (s).max_b; \
+        (s).num_samples += ok_; \
+    } while (0)
+
+static void gather_awb_planar(struct priv_rpigrafx_awb_stats *st,
+                              const uint16_t *pr, const uint16_t *pg,
+                              const uint16_t *pb, const int32_t width,
+                              const int step, const int unit,
+                              const uint16_t thr)
+{
+    struct priv_rpigrafx_awb_stats s = *st;
+    int32_t i, j;
+
+    for (i = 0; i < width; i += unit * step)
+        for (j = i; j < i + unit; j ++)
+            GATHER_AWB_PIXEL(s, (uint32_t) pr[j], (uint32_t) pg[j],
+                             (uint32_t) pb[j], (uint32_t) thr);
+    *st = s;
+}
+
+/* Statistics which the fused kernel gathers from its output lines. */
+struct line_stats {
+    uint32_t *num_saturated;
+    int sat_step;
+    struct priv_rpigrafx_awb_stats *awb;
+    int awb_step;
+    /* Line of the frame which the kernel starts at. */
+    int32_t y0;
+};
+
+/*
+ * Count the saturated samples of a pair of full-resolution RGB888 lines y and
+ * y + 1. White balance statistics are gathered from the quads instead, see
+ * gather_awb_quads.
+ */
+static void gather_rgb888_pair(const struct line_stats *st,
+                               const uint8_t *d0, const uint8_t *d1,
+                               const int32_t width, const int32_t y)
+{
+    if (st->num_saturated != NULL && is_sat_line(st->y0 + y, st->sat_step, 2))
+        *st->num_saturated += count_saturated_rgb888(d0, width, st->sat_step)
+                              + count_saturated_rgb888(d1, width,
+                                                       st->sat_step);
+}
+
+/*
+ * YUV 4:2:0 output in BT.601 limited range, which is what the isp assumes for
+ * YUV input. Y is per pixel and Cb and Cr are of the mean of each 2x2 block;
+ * the chroma functions take the sums of the four R, G and B values.
+ */
+static inline uint8_t rgb_to_y(const int32_t r, const int32_t g,
+                               const int32_t b)
+{
+    return 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+}
+
+static inline uint8_t rgb4_to_cb(const int32_t r4, const int32_t g4,
+                                 const int32_t b4)
+{
+    return 128 + ((-38 * r4 - 74 * g4 + 112 * b4 + 512) >> 10);
+}
+
+static inline uint8_t rgb4_to_cr(const int32_t r4, const int32_t g4,
+                                 const int32_t b4)
+{
+    return 128 + ((112 * r4 - 94 * g4 - 18 * b4 + 512) >> 10);
+}
+
+static _Bool is_yuv_encoding(const MMAL_FOURCC_T encoding)
+{
+    return encoding == MMAL_ENCODING_I420 || encoding == MMAL_ENCODING_NV12;
+}
+
+/*
+ * YUV output of the fused kernel, which converts each quad as it demosaics it
+ * and gathers the statistics from the quads instead of RGB888 lines.
+ */
+struct fused_yuv {
+    const struct priv_rpigrafx_raw_job *job;
+    /* Line of the frame which the kernel starts at. */
+    int32_t y0;
+};
+
+/*
+ * Defective-pixel, black level and lens shading correction of the fused
+ * kernel. map may be NULL for the dynamic defect correction only. Without a
+ * grid the black level and the gain are folded into the tone maps instead,
+ * see build_fused_luts, and map is given only for its defects.
+ */
+struct fused_calib {
+    const struct priv_rpigrafx_calib_map *map;
+    /* Threshold of dpc_line8 in 8-bit units, or 0. */
+    uint8_t dpc_threshold;
+    /* Corrected upper bytes of the two lines of a pair. */
+    uint8_t *line0, *line1;
+    /* Upper bytes before dpc_line8, with room for mirrored paddings of 2. */
+    uint8_t *tmp;
+    /* Line of the frame which the kernel starts at. */
+    int32_t y0;
+};
+
+/*
+ * Blend the gains a and b of the calibration map with weight fy. This and
+ * the corrections are written as 16-bit multiply-highs so that they are
+ * vectorized on 16-bit lanes; the blend loses the lowest bit of the gain.
+ */
+static inline uint16_t calib_blend(const uint16_t a, const uint16_t b,
+                                   const int16_t fy)
+{
+    const int16_t h = ((int32_t) (int16_t) (b - a) * fy) >> 16;
+    return a + 2 * h;
+}
+
+/* Correct the sample v with the black level black and the gain c. */
+static inline uint16_t calib_sample(const uint16_t v, const uint16_t c,
+                                    const uint16_t black, const uint16_t maxv)
+{
+    const uint16_t d = (v > black) ? v - black : 0,
+                   s = d << (16 - PRIV_RPIGRAFX_CALIB_SHIFT),
+                   h = ((uint32_t) s * c) >> 16;
+    return (h < maxv) ? h : maxv;
+}
+
+/*
+ * Replace the defective pixels of line y listed in map with the mean of their
+ * neighbors of the same color. Adjacent defects of the same color are not
+ * told apart. Same as correct_defects on 8-bit samples.
+ */
+static void correct_defects8(uint8_t *line, const int32_t width,
+                             const struct priv_rpigrafx_calib_map *map,
+                             const int32_t y)
+{
+    uint32_t k;
+
+    if (map->defect_x == NULL)
+        return;
+    for (k = map->defect_index[y]; k < map->defect_index[y + 1]; k ++) {
+        const int32_t x = map->defect_x[k];
+        const uint8_t a = line[(x >= 2) ? x - 2 : x + 2],
+                      b = line[(x + 2 < width) ? x + 2 : x - 2];
+        line[x] = (a + b + 1) >> 1;
+    }
+}
+
+/*
+ * Dynamic defective-pixel correction of an 8-bit line with mirrored paddings
+ * of 2 from src into dst. Same as dpc_line on 8-bit samples.
+ */
+static inline void dpc_line8(uint8_t *restrict dst,
+                             const uint8_t *restrict src, const int32_t width,
+                             const uint8_t threshold)
+{
+    int32_t x;
+
+    for (x = 0; x < width; x ++) {
+        const uint8_t p = src[x], a = src[x - 2], b = src[x + 2],
+                      c = src[x - 1], d = src[x + 1],
+                      hi = (a > b) ? a : b, lo = (a < b) ? a : b,
+                      chi = (c > d) ? c : d, clo = (c < d) ? c : d,
+                      top = (hi > chi) ? hi : chi,
+                      bottom = (lo < clo) ? lo : clo;
+        const uint16_t above = top + threshold, p_up = p + threshold;
+        dst[x] = (p > above) ? hi : (p_up < bottom) ? lo : p;
+    }
+}
+
+/*
+ * Correct the upper bytes of line y of the frame, which are gathered in
+ * place, with the calibration map. Correcting a whole line apart from the
+ * demosaic keeps the correction vectorized, which is cheaper than doing it
+ * on each sample as the tone maps are looked up.
+ */
+static inline void calib_line8(uint8_t *restrict dst, const int32_t width,
+                               const struct priv_rpigrafx_calib_map *map,
+                               const int32_t y, const uint8_t black8)
+{
+    const uint16_t *row0, *row1, *a, *b;
+    int32_t fy, x;
+
+    /* Stores to dst could alias row0 and row1 themselves otherwise. */
+    priv_rpigrafx_calib_map_rows(map, y, &row0, &row1, &fy);
+    a = row0;
+    b = row1;
+    for (x = 0; x < width; x ++)
+        dst[x] = calib_sample(dst[x], calib_blend(a[x], b[x], fy), black8,
+                              255);
+}
+
+/*
+ * Gather the upper bytes of line y of the frame from src into dst and correct
+ * its defects and then its black level and lens shading, if not in the tone
+ * maps. dst must have room for width rounded up to group_pixels.
+ */
+static inline void prepare_line8(const struct fused_calib *calib,
+                                 uint8_t *dst, const uint8_t *src,
+                                 const int32_t width, const int32_t y,
+                                 const uint8_t black8,
+                                 const int32_t group_pixels,
+                                 const int32_t group_bytes)
+{
+    uint8_t *line = (calib->dpc_threshold != 0) ? calib->tmp : dst;
+    int32_t x;
+
+    for (x = 0; x < width; x += group_pixels, src += group_bytes)
+        memcpy(line + x, src, group_pixels);
+    if (calib->map != NULL)
+        correct_defects8(line, width, calib->map, y);
+    if (calib->dpc_threshold != 0) {
+        for (x = 1; x <= 2; x ++) {
+            line[-x] = line[x];
+            line[width - 1 + x] = line[width - 1 - x];
+        }
+        dpc_line8(dst, line, width, calib->dpc_threshold);
+    }
+    if (calib->map != NULL && calib->map->has_grid)
+        calib_line8(dst, width, calib->map, y, black8);
+}
+
+/*
+ * The fused kernel is specialized by inlining it with constant parameters,
+ * which GCC stops doing by itself once there are a few specializations.
+ */
+#define FUSED_INLINE inline __attribute__((always_inline))
+
+/*
+ * Samples of the quad at byte o of lines s0 and s1, with B at (bx, by). g0 is
+ * the green of s0 and g1 that of s1.
+ */
+#define READ_QUAD(s0, s1, o, bx, by, lut_r, lut_g, lut_b, r, g0, g1, b) \
+    do { \
+        (b)  = (lut_b)[((by) ? (s1) : (s0))[(o) + (bx)]]; \
+        (r)  = (lut_r)[((by) ? (s0) : (s1))[(o) + 1 - (bx)]]; \
+        (g0) = (lut_g)[(s0)[(o) + ((bx) ^ (by) ^ 1)]]; \
+        (g1) = (lut_g)[(s1)[(o) + ((bx) ^ (by))]]; \
+    } while (0)
+
+/*
+ * Demosaic a pair of lines into RGB888 lines d0 and d1, or if is_yuv into
+ * luma lines d0 and d1 and a chroma line cb and cr, whose samples are step
+ * bytes apart. Inlined with is_yuv and the Bayer pattern constant. YUV output
+ * also returns the number of saturated samples of the pair, which can't be
+ * counted from the output afterwards.
+ */
+static FUSED_INLINE uint32_t fused_quads(uint8_t *d0, uint8_t *d1,
+                                         uint8_t *cb, uint8_t *cr,
+                                         const uint8_t *s0, const uint8_t *s1,
+                                         const int32_t width,
+                                         const uint8_t *restrict lut_r,
+                                         const uint8_t *restrict lut_g,
+                                         const uint8_t *restrict lut_b,
+                                         const _Bool do_hist,
+                                         uint32_t hist_r[256],
+                                         uint32_t hist_g[256],
+                                         uint32_t hist_b[256],
+                                         const _Bool is_yuv, const int step,
+                                         const int bx, const int by,
+                                         const int32_t group_pixels,
+                                         const int32_t group_bytes)
+{
+    uint32_t n = 0;
+    int32_t x;
+
+    /* x is in pixels. */
+    for (x = 0; x < width; x += 2) {
+        const int32_t o = x / group_pixels * group_bytes + x % group_pixels;
+        {
+            uint8_t r, g0, g1, b;
+
+            READ_QUAD(s0, s1, o, bx, by, lut_r, lut_g, lut_b, r, g0, g1, b);
+
+            if (is_yuv) {
+                n += 4 * (r == 255) + 2 * (g0 == 255) + 2 * (g1 == 255)
+                     + 4 * (b == 255);
+                /* All four pixels of the quad have the same R and B. */
+                d0[0] = d0[1] = rgb_to_y(r, g0, b);
+                d1[0] = d1[1] = rgb_to_y(r, g1, b);
+                *cb = rgb4_to_cb(4 * r, 2 * (g0 + g1), 4 * b);
+                *cr = rgb4_to_cr(4 * r, 2 * (g0 + g1), 4 * b);
+                d0 += 2;
+                d1 += 2;
+                cb += step;
+                cr += step;
+            } else {
+                d0[0] = r; d0[1] = g0; d0[2] = b;
+                d0[3] = r; d0[4] = g0; d0[5] = b;
+                d1[0] = r; d1[1] = g1; d1[2] = b;
+                d1[3] = r; d1[4] = g1; d1[5] = b;
+                d0 += 6;
+                d1 += 6;
+            }
+
+            if (do_hist) {
+                hist_r[r] += 4;
+                hist_g[g0] += 2;
+                hist_g[g1] += 2;
+                hist_b[b] += 4;
+            }
+        }
+    }
+    return n;
+}
+
+/*
+ * Gather white balance statistics from the sampled quads of a pair of lines,
+ * as the fused kernel demosaics them: each quad makes two pixels of R, G0 and
+ * B and two of R, G1 and B. Reading the few sampled quads from the packed
+ * lines is cheaper than reading the written pixels back. The quads are
+ * gathered AWB_CHUNK at a time and then reduced as in GATHER_AWB_PIXEL by a
+ * loop which is vectorized; the sums of a chunk fit in 32 bits.
+ */
+#define AWB_CHUNK 64
+
+static FUSED_INLINE void gather_awb_quads(struct priv_rpigrafx_awb_stats *st,
+                                          const uint8_t *s0, const uint8_t *s1,
+                                          const int32_t width, const int step,
+                                          const uint8_t *restrict lut_r,
+                                          const uint8_t *restrict lut_g,
+                                          const uint8_t *restrict lut_b,
+                                          const int bx, const int by,
+                                          const int32_t group_pixels,
+                                          const int32_t group_bytes)
+{
+    uint8_t qr[AWB_CHUNK], qg0[AWB_CHUNK], qg1[AWB_CHUNK], qb[AWB_CHUNK],
+            max_r = st->max_r, max_g = st->max_g, max_b = st->max_b;
+    int32_t x = 0;
+
+    while (x < width) {
+        uint32_t sum_r = 0, sum_g = 0, sum_b = 0, n = 0;
+        int num = 0, k;
+
+        for (; x < width && num < AWB_CHUNK; x += 2 * step, num ++) {
+            const int32_t o = x / group_pixels * group_bytes
+                              + x % group_pixels;
+            READ_QUAD(s0, s1, o, bx, by, lut_r, lut_g, lut_b, qr[num],
+                      qg0[num], qg1[num], qb[num]);
+        }
+        for (k = 0; k < num; k ++) {
+            const uint8_t r = qr[k], g0 = qg0[k], g1 = qg1[k], b = qb[k],
+                          ok0 = (r < 255) & (g0 < 255) & (b < 255),
+                          ok1 = (r < 255) & (g1 < 255) & (b < 255),
+                          m0 = -ok0, m1 = -ok1, mr = m0 | m1,
+                          r_ = r & mr, g0_ = g0 & m0, g1_ = g1 & m1,
+                          b_ = b & mr;
+            sum_r += (r & m0) + (r & m1);
+            sum_g += g0_ + g1_;
+            sum_b += (b & m0) + (b & m1);
+            n += ok0 + ok1;
+            max_r = (r_ > max_r) ? r_ : max_r;
+            max_b = (b_ > max_b) ? b_ : max_b;
+            max_g = (g0_ > max_g) ? g0_ : max_g;
+            max_g = (g1_ > max_g) ? g1_ : max_g;
+        }
+        st->sum_r += 2 * sum_r;
+        st->sum_g += 2 * sum_g;
+        st->sum_b += 2 * sum_b;
+        st->num_samples += 2 * n;
+    }
+    st->max_r = max_r;
+    st->max_g = max_g;
+    st->max_b = max_b;
+}
+
+/*
+ * Same as gather_rgb888_pair but from the quads of a pair of lines, as the
+ * fused kernel would demosaic them. num_saturated is the count of the whole
+ * pair from fused_quads, which is used as is on a grid of step 1.
+ */
+static FUSED_INLINE void gather_quads_pair(const struct line_stats *st,
+                                           const uint32_t num_saturated,
+                                           const uint8_t *s0, const uint8_t *s1,
+                                           const int32_t width, const int32_t y,
+                                           const uint8_t *restrict lut_r,
+                                           const uint8_t *restrict lut_g,
+                                           const uint8_t *restrict lut_b,
+                                           const int bx, const int by,
+                                           const int32_t group_pixels,
+                                           const int32_t group_bytes)
+{
+    uint32_t n = 0;
+    int32_t x;
+
+    if (st->num_saturated == NULL || !is_sat_line(st->y0 + y, st->sat_step, 2))
+        return;
+    if (st->sat_step == 1) {
+        *st->num_saturated += num_saturated;
+        return;
+    }
+    for (x = 0; x < width; x += 2 * st->sat_step) {
+        const int32_t o = x / group_pixels * group_bytes + x % group_pixels;
+        uint32_t r, g0, g1, b;
+
+        READ_QUAD(s0, s1, o, bx, by, lut_r, lut_g, lut_b, r, g0, g1, b);
+        n += 4 * (r == 255) + 2 * (g0 == 255) + 2 * (g1 == 255)
+             + 4 * (b == 255);
+    }
+    *st->num_saturated += n;
+}
+
+/* Demosaic the pair of lines y and y + 1 and gather its statistics. */
+static FUSED_INLINE void fused_pair(uint8_t *dst, const int32_t dst_stride,
+                                    const uint8_t *s0, const uint8_t *s1,
+                                    const int32_t width, const int32_t y,
+                                    const uint8_t *restrict lut_r,
+                                    const uint8_t *restrict lut_g,
+                                    const uint8_t *restrict lut_b,
+                                    const _Bool do_hist, uint32_t hist_r[256],
+                                    uint32_t hist_g[256], uint32_t hist_b[256],
+                                    const struct line_stats *stats,
+                                    const struct fused_yuv *yuv,
+                                    const int bx, const int by,
+                                    const int32_t group_pixels,
+                                    const int32_t group_bytes)
+{
+    if (yuv == NULL) {
+        uint8_t *d0 = dst + dst_stride * y, *d1 = d0 + dst_stride;
+        fused_quads(d0, d1, NULL, NULL, s0, s1, width, lut_r, lut_g, lut_b,
+                    do_hist, hist_r, hist_g, hist_b, 0, 0, bx, by,
+                    group_pixels, group_bytes);
+        if (stats != NULL)
+            gather_rgb888_pair(stats, d0, d1, width, y);
+    } else {
+        const struct priv_rpigrafx_raw_job *job = yuv->job;
+        const int32_t p = (yuv->y0 + y) / 2;
+        uint8_t *d0 = job->dst + job->dst_stride * 2 * p,
+                *d1 = d0 + job->dst_stride;
+        const uint32_t n = fused_quads(d0, d1,
+                                job->dst_cb + job->dst_chroma_stride * p,
+                                job->dst_cr + job->dst_chroma_stride * p,
+                                s0, s1, width, lut_r, lut_g, lut_b, do_hist,
+                                hist_r, hist_g, hist_b, !0,
+                                (job->encoding == MMAL_ENCODING_NV12) ? 2 : 1,
+                                bx, by, group_pixels, group_bytes);
+        if (stats != NULL)
+            gather_quads_pair(stats, n, s0, s1, width, y, lut_r, lut_g,
+                              lut_b, bx, by, group_pixels, group_bytes);
+    }
+    if (stats != NULL && stats->awb != NULL
+            && is_sat_line(stats->y0 + y, stats->awb_step, 2))
+        gather_awb_quads(stats->awb, s0, s1, width, stats->awb_step, lut_r,
+                         lut_g, lut_b, bx, by, group_pixels, group_bytes);
+}
+
+/*
+ * Packed RAW10 and RAW12 both start each group of group_pixels pixels with
+ * their upper 8 bits, one byte per pixel, followed by the lower bits. The
+ * fused kernel reads only the upper bytes, so the two formats differ only in
+ * the group geometry. This is inlined with constant geometry and Bayer
+ * pattern for each combination, see fused_kernels.
+ *
+ * Without corrections, BGGR RGB888 output is bit-for-bit the same as the
+ * chain of rpiraw_convert_raw10_to_raw8, rpiraw_raw8bggr_component_gain,
+ * rpiraw_raw8bggr_to_rgb888_nearest_neighbor and
+ * rpiraw_calc_histogram_rgb888, see test_raw_fused.
+ */
+static FUSED_INLINE int fused_to_rgb888(uint8_t *dst, const int32_t dst_stride,
+                                        const uint8_t *src,
+                                        const int32_t src_stride,
+                                        const int32_t width,
+                                        const int32_t height,
+                                        const uint8_t *restrict lut_r,
+                                        const uint8_t *restrict lut_g,
+                                        const uint8_t *restrict lut_b,
+                                        uint32_t hist_r[256],
+                                        uint32_t hist_g[256],
+                                        uint32_t hist_b[256],
+                                        const struct line_stats *stats,
+                                        const struct fused_calib *calib,
+                                        const struct fused_yuv *yuv,
+                                        const int bx, const int by,
+                                        const int32_t group_pixels,
+                                        const int32_t group_bytes)
+{
+    int32_t y;
+    const _Bool do_hist = hist_r != NULL && hist_g != NULL && hist_b != NULL;
+    uint8_t black8 = 0;
+    int ret = 0;
+
+    if (width <= 0 || height <= 0 || width % 2 != 0 || height % 2 != 0) {
+        print_error("Invalid size: %dx%d", width, height);
+        ret = 1;
+        goto end;
+    }
+    if (src_stride < (width + group_pixels - 1) / group_pixels * group_bytes
+            || dst_stride < width * ((yuv != NULL) ? 1 : 3)) {
+        print_error("Stride is too small: src=%d dst=%d",
+                    src_stride, dst_stride);
+        ret = 1;
+        goto end;
+    }
+
+    if (do_hist) {
+        memset(hist_r, 0, sizeof(hist_r[0]) * 256);
+        memset(hist_g, 0, sizeof(hist_g[0]) * 256);
+        memset(hist_b, 0, sizeof(hist_b[0]) * 256);
+    }
+
+    if (calib != NULL && calib->map != NULL)
+        black8 = (calib->map->black + (1u << (calib->map->nbits - 8) >> 1))
+                 >> (calib->map->nbits - 8);
+
+    for (y = 0; y < height; y += 2) {
+        const uint8_t *s0 = src + src_stride * y,
+                      *s1 = src + src_stride * (y + 1);
+
+        if (calib == NULL) {
+            fused_pair(dst, dst_stride, s0, s1, width, y, lut_r, lut_g, lut_b,
+                       do_hist, hist_r, hist_g, hist_b, stats, yuv, bx, by,
+                       group_pixels, group_bytes);
+        } else {
+            prepare_line8(calib, calib->line0, s0, width, calib->y0 + y,
+                          black8, group_pixels, group_bytes);
+            prepare_line8(calib, calib->line1, s1, width, calib->y0 + y + 1,
+                          black8, group_pixels, group_bytes);
+            /* The corrected lines are plain bytes. */
+            fused_pair(dst, dst_stride, calib->line0, calib->line1, width, y,
+                       lut_r, lut_g, lut_b, do_hist, hist_r, hist_g, hist_b,
+                       stats, yuv, bx, by, 2, 2);
+        }
+    }
+
+end:
+    return ret;
+}
+
+/*
+ * fused_to_rgb888 specialized for each Bayer pattern and packing, so that
+ * the per-pixel loops have no branches on them. Indexed by
+ * rpigrafx_bayer_pattern_t and then 0 for RAW10 and 1 for RAW12.
+ */
+typedef int (*fused_kernel_t)(uint8_t *dst, const int32_t dst_stride,
+                              const uint8_t *src, const int32_t src_stride,
+                              const int32_t width, const int32_t height,
+                              const uint8_t *lut_r, const uint8_t *lut_g,
+                              const uint8_t *lut_b, uint32_t hist_r[256],
+                              uint32_t hist_g[256], uint32_t hist_b[256],
+                              const struct line_stats *stats,
+                              const struct fused_calib *calib,
+                              const struct fused_yuv *yuv);
+
+#define DEFINE_FUSED_KERNEL(name, bx, by, group_pixels, group_bytes) \
+    static int name(uint8_t *dst, const int32_t dst_stride, \
+                    const uint8_t *src, const int32_t src_stride, \
+                    const int32_t width, const int32_t height, \
+                    const uint8_t *lut_r, const uint8_t *lut_g, \
+                    const uint8_t *lut_b, uint32_t hist_r[256], \
+                    uint32_t hist_g[256], uint32_t hist_b[256], \
+                    const struct line_stats *stats, \
+                    const struct fused_calib *calib, \
+                    const struct fused_yuv *yuv) \
+    { \
+        return fused_to_rgb888(dst, dst_stride, src, src_stride, width, \
+                               height, lut_r, lut_g, lut_b, hist_r, hist_g, \
+                               hist_b, stats, calib, yuv, bx, by, \
+                               group_pixels, group_bytes); \
+    }
+
+DEFINE_FUSED_KERNEL(fused_raw10_bggr, 0, 0, 4, 5)
+DEFINE_FUSED_KERNEL(fused_raw10_grbg, 0, 1, 4, 5)
+DEFINE_FUSED_KERNEL(fused_raw10_gbrg, 1, 0, 4, 5)
+DEFINE_FUSED_KERNEL(fused_raw10_rggb, 1, 1, 4, 5)
+DEFINE_FUSED_KERNEL(fused_raw12_bggr, 0, 0, 2, 3)
+DEFINE_FUSED_KERNEL(fused_raw12_grbg, 0, 1, 2, 3)
+DEFINE_FUSED_KERNEL(fused_raw12_gbrg, 1, 0, 2, 3)
+DEFINE_FUSED_KERNEL(fused_raw12_rggb, 1, 1, 2, 3)
+
+#undef DEFINE_FUSED_KERNEL
+
+static const fused_kernel_t fused_kernels[4][2] = {
+    [RPIGRAFX_BAYER_PATTERN_BGGR] = {fused_raw10_bggr, fused_raw12_bggr},
+    [RPIGRAFX_BAYER_PATTERN_GRBG] = {fused_raw10_grbg, fused_raw12_grbg},
+    [RPIGRAFX_BAYER_PATTERN_GBRG] = {fused_raw10_gbrg, fused_raw12_gbrg},
+    [RPIGRAFX_BAYER_PATTERN_RGGB] = {fused_raw10_rggb, fused_raw12_rggb},
+};
+
+/*
+ * Generic path.
+ *
+ * Each line of the frame is unpacked into 16-bit samples, tone-mapped and
+ * kept in a ring of RING_LINES lines, which has MARGIN-pixel
+ * mirrored paddings on both sides. This way every packed line is read only
+ * once while demosaicing sees MARGIN lines above and below. Demosaicing
+ * produces planar R, G and B lines, which are then written in the output
+ * format.
+ *
+ * The line functions below are written over pairs of pixels without branches
+ * so that the compiler can vectorize them. A line consists of pairs of a
+ * non-green pixel ("own" color, R or B) and a green pixel; phase is the
+ * position of the non-green pixel in the pair. The other non-green color is
+ * on the lines above and below.
+ */
+
+#define MARGIN 2
+#define RING_LINES 8
+
+struct raw_params {
+    const struct priv_rpigrafx_tone *tone;
+    unsigned out_bits;
+    int32_t maxv;
+    int sat_step, awb_step;
+    /* Position of B in the quads, see bayer_bx and bayer_by. */
+    int bx, by;
+    /*
+     * Whether the calibration of the job, which has no grid, is folded into
+     * luts, which then replace the tone maps, see build_calib_luts.
+     */
+    _Bool calib_in_luts;
+    uint16_t luts[3][1 << PRIV_RPIGRAFX_TONE_MAX_BITS];
+};
+
+static int32_t line_len(const int32_t width)
+{
+    return (width + 2 * MARGIN + 15) & ~15;
+}
+
+/*
+ * Each thread has its own part of the scratch: a header followed by the line
+ * ring, two sets of planar R, G and B lines (the previous one is kept for the
+ * chroma of YUV output) and two more lines: the unpacked samples before the
+ * dynamic defect correction, or the corrected samples of the fused kernel,
+ * which then keeps its uncorrected samples in the ring. Parts are cache-line
+ * aligned.
+ */
+struct raw_thread_scratch {
+    uint32_t hist_r[256], hist_g[256], hist_b[256];
+    uint32_t num_saturated;
+    struct priv_rpigrafx_awb_stats awb;
+    int ret;
+};
+
+#define ALIGN_CACHE_LINE(n) (((n) + 63) & ~(size_t) 63)
+
+static size_t thread_scratch_size(const int32_t width)
+{
+    return ALIGN_CACHE_LINE(sizeof(struct raw_thread_scratch))
+           + ALIGN_CACHE_LINE(sizeof(uint16_t) * (RING_LINES + 8)
+                              * line_len(width));
+}
+
+size_t priv_rpigrafx_raw_scratch_size(const int32_t width,
+                                      const int num_threads)
+{
+    return thread_scratch_size(width) * num_threads;
+}
+
+static void gain_line(uint16_t *restrict line, const int32_t width,
+                      const uint32_t k_even, const uint32_t k_odd,
+                      const uint32_t maxv)
+{
+    int32_t i;
+
+    for (i = 0; i < width / 2; i ++) {
+        const uint32_t v0 = (line[2 * i] * k_even)
+                            >> PRIV_RPIGRAFX_TONE_GAIN_SHIFT,
+                       v1 = (line[2 * i + 1] * k_odd)
+                            >> PRIV_RPIGRAFX_TONE_GAIN_SHIFT;
+        line[2 * i]     = (v0 < maxv) ? v0 : maxv;
+        line[2 * i + 1] = (v1 < maxv) ? v1 : maxv;
+    }
+}
+
+/* Correct line y with the calibration map, blending its gains on the way. */
+static void calib_line(uint16_t *restrict line, const int32_t width,
+                       const struct priv_rpigrafx_calib_map *map,
+                       const int32_t y, const uint16_t maxv)
+{
+    const uint16_t *a, *b;
+    int32_t fy, x;
+
+    priv_rpigrafx_calib_map_rows(map, y, &a, &b, &fy);
+    for (x = 0; x < width; x ++)
+        line[x] = calib_sample(line[x], calib_blend(a[x], b[x], fy),
+                               map->black, maxv);
+}
+
+/*
+ * Replace the defective pixels of line y listed in map with the mean of their
+ * neighbors of the same color. Adjacent defects of the same color are not
+ * told apart.
+ */
+static void correct_defects(uint16_t *line, const int32_t width,
+                            const struct priv_rpigrafx_calib_map *map,
+                            const int32_t y)
+{
+    uint32_t k;
+
+    if (map->defect_x == NULL)
+        return;
+    for (k = map->defect_index[y]; k < map->defect_index[y + 1]; k ++) {
+        const int32_t x = map->defect_x[k];
+        const uint16_t a = line[(x >= 2) ? x - 2 : x + 2],
+                       b = line[(x + 2 < width) ? x + 2 : x - 2];
+        line[x] = (a + b + 1) >> 1;
+    }
+}
+
+/*
+ * Dynamic defective-pixel correction of a line with MARGIN-pixel mirrored
+ * paddings from src into dst. A sample which is above all four of its
+ * neighbors on the line by more than threshold, or below all of them, is
+ * replaced with the median of itself and its two neighbors of the same color,
+ * i.e. the nearer of them. Comparing with the other color too keeps lines of
+ * two pixels wide, whose samples stand out only from their own color.
+ */
+static void dpc_line(uint16_t *restrict dst, const uint16_t *restrict src,
+                     const int32_t width, const uint16_t threshold)
+{
+    int32_t x;
+
+    /* Samples and the threshold are below 4096, so sums stay in 16 bits. */
+    for (x = 0; x < width; x ++) {
+        const uint16_t p = src[x], a = src[x - 2], b = src[x + 2],
+                       c = src[x - 1], d = src[x + 1],
+                       hi = (a > b) ? a : b, lo = (a < b) ? a : b,
+                       chi = (c > d) ? c : d, clo = (c < d) ? c : d,
+                       top = (hi > chi) ? hi : chi,
+                       bottom = (lo < clo) ? lo : clo,
+                       above = top + threshold, p_up = p + threshold;
+        dst[x] = (p > above) ? hi : (p_up < bottom) ? lo : p;
+    }
+}
+
+/*
+ * NEON table lookups only cover tables of up to 64 bytes, so this is scalar.
+ * It is used only when gamma is not 1 or the calibration is in the maps.
+ */
+static void lut_line(uint16_t *restrict line, const int32_t width,
+                     const uint16_t *restrict lut_even,
+                     const uint16_t *restrict lut_odd)
+{
+    int32_t i;
+
+    for (i = 0; i < width / 2; i ++) {
+        line[2 * i]     = lut_even[line[2 * i]];
+        line[2 * i + 1] = lut_odd[line[2 * i + 1]];
+    }
+}
+
+static inline uint16_t clamp_out(const int32_t v, const int32_t maxv)
+{
+    return (v < 0) ? 0 : (v > maxv) ? maxv : v;
+}
+
+static void demosaic_line_nearest(uint16_t *restrict own,
+                                  uint16_t *restrict g,
+                                  uint16_t *restrict other,
+                                  const uint16_t *restrict c,
+                                  const uint16_t *restrict mate,
+                                  const int32_t width, const int phase)
+{
+    int32_t i;
+
+    for (i = 0; i < width / 2; i ++) {
+        const int32_t xo = 2 * i + phase, xg = 2 * i + 1 - phase;
+        const uint16_t vo = c[xo], vg = c[xg], vx = mate[xg];
+        own[xo]   = vo; own[xg]   = vo;
+        g[xo]     = vg; g[xg]     = vg;
+        other[xo] = vx; other[xg] = vx;
+    }
+}
+
+static void demosaic_line_bilinear(uint16_t *restrict own,
+                                   uint16_t *restrict g,
+                                   uint16_t *restrict other,
+                                   const uint16_t *restrict n,
+                                   const uint16_t *restrict c,
+                                   const uint16_t *restrict s,
+                                   const int32_t width, const int phase)
+{
+    int32_t i;
+
+    for (i = 0; i < width / 2; i ++) {
+        const int32_t xo = 2 * i + phase, xg = 2 * i + 1 - phase;
+
+        own[xo]   = c[xo];
+        g[xo]     = (c[xo - 1] + c[xo + 1] + n[xo] + s[xo] + 2) >> 2;
+        other[xo] = (n[xo - 1] + n[xo + 1] + s[xo - 1] + s[xo + 1] + 2) >> 2;
+
+        own[xg]   = (c[xg - 1] + c[xg + 1] + 1) >> 1;
+        g[xg]     = c[xg];
+        other[xg] = (n[xg] + s[xg] + 1) >> 1;
+    }
+}
+
+/*
+ * Gradient-corrected bilinear interpolation by Malvar, He and Cutler,
+ * "High-quality linear interpolation for demosaicing of Bayer-patterned color
+ * images", ICASSP 2004. The 5x5 kernels are scaled by 16.
+ */
+static void demosaic_line_edge_aware(uint16_t *restrict own,
+                                     uint16_t *restrict g,
+                                     uint16_t *restrict other,
+                                     const uint16_t *const restrict l[5],
+                                     const int32_t width, const int phase,
+                                     const int32_t maxv)
+{
+    const uint16_t *restrict n2 = l[0], *restrict n = l[1], *restrict c = l[2],
+                   *restrict s = l[3], *restrict s2 = l[4];
+    int32_t i;
+
+    for (i = 0; i < width / 2; i ++) {
+        const int32_t xo = 2 * i + phase, xg = 2 * i + 1 - phase;
+        int32_t cross, diag, far;
+
+        /* Non-green pixel. */
+        cross = c[xo - 1] + c[xo + 1] + n[xo] + s[xo];
+        diag = n[xo - 1] + n[xo + 1] + s[xo - 1] + s[xo + 1];
+        far = c[xo - 2] + c[xo + 2] + n2[xo] + s2[xo];
+        own[xo]   = c[xo];
+        g[xo]     = clamp_out((8 * c[xo] + 4 * cross - 2 * far + 8) >> 4,
+                              maxv);
+        other[xo] = clamp_out((12 * c[xo] + 4 * diag - 3 * far + 8) >> 4,
+                              maxv);
+
+        /* Green pixel. The own color is on the left and right. */
+        diag = n[xg - 1] + n[xg + 1] + s[xg - 1] + s[xg + 1];
+        own[xg]   = clamp_out((10 * c[xg] + 8 * (c[xg - 1] + c[xg + 1])
+                               - 2 * (c[xg - 2] + c[xg + 2]) - 2 * diag
+                               + n2[xg] + s2[xg] + 8) >> 4, maxv);
+        g[xg]     = c[xg];
+        other[xg] = clamp_out((10 * c[xg] + 8 * (n[xg] + s[xg])
+                               - 2 * (n2[xg] + s2[xg]) - 2 * diag
+                               + c[xg - 2] + c[xg + 2] + 8) >> 4, maxv);
+    }
+}
+
+static void write_line_rgb888(uint8_t *restrict dst,
+                              const uint16_t *restrict r,
+                              const uint16_t *restrict g,
+                              const uint16_t *restrict b,
+                              const int32_t width)
+{
+    int32_t x;
+
+    for (x = 0; x < width; x ++) {
+        dst[3 * x + 0] = r[x];
+        dst[3 * x + 1] = g[x];
+        dst[3 * x + 2] = b[x];
+    }
+}
+
+static void write_line_rgb48(uint16_t *restrict dst,
+                             const uint16_t *restrict r,
+                             const uint16_t *restrict g,
+                             const uint16_t *restrict b,
+                             const int32_t width)
+{
+    int32_t x;
+
+    for (x = 0; x < width; x ++) {
+        dst[3 * x + 0] = r[x];
+        dst[3 * x + 1] = g[x];
+        dst[3 * x + 2] = b[x];
+    }
+}
+
+static void write_line_luma(uint8_t *restrict dst,
+                            const uint16_t *restrict r,
+                            const uint16_t *restrict g,
+                            const uint16_t *restrict b,
+                            const int32_t width)
+{
+    int32_t x;
+
+    for (x = 0; x < width; x ++)
+        dst[x] = rgb_to_y(r[x], g[x], b[x]);
+}
+
+/* Chroma from planar lines q (upper) and p (lower). See write_chroma_rgb888. */
+static inline void write_chroma_planar(uint8_t *restrict cb,
+                                       uint8_t *restrict cr,
+                                       const uint16_t *restrict qr,
+                                       const uint16_t *restrict qg,
+                                       const uint16_t *restrict qb,
+                                       const uint16_t *restrict pr,
+                                       const uint16_t *restrict pg,
+                                       const uint16_t *restrict pb,
+                                       const int32_t width, const int step)
+{
+    int32_t i;
+
+    for (i = 0; i < width / 2; i ++) {
+        const int32_t r = qr[2 * i] + qr[2 * i + 1] + pr[2 * i] + pr[2 * i + 1],
+                      g = qg[2 * i] + qg[2 * i + 1] + pg[2 * i] + pg[2 * i + 1],
+                      b = qb[2 * i] + qb[2 * i + 1] + pb[2 * i] + pb[2 * i + 1];
+        cb[step * i] = rgb4_to_cb(r, g, b);
+        cr[step * i] = rgb4_to_cr(r, g, b);
+    }
+}
+
+/*
+ * Unpack line y into line, correct its defects, correct it with the
+ * calibration and tone-map it. tmp is a line with MARGIN-pixel paddings for
+ * the dynamic defect correction.
+ */
+static void prepare_line(const struct priv_rpigrafx_raw_job *job,
+                         const struct raw_params *params,
+                         uint16_t *line, uint16_t *tmp, int32_t y)
+{
+    const struct priv_rpigrafx_tone *t = params->tone;
+    const int32_t width = job->width, height = job->height;
+    /* Unpack into tmp if the dynamic correction reads it back into line. */
+    uint16_t *raw = (job->dpc_threshold != 0) ? tmp : line;
+    const uint8_t *s;
+    _Bool is_b_line;
+    int phase;
+    int32_t x;
+
+    /* Mirror at the borders keeping the Bayer phase. */
+    if (y < 0)
+        y = -y;
+    else if (y >= height)
+        y = 2 * (height - 1) - y;
+
+    s = job->src + job->src_stride * y;
+    switch (job->nbits) {
+        case 8:
+            for (x = 0; x < width; x ++)
+                raw[x] = s[x];
+            break;
+        case 10:
+            if (job->is_dpcm)
+                priv_rpigrafx_dpcm10_decode_line(raw, s, width);
+            else
+                priv_rpigrafx_unpacker->raw10_to_raw16(raw, s, width);
+            break;
+        case 12:
+            priv_rpigrafx_unpacker->raw12_to_raw16(raw, s, width);
+            break;
+    }
+
+    if (job->calib != NULL)
+        correct_defects(raw, width, job->calib, y);
+    if (job->dpc_threshold != 0) {
+        for (x = 1; x <= MARGIN; x ++) {
+            raw[-x] = raw[x];
+            raw[width - 1 + x] = raw[width - 1 - x];
+        }
+        dpc_line(line, raw, width, job->dpc_threshold);
+    }
+    if (job->calib != NULL && job->calib->has_grid)
+        calib_line(line, width, job->calib, y, (1u << job->nbits) - 1);
+
+    /* Lines of B and G, or of G and R, with B or R at phase in pairs. */
+    is_b_line = (y & 1) == params->by;
+    phase = is_b_line ? params->bx : !params->bx;
+    if (params->calib_in_luts) {
+        const uint16_t *lut = params->luts[is_b_line ? 2 : 0];
+        if (phase == 0)
+            lut_line(line, width, lut, params->luts[1]);
+        else
+            lut_line(line, width, params->luts[1], lut);
+    } else if (t->is_linear) {
+        const uint32_t k = is_b_line ? t->k_b : t->k_r;
+        if (phase == 0)
+            gain_line(line, width, k, t->k_g, t->maxv);
+        else
+            gain_line(line, width, t->k_g, k, t->maxv);
+    } else {
+        const uint16_t *lut = is_b_line ? t->lut_b : t->lut_r;
+        if (phase == 0)
+            lut_line(line, width, lut, t->lut_g);
+        else
+            lut_line(line, width, t->lut_g, lut);
+    }
+
+    for (x = 1; x <= MARGIN; x ++) {
+        line[-x] = line[x];
+        line[width - 1 + x] = line[width - 1 - x];
+    }
+}
+
+/*
+ * Write a line of planar R, G and B in the output encoding and accumulate the
+ * statistics, counting each pixel weight times. q{r,g,b} are the previous
+ * line, of which YUV output takes the chroma on odd lines.
+ */
+static void emit_line(const struct priv_rpigrafx_raw_job *job,
+                      const struct raw_params *params, const int32_t y,
+                      const uint16_t *pr, const uint16_t *pg,
+                      const uint16_t *pb, const uint16_t *qr,
+                      const uint16_t *qg, const uint16_t *qb,
+                      const int32_t width, const int32_t height,
+                      const uint32_t weight)
+{
+    const unsigned hist_shift = params->out_bits - 8;
+    uint8_t *d = job->dst + job->dst_stride * y;
+
+    switch (job->encoding) {
+        case RPIGRAFX_ENCODING_RGB48:
+            write_line_rgb48((uint16_t*) d, pr, pg, pb, width);
+            break;
+        case RPIGRAFX_ENCODING_RGB16P: {
+            const size_t plane = (size_t) job->dst_stride * height;
+            memcpy(d,             pr, width * sizeof(*pr));
+            memcpy(d + plane,     pg, width * sizeof(*pg));
+            memcpy(d + plane * 2, pb, width * sizeof(*pb));
+            break;
+        }
+        case MMAL_ENCODING_I420:
+        case MMAL_ENCODING_NV12: {
+            uint8_t *cb = job->dst_cb + job->dst_chroma_stride * (y / 2),
+                    *cr = job->dst_cr + job->dst_chroma_stride * (y / 2);
+            write_line_luma(d, pr, pg, pb, width);
+            if (y % 2 == 0)
+                break;
+            if (job->encoding == MMAL_ENCODING_NV12)
+                write_chroma_planar(cb, cr, qr, qg, qb, pr, pg, pb, width, 2);
+            else
+                write_chroma_planar(cb, cr, qr, qg, qb, pr, pg, pb, width, 1);
+            break;
+        }
+        default:
+            write_line_rgb888(d, pr, pg, pb, width);
+            break;
+    }
+
+    if (job->num_saturated != NULL
+            && is_sat_line(y, params->sat_step, job->superpixel ? 1 : 2))
+        *job->num_saturated += weight * count_saturated_planar(pr, pg, pb,
+                                               width, params->sat_step,
+                                               job->superpixel ? 1 : 2,
+                                               255 << hist_shift);
+    if (job->awb_stats != NULL
+            && is_sat_line(y, params->awb_step, job->superpixel ? 1 : 2))
+        gather_awb_planar(job->awb_stats, pr, pg, pb, width, params->awb_step,
+                          job->superpixel ? 1 : 2, 255 << hist_shift);
+    if (job->hist_r != NULL && job->hist_g != NULL && job->hist_b != NULL) {
+        int32_t x;
+        for (x = 0; x < width; x ++) {
+            job->hist_r[pr[x] >> hist_shift] += weight;
+            job->hist_g[pg[x] >> hist_shift] += weight;
+            job->hist_b[pb[x] >> hist_shift] += weight;
+        }
+    }
+}
+
+static void process_lines(const struct priv_rpigrafx_raw_job *job,
+                          const struct raw_params *params,
+                          const int32_t y0, const int32_t y1,
+                          uint16_t *scratch)
+{
+    const int32_t width = job->width, ll = line_len(width),
+                  maxv = params->maxv;
+    uint16_t *ring = scratch, *planes = ring + RING_LINES * ll,
+             *tmp = planes + 6 * ll + MARGIN;
+    int32_t y, next = y0 - MARGIN;
+
+#define LINE(y) (ring + ((y) & (RING_LINES - 1)) * ll + MARGIN)
+
+    for (y = y0; y < y1; y ++) {
+        const uint16_t *l[5];
+        /* The own color is B on lines of B at bx, and R at the other x. */
+        const _Bool is_b_line = (y & 1) == params->by;
+        const int phase = is_b_line ? params->bx : !params->bx;
+        /* Planar lines alternate so that the previous one is kept. */
+        uint16_t *pr = planes + (y & 1) * 3 * ll,
+                 *pg = pr + ll,
+                 *pb = pg + ll,
+                 *qr = planes + (~y & 1) * 3 * ll,
+                 *own   = is_b_line ? pb : pr,
+                 *other = is_b_line ? pr : pb;
+        int k;
+
+        for (; next <= y + MARGIN; next ++)
+            prepare_line(job, params, LINE(next), tmp, next);
+        for (k = 0; k < 5; k ++)
+            l[k] = LINE(y - MARGIN + k);
+
+        switch (job->demosaic_mode) {
+            case RPIGRAFX_DEMOSAIC_MODE_NEAREST:
+                demosaic_line_nearest(own, pg, other, l[2],
+                                      (y & 1) ? l[1] : l[3], width, phase);
+                break;
+            case RPIGRAFX_DEMOSAIC_MODE_BILINEAR:
+                demosaic_line_bilinear(own, pg, other, l[1], l[2], l[3],
+                                       width, phase);
+                break;
+            case RPIGRAFX_DEMOSAIC_MODE_EDGE_AWARE:
+                demosaic_line_edge_aware(own, pg, other, l, width, phase,
+                                         maxv);
+                break;
+        }
+
+        emit_line(job, params, y, pr, pg, pb, qr, qr + ll, qr + 2 * ll,
+                  width, job->height, 1);
+    }
+
+#undef LINE
+}
+
+/*
+ * Superpixel demosaicing: each 2x2 Bayer quad becomes one pixel and G is the
+ * mean of the two green samples. lr, lg0, lg1 and lb point to the R, G and B
+ * samples of the first quad.
+ */
+static void demosaic_quads(uint16_t *restrict r, uint16_t *restrict g,
+                           uint16_t *restrict b,
+                           const uint16_t *restrict lr,
+                           const uint16_t *restrict lg0,
+                           const uint16_t *restrict lg1,
+                           const uint16_t *restrict lb,
+                           const int32_t out_width)
+{
+    int32_t i;
+
+    for (i = 0; i < out_width; i ++) {
+        b[i] = lb[2 * i];
+        g[i] = (lg0[2 * i] + lg1[2 * i] + 1) >> 1;
+        r[i] = lr[2 * i];
+    }
+}
+
+/* Produce output lines y0 to y1 (exclusive) of a superpixel job. */
+static void process_superpixel_lines(const struct priv_rpigrafx_raw_job *job,
+                                     const struct raw_params *params,
+                                     const int32_t y0, const int32_t y1,
+                                     uint16_t *scratch)
+{
+    const int32_t out_width = job->width / 2, out_height = job->height / 2,
+                  ll = line_len(job->width);
+    const int bx = params->bx, by = params->by;
+    uint16_t *l0 = scratch + MARGIN,
+             *l1 = l0 + ll,
+             *planes = scratch + RING_LINES * ll,
+             *tmp = planes + 6 * ll + MARGIN;
+    const uint16_t *lr = (by ? l0 : l1) + !bx, *lb = (by ? l1 : l0) + bx;
+    int32_t y;
+
+    for (y = y0; y < y1; y ++) {
+        uint16_t *pr = planes + (y & 1) * 3 * ll,
+                 *qr = planes + (~y & 1) * 3 * ll;
+        prepare_line(job, params, l0, tmp, 2 * y);
+        prepare_line(job, params, l1, tmp, 2 * y + 1);
+        demosaic_quads(pr, pr + ll, pr + 2 * ll, lr, l0 + (bx ^ by ^ 1),
+                       l1 + (bx ^ by), lb, out_width);
+        /* Each output pixel stands for four sensor pixels. */
+        emit_line(job, params, y, pr, pr + ll, pr + 2 * ll, qr, qr + ll,
+                  qr + 2 * ll, out_width, out_height, 4);
+    }
+}
+
+struct raw_run {
+    const struct priv_rpigrafx_raw_job *job;
+    const struct raw_params *params;
+    _Bool use_fused, do_hist;
+    /* dpc_threshold of the job for the 8-bit samples of the fused kernel. */
+    uint8_t dpc_threshold8;
+    /*
+     * Tone maps of the fused kernel: those of params->tone, or luts with the
+     * calibration of the job folded in, see build_fused_luts.
+     */
+    const uint8_t *lut8_r, *lut8_g, *lut8_b;
+    uint8_t luts[3][256];
+    uint8_t *scratch;
+    size_t thread_size;
+};
+
+/*
+ * Fold the black level and the gain of map, which has no grid and so the
+ * same gain everywhere, into the tone maps of the fused kernel, the same as
+ * calib_line8 would do.
+ */
+static void build_fused_luts(struct raw_run *run,
+                             const struct priv_rpigrafx_tone *tone,
+                             const struct priv_rpigrafx_calib_map *map)
+{
+    const unsigned shift = map->nbits - 8;
+    const uint16_t black8 = (map->black + (1u << shift >> 1)) >> shift;
+    int v;
+
+    for (v = 0; v < 256; v ++) {
+        const uint16_t i = calib_sample(v, map->rows[0], black8, 255);
+        run->luts[0][v] = tone->lut8_r[i];
+        run->luts[1][v] = tone->lut8_g[i];
+        run->luts[2][v] = tone->lut8_b[i];
+    }
+    run->lut8_r = run->luts[0];
+    run->lut8_g = run->luts[1];
+    run->lut8_b = run->luts[2];
+}
+
+/*
+ * Same as build_fused_luts for the maps of params, which replace both the
+ * tone maps and calib_line.
+ */
+static void build_calib_luts(struct raw_params *params,
+                             const struct priv_rpigrafx_calib_map *map)
+{
+    const struct priv_rpigrafx_tone *t = params->tone;
+    const uint16_t maxv_in = (1u << map->nbits) - 1;
+    const uint32_t maxv = t->maxv;
+    int32_t v;
+
+    for (v = 0; v <= maxv_in; v ++) {
+        const uint32_t i = calib_sample(v, map->rows[0], map->black, maxv_in);
+        if (t->is_linear) {
+            const uint32_t r = (i * t->k_r) >> PRIV_RPIGRAFX_TONE_GAIN_SHIFT,
+                           g = (i * t->k_g) >> PRIV_RPIGRAFX_TONE_GAIN_SHIFT,
+                           b = (i * t->k_b) >> PRIV_RPIGRAFX_TONE_GAIN_SHIFT;
+            params->luts[0][v] = (r < maxv) ? r : maxv;
+            params->luts[1][v] = (g < maxv) ? g : maxv;
+            params->luts[2][v] = (b < maxv) ? b : maxv;
+        } else {
+            params->luts[0][v] = t->lut_r[i];
+            params->luts[1][v] = t->lut_g[i];
+            params->luts[2][v] = t->lut_b[i];
+        }
+    }
+    params->calib_in_luts = !0;
+}
+
+/*
+ * Process the idx-th of num horizontal bands. Bands start at even lines so
+ * that they keep the Bayer phase, and at even output lines so that YUV output
+ * has whole chroma lines. Demosaicing needs MARGIN lines above and below each
+ * band, which process_lines unpacks again as overlap.
+ */
+static void process_band(void *arg, const int idx, const int num)
+{
+    const struct raw_run *run = arg;
+    const struct priv_rpigrafx_raw_job *job = run->job;
+    struct raw_thread_scratch *ts = (struct raw_thread_scratch*)
+                                    (run->scratch + run->thread_size * idx);
+    uint16_t *lines = (uint16_t*) ((uint8_t*) ts
+                      + ALIGN_CACHE_LINE(sizeof(struct raw_thread_scratch)));
+    const int32_t unit = (job->superpixel && is_yuv_encoding(job->encoding))
+                         ? 4 : 2,
+                  num_units = job->height / unit,
+                  y0 = num_units * idx / num * unit,
+                  y1 = num_units * (idx + 1) / num * unit;
+    struct priv_rpigrafx_raw_job band = *job;
+
+    ts->ret = 0;
+    ts->num_saturated = 0;
+    band.num_saturated = (job->num_saturated != NULL) ? &ts->num_saturated
+                                                      : NULL;
+    priv_rpigrafx_awb_stats_clear(&ts->awb);
+    band.awb_stats = (job->awb_stats != NULL) ? &ts->awb : NULL;
+    if (run->do_hist) {
+        band.hist_r = ts->hist_r;
+        band.hist_g = ts->hist_g;
+        band.hist_b = ts->hist_b;
+        memset(ts->hist_r, 0, sizeof(ts->hist_r));
+        memset(ts->hist_g, 0, sizeof(ts->hist_g));
+        memset(ts->hist_b, 0, sizeof(ts->hist_b));
+    }
+    if (y0 == y1)
+        return;
+
+    if (run->use_fused) {
+        const uint8_t *src = job->src + job->src_stride * y0;
+        uint8_t *dst = job->dst + job->dst_stride * y0;
+        const struct line_stats stats = {
+            .num_saturated = band.num_saturated,
+            .sat_step = run->params->sat_step,
+            .awb = band.awb_stats,
+            .awb_step = run->params->awb_step,
+            .y0 = y0
+        };
+        const int32_t ll = line_len(job->width);
+        const struct fused_calib calib = {
+            .map = job->calib,
+            .dpc_threshold = run->dpc_threshold8,
+            .line0 = (uint8_t*) (lines + (RING_LINES + 6) * ll),
+            .line1 = (uint8_t*) (lines + (RING_LINES + 7) * ll),
+            .tmp = (uint8_t*) lines + MARGIN,
+            .y0 = y0
+        };
+        const struct fused_yuv yuv = {
+            .job = job,
+            .y0 = y0
+        };
+        ts->ret = fused_kernels[job->bayer_pattern][job->nbits == 12](
+                                dst, job->dst_stride, src, job->src_stride,
+                                job->width, y1 - y0, run->lut8_r,
+                                run->lut8_g, run->lut8_b, band.hist_r,
+                                band.hist_g, band.hist_b, &stats,
+                                /* Without a grid it may be all in the maps. */
+                                ((job->calib != NULL
+                                  && (job->calib->has_grid
+                                      || job->calib->defect_x != NULL))
+                                 || job->dpc_threshold != 0) ? &calib : NULL,
+                                is_yuv_encoding(job->encoding) ? &yuv : NULL);
+    } else if (job->superpixel)
+        process_superpixel_lines(&band, run->params, y0 / 2, y1 / 2, lines);
+    else
+        process_lines(&band, run->params, y0, y1, lines);
+}
+
+/*
+ * Process a packed raw frame described by job, splitting it into bands over
+ * the threads of pool, which may be NULL. scratch must be at least
+ * priv_rpigrafx_raw_scratch_size(job->width, number of threads of pool) bytes
+ * and cache-line aligned.
+ */
+int priv_rpigrafx_raw_process(const struct priv_rpigrafx_raw_job *job,
+                              void *scratch, struct priv_rpigrafx_pool *pool)
+{
+    const int num_threads = priv_rpigrafx_pool_num_threads(pool);
+    struct raw_params params;
+    struct priv_rpigrafx_tone tone;
+    struct raw_run run = {
+        .job = job,
+        .params = &params,
+        .do_hist = job->hist_r != NULL && job->hist_g != NULL
+                   && job->hist_b != NULL,
+        .scratch = scratch,
+        .thread_size = thread_scratch_size(job->width)
+    };
+    int i, k;
+    int ret = 0;
+
+    if (job->width < 4 || job->height < 4
+            || job->width % 2 != 0 || job->height % 2 != 0) {
+        print_error("Invalid size: %dx%d", job->width, job->height);
+        ret = 1;
+        goto end;
+    }
+    switch (job->nbits) {
+        case 8: case 10: case 12:
+            break;
+        default:
+            print_error("Unsupported number of bits: %u", job->nbits);
+            ret = 1;
+            goto end;
+    }
+    switch (job->bayer_pattern) {
+        case RPIGRAFX_BAYER_PATTERN_BGGR:
+        case RPIGRAFX_BAYER_PATTERN_GRBG:
+        case RPIGRAFX_BAYER_PATTERN_GBRG:
+        case RPIGRAFX_BAYER_PATTERN_RGGB:
+            break;
+        default:
+            print_error("Unknown Bayer pattern: %d", job->bayer_pattern);
+            ret = 1;
+            goto end;
+    }
+    if (job->is_dpcm && job->nbits != 10) {
+        print_error("DPCM is only for 10 bits, not %u", job->nbits);
+        ret = 1;
+        goto end;
+    }
+    switch (job->encoding) {
+        case MMAL_ENCODING_RGB24:
+            params.out_bits = 8;
+            break;
+        case MMAL_ENCODING_I420:
+        case MMAL_ENCODING_NV12:
+            if (job->superpixel && (job->width % 4 != 0
+                                    || job->height % 4 != 0)) {
+                print_error("Superpixel YUV needs a multiple of 4: %dx%d",
+                            job->width, job->height);
+                ret = 1;
+                goto end;
+            }
+            if (job->dst_cb == NULL || job->dst_cr == NULL) {
+                print_error("Chroma planes are not given");
+                ret = 1;
+                goto end;
+            }
+            params.out_bits = 8;
+            break;
+        case RPIGRAFX_ENCODING_RGB48:
+        case RPIGRAFX_ENCODING_RGB16P:
+            params.out_bits = job->nbits;
+            break;
+        default:
+            print_error("Unsupported encoding: 0x%08x", job->encoding);
+            ret = 1;
+            goto end;
+    }
+
+    /* The fused kernel reads the upper bytes of packed samples in place. */
+    run.use_fused = (job->encoding == MMAL_ENCODING_RGB24
+                     || is_yuv_encoding(job->encoding)) && !job->superpixel
+                    && job->demosaic_mode == RPIGRAFX_DEMOSAIC_MODE_NEAREST
+                    && (job->nbits == 10 || job->nbits == 12)
+                    && !job->is_dpcm;
+
+    if (job->tone == NULL) {
+        priv_rpigrafx_tone_init(&tone);
+        priv_rpigrafx_tone_update(&tone, job->gain_r, job->gain_g,
+                                  job->gain_b, 1, job->nbits,
+                                  params.out_bits);
+        params.tone = &tone;
+    } else if (job->tone->nbits != job->nbits
+               || job->tone->out_bits != params.out_bits) {
+        print_error("Tone maps are for %u to %u bits, not %u to %u",
+                    job->tone->nbits, job->tone->out_bits, job->nbits,
+                    params.out_bits);
+        ret = 1;
+        goto end;
+    } else
+        params.tone = job->tone;
+    if (job->calib != NULL && (job->calib->width != job->width
+                               || job->calib->height != job->height
+                               || job->calib->nbits != job->nbits
+                               || job->calib->bayer_pattern
+                                                    != job->bayer_pattern)) {
+        print_error("Calibration is for %dx%d %u-bit frames of pattern %d",
+                    job->calib->width, job->calib->height, job->calib->nbits,
+                    job->calib->bayer_pattern);
+        ret = 1;
+        goto end;
+    }
+    if (job->dpc_threshold >= (1u << job->nbits)) {
+        print_error("Defect threshold is too high: %u", job->dpc_threshold);
+        ret = 1;
+        goto end;
+    }
+    /* Not rounded down to 0, which would disable the correction. */
+    if (job->dpc_threshold != 0) {
+        const unsigned t8 = job->dpc_threshold >> (job->nbits - 8);
+        run.dpc_threshold8 = (t8 > 0) ? t8 : 1;
+    }
+    run.lut8_r = params.tone->lut8_r;
+    run.lut8_g = params.tone->lut8_g;
+    run.lut8_b = params.tone->lut8_b;
+    params.calib_in_luts = 0;
+    if (job->calib != NULL && !job->calib->has_grid) {
+        if (run.use_fused)
+            build_fused_luts(&run, params.tone, job->calib);
+        else
+            build_calib_luts(&params, job->calib);
+    }
+    params.maxv = (1 << params.out_bits) - 1;
+    params.sat_step = (job->sat_step > 1) ? job->sat_step : 1;
+    params.awb_step = (job->awb_step > 1) ? job->awb_step : 1;
+    params.bx = bayer_bx(job->bayer_pattern);
+    params.by = bayer_by(job->bayer_pattern);
+
+    priv_rpigrafx_pool_run(pool, process_band, &run);
+
+    if (run.do_hist) {
+        memset(job->hist_r, 0, sizeof(job->hist_r[0]) * 256);
+        memset(job->hist_g, 0, sizeof(job->hist_g[0]) * 256);
+        memset(job->hist_b, 0, sizeof(job->hist_b[0]) * 256);
+    }
+    if (job->num_saturated != NULL)
+        *job->num_saturated = 0;
+    if (job->awb_stats != NULL)
+        priv_rpigrafx_awb_stats_clear(job->awb_stats);
+    for (i = 0; i < num_threads; i ++) {
+        const struct raw_thread_scratch *ts = (struct raw_thread_scratch*)
+                                        (run.scratch + run.thread_size * i);
+        ret |= ts->ret;
+        if (job->awb_stats != NULL)
+            priv_rpigrafx_awb_stats_merge(job->awb_stats, &ts->awb);
+        if (job->num_saturated != NULL)
+            *job->num_saturated += ts->num_saturated
+                                   * params.sat_step * params.sat_step;
+        if (!run.do_hist)
+            continue;
+        for (k = 0; k < 256; k ++) {
+            job->hist_r[k] += ts->hist_r[k];
+            job->hist_g[k] += ts->hist_g[k];
+            job->hist_b[k] += ts->hist_b[k];
+        }
+    }
+
+end:
+    return ret;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <math.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Tone mapping of raw samples: per-channel gain, clamping and gamma.
+ *
+ * Building the tables costs a powf per entry, so they are kept with the
+ * parameters they were built for and rebuilt only when those change.
+ */
+
+void priv_rpigrafx_tone_init(struct priv_rpigrafx_tone *tone)
+{
+    tone->is_built = 0;
+    tone->num_builds = 0;
+}
+
+uint32_t priv_rpigrafx_tone_gain_to_fixed(const float gain,
+                                          const unsigned nbits,
+                                          const unsigned out_bits)
+{
+    /* Keep in * k within 32 bits. */
+    const float max_k = (float) (UINT32_MAX >> nbits);
+    const float k = gain * (float) (1 << PRIV_RPIGRAFX_TONE_GAIN_SHIFT)
+                    * (float) (1 << out_bits) / (float) (1 << nbits);
+
+    if (!(k > 0))
+        return 0;
+    if (k >= max_k)
+        return UINT32_MAX >> nbits;
+    return k + 0.5f;
+}
+
+/* Apply gamma to a linear value in [0, maxv]. */
+static float apply_gamma(const float v, const float maxv, const float gamma)
+{
+    if (gamma == 1)
+        return v;
+    return maxv * powf(v / maxv, 1 / gamma);
+}
+
+/*
+ * The 8-bit tables of the fused kernel truncate linear values, which is what
+ * rpiraw_raw8bggr_component_gain does.
+ */
+static void build_lut8(uint8_t lut[256], const float gain, const float gamma)
+{
+    int i;
+
+    for (i = 0; i < 256; i ++) {
+        float v = i * gain;
+        v = (v >= 255) ? 255 : v;
+        lut[i] = (gamma == 1) ? (uint8_t) v
+                              : (uint8_t) (apply_gamma(v, 255, gamma) + 0.5f);
+    }
+}
+
+/*
+ * Gamma is applied to the gained value before it is quantized, so that the
+ * dark end keeps the precision of the input.
+ */
+static void build_lut16(uint16_t *lut, const uint32_t k, const unsigned nbits,
+                        const int32_t maxv, const float gamma)
+{
+    const float scale = 1.0f / (1 << PRIV_RPIGRAFX_TONE_GAIN_SHIFT);
+    int32_t i;
+
+    for (i = 0; i < (1 << nbits); i ++) {
+        float v = (float) i * k * scale;
+        v = (v >= maxv) ? maxv : v;
+        lut[i] = apply_gamma(v, maxv, gamma) + 0.5f;
+    }
+}
+
+_Bool priv_rpigrafx_tone_update(struct priv_rpigrafx_tone *tone,
+                                const float gain_r, const float gain_g,
+                                const float gain_b, const float gamma,
+                                const unsigned nbits, const unsigned out_bits)
+{
+    if (tone->is_built && tone->gain_r == gain_r && tone->gain_g == gain_g
+            && tone->gain_b == gain_b && tone->gamma == gamma
+            && tone->nbits == nbits && tone->out_bits == out_bits)
+        return 0;
+
+    tone->gain_r = gain_r;
+    tone->gain_g = gain_g;
+    tone->gain_b = gain_b;
+    tone->gamma = gamma;
+    tone->nbits = nbits;
+    tone->out_bits = out_bits;
+    tone->is_linear = gamma == 1;
+    tone->maxv = (1 << out_bits) - 1;
+    tone->k_r = priv_rpigrafx_tone_gain_to_fixed(gain_r, nbits, out_bits);
+    tone->k_g = priv_rpigrafx_tone_gain_to_fixed(gain_g, nbits, out_bits);
+    tone->k_b = priv_rpigrafx_tone_gain_to_fixed(gain_b, nbits, out_bits);
+
+    build_lut8(tone->lut8_r, gain_r, gamma);
+    build_lut8(tone->lut8_g, gain_g, gamma);
+    build_lut8(tone->lut8_b, gain_b, gamma);
+    if (!tone->is_linear) {
+        build_lut16(tone->lut_r, tone->k_r, nbits, tone->maxv, gamma);
+        build_lut16(tone->lut_g, tone->k_g, nbits, tone->maxv, gamma);
+        build_lut16(tone->lut_b, tone->k_b, nbits, tone->maxv, gamma);
+    }
+
+    tone->is_built = !0;
+    tone->num_builds ++;
+    return !0;
+}
@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+/*
+ * Control thread of the sensor.
+ *
+ * The tuner and manual settings write sensor registers over I2C, which takes
+ * long enough to delay frames if it is done between them. Instead the thread
+ * processing frames posts the statistics of each frame here without waiting,
+ * and this thread runs the tuner on the newest statistics which are due, and
+ * writes manual settings when they change. The sensor is abstracted by
+ * priv_rpigrafx_tuner_ops so that this can be tested without it.
+ *
+ * Statistics are due every interval frames, or earlier if the number of
+ * saturated samples changes by more than change of that of the last run.
+ * The settings of a run reach the sensor a frame or two later, and frames
+ * exposed before that would make the tuner overshoot. So if the sensor
+ * reports its state, no statistics are due until it reports a change of
+ * exposure or gain, or MAX_SETTLE_FRAMES frames pass without one.
+ */
+
+#define MAX_SETTLE_FRAMES 3
+/* Changes of fewer saturated samples than this are never significant. */
+#define MIN_SATURATED_CHANGE 16
+
+struct priv_rpigrafx_tuner {
+    const struct priv_rpigrafx_tuner_ops *ops;
+    void *user;
+    pthread_t thread;
+
+    /* Protects the members below and whatever the ops share with users. */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    _Bool quit, is_running;
+    int ret;
+    _Bool is_enabled;
+    int interval;
+    float change;
+    _Bool is_update_pending, is_stats_pending;
+    struct priv_rpigrafx_tuner_stats pending;
+    double pending_time;
+    /* Statistics of the last run, and frames posted since. */
+    _Bool has_last;
+    struct priv_rpigrafx_tuner_stats last;
+    int num_frames_since;
+    uint64_t num_runs;
+    float latency_us, max_latency_us;
+};
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void* tuner_main(void *arg)
+{
+    struct priv_rpigrafx_tuner *tn = arg;
+    const struct priv_rpigrafx_tuner_ops *ops = tn->ops;
+    int ret = 0;
+
+    for (; ; ) {
+        struct priv_rpigrafx_tuner_stats stats;
+        _Bool is_update, is_stats;
+        double posted;
+
+        pthread_mutex_lock(&tn->mutex);
+        while (!tn->quit && !tn->is_update_pending && !tn->is_stats_pending)
+            pthread_cond_wait(&tn->cond, &tn->mutex);
+        if (tn->quit) {
+            pthread_mutex_unlock(&tn->mutex);
+            break;
+        }
+        is_update = tn->is_update_pending;
+        is_stats = tn->is_stats_pending;
+        memcpy(&stats, &tn->pending, sizeof(stats));
+        posted = tn->pending_time;
+        tn->is_update_pending = tn->is_stats_pending = 0;
+        pthread_mutex_unlock(&tn->mutex);
+
+        if (is_update && (ret = ops->update(tn->user)))
+            break;
+        if (is_stats) {
+            float latency_us;
+
+            if ((ret = ops->tune(tn->user, &stats)))
+                break;
+            latency_us = (get_time() - posted) * 1e6;
+            pthread_mutex_lock(&tn->mutex);
+            tn->num_runs ++;
+            tn->latency_us = latency_us;
+            if (latency_us > tn->max_latency_us)
+                tn->max_latency_us = latency_us;
+            pthread_mutex_unlock(&tn->mutex);
+        }
+    }
+
+    pthread_mutex_lock(&tn->mutex);
+    tn->ret = ret;
+    tn->is_running = 0;
+    pthread_mutex_unlock(&tn->mutex);
+    if (ret)
+        print_error("Tuner stopped: %d", ret);
+
+    return NULL;
+}
+
+int priv_rpigrafx_tuner_create(struct priv_rpigrafx_tuner **tnp,
+                               const struct priv_rpigrafx_tuner_ops *ops,
+                               void *user,
+                               const int interval, const float change)
+{
+    struct priv_rpigrafx_tuner *tn = NULL;
+    int reti;
+    int ret = 0;
+
+    tn = calloc(1, sizeof(*tn));
+    if (tn == NULL) {
+        print_error("Failed to allocate tuner");
+        ret = 1;
+        goto end;
+    }
+    tn->ops = ops;
+    tn->user = user;
+    tn->is_running = !0;
+    tn->is_enabled = !0;
+    tn->interval = interval;
+    tn->change = change;
+    pthread_mutex_init(&tn->mutex, NULL);
+    pthread_cond_init(&tn->cond, NULL);
+
+    /* The ops may use *tnp, e.g. for priv_rpigrafx_tuner_lock. */
+    *tnp = tn;
+    reti = pthread_create(&tn->thread, NULL, tuner_main, tn);
+    if (reti) {
+        print_error("Failed to create tuner thread: %s", strerror(reti));
+        pthread_cond_destroy(&tn->cond);
+        pthread_mutex_destroy(&tn->mutex);
+        free(tn);
+        tn = NULL;
+        ret = 1;
+        goto end;
+    }
+
+end:
+    *tnp = tn;
+    return ret;
+}
+
+/* Stop the thread after the run in progress, if any, and free tn. */
+void priv_rpigrafx_tuner_destroy(struct priv_rpigrafx_tuner *tn)
+{
+    if (tn == NULL)
+        return;
+
+    pthread_mutex_lock(&tn->mutex);
+    tn->quit = !0;
+    pthread_cond_signal(&tn->cond);
+    pthread_mutex_unlock(&tn->mutex);
+    pthread_join(tn->thread, NULL);
+    pthread_cond_destroy(&tn->cond);
+    pthread_mutex_destroy(&tn->mutex);
+    free(tn);
+}
+
+/* Return non-zero if the thread has stopped because of an error. */
+int priv_rpigrafx_tuner_status(struct priv_rpigrafx_tuner *tn)
+{
+    int ret;
+
+    if (tn == NULL)
+        return 0;
+    pthread_mutex_lock(&tn->mutex);
+    ret = tn->is_running ? 0 : (tn->ret ? tn->ret : 1);
+    pthread_mutex_unlock(&tn->mutex);
+    return ret;
+}
+
+void priv_rpigrafx_tuner_set_cadence(struct priv_rpigrafx_tuner *tn,
+                                     const int interval, const float change)
+{
+    if (tn == NULL)
+        return;
+    pthread_mutex_lock(&tn->mutex);
+    tn->interval = interval;
+    tn->change = change;
+    pthread_mutex_unlock(&tn->mutex);
+}
+
+/* Whether stats are due for a run. Called with the lock held. */
+static _Bool is_due(const struct priv_rpigrafx_tuner *tn,
+                    const struct priv_rpigrafx_tuner_stats *stats)
+{
+    const rpigrafx_rawcam_metadata_t *md = &stats->metadata,
+                                     *last_md = &tn->last.metadata;
+    int64_t diff, min_diff;
+
+    if (!tn->has_last)
+        return !0;
+    if (md->is_valid && last_md->is_valid
+            && md->exposure_us == last_md->exposure_us
+            && md->analog_gain == last_md->analog_gain
+            && md->digital_gain == last_md->digital_gain
+            && tn->num_frames_since <= MAX_SETTLE_FRAMES)
+        return 0;
+    if (tn->num_frames_since >= tn->interval)
+        return !0;
+    if (tn->change <= 0)
+        return 0;
+    diff = (int64_t) stats->num_saturated - tn->last.num_saturated;
+    min_diff = tn->change * tn->last.num_saturated;
+    if (min_diff < MIN_SATURATED_CHANGE)
+        min_diff = MIN_SATURATED_CHANGE;
+    return diff > min_diff || -diff > min_diff;
+}
+
+void priv_rpigrafx_tuner_post(struct priv_rpigrafx_tuner *tn,
+                              const struct priv_rpigrafx_tuner_stats *stats)
+{
+    if (tn == NULL)
+        return;
+
+    pthread_mutex_lock(&tn->mutex);
+    tn->num_frames_since ++;
+    if (tn->is_enabled && is_due(tn, stats)) {
+        /* Replaces older statistics which the thread has not taken yet. */
+        memcpy(&tn->pending, stats, sizeof(tn->pending));
+        tn->pending_time = get_time();
+        tn->is_stats_pending = !0;
+        memcpy(&tn->last, stats, sizeof(tn->last));
+        tn->has_last = !0;
+        tn->num_frames_since = 0;
+        pthread_cond_signal(&tn->cond);
+    }
+    pthread_mutex_unlock(&tn->mutex);
+}
+
+/*
+ * Make the thread call ops->update, and run the tuner only if is_enabled.
+ * Statistics posted while it is disabled are dropped.
+ */
+void priv_rpigrafx_tuner_update(struct priv_rpigrafx_tuner *tn,
+                                const _Bool is_enabled)
+{
+    if (tn == NULL)
+        return;
+
+    pthread_mutex_lock(&tn->mutex);
+    tn->is_enabled = is_enabled;
+    if (!is_enabled)
+        tn->is_stats_pending = 0;
+    tn->is_update_pending = !0;
+    pthread_cond_signal(&tn->cond);
+    pthread_mutex_unlock(&tn->mutex);
+}
+
+void priv_rpigrafx_tuner_get_stats(struct priv_rpigrafx_tuner *tn,
+                                   uint64_t *num_runsp, float *latency_usp,
+                                   float *max_latency_usp)
+{
+    if (tn == NULL) {
+        *num_runsp = 0;
+        *latency_usp = *max_latency_usp = 0;
+        return;
+    }
+    pthread_mutex_lock(&tn->mutex);
+    *num_runsp = tn->num_runs;
+    *latency_usp = tn->latency_us;
+    *max_latency_usp = tn->max_latency_us;
+    pthread_mutex_unlock(&tn->mutex);
+}
+
+/*
+ * Serialize access to state which the ops share with users, such as manual
+ * settings. tn may be NULL, in which case these do nothing.
+ */
+void priv_rpigrafx_tuner_lock(struct priv_rpigrafx_tuner *tn)
+{
+    if (tn != NULL)
+        pthread_mutex_lock(&tn->mutex);
+}
+
+void priv_rpigrafx_tuner_unlock(struct priv_rpigrafx_tuner *tn)
+{
+    if (tn != NULL)
+        pthread_mutex_unlock(&tn->mutex);
+}
@@ -0,0 +1,501 @@
+/*
+ * Copyright (c) 2017 Sugizaki Yukimasa (ysugi@idein.jp)
+ * All rights reserved.
+ *
+ * This software is licensed under a Modified (3-Clause) BSD License.
+ * You should have received a copy of this license along with this
+ * software. If not, contact the copyright holder above.
+ */
+
+#include <stdint.h>
+#include "rpigrafx.h"
+#include "local.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_UNPACK_NEON 1
+#include <arm_neon.h>
+#if defined(__linux__) && !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif /* defined(__ARM_NEON) || defined(__ARM_NEON__) */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_UNPACK_X86 1
+#include <immintrin.h>
+#endif /* defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) */
+
+/*
+ * Unpackers of MIPI CSI-2 packed raw lines.
+ *
+ * RAW10: 4 pixels in 5 bytes. Bytes 0-3 are the upper 8 bits of pixels 0-3 and
+ *        byte 4 holds the lower 2 bits of them from LSB.
+ * RAW12: 2 pixels in 3 bytes. Bytes 0-1 are the upper 8 bits of pixels 0-1 and
+ *        byte 2 holds the lower 4 bits of them from LSB.
+ *
+ * The 8-bit outputs are the upper 8 bits. The 16-bit outputs are not shifted,
+ * i.e. they are in [0, 1023] or [0, 4095].
+ *
+ * A line of src must hold whole groups, i.e. (width + 3) / 4 * 5 bytes for
+ * RAW10 and (width + 1) / 2 * 3 bytes for RAW12. Vectorized variants only read
+ * within them and fall back to the scalar code for the rest of the line.
+ */
+
+#define RAW10_BYTES(width) (((width) + 3) / 4 * 5)
+#define RAW12_BYTES(width) (((width) + 1) / 2 * 3)
+
+
+static void raw10_to_raw8_scalar_from(uint8_t *dst, const uint8_t *src,
+                                      int32_t x, const int32_t width)
+{
+    for (; x < width; x ++)
+        dst[x] = src[x / 4 * 5 + x % 4];
+}
+
+static void raw10_to_raw16_scalar_from(uint16_t *dst, const uint8_t *src,
+                                       int32_t x, const int32_t width)
+{
+    for (; x < width; x ++) {
+        const uint8_t *g = src + x / 4 * 5;
+        dst[x] = (g[x % 4] << 2) | ((g[4] >> (x % 4 * 2)) & 3);
+    }
+}
+
+static void raw12_to_raw8_scalar_from(uint8_t *dst, const uint8_t *src,
+                                      int32_t x, const int32_t width)
+{
+    for (; x < width; x ++)
+        dst[x] = src[x / 2 * 3 + x % 2];
+}
+
+static void raw12_to_raw16_scalar_from(uint16_t *dst, const uint8_t *src,
+                                       int32_t x, const int32_t width)
+{
+    for (; x < width; x ++) {
+        const uint8_t *g = src + x / 2 * 3;
+        dst[x] = (g[x % 2] << 4) | ((g[2] >> (x % 2 * 4)) & 0xf);
+    }
+}
+
+static void raw10_to_raw8_scalar(uint8_t *dst, const uint8_t *src,
+                                 const int32_t width)
+{
+    raw10_to_raw8_scalar_from(dst, src, 0, width);
+}
+
+static void raw10_to_raw16_scalar(uint16_t *dst, const uint8_t *src,
+                                  const int32_t width)
+{
+    raw10_to_raw16_scalar_from(dst, src, 0, width);
+}
+
+static void raw12_to_raw8_scalar(uint8_t *dst, const uint8_t *src,
+                                 const int32_t width)
+{
+    raw12_to_raw8_scalar_from(dst, src, 0, width);
+}
+
+static void raw12_to_raw16_scalar(uint16_t *dst, const uint8_t *src,
+                                  const int32_t width)
+{
+    raw12_to_raw16_scalar_from(dst, src, 0, width);
+}
+
+static const struct priv_rpigrafx_unpacker unpacker_scalar = {
+    .name = "scalar",
+    .raw10_to_raw8  = raw10_to_raw8_scalar,
+    .raw10_to_raw16 = raw10_to_raw16_scalar,
+    .raw12_to_raw8  = raw12_to_raw8_scalar,
+    .raw12_to_raw16 = raw12_to_raw16_scalar
+};
+
+
+#ifdef HAVE_UNPACK_NEON
+
+static void raw10_to_raw8_neon(uint8_t *dst, const uint8_t *src,
+                               const int32_t width)
+{
+    static const uint8_t idx[16] = {
+        0, 1, 2, 3, 5, 6, 7, 8, 10, 11, 12, 13, 15, 16, 17, 18
+    };
+    const uint8x8_t idx_lo = vld1_u8(idx), idx_hi = vld1_u8(idx + 8);
+    const int32_t nbytes = RAW10_BYTES(width);
+    int32_t x;
+
+    /* 16 pixels (20 bytes) per iteration, but 24 bytes are loaded. */
+    for (x = 0; x + 16 <= width && x / 4 * 5 + 24 <= nbytes; x += 16) {
+        const uint8_t *s = src + x / 4 * 5;
+        uint8x8x3_t v;
+        v.val[0] = vld1_u8(s);
+        v.val[1] = vld1_u8(s + 8);
+        v.val[2] = vld1_u8(s + 16);
+        vst1q_u8(dst + x, vcombine_u8(vtbl3_u8(v, idx_lo),
+                                      vtbl3_u8(v, idx_hi)));
+    }
+    raw10_to_raw8_scalar_from(dst, src, x, width);
+}
+
+static void raw10_to_raw16_neon(uint16_t *dst, const uint8_t *src,
+                                const int32_t width)
+{
+    static const uint8_t idx[16] = {
+        0, 1, 2, 3, 5, 6, 7, 8, 10, 11, 12, 13, 15, 16, 17, 18
+    };
+    static const uint8_t idx_low[16] = {
+        4, 4, 4, 4, 9, 9, 9, 9, 14, 14, 14, 14, 19, 19, 19, 19
+    };
+    static const int16_t shifts[8] = {0, -2, -4, -6, 0, -2, -4, -6};
+    const uint8x8_t idx_lo = vld1_u8(idx), idx_hi = vld1_u8(idx + 8),
+                    idx_low_lo = vld1_u8(idx_low),
+                    idx_low_hi = vld1_u8(idx_low + 8);
+    const int16x8_t shift = vld1q_s16(shifts);
+    const uint16x8_t mask = vdupq_n_u16(3);
+    const int32_t nbytes = RAW10_BYTES(width);
+    int32_t x;
+
+    for (x = 0; x + 16 <= width && x / 4 * 5 + 24 <= nbytes; x += 16) {
+        const uint8_t *s = src + x / 4 * 5;
+        uint8x8x3_t v;
+        uint16x8_t hi0, hi1, lo0, lo1;
+        v.val[0] = vld1_u8(s);
+        v.val[1] = vld1_u8(s + 8);
+        v.val[2] = vld1_u8(s + 16);
+        hi0 = vshll_n_u8(vtbl3_u8(v, idx_lo), 2);
+        hi1 = vshll_n_u8(vtbl3_u8(v, idx_hi), 2);
+        lo0 = vmovl_u8(vtbl3_u8(v, idx_low_lo));
+        lo1 = vmovl_u8(vtbl3_u8(v, idx_low_hi));
+        lo0 = vandq_u16(vshlq_u16(lo0, shift), mask);
+        lo1 = vandq_u16(vshlq_u16(lo1, shift), mask);
+        vst1q_u16(dst + x,     vorrq_u16(hi0, lo0));
+        vst1q_u16(dst + x + 8, vorrq_u16(hi1, lo1));
+    }
+    raw10_to_raw16_scalar_from(dst, src, x, width);
+}
+
+static void raw12_to_raw8_neon(uint8_t *dst, const uint8_t *src,
+                               const int32_t width)
+{
+    const int32_t nbytes = RAW12_BYTES(width);
+    int32_t x;
+
+    /* 16 pixels (24 bytes) per iteration. */
+    for (x = 0; x + 16 <= width && x / 2 * 3 + 24 <= nbytes; x += 16) {
+        const uint8x8x3_t v = vld3_u8(src + x / 2 * 3);
+        uint8x8x2_t w;
+        w.val[0] = v.val[0];
+        w.val[1] = v.val[1];
+        vst2_u8(dst + x, w);
+    }
+    raw12_to_raw8_scalar_from(dst, src, x, width);
+}
+
+static void raw12_to_raw16_neon(uint16_t *dst, const uint8_t *src,
+                                const int32_t width)
+{
+    const uint16x8_t mask = vdupq_n_u16(0xf);
+    const int32_t nbytes = RAW12_BYTES(width);
+    int32_t x;
+
+    for (x = 0; x + 16 <= width && x / 2 * 3 + 24 <= nbytes; x += 16) {
+        const uint8x8x3_t v = vld3_u8(src + x / 2 * 3);
+        const uint16x8_t low = vmovl_u8(v.val[2]);
+        uint16x8x2_t w;
+        w.val[0] = vorrq_u16(vshll_n_u8(v.val[0], 4), vandq_u16(low, mask));
+        w.val[1] = vorrq_u16(vshll_n_u8(v.val[1], 4), vshrq_n_u16(low, 4));
+        vst2q_u16(dst + x, w);
+    }
+    raw12_to_raw16_scalar_from(dst, src, x, width);
+}
+
+static const struct priv_rpigrafx_unpacker unpacker_neon = {
+    .name = "neon",
+    .raw10_to_raw8  = raw10_to_raw8_neon,
+    .raw10_to_raw16 = raw10_to_raw16_neon,
+    .raw12_to_raw8  = raw12_to_raw8_neon,
+    .raw12_to_raw16 = raw12_to_raw16_neon
+};
+
+static _Bool cpu_has_neon()
+{
+#if defined(__linux__) && !defined(__aarch64__)
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+    return !0;
+#endif
+}
+
+#endif /* HAVE_UNPACK_NEON */
+
+
+#ifdef HAVE_UNPACK_X86
+
+/*
+ * The shuffles below work on 16-byte loads. For RAW10 a load at group g gives
+ * pixels of groups g and g + 1, and for RAW12 of groups g to g + 3.
+ */
+
+#define RAW10_SHUF8 \
+    _mm_setr_epi8(0, 1, 2, 3, 5, 6, 7, 8, -1, -1, -1, -1, -1, -1, -1, -1)
+/* Upper bits to the high byte and lower bits to the low byte of each pixel. */
+#define RAW10_SHUF16 \
+    _mm_setr_epi8(4, 0, 4, 1, 4, 2, 4, 3, 9, 5, 9, 6, 9, 7, 9, 8)
+#define RAW12_SHUF8 \
+    _mm_setr_epi8(0, 1, 3, 4, 6, 7, 9, 10, -1, -1, -1, -1, -1, -1, -1, -1)
+#define RAW12_SHUF16 \
+    _mm_setr_epi8(2, 0, 2, 1, 5, 3, 5, 4, 8, 6, 8, 7, 11, 9, 11, 10)
+
+__attribute__((target("ssse3")))
+static inline __m128i raw10_16_ssse3(const __m128i v)
+{
+    /* Move lower bits of pixel i to bit 7:6 of the low byte. */
+    const __m128i mul = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1);
+    const __m128i w = _mm_shuffle_epi8(v, RAW10_SHUF16);
+    const __m128i lo = _mm_and_si128(_mm_mullo_epi16(w, mul),
+                                     _mm_set1_epi16(0xc0));
+    const __m128i hi = _mm_and_si128(w, _mm_set1_epi16((short) 0xff00));
+    return _mm_srli_epi16(_mm_or_si128(hi, lo), 6);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i raw12_16_ssse3(const __m128i v)
+{
+    const __m128i w = _mm_shuffle_epi8(v, RAW12_SHUF16);
+    const __m128i a = _mm_srli_epi16(w, 4);
+    return _mm_or_si128(_mm_and_si128(a,
+                            _mm_setr_epi16(0xff0, 0xfff, 0xff0, 0xfff,
+                                           0xff0, 0xfff, 0xff0, 0xfff)),
+                        _mm_and_si128(w,
+                            _mm_setr_epi16(0xf, 0, 0xf, 0, 0xf, 0, 0xf, 0)));
+}
+
+__attribute__((target("ssse3")))
+static void raw10_to_raw8_ssse3(uint8_t *dst, const uint8_t *src,
+                                const int32_t width)
+{
+    const int32_t nbytes = RAW10_BYTES(width);
+    int32_t x;
+
+    for (x = 0; x + 16 <= width && x / 4 * 5 + 26 <= nbytes; x += 16) {
+        const uint8_t *s = src + x / 4 * 5;
+        const __m128i a = _mm_loadu_si128((const __m128i*) s),
+                      b = _mm_loadu_si128((const __m128i*) (s + 10));
+        _mm_storeu_si128((__m128i*) (dst + x),
+                         _mm_unpacklo_epi64(_mm_shuffle_epi8(a, RAW10_SHUF8),
+                                            _mm_shuffle_epi8(b, RAW10_SHUF8)));
+    }
+    raw10_to_raw8_scalar_from(dst, src, x, width);
+}
+
+__attribute__((target("ssse3")))
+static void raw10_to_raw16_ssse3(uint16_t *dst, const uint8_t *src,
+                                 const int32_t width)
+{
+    const int32_t nbytes = RAW10_BYTES(width);
+    int32_t x;
+
+    for (x = 0; x + 8 <= width && x / 4 * 5 + 16 <= nbytes; x += 8) {
+        const __m128i v = _mm_loadu_si128((const __m128i*) (src + x / 4 * 5));
+        _mm_storeu_si128((__m128i*) (dst + x), raw10_16_ssse3(v));
+    }
+    raw10_to_raw16_scalar_from(dst, src, x, width);
+}
+
+__attribute__((target("ssse3")))
+static void raw12_to_raw8_ssse3(uint8_t *dst, const uint8_t *src,
+                                const int32_t width)
+{
+    const int32_t nbytes = RAW12_BYTES(width);
+    int32_t x;
+
+    for (x = 0; x + 16 <= width && x / 2 * 3 + 28 <= nbytes; x += 16) {
+        const uint8_t *s = src + x / 2 * 3;
+        const __m128i a = _mm_loadu_si128((const __m128i*) s),
+                      b = _mm_loadu_si128((const __m128i*) (s + 12));
+        _mm_storeu_si128((__m128i*) (dst + x),
+                         _mm_unpacklo_epi64(_mm_shuffle_epi8(a, RAW12_SHUF8),
+                                            _mm_shuffle_epi8(b, RAW12_SHUF8)));
+    }
+    raw12_to_raw8_scalar_from(dst, src, x, width);
+}
+
+__attribute__((target("ssse3")))
+static void raw12_to_raw16_ssse3(uint16_t *dst, const uint8_t *src,
+                                 const int32_t width)
+{
+    const int32_t nbytes = RAW12_BYTES(width);
+    int32_t x;
+
+    for (x = 0; x + 8 <= width && x / 2 * 3 + 16 <= nbytes; x += 8) {
+        const __m128i v = _mm_loadu_si128((const __m128i*) (src + x / 2 * 3));
+        _mm_storeu_si128((__m128i*) (dst + x), raw12_16_ssse3(v));
+    }
+    raw12_to_raw16_scalar_from(dst, src, x, width);
+}
+
+static const struct priv_rpigrafx_unpacker unpacker_ssse3 = {
+    .name = "ssse3",
+    .raw10_to_raw8  = raw10_to_raw8_ssse3,
+    .raw10_to_raw16 = raw10_to_raw16_ssse3,
+    .raw12_to_raw8  = raw12_to_raw8_ssse3,
+    .raw12_to_raw16 = raw12_to_raw16_ssse3
+};
+
+/* Load two 16-byte chunks into the two 128-bit lanes. */
+__attribute__((target("avx2")))
+static inline __m256i load2_avx2(const uint8_t *lo, const uint8_t *hi)
+{
+    return _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) lo)),
+                _mm_loadu_si128((const __m128i*) hi), 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i shuf8_avx2(const uint8_t *s, const int32_t step,
+                                 const __m128i shuf)
+{
+    const __m256i m = _mm256_broadcastsi128_si256(shuf);
+    const __m256i a = _mm256_shuffle_epi8(load2_avx2(s, s + step), m),
+                  b = _mm256_shuffle_epi8(load2_avx2(s + step * 2,
+                                                     s + step * 3), m);
+    return _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b),
+                                    _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+__attribute__((target("avx2")))
+static void raw10_to_raw8_avx2(uint8_t *dst, const uint8_t *src,
+                               const int32_t width)
+{
+    const int32_t nbytes = RAW10_BYTES(width);
+    int32_t x;
+
+    for (x = 0; x + 32 <= width && x / 4 * 5 + 46 <= nbytes; x += 32)
+        _mm256_storeu_si256((__m256i*) (dst + x),
+                            shuf8_avx2(src + x / 4 * 5, 10, RAW10_SHUF8));
+    raw10_to_raw8_scalar_from(dst, src, x, width);
+}
+
+__attribute__((target("avx2")))
+static void raw10_to_raw16_avx2(uint16_t *dst, const uint8_t *src,
+                                const int32_t width)
+{
+    const __m256i shuf = _mm256_broadcastsi128_si256(RAW10_SHUF16);
+    const __m256i mul = _mm256_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1,
+                                          64, 16, 4, 1, 64, 16, 4, 1);
+    const int32_t nbytes = RAW10_BYTES(width);
+    int32_t x;
+
+    for (x = 0; x + 16 <= width && x / 4 * 5 + 26 <= nbytes; x += 16) {
+        const uint8_t *s = src + x / 4 * 5;
+        const __m256i w = _mm256_shuffle_epi8(load2_avx2(s, s + 10), shuf);
+        const __m256i lo = _mm256_and_si256(_mm256_mullo_epi16(w, mul),
+                                            _mm256_set1_epi16(0xc0));
+        const __m256i hi = _mm256_and_si256(w,
+                                            _mm256_set1_epi16((short) 0xff00));
+        _mm256_storeu_si256((__m256i*) (dst + x),
+                            _mm256_srli_epi16(_mm256_or_si256(hi, lo), 6));
+    }
+    raw10_to_raw16_scalar_from(dst, src, x, width);
+}
+
+__attribute__((target("avx2")))
+static void raw12_to_raw8_avx2(uint8_t *dst, const uint8_t *src,
+                               const int32_t width)
+{
+    const int32_t nbytes = RAW12_BYTES(width);
+    int32_t x;
+
+    for (x = 0; x + 32 <= width && x / 2 * 3 + 52 <= nbytes; x += 32)
+        _mm256_storeu_si256((__m256i*) (dst + x),
+                            shuf8_avx2(src + x / 2 * 3, 12, RAW12_SHUF8));
+    raw12_to_raw8_scalar_from(dst, src, x, width);
+}
+
+__attribute__((target("avx2")))
+static void raw12_to_raw16_avx2(uint16_t *dst, const uint8_t *src,
+                                const int32_t width)
+{
+    const __m256i shuf = _mm256_broadcastsi128_si256(RAW12_SHUF16);
+    const __m256i mask_hi = _mm256_setr_epi16(0xff0, 0xfff, 0xff0, 0xfff,
+                                              0xff0, 0xfff, 0xff0, 0xfff,
+                                              0xff0, 0xfff, 0xff0, 0xfff,
+                                              0xff0, 0xfff, 0xff0, 0xfff),
+                  mask_lo = _mm256_setr_epi16(0xf, 0, 0xf, 0, 0xf, 0, 0xf, 0,
+                                              0xf, 0, 0xf, 0, 0xf, 0, 0xf, 0);
+    const int32_t nbytes = RAW12_BYTES(width);
+    int32_t x;
+
+    for (x = 0; x + 16 <= width && x / 2 * 3 + 28 <= nbytes; x += 16) {
+        const uint8_t *s = src + x / 2 * 3;
+        const __m256i w = _mm256_shuffle_epi8(load2_avx2(s, s + 12), shuf);
+        _mm256_storeu_si256((__m256i*) (dst + x),
+                _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(w, 4),
+                                                 mask_hi),
+                                _mm256_and_si256(w, mask_lo)));
+    }
+    raw12_to_raw16_scalar_from(dst, src, x, width);
+}
+
+static const struct priv_rpigrafx_unpacker unpacker_avx2 = {
+    .name = "avx2",
+    .raw10_to_raw8  = raw10_to_raw8_avx2,
+    .raw10_to_raw16 = raw10_to_raw16_avx2,
+    .raw12_to_raw8  = raw12_to_raw8_avx2,
+    .raw12_to_raw16 = raw12_to_raw16_avx2
+};
+
+#endif /* HAVE_UNPACK_X86 */
+
+
+const struct priv_rpigrafx_unpacker *priv_rpigrafx_unpacker = &unpacker_scalar;
+
+/*
+ * Returns the i-th unpacker from the slowest one, or NULL if it's not
+ * available on this CPU. The scalar one is always available as the 0th one.
+ */
+const struct priv_rpigrafx_unpacker *priv_rpigrafx_unpack_variant(const int i)
+{
+    switch (i) {
+        case 0:
+            return &unpacker_scalar;
+#ifdef HAVE_UNPACK_NEON
+        case 1:
+            return cpu_has_neon() ? &unpacker_neon : NULL;
+#endif /* HAVE_UNPACK_NEON */
+#ifdef HAVE_UNPACK_X86
+        case 1:
+            return __builtin_cpu_supports("ssse3") ? &unpacker_ssse3 : NULL;
+        case 2:
+            return __builtin_cpu_supports("avx2") ? &unpacker_avx2 : NULL;
+#endif /* HAVE_UNPACK_X86 */
+        default:
+            return NULL;
+    }
+}
+
+int priv_rpigrafx_unpack_num_variants()
+{
+#if defined(HAVE_UNPACK_X86)
+    return 3;
+#elif defined(HAVE_UNPACK_NEON)
+    return 2;
+#else
+    return 1;
+#endif
+}
+
+/* Select the fastest unpacker available on this CPU. */
+void priv_rpigrafx_unpack_init()
+{
+    int i;
+
+#ifdef HAVE_UNPACK_X86
+    __builtin_cpu_init();
+#endif /* HAVE_UNPACK_X86 */
+
+    for (i = 0; i < priv_rpigrafx_unpack_num_variants(); i ++) {
+        const struct priv_rpigrafx_unpacker *up =
+                                            priv_rpigrafx_unpack_variant(i);
+        if (up != NULL)
+            priv_rpigrafx_unpacker = up;
+    }
+}
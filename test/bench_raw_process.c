@@ -0,0 +1,139 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+static double get_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/*
+ * Report throughput of priv_rpigrafx_raw_process in Mpx/s on a full IMX219
+ * RAW10 frame for 1 to 4 threads.
+ */
+int main()
+{
+    const int width = 3280, height = 2464, nframes = 10, max_threads = 4;
+    const int src_stride = priv_rpigrafx_raw_stride(width, 10);
+    static const struct {
+        const char *name;
+        rpigrafx_demosaic_mode_t mode;
+        _Bool superpixel;
+    } cases[] = {
+        {"nearest",    RPIGRAFX_DEMOSAIC_MODE_NEAREST,    0},
+        {"bilinear",   RPIGRAFX_DEMOSAIC_MODE_BILINEAR,   0},
+        {"edge-aware", RPIGRAFX_DEMOSAIC_MODE_EDGE_AWARE, 0},
+        {"superpixel", RPIGRAFX_DEMOSAIC_MODE_NEAREST,    !0},
+    };
+    struct priv_rpigrafx_raw_scratch scratch = {0};
+    uint32_t hist_r[256], hist_g[256], hist_b[256];
+    uint8_t *src = NULL, *dst = NULL;
+    int i, j, t;
+
+    src = malloc(src_stride * height);
+    dst = malloc(width * height * 3);
+    if (src == NULL || dst == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < src_stride * height; i ++)
+        src[i] = rand();
+    _check(priv_rpigrafx_raw_scratch_reserve(&scratch,
+                          priv_rpigrafx_raw_scratch_size(width, max_threads)));
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i ++) {
+        const struct priv_rpigrafx_raw_job job = {
+            .src = src,
+            .src_stride = src_stride,
+            .nbits = 10,
+            .width = width,
+            .height = height,
+            .demosaic_mode = cases[i].mode,
+            .superpixel = cases[i].superpixel,
+            .gain_r = 1.55, .gain_g = 1.0, .gain_b = 1.5,
+            .encoding = MMAL_ENCODING_RGB24,
+            .dst = dst,
+            .dst_stride = (cases[i].superpixel ? width / 2 : width) * 3,
+            .hist_r = hist_r, .hist_g = hist_g, .hist_b = hist_b
+        };
+        double base = 0;
+
+        printf("%-10s", cases[i].name);
+        for (t = 1; t <= max_threads; t ++) {
+            struct priv_rpigrafx_pool *pool = NULL;
+            double start, mpxs;
+
+            _check(priv_rpigrafx_pool_create(&pool, t, 0));
+            start = get_time();
+            for (j = 0; j < nframes; j ++)
+                _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+            mpxs = (double) width * height * nframes
+                   / (get_time() - start) * 1e-6;
+            priv_rpigrafx_pool_destroy(pool);
+
+            if (t == 1)
+                base = mpxs;
+            printf("  %dT: %7.1f Mpx/s (x%.2f)", t, mpxs, mpxs / base);
+        }
+        printf("\n");
+    }
+
+    /*
+     * Cost of the AWB statistics on the fastest path, on one thread.
+     * Interleaved so that both see the same load of the machine.
+     */
+    {
+        struct priv_rpigrafx_awb_stats stats;
+        struct priv_rpigrafx_raw_job job = {
+            .src = src,
+            .src_stride = src_stride,
+            .nbits = 10,
+            .width = width,
+            .height = height,
+            .demosaic_mode = RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+            .gain_r = 1, .gain_g = 1, .gain_b = 1,
+            .encoding = MMAL_ENCODING_RGB24,
+            .dst = dst,
+            .dst_stride = width * 3,
+            .awb_step = 8
+        };
+        double t_without = INFINITY, t_with = INFINITY;
+
+        for (j = 0; j < nframes; j ++) {
+            double start, t;
+
+            job.awb_stats = NULL;
+            start = get_time();
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, NULL));
+            if ((t = get_time() - start) < t_without)
+                t_without = t;
+            job.awb_stats = &stats;
+            start = get_time();
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, NULL));
+            if ((t = get_time() - start) < t_with)
+                t_with = t;
+        }
+        printf("awb stats   fused: %.2f ms, %.2f ms with statistics "
+               "(%+.2f%%)\n", t_without * 1e3, t_with * 1e3,
+               (t_with / t_without - 1) * 100);
+    }
+
+    priv_rpigrafx_raw_scratch_free(&scratch);
+    free(src);
+    free(dst);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+static double get_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double) tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* Report throughput of each unpacker in GB/s of packed input. */
+int main()
+{
+    const int width = 3280, height = 2464, nframes = 10;
+    const int stride = (width * 3 / 2 + 31) & ~31;
+    uint8_t *src = NULL;
+    uint16_t *dst = NULL;
+    int i, j, y;
+
+    src = malloc(stride * height);
+    dst = malloc(sizeof(*dst) * width * height);
+    if (src == NULL || dst == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < stride * height; i ++)
+        src[i] = rand();
+
+    for (i = 0; i < priv_rpigrafx_unpack_num_variants(); i ++) {
+        const struct priv_rpigrafx_unpacker *up =
+                                            priv_rpigrafx_unpack_variant(i);
+        double start, t10_8, t10_16, t12_8, t12_16;
+
+        if (up == NULL)
+            continue;
+
+#define BENCH(t, func, type, nbytes) \
+        do { \
+            start = get_time(); \
+            for (j = 0; j < nframes; j ++) \
+                for (y = 0; y < height; y ++) \
+                    up->func((type*) dst + width * y, src + stride * y, \
+                             width); \
+            t = (double) (nbytes) * height * nframes \
+                / (get_time() - start) * 1e-9; \
+        } while (0)
+
+        BENCH(t10_8,  raw10_to_raw8,  uint8_t,  (width + 3) / 4 * 5);
+        BENCH(t10_16, raw10_to_raw16, uint16_t, (width + 3) / 4 * 5);
+        BENCH(t12_8,  raw12_to_raw8,  uint8_t,  (width + 1) / 2 * 3);
+        BENCH(t12_16, raw12_to_raw16, uint16_t, (width + 1) / 2 * 3);
+
+#undef BENCH
+
+        printf("%-8s raw10->8: %6.2f GB/s  raw10->16: %6.2f GB/s  "
+               "raw12->8: %6.2f GB/s  raw12->16: %6.2f GB/s\n",
+               up->name, t10_8, t10_16, t12_8, t12_16);
+    }
+
+    free(src);
+    free(dst);
+    return 0;
+}
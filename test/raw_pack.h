@@ -0,0 +1,52 @@
+/*
+ * Making packed raw frames of rawcam from frames of samples, for the tests.
+ */
+
+#ifndef RAW_PACK_H
+#define RAW_PACK_H
+
+#include <stdint.h>
+
+/* Channel of (x, y) through a BGGR CFA: 0 for R, 1 for G and 2 for B. */
+static inline int bggr_channel(const int x, const int y)
+{
+    if (y & 1)
+        return (x & 1) ? 0 : 1;
+    return (x & 1) ? 1 : 2;
+}
+
+/*
+ * Pack the width x height samples of v, of nbits 8, 10 or 12, into lines of
+ * raw_stride bytes of raw. The low bits of a partial group at the end of a
+ * line are zero.
+ */
+static inline void pack_raw(uint8_t *raw, const int raw_stride,
+                            const uint16_t *v, const int width,
+                            const int height, const unsigned nbits)
+{
+    int x, y;
+
+    for (y = 0; y < height; y ++) {
+        const uint16_t *s = v + (size_t) y * width;
+        uint8_t *q = raw + (size_t) y * raw_stride;
+        for (x = 0; x < width; x ++) {
+            if (nbits == 8) {
+                q[x] = s[x];
+            } else if (nbits == 10) {
+                uint8_t *g = q + x / 4 * 5;
+                if (x % 4 == 0)
+                    g[4] = 0;
+                g[x % 4] = s[x] >> 2;
+                g[4] |= (s[x] & 3) << (x % 4 * 2);
+            } else {
+                uint8_t *g = q + x / 2 * 3;
+                if (x % 2 == 0)
+                    g[2] = 0;
+                g[x % 2] = s[x] >> 4;
+                g[2] |= (s[x] & 0xf) << (x % 2 * 4);
+            }
+        }
+    }
+}
+
+#endif /* RAW_PACK_H */
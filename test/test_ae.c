@@ -0,0 +1,182 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include "raw_pack.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A simulated sensor whose cells have a luminance of radiance times exposure
+ * times gain, clipped at full scale. Settings take effect LAG frames after
+ * they are set, and frames report the settings they were taken with if
+ * has_metadata.
+ */
+#define LAG 2
+#define MAX_EXPOSURE_US 33000.0f
+#define MAX_GAIN 8.0f
+#define TARGET 0.18f
+
+struct scene {
+    const char *name;
+    /* Per us of exposure at gain 1, in the center and around it. */
+    float center, surround;
+    rpigrafx_ae_metering_t metering;
+    _Bool has_metadata;
+    /* Frames to converge within, or 0 if it must end up at a limit. */
+    int max_frames;
+};
+
+static const struct scene scenes[] = {
+    {"indoor",       2e-5f,  2e-5f,  RPIGRAFX_AE_METERING_AVERAGE, !0, 4},
+    {"dim",          2e-6f,  2e-6f,  RPIGRAFX_AE_METERING_AVERAGE, !0, 6},
+    {"sunlight",     1e-2f,  1e-2f,  RPIGRAFX_AE_METERING_AVERAGE, !0, 8},
+    {"no metadata",  2e-5f,  2e-5f,  RPIGRAFX_AE_METERING_AVERAGE, 0, 16},
+    {"spot",         1e-4f,  1e-6f,  RPIGRAFX_AE_METERING_SPOT,    !0, 6},
+    {"center",       1e-4f,  1e-6f,  RPIGRAFX_AE_METERING_CENTER,  !0, 8},
+    {"black",        0,      0,      RPIGRAFX_AE_METERING_AVERAGE, !0, 0},
+};
+
+static _Bool is_center(const int cx, const int cy)
+{
+    return cx >= PRIV_RPIGRAFX_AE_GRID_WIDTH / 2 - 2
+           && cx < PRIV_RPIGRAFX_AE_GRID_WIDTH / 2 + 2
+           && cy >= PRIV_RPIGRAFX_AE_GRID_HEIGHT / 2 - 2
+           && cy < PRIV_RPIGRAFX_AE_GRID_HEIGHT / 2 + 2;
+}
+
+static void expose(struct priv_rpigrafx_ae_grid *grid,
+                   const struct scene *scene, const float exposure_us,
+                   const float gain)
+{
+    int cx, cy;
+
+    for (cy = 0; cy < PRIV_RPIGRAFX_AE_GRID_HEIGHT; cy ++) {
+        for (cx = 0; cx < PRIV_RPIGRAFX_AE_GRID_WIDTH; cx ++) {
+            const float r = is_center(cx, cy) ? scene->center
+                                              : scene->surround,
+                        v = r * exposure_us * gain;
+            grid->luma[cy][cx] = (v > 1) ? 1 : v;
+        }
+    }
+}
+
+/* Return the frames until the AE converged, or -1 if it did not in 100. */
+static int simulate(const struct scene *scene, float *lumap)
+{
+    struct priv_rpigrafx_ae ae;
+    struct priv_rpigrafx_ae_grid grid;
+    /* Settings of the frames to come; [0] is the next one. */
+    float exposure_us[LAG], gain[LAG];
+    int i, n;
+
+    priv_rpigrafx_ae_init(&ae, RPIGRAFX_AE_MODE_MEAN, scene->metering,
+                          TARGET);
+    for (i = 0; i < LAG; i ++) {
+        exposure_us[i] = ae.exposure_us;
+        gain[i] = ae.gain;
+    }
+    for (n = 1; n <= 100; n ++) {
+        rpigrafx_rawcam_metadata_t md;
+
+        memset(&md, 0, sizeof(md));
+        md.is_valid = scene->has_metadata;
+        md.exposure_us = exposure_us[0];
+        md.analog_gain = gain[0];
+        md.digital_gain = 1;
+        expose(&grid, scene, exposure_us[0], gain[0]);
+        priv_rpigrafx_ae_update(&ae, &grid, &md, MAX_EXPOSURE_US, MAX_GAIN);
+        *lumap = ae.luma;
+        if (ae.is_converged)
+            return n;
+
+        for (i = 0; i < LAG - 1; i ++) {
+            exposure_us[i] = exposure_us[i + 1];
+            gain[i] = gain[i + 1];
+        }
+        exposure_us[LAG - 1] = ae.exposure_us;
+        gain[LAG - 1] = ae.gain;
+    }
+    return -1;
+}
+
+/* A raw frame of RAW10 or RAW8 whose left half is twice as bright. */
+static void test_gather(const unsigned nbits)
+{
+    const int32_t width = 320, height = 240,
+                  stride = priv_rpigrafx_raw_stride(width, nbits);
+    const uint32_t v = (nbits == 10) ? 200 : 50,
+                   maxv = (1u << nbits) - 1;
+    uint8_t *src = calloc((size_t) stride * height, 1);
+    uint16_t *samples = malloc(sizeof(*samples) * width * height);
+    struct priv_rpigrafx_raw_job job;
+    struct priv_rpigrafx_ae_grid grid;
+    int32_t x, y;
+    int cx, cy;
+
+    if (src == NULL || samples == NULL) {
+        fprintf(stderr, "error: Failed to allocate frame\n");
+        exit(EXIT_FAILURE);
+    }
+    for (y = 0; y < height; y ++)
+        for (x = 0; x < width; x ++)
+            samples[y * width + x] = (x < width / 2) ? 2 * v : v;
+    pack_raw(src, stride, samples, width, height, nbits);
+    free(samples);
+
+    memset(&job, 0, sizeof(job));
+    job.src = src;
+    job.src_stride = stride;
+    job.nbits = nbits;
+    job.width = width;
+    job.height = height;
+    job.bayer_pattern = RPIGRAFX_BAYER_PATTERN_RGGB;
+    priv_rpigrafx_ae_gather(&grid, &job, NULL);
+    for (cy = 0; cy < PRIV_RPIGRAFX_AE_GRID_HEIGHT; cy ++) {
+        for (cx = 0; cx < PRIV_RPIGRAFX_AE_GRID_WIDTH; cx ++) {
+            const float expected = (float) ((cx < PRIV_RPIGRAFX_AE_GRID_WIDTH
+                                             / 2) ? 2 * v : v) / maxv;
+            if (fabsf(grid.luma[cy][cx] - expected) > 1e-4f) {
+                fprintf(stderr, "error: RAW%u: Cell (%d, %d) is %f, "
+                                "expected %f\n", nbits, cx, cy,
+                        grid.luma[cy][cx], expected);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    printf("gather RAW%-2u: %.4f and %.4f\n", nbits, grid.luma[0][0],
+           grid.luma[0][PRIV_RPIGRAFX_AE_GRID_WIDTH - 1]);
+    free(src);
+}
+
+int main()
+{
+    int i;
+
+    test_gather(10);
+    test_gather(8);
+
+    for (i = 0; i < (int) (sizeof(scenes) / sizeof(scenes[0])); i ++) {
+        const struct scene *scene = &scenes[i];
+        float luma;
+        const int n = simulate(scene, &luma);
+
+        printf("%-12s: converged in %d frames at %.3f\n", scene->name, n,
+               luma);
+        if (n < 0 || (scene->max_frames > 0 && n > scene->max_frames)) {
+            fprintf(stderr, "error: %s: Converged in %d frames, expected "
+                            "%d at most\n", scene->name, n,
+                    scene->max_frames);
+            exit(EXIT_FAILURE);
+        }
+        /* On target, unless it is beyond the limits. */
+        if (scene->max_frames > 0 && fabsf(luma / TARGET - 1) > 0.1f) {
+            fprintf(stderr, "error: %s: Luminance is %f\n", scene->name,
+                    luma);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fprintf(stderr, "OK\n");
+    return 0;
+}
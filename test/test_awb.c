@@ -0,0 +1,191 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include "raw_pack.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define WIDTH     1280
+#define HEIGHT    720
+#define NTHREADS  3
+#define AWB_STEP  8
+#define NFRAMES   30
+#define SMOOTHING 0.25f
+
+/* Color cast of the light, i.e. the gains AWB must undo. */
+static const float cast[3] = {1.6, 1.0, 0.6};
+
+/*
+ * Sample a linear 10-bit scene through a BGGR CFA under the cast.
+ * scene(x, y, c) gives the reflected light of channel c.
+ */
+static void make_samples(uint16_t *v, unsigned (*scene)(int x, int y, int c))
+{
+    int x, y;
+
+    for (y = 0; y < HEIGHT; y ++) {
+        for (x = 0; x < WIDTH; x ++) {
+            const int c = bggr_channel(x, y);
+            const float f = scene(x, y, c) * cast[c];
+            v[y * WIDTH + x] = (f > 1023) ? 1023 : f;
+        }
+    }
+}
+
+/* Gray texture: its mean is gray, which gray world assumes. */
+static unsigned scene_gray(int x, int y, int c)
+{
+    (void) c;
+    return 350 + 250 * sin(x * 0.05) * cos(y * 0.07);
+}
+
+/*
+ * Foliage with a white card: the mean is green, so only white patch gets the
+ * white of the card right.
+ */
+static unsigned scene_foliage(int x, int y, int c)
+{
+    static const float tint[3] = {0.3, 1.0, 0.4};
+
+    if (x >= 600 && x < 700 && y >= 300 && y < 400)
+        return 560;
+    return (200 + 150 * sin(x * 0.05) * cos(y * 0.07)) * tint[c];
+}
+
+/*
+ * Run AWB over NFRAMES frames of raw. Each frame is processed with the gains
+ * estimated from the previous ones, and with the gamma of awb.
+ */
+static void run_awb(struct priv_rpigrafx_awb *awb, const uint8_t *raw,
+                    const int raw_stride, uint8_t *rgb,
+                    const rpigrafx_demosaic_mode_t demosaic_mode,
+                    void *scratch, struct priv_rpigrafx_pool *pool)
+{
+    static struct priv_rpigrafx_tone tone;
+    struct priv_rpigrafx_awb_stats stats;
+    int i;
+
+    priv_rpigrafx_tone_init(&tone);
+    for (i = 0; i < NFRAMES; i ++) {
+        const struct priv_rpigrafx_raw_job job = {
+            .src = raw,
+            .src_stride = raw_stride,
+            .nbits = 10,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .demosaic_mode = demosaic_mode,
+            .tone = &tone,
+            .encoding = MMAL_ENCODING_RGB24,
+            .dst = rgb,
+            .dst_stride = WIDTH * 3,
+            .awb_stats = &stats,
+            .awb_step = AWB_STEP,
+        };
+
+        priv_rpigrafx_tone_update(&tone, awb->gain_r, awb->gain_g,
+                                  awb->gain_b, awb->gamma, 10, 8);
+        _check(priv_rpigrafx_raw_process(&job, scratch, pool));
+        priv_rpigrafx_awb_update(awb, &stats);
+
+        /* The first estimate is only partly taken. */
+        if (i == 0) {
+            const float expected = 1 + SMOOTHING * (1 / cast[0] - 1);
+            if (fabsf(awb->gain_r - expected) > expected * 0.03) {
+                fprintf(stderr, "error: R gain is %.3f after the first frame, "
+                                "expected about %.3f\n",
+                        awb->gain_r, expected);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+static void check_gains(const char *name, const struct priv_rpigrafx_awb *awb)
+{
+    const float expected_r = 1 / cast[0], expected_b = 1 / cast[2];
+
+    printf("%-22s: gains %.3f %.3f %.3f (expected %.3f 1 %.3f)\n", name,
+           awb->gain_r, awb->gain_g, awb->gain_b, expected_r, expected_b);
+    if (fabsf(awb->gain_r - expected_r) > expected_r * 0.03
+            || fabsf(awb->gain_b - expected_b) > expected_b * 0.03
+            || awb->gain_g != 1) {
+        fprintf(stderr, "error: %s did not converge\n", name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main()
+{
+    const int raw_stride = ALIGN_UP(WIDTH * 5 / 4, 32);
+    struct priv_rpigrafx_raw_scratch scratch = {0};
+    struct priv_rpigrafx_pool *pool = NULL;
+    struct priv_rpigrafx_awb awb;
+    uint16_t *v;
+    uint8_t *raw, *rgb;
+
+    v = malloc(sizeof(*v) * WIDTH * HEIGHT);
+    raw = calloc(raw_stride, HEIGHT);
+    rgb = malloc(WIDTH * HEIGHT * 3);
+    if (v == NULL || raw == NULL || rgb == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    _check(priv_rpigrafx_pool_create(&pool, NTHREADS, 0));
+    _check(priv_rpigrafx_raw_scratch_reserve(&scratch,
+                             priv_rpigrafx_raw_scratch_size(WIDTH, NTHREADS)));
+
+    make_samples(v, scene_gray);
+    pack_raw(raw, raw_stride, v, WIDTH, HEIGHT, 10);
+    priv_rpigrafx_awb_init(&awb, RPIGRAFX_AWB_MODE_GRAY_WORLD, SMOOTHING,
+                           1, 1, 1);
+    run_awb(&awb, raw, raw_stride, rgb, RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+            scratch.base, NULL);
+    check_gains("gray world, fused", &awb);
+    priv_rpigrafx_awb_init(&awb, RPIGRAFX_AWB_MODE_GRAY_WORLD, SMOOTHING,
+                           1, 1, 1);
+    run_awb(&awb, raw, raw_stride, rgb, RPIGRAFX_DEMOSAIC_MODE_BILINEAR,
+            scratch.base, pool);
+    check_gains("gray world, bilinear", &awb);
+
+    make_samples(v, scene_foliage);
+    pack_raw(raw, raw_stride, v, WIDTH, HEIGHT, 10);
+    priv_rpigrafx_awb_init(&awb, RPIGRAFX_AWB_MODE_WHITE_PATCH, SMOOTHING,
+                           1, 1, 1);
+    run_awb(&awb, raw, raw_stride, rgb, RPIGRAFX_DEMOSAIC_MODE_BILINEAR,
+            scratch.base, pool);
+    check_gains("white patch, bilinear", &awb);
+
+    /* Statistics of gamma-encoded output are linearized. */
+    priv_rpigrafx_awb_init(&awb, RPIGRAFX_AWB_MODE_WHITE_PATCH, SMOOTHING,
+                           1, 1, 1);
+    awb.gamma = 2.2;
+    run_awb(&awb, raw, raw_stride, rgb, RPIGRAFX_DEMOSAIC_MODE_BILINEAR,
+            scratch.base, pool);
+    check_gains("white patch, gamma 2.2", &awb);
+    make_samples(v, scene_gray);
+    pack_raw(raw, raw_stride, v, WIDTH, HEIGHT, 10);
+    priv_rpigrafx_awb_init(&awb, RPIGRAFX_AWB_MODE_GRAY_WORLD, SMOOTHING,
+                           1, 1, 1);
+    awb.gamma = 2.2;
+    run_awb(&awb, raw, raw_stride, rgb, RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+            scratch.base, pool);
+    check_gains("gray world, gamma 2.2", &awb);
+
+    priv_rpigrafx_pool_destroy(pool);
+    priv_rpigrafx_raw_scratch_free(&scratch);
+    free(v);
+    free(raw);
+    free(rgb);
+    fprintf(stderr, "OK\n");
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include "raw_pack.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define WIDTH   1280
+#define HEIGHT  720
+#define GRID_W  32
+#define GRID_H  24
+#define BLACK   64
+#define NRUNS   10
+#define PATH    "test_calib.txt"
+
+/* Signal of the flat field above black, per channel. */
+static const float level[3] = {300, 500, 350};
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * Falloff of the lens at (x, y) in [0, 1]^2 for channel c: cos^4-like and a
+ * little stronger for R, which gives the color shading of cheap modules.
+ */
+static float vignette(const float x, const float y, const int c)
+{
+    const float dx = x - 0.5f, dy = (y - 0.5f) * HEIGHT / WIDTH,
+                r2 = (dx * dx + dy * dy) * ((c == 0) ? 2.4f : 2.0f);
+    return 1 / ((1 + r2) * (1 + r2));
+}
+
+/* 10-bit flat field through the vignette and the black level. */
+static void make_flat_field(uint16_t *v)
+{
+    int x, y;
+
+    for (y = 0; y < HEIGHT; y ++) {
+        for (x = 0; x < WIDTH; x ++) {
+            const int c = bggr_channel(x, y);
+            v[y * WIDTH + x] = BLACK + level[c]
+                               * vignette((float) x / (WIDTH - 1),
+                                          (float) y / (HEIGHT - 1), c)
+                               + 0.5f;
+        }
+    }
+}
+
+/* Write the calibration which undoes the vignette. */
+static void write_calibration(void)
+{
+    FILE *fp = fopen(PATH, "w");
+    int c, i, j;
+
+    if (fp == NULL) {
+        fprintf(stderr, "error: Failed to open %s\n", PATH);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "# Flat field of test_calib\nblack_level %d 10\n"
+                "grid %d %d\n", BLACK, GRID_W, GRID_H);
+    for (c = 0; c < 3; c ++) {
+        fprintf(fp, "%c\n", "rgb"[c]);
+        for (j = 0; j < GRID_H; j ++) {
+            for (i = 0; i < GRID_W; i ++)
+                fprintf(fp, " %.4f", 1 / vignette((float) i / (GRID_W - 1),
+                                                  (float) j / (GRID_H - 1),
+                                                  c));
+            fprintf(fp, "\n");
+        }
+    }
+    fclose(fp);
+}
+
+static const struct {
+    const char *name;
+    MMAL_FOURCC_T encoding;
+    rpigrafx_demosaic_mode_t mode;
+    _Bool superpixel;
+} cases[] = {
+    {"fused",      MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_NEAREST,  0},
+    {"bilinear",   MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_BILINEAR, 0},
+    {"rgb48",      RPIGRAFX_ENCODING_RGB48, RPIGRAFX_DEMOSAIC_MODE_BILINEAR, 0},
+    {"superpixel", MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_NEAREST, !0},
+};
+
+/*
+ * A vignetted flat field must come out flat: every pixel within 2% of the
+ * level of its channel scaled to the output, apart from rounding.
+ */
+int main()
+{
+    const int raw_stride = ALIGN_UP(WIDTH * 5 / 4, 32);
+    struct priv_rpigrafx_raw_scratch scratch = {0};
+    struct priv_rpigrafx_calib calib;
+    struct priv_rpigrafx_calib_map map;
+    uint16_t *v;
+    uint8_t *raw, *dst;
+    int i;
+
+    v = malloc(sizeof(*v) * WIDTH * HEIGHT);
+    raw = calloc(raw_stride, HEIGHT);
+    dst = malloc(WIDTH * HEIGHT * 6);
+    if (v == NULL || raw == NULL || dst == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    _check(priv_rpigrafx_raw_scratch_reserve(&scratch,
+                                     priv_rpigrafx_raw_scratch_size(WIDTH, 1)));
+    make_flat_field(v);
+    pack_raw(raw, raw_stride, v, WIDTH, HEIGHT, 10);
+    free(v);
+    write_calibration();
+
+    priv_rpigrafx_calib_init(&calib);
+    priv_rpigrafx_calib_map_init(&map);
+    _check(priv_rpigrafx_calib_load(&calib, PATH));
+    remove(PATH);
+    if (calib.black_level != BLACK || calib.grid_width != GRID_W
+            || calib.grid_height != GRID_H) {
+        fprintf(stderr, "error: The calibration was not loaded\n");
+        exit(EXIT_FAILURE);
+    }
+    _check(priv_rpigrafx_calib_map_build(&map, &calib, WIDTH, HEIGHT, 10,
+                                         RPIGRAFX_BAYER_PATTERN_BGGR));
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i ++) {
+        const _Bool is_rgb48 = cases[i].encoding == RPIGRAFX_ENCODING_RGB48;
+        const int32_t out_width = cases[i].superpixel ? WIDTH / 2 : WIDTH,
+                      out_height = cases[i].superpixel ? HEIGHT / 2 : HEIGHT;
+        /* Full scale of the output over full scale of RAW10 above black. */
+        const float scale = (is_rgb48 ? 1023.0f : 255.0f) / (1023 - BLACK);
+        struct priv_rpigrafx_raw_job job = {
+            .src = raw,
+            .src_stride = raw_stride,
+            .nbits = 10,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .demosaic_mode = cases[i].mode,
+            .superpixel = cases[i].superpixel,
+            .gain_r = 1, .gain_g = 1, .gain_b = 1,
+            .encoding = cases[i].encoding,
+            .dst = dst,
+            .dst_stride = out_width * (is_rgb48 ? 6 : 3),
+        };
+        double t_plain, t_calib;
+        float worst = 0, worst_plain = 0;
+        int32_t x, y, k;
+
+        t_plain = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, NULL));
+        t_plain = get_time() - t_plain;
+        /* Without the calibration, the corners are dark. */
+        for (k = 0; k < 3; k ++) {
+            const float v = is_rgb48 ? ((uint16_t*) dst)[k] : dst[k];
+            const float e = fabsf(v / (level[k] * scale) - 1);
+            worst_plain = (e > worst_plain) ? e : worst_plain;
+        }
+
+        job.calib = &map;
+        t_calib = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, NULL));
+        t_calib = get_time() - t_calib;
+
+        for (y = 0; y < out_height; y ++) {
+            for (x = 0; x < out_width; x ++) {
+                for (k = 0; k < 3; k ++) {
+                    const size_t idx = ((size_t) y * out_width + x) * 3 + k;
+                    const float v = is_rgb48 ? ((uint16_t*) dst)[idx]
+                                             : dst[idx],
+                                expected = level[k] * scale,
+                                /* The fused kernel has 8-bit input. */
+                                tol = expected * 0.02f
+                                      + (is_rgb48 ? 1 : 2.5f),
+                                e = fabsf(v - expected);
+                    if (e > tol) {
+                        fprintf(stderr, "error: %s: (%d, %d, %d) is %.0f, "
+                                        "expected %.1f\n",
+                                cases[i].name, x, y, k, v, expected);
+                        exit(EXIT_FAILURE);
+                    }
+                    if (e / expected > worst)
+                        worst = e / expected;
+                }
+            }
+        }
+        printf("%-10s: corner off by %4.1f%% without calibration, "
+               "at most %4.1f%% with; %6.2f ms, %6.2f ms calibrated\n",
+               cases[i].name, worst_plain * 100, worst * 100,
+               t_plain / NRUNS * 1e3, t_calib / NRUNS * 1e3);
+        if (worst_plain < 0.2) {
+            fprintf(stderr, "error: The field is not vignetted\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    priv_rpigrafx_calib_map_free(&map);
+    priv_rpigrafx_calib_free(&calib);
+    priv_rpigrafx_raw_scratch_free(&scratch);
+    free(raw);
+    free(dst);
+    fprintf(stderr, "OK\n");
+    return 0;
+}
@@ -0,0 +1,277 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define _assert(x) \
+    do { \
+        if (!(x)) { \
+            fprintf(stderr, "%s:%d: error: %s\n", __FILE__, __LINE__, #x); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+/* Items are sequence numbers from 1, as pointers. */
+#define ITEM(n) ((void*) (uintptr_t) (n))
+#define SEQ(p)  ((uint64_t) (uintptr_t) (p))
+
+#define NUM_PUSHES 1000000
+
+static void* spsc_producer(void *arg)
+{
+    struct priv_rpigrafx_spsc *q = arg;
+    uint64_t n;
+
+    for (n = 1; n <= NUM_PUSHES; n ++)
+        while (!priv_rpigrafx_spsc_push(q, ITEM(n)))
+            sched_yield();
+    return NULL;
+}
+
+static void test_spsc(void)
+{
+    struct priv_rpigrafx_spsc q;
+    pthread_t thread;
+    uint64_t n, expected;
+
+    _assert(priv_rpigrafx_spsc_init(&q, 3) != 0);
+    _check(priv_rpigrafx_spsc_init(&q, 4));
+
+    /* Fill, overflow and drain across the wrap of the indices. */
+    q.head = q.tail = UINT32_MAX - 1;
+    for (n = 1; n <= 4; n ++)
+        _assert(priv_rpigrafx_spsc_push(&q, ITEM(n)));
+    _assert(!priv_rpigrafx_spsc_push(&q, ITEM(5)));
+    for (n = 1; n <= 4; n ++)
+        _assert(SEQ(priv_rpigrafx_spsc_pop(&q)) == n);
+    _assert(priv_rpigrafx_spsc_pop(&q) == NULL);
+
+    /* Nothing is lost or reordered between two threads. */
+    _assert(pthread_create(&thread, NULL, spsc_producer, &q) == 0);
+    for (expected = 1; expected <= NUM_PUSHES; ) {
+        void *item = priv_rpigrafx_spsc_pop(&q);
+        if (item == NULL) {
+            sched_yield();
+            continue;
+        }
+        if (SEQ(item) != expected) {
+            fprintf(stderr, "error: Popped %llu, expected %llu\n",
+                    (unsigned long long) SEQ(item),
+                    (unsigned long long) expected);
+            exit(EXIT_FAILURE);
+        }
+        expected ++;
+    }
+    pthread_join(thread, NULL);
+    _assert(priv_rpigrafx_spsc_pop(&q) == NULL);
+    priv_rpigrafx_spsc_free(&q);
+    printf("spsc: %d items in order\n", NUM_PUSHES);
+}
+
+/*
+ * Each channel has a producer thread which makes NUM_FRAMES items every
+ * POST_US, like the MMAL callback of an output. It has DEPTH items like the
+ * pool of the connection, and skips an item when all are in flight, like the
+ * isp without a buffer; the ring holds all of them as in mmal.c. Delivering an
+ * item of channel k takes k * DELIVER_US, so that the slow channels drop
+ * items.
+ */
+#define NUM_CHANNELS 3
+#define DEPTH        4
+#define NUM_FRAMES   500
+#define POST_US      200
+#define DELIVER_US   300
+
+static struct priv_rpigrafx_dispatcher *dp = NULL;
+
+static struct {
+    /* Written by the dispatcher thread only, read after its stats. */
+    uint64_t last_delivered, num_delivered, num_released;
+    /* Items of the producer which are posted and not yet given back. */
+    int num_in_flight;
+    uint64_t num_posted;
+} results[NUM_CHANNELS];
+
+static void deliver(void *user, int channel, void *item)
+{
+    (void) user;
+
+    _assert(priv_rpigrafx_dispatcher_is_current(dp));
+    if (SEQ(item) <= results[channel].last_delivered) {
+        fprintf(stderr, "error: Channel %d: Delivered %llu after %llu\n",
+                channel, (unsigned long long) SEQ(item),
+                (unsigned long long) results[channel].last_delivered);
+        exit(EXIT_FAILURE);
+    }
+    results[channel].last_delivered = SEQ(item);
+    results[channel].num_delivered ++;
+    usleep(channel * DELIVER_US);
+    __atomic_sub_fetch(&results[channel].num_in_flight, 1, __ATOMIC_RELEASE);
+}
+
+static void release(void *user, int channel, void *item)
+{
+    (void) user;
+    (void) item;
+
+    _assert(priv_rpigrafx_dispatcher_is_current(dp));
+    results[channel].num_released ++;
+    __atomic_sub_fetch(&results[channel].num_in_flight, 1, __ATOMIC_RELEASE);
+}
+
+static const struct priv_rpigrafx_dispatcher_ops ops = {
+    .deliver = deliver,
+    .release = release,
+};
+
+static void* producer(void *arg)
+{
+    const int channel = (int) (intptr_t) arg;
+    uint64_t n;
+
+    for (n = 1; n <= NUM_FRAMES; n ++) {
+        /* Wait for the last one so that it is delivered in the end. */
+        while (n == NUM_FRAMES && __atomic_load_n(
+                    &results[channel].num_in_flight, __ATOMIC_ACQUIRE) == DEPTH)
+            usleep(POST_US);
+        if (__atomic_load_n(&results[channel].num_in_flight, __ATOMIC_ACQUIRE)
+                < DEPTH) {
+            __atomic_add_fetch(&results[channel].num_in_flight, 1,
+                               __ATOMIC_RELAXED);
+            _assert(priv_rpigrafx_dispatcher_post(dp, channel, ITEM(n)));
+            results[channel].num_posted ++;
+        }
+        usleep(POST_US);
+    }
+    return NULL;
+}
+
+static void test_dispatcher(void)
+{
+    pthread_t threads[NUM_CHANNELS];
+    int k, n;
+
+    _check(priv_rpigrafx_dispatcher_create(&dp, &ops, NULL, NUM_CHANNELS,
+                                           DEPTH));
+    _assert(!priv_rpigrafx_dispatcher_is_current(dp));
+    for (k = 0; k < NUM_CHANNELS; k ++)
+        _assert(pthread_create(&threads[k], NULL, producer,
+                               (void*) (intptr_t) k) == 0);
+    for (k = 0; k < NUM_CHANNELS; k ++)
+        pthread_join(threads[k], NULL);
+
+    /* Every item is delivered or given back in the end. */
+    for (n = 0; n < 1000; n ++) {
+        for (k = 0; k < NUM_CHANNELS; k ++) {
+            uint64_t num_delivered, num_dropped;
+
+            priv_rpigrafx_dispatcher_get_stats(dp, k, &num_delivered,
+                                               &num_dropped);
+            if (num_delivered + num_dropped != results[k].num_posted)
+                break;
+        }
+        if (k == NUM_CHANNELS)
+            break;
+        usleep(1000);
+    }
+
+    for (k = 0; k < NUM_CHANNELS; k ++) {
+        uint64_t num_delivered, num_dropped;
+
+        priv_rpigrafx_dispatcher_get_stats(dp, k, &num_delivered,
+                                           &num_dropped);
+        printf("channel %d: %llu posted, %llu delivered, %llu dropped\n", k,
+               (unsigned long long) results[k].num_posted,
+               (unsigned long long) num_delivered,
+               (unsigned long long) num_dropped);
+        /* The newest item is never dropped. */
+        if (results[k].last_delivered != NUM_FRAMES) {
+            fprintf(stderr, "error: Channel %d: Last delivered %llu\n", k,
+                    (unsigned long long) results[k].last_delivered);
+            exit(EXIT_FAILURE);
+        }
+        _assert(num_delivered == results[k].num_delivered);
+        _assert(num_dropped == results[k].num_released);
+        _assert(num_delivered + num_dropped == results[k].num_posted);
+    }
+    /* The slowest channel can't keep up and drops items. */
+    _assert(results[NUM_CHANNELS - 1].num_released > 0);
+
+    priv_rpigrafx_dispatcher_destroy(dp);
+    dp = NULL;
+}
+
+/*
+ * A post to a full ring fails and leaves the item to the producer. The
+ * delivery of the first item is held until the ring is filled behind it.
+ */
+static pthread_mutex_t gate = PTHREAD_MUTEX_INITIALIZER;
+static int is_delivering = 0, num_gate_releases = 0;
+
+static void gate_deliver(void *user, int channel, void *item)
+{
+    (void) user;
+    (void) channel;
+    (void) item;
+
+    __atomic_store_n(&is_delivering, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&gate);
+    pthread_mutex_unlock(&gate);
+}
+
+static void gate_release(void *user, int channel, void *item)
+{
+    (void) user;
+    (void) channel;
+    (void) item;
+
+    num_gate_releases ++;
+}
+
+static const struct priv_rpigrafx_dispatcher_ops gate_ops = {
+    .deliver = gate_deliver,
+    .release = gate_release,
+};
+
+static void test_full(void)
+{
+    struct priv_rpigrafx_dispatcher *gdp = NULL;
+
+    pthread_mutex_lock(&gate);
+    _check(priv_rpigrafx_dispatcher_create(&gdp, &gate_ops, NULL, 1, 2));
+    _assert(priv_rpigrafx_dispatcher_post(gdp, 0, ITEM(1)));
+    while (!__atomic_load_n(&is_delivering, __ATOMIC_ACQUIRE))
+        usleep(100);
+    _assert(priv_rpigrafx_dispatcher_post(gdp, 0, ITEM(2)));
+    _assert(priv_rpigrafx_dispatcher_post(gdp, 0, ITEM(3)));
+    _assert(!priv_rpigrafx_dispatcher_post(gdp, 0, ITEM(4)));
+    _assert(num_gate_releases == 0);
+    pthread_mutex_unlock(&gate);
+    priv_rpigrafx_dispatcher_destroy(gdp);
+    /* Item 2 is dropped for 3, or both are given back on destroy. */
+    _assert(num_gate_releases >= 1);
+    printf("full ring: post failed without giving the item back\n");
+}
+
+int main()
+{
+    test_spsc();
+    test_dispatcher();
+    test_full();
+
+    fprintf(stderr, "OK\n");
+    return 0;
+}
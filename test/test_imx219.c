@@ -0,0 +1,230 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+static const struct {
+    const char *name;
+    rpigrafx_rawcam_imx219_binning_mode_t mode;
+    int32_t x, y, out_width, out_height;
+    /* Expected window and value of the binning registers. */
+    int32_t width, height;
+    uint8_t binning;
+} cases[] = {
+    {"none",        RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE,
+     0, 0, 3280, 2464, 3280, 2464, 0},
+    {"2x2",         RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2,
+     0, 0, 1640, 1232, 3280, 2464, 1},
+    {"2x2-analog",  RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2_ANALOG,
+     0, 0, 1640, 1232, 3280, 2464, 3},
+    {"4x4",         RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_4X4,
+     0, 0, 820, 616, 3280, 2464, 2},
+    {"2x2-offset",  RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2,
+     640, 512, 640, 480, 1280, 960, 1},
+    /* A strip for line scanning, set with rpigrafx_config_rawcam_roi. */
+    {"strip",       RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE,
+     1128, 1104, 1024, 256, 1024, 256, 0},
+    {"2x2-strip",   RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2,
+     1128, 1104, 512, 128, 1024, 256, 1},
+};
+
+static const struct {
+    const char *name;
+    rpigrafx_rawcam_imx219_binning_mode_t mode;
+    int32_t x, y, out_width, out_height;
+} bad_cases[] = {
+    {"too wide",    RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2,  0, 0, 1642, 1232},
+    {"too high",    RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_4X4,  0, 0, 820, 618},
+    {"off sensor",  RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2,  2, 0, 1640, 1232},
+    {"odd size",    RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE, 0, 0, 641, 480},
+    {"strip off",   RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE,
+     2560, 1104, 1024, 256},
+    {"unknown",     (rpigrafx_rawcam_imx219_binning_mode_t) 99,
+     0, 0, 640, 480},
+};
+
+static void check_regs(const char *name,
+                       const struct priv_rpigrafx_imx219_reg *regs,
+                       const int n,
+                       const struct priv_rpigrafx_imx219_reg *expected,
+                       const int n_expected)
+{
+    int k;
+
+    if (n != n_expected) {
+        fprintf(stderr, "error: %s: %d registers, expected %d\n",
+                name, n, n_expected);
+        exit(EXIT_FAILURE);
+    }
+    for (k = 0; k < n; k ++) {
+        if (regs[k].addr != expected[k].addr
+                || regs[k].value != expected[k].value) {
+            fprintf(stderr, "error: %s: Register %d is 0x%02x at 0x%04x, "
+                            "expected 0x%02x at 0x%04x\n", name, k,
+                    regs[k].value, regs[k].addr, expected[k].value,
+                    expected[k].addr);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void check_value(const char *name, const float value,
+                        const float expected)
+{
+    if (fabsf(value - expected) > expected * 1e-4f) {
+        fprintf(stderr, "error: %s is %f, expected %f\n",
+                name, value, expected);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * At 24 MHz lines take 3448 / 182.4 MHz. Frames are as short as the binned
+ * frame plus 32 lines of blanking, and exposure is 4 lines shorter.
+ */
+static void test_timing()
+{
+    struct priv_rpigrafx_imx219_geometry geom;
+    struct priv_rpigrafx_imx219_timing t;
+    struct priv_rpigrafx_imx219_reg regs[PRIV_RPIGRAFX_IMX219_MAX_REGS];
+    const float line_us = 3448 / 182.4f;
+    const struct priv_rpigrafx_imx219_reg expected_auto[] = {
+        {0x0160, 1264 >> 8}, {0x0161, 1264 & 0xff},
+        {0x0162, 3448 >> 8}, {0x0163, 3448 & 0xff},
+    };
+    /* 30 fps, 10 ms exposure, 4x analog gain. */
+    const struct priv_rpigrafx_imx219_reg expected_manual[] = {
+        {0x0160, 1763 >> 8}, {0x0161, 1763 & 0xff},
+        {0x0162, 3448 >> 8}, {0x0163, 3448 & 0xff},
+        {0x015a, 529 >> 8},  {0x015b, 529 & 0xff},
+        {0x0157, 192},
+        {0x0158, 0x01},      {0x0159, 0x00},
+    };
+    const int n_auto = sizeof(expected_auto) / sizeof(expected_auto[0]),
+              n_manual = sizeof(expected_manual) / sizeof(expected_manual[0]);
+
+    _check(priv_rpigrafx_imx219_geometry(&geom,
+                                    RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2,
+                                    0, 0, 1640, 1232));
+    priv_rpigrafx_imx219_timing_init(&t, 24.0, &geom);
+    check_value("Fastest frame period", priv_rpigrafx_imx219_frame_period(&t),
+                1264 * line_us);
+    check_regs("auto", regs, priv_rpigrafx_imx219_timing_regs(regs, &t),
+               expected_auto, n_auto);
+
+    /* Frames can't be shorter than the readout. */
+    check_value("Frame period at 100 fps",
+                priv_rpigrafx_imx219_set_framerate(&t, 100), 1264 * line_us);
+    check_value("Frame period at 30 fps",
+                priv_rpigrafx_imx219_set_framerate(&t, 30), 1763 * line_us);
+    check_value("Exposure of 10 ms",
+                priv_rpigrafx_imx219_set_exposure(&t, 10000), 529 * line_us);
+    check_value("Gain of 4", priv_rpigrafx_imx219_set_gain(&t, 4), 4);
+    check_regs("manual", regs, priv_rpigrafx_imx219_timing_regs(regs, &t),
+               expected_manual, n_manual);
+
+    /* Exposure is limited by the frame, and comes back with longer ones. */
+    check_value("Exposure of 50 ms at 30 fps",
+                priv_rpigrafx_imx219_set_exposure(&t, 50000),
+                (1763 - 4) * line_us);
+    check_value("Frame period at 10 fps",
+                priv_rpigrafx_imx219_set_framerate(&t, 10), 5290 * line_us);
+    check_value("Exposure of 50 ms at 10 fps",
+                priv_rpigrafx_imx219_exposure(&t), 2645 * line_us);
+
+    /* Beyond the analog gain, the rest is digital. */
+    check_value("Gain of 16", priv_rpigrafx_imx219_set_gain(&t, 16), 16);
+    if (t.analog_gain != 232 || t.digital_gain != 384) {
+        fprintf(stderr, "error: Gain of 16 is 0x%02x analog and 0x%04x "
+                        "digital\n", t.analog_gain, t.digital_gain);
+        exit(EXIT_FAILURE);
+    }
+    check_value("Gain of 1000", priv_rpigrafx_imx219_set_gain(&t, 1000),
+                256.0f / 24 * 0xfff / 256);
+
+    /* Back to the tuner. */
+    priv_rpigrafx_imx219_set_framerate(&t, 0);
+    priv_rpigrafx_imx219_set_exposure(&t, 0);
+    priv_rpigrafx_imx219_set_gain(&t, 0);
+    check_regs("auto again", regs, priv_rpigrafx_imx219_timing_regs(regs, &t),
+               expected_auto, n_auto);
+
+    printf("timing    : %.1f us per line, %.1f to %.1f fps\n", line_us,
+           1e6 / (65535 * line_us), 1e6 / (1264 * line_us));
+}
+
+/*
+ * The binned frames must come from a window of the sensor of the binned size
+ * times the factor, and the registers must bin it into frames of the size of
+ * the rawcam output.
+ */
+int main()
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i ++) {
+        struct priv_rpigrafx_imx219_geometry geom;
+        struct priv_rpigrafx_imx219_reg regs[PRIV_RPIGRAFX_IMX219_MAX_REGS];
+        const struct priv_rpigrafx_imx219_reg expected[] = {
+            {0x0174, cases[i].binning},
+            {0x0175, cases[i].binning},
+            {0x016c, cases[i].out_width >> 8},
+            {0x016d, cases[i].out_width & 0xff},
+            {0x016e, cases[i].out_height >> 8},
+            {0x016f, cases[i].out_height & 0xff},
+        };
+        const int n_expected = sizeof(expected) / sizeof(expected[0]);
+        int n;
+
+        _check(priv_rpigrafx_imx219_geometry(&geom, cases[i].mode,
+                                             cases[i].x, cases[i].y,
+                                             cases[i].out_width,
+                                             cases[i].out_height));
+        if (geom.x != cases[i].x || geom.y != cases[i].y
+                || geom.width != cases[i].width
+                || geom.height != cases[i].height
+                || geom.out_width != cases[i].out_width
+                || geom.out_height != cases[i].out_height
+                || geom.frame_length != cases[i].out_height + 32
+                || geom.bin != geom.width / geom.out_width) {
+            fprintf(stderr, "error: %s: Window is %dx%d at (%d, %d) binned "
+                            "by %d into %dx%d\n", cases[i].name, geom.width,
+                    geom.height, geom.x, geom.y, geom.bin, geom.out_width,
+                    geom.out_height);
+            exit(EXIT_FAILURE);
+        }
+
+        n = priv_rpigrafx_imx219_window_regs(regs, &geom);
+        check_regs(cases[i].name, regs, n, expected, n_expected);
+        printf("%-10s: %4dx%-4d from %4dx%-4d at (%d, %d)\n", cases[i].name,
+               geom.out_width, geom.out_height, geom.width, geom.height,
+               geom.x, geom.y);
+    }
+
+    for (i = 0; i < (int) (sizeof(bad_cases) / sizeof(bad_cases[0])); i ++) {
+        struct priv_rpigrafx_imx219_geometry geom;
+        if (!priv_rpigrafx_imx219_geometry(&geom, bad_cases[i].mode,
+                                           bad_cases[i].x, bad_cases[i].y,
+                                           bad_cases[i].out_width,
+                                           bad_cases[i].out_height)) {
+            fprintf(stderr, "error: %s: Geometry was accepted\n",
+                    bad_cases[i].name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    test_timing();
+
+    fprintf(stderr, "OK\n");
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Side info of rawcam with the embedded data lines of an IMX219 at 24 MHz:
+ * frame count 42, analog gain 4 (code 192), digital gain 1, exposure of 529
+ * lines, frame length of 1763 lines and line length of 3448 pixels.
+ */
+static const uint8_t raw10_one_line[] = {
+    0x0a, 0xaa, 0x00, 0xa5, 0x55, 0x00, 0x5a, 0x02, 0x5a, 0x55,
+    0x19, 0x55, 0x00, 0x5a, 0x55, 0x00, 0x5a, 0x00, 0x5a, 0x55,
+    0x2a, 0xaa, 0x01, 0xa5, 0x55, 0x57, 0x5a, 0xc0, 0x5a, 0x55,
+    0x01, 0x5a, 0x00, 0x5a, 0x55, 0x02, 0x5a, 0x11, 0x55, 0x55,
+    0x00, 0x55, 0x00, 0x55, 0x55, 0x00, 0x55, 0x00, 0x5a, 0x55,
+    0x06, 0x5a, 0xe3, 0x5a, 0x55, 0x0d, 0x5a, 0x78, 0x07, 0x55,
+    0x07, 0x07, 0x07, 0x07, 0x55, 0x07, 0x07, 0x07, 0x07, 0x55,
+    0x0a, 0x07, 0x07, 0x07, 0x55, 0x07, 0x07, 0x07, 0x07, 0x55,
+    0x07, 0x07, 0x07, 0x07, 0x55, 0x07, 0x07, 0x07, 0x07, 0x55,
+    0x07, 0x07, 0x07, 0x07, 0x55, 0x07, 0x07, 0x07, 0x07, 0x55,
+    0x07, 0x07, 0x07, 0x07, 0x55, 0x07, 0x07, 0x07, 0x07, 0x55,
+    0x07, 0x07, 0x07, 0x07, 0x55, 0x07, 0x07, 0x07, 0x07, 0x55,
+    0x07, 0x07, 0x07, 0x07, 0x55, 0x07, 0x07, 0x07, 0x07, 0x55,
+    0x07, 0x07, 0x07, 0x07, 0x55, 0x07, 0x07, 0x07, 0x07, 0x55,
+};
+
+static const uint8_t raw10_two_lines[] = {
+    0x0a, 0xaa, 0x00, 0xa5, 0x55, 0x00, 0x5a, 0x02, 0x5a, 0x55,
+    0x19, 0x55, 0x00, 0x5a, 0x55, 0x00, 0x5a, 0x00, 0x5a, 0x55,
+    0x2a, 0x07, 0x07, 0x07, 0x55, 0x07, 0x07, 0x07, 0x07, 0x55,
+    0x07, 0x07, 0x07, 0x07, 0x55, 0x07, 0x07, 0x07, 0x07, 0x55,
+    0x07, 0x07, 0x07, 0x07, 0x55, 0x07, 0x07, 0x07, 0x07, 0x55,
+    0x0a, 0xaa, 0x01, 0xa5, 0x55, 0x57, 0x5a, 0xc0, 0x5a, 0x55,
+    0x01, 0x5a, 0x00, 0x5a, 0x55, 0x02, 0x5a, 0x11, 0x55, 0x55,
+    0x00, 0x55, 0x00, 0x55, 0x55, 0x00, 0x55, 0x00, 0x5a, 0x55,
+    0x06, 0x5a, 0xe3, 0x5a, 0x55, 0x0d, 0x5a, 0x78, 0x07, 0x55,
+    0x07, 0x07, 0x07, 0x07, 0x55, 0x07, 0x07, 0x07, 0x07, 0x55,
+};
+
+static const uint8_t raw8_one_line[] = {
+    0x0a, 0xaa, 0x00, 0xa5, 0x00, 0x5a, 0x02, 0x5a, 0x19, 0x55,
+    0x00, 0x5a, 0x00, 0x5a, 0x00, 0x5a, 0x2a, 0xaa, 0x01, 0xa5,
+    0x57, 0x5a, 0xc0, 0x5a, 0x01, 0x5a, 0x00, 0x5a, 0x02, 0x5a,
+    0x11, 0x55, 0x00, 0x55, 0x00, 0x55, 0x00, 0x55, 0x00, 0x5a,
+    0x06, 0x5a, 0xe3, 0x5a, 0x0d, 0x5a, 0x78, 0x07, 0x07, 0x07,
+    0x07, 0x07, 0x07, 0x07, 0x07, 0x07,
+};
+
+static const struct {
+    const char *name;
+    const uint8_t *data;
+    size_t length, stride;
+    unsigned nbits;
+    _Bool is_valid;
+} cases[] = {
+    {"raw10",            raw10_one_line,  sizeof(raw10_one_line),  70, 10, !0},
+    {"raw10 two lines",  raw10_two_lines, sizeof(raw10_two_lines), 50, 10, !0},
+    {"raw8",             raw8_one_line,   sizeof(raw8_one_line),    0,  8, !0},
+    /* The timing registers are in the second line. */
+    {"first line only",  raw10_two_lines, sizeof(raw10_two_lines),  0, 10, 0},
+    {"truncated",        raw8_one_line,   30,                       0,  8, 0},
+    /* The bytes of the low bits are taken as tags. */
+    {"raw10 as raw8",    raw10_one_line,  sizeof(raw10_one_line),  70,  8, 0},
+};
+
+static void check_value(const char *name, const char *field,
+                        const float value, const float expected)
+{
+    if (fabsf(value - expected) > expected * 1e-4f) {
+        fprintf(stderr, "error: %s: %s is %f, expected %f\n",
+                name, field, value, expected);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main()
+{
+    struct priv_rpigrafx_imx219_geometry geom;
+    struct priv_rpigrafx_imx219_timing t;
+    const float line_us = 3448 / 182.4f;
+    rpigrafx_rawcam_metadata_t md;
+    uint8_t corrupted[sizeof(raw8_one_line)];
+    int i;
+
+    if (priv_rpigrafx_imx219_geometry(&geom,
+                                      RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE,
+                                      0, 0, 3280, 2464)) {
+        fprintf(stderr, "error: Failed to set up the geometry\n");
+        exit(EXIT_FAILURE);
+    }
+    priv_rpigrafx_imx219_timing_init(&t, 24.0, &geom);
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i ++) {
+        const int ret = priv_rpigrafx_imx219_parse_embedded(&md,
+                                cases[i].data, cases[i].length,
+                                cases[i].stride, cases[i].nbits, &t);
+
+        if (!ret != cases[i].is_valid || md.is_valid != cases[i].is_valid) {
+            fprintf(stderr, "error: %s: Returned %d and is_valid is %d\n",
+                    cases[i].name, ret, md.is_valid);
+            exit(EXIT_FAILURE);
+        }
+        if (!md.is_valid)
+            continue;
+        if (md.frame_count != 42) {
+            fprintf(stderr, "error: %s: Frame count is %u\n",
+                    cases[i].name, md.frame_count);
+            exit(EXIT_FAILURE);
+        }
+        check_value(cases[i].name, "Analog gain", md.analog_gain, 4);
+        check_value(cases[i].name, "Digital gain", md.digital_gain, 1);
+        check_value(cases[i].name, "Exposure", md.exposure_us,
+                    529 * line_us);
+        check_value(cases[i].name, "Frame period", md.frame_period_us,
+                    1763 * line_us);
+        printf("%-16s: frame %u, %.1f us of %.1f us, gain %.2f x %.2f\n",
+               cases[i].name, md.frame_count, md.exposure_us,
+               md.frame_period_us, md.analog_gain, md.digital_gain);
+    }
+
+    /* An unknown tag in place of the one of the analog gain. */
+    memcpy(corrupted, raw8_one_line, sizeof(corrupted));
+    corrupted[21] = 0x33;
+    if (!priv_rpigrafx_imx219_parse_embedded(&md, corrupted,
+                                             sizeof(corrupted), 0, 8, &t)
+            || md.is_valid) {
+        fprintf(stderr, "error: Unknown tag was accepted\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "OK\n");
+    return 0;
+}
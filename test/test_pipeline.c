@@ -0,0 +1,370 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+/*
+ * A synthetic sensor sends a frame every PERIOD_US into NUM_RAW buffers like
+ * rawcam, and drops frames when none is free. The pipeline "demosaics" each
+ * frame in PROCESS_US into one of NUM_OUT buffers like the splitter input and
+ * isp output. Only the newest finished frame is kept, like callback_conn does
+ * for the isp output, and the consumer takes it like
+ * rpigrafx_capture_next_frame in the pipelined mode.
+ */
+#define PERIOD_US  10000
+#define PROCESS_US 8000
+#define NUM_RAW    4
+#define NUM_OUT    3
+#define NUM_TAKES  40
+/* The ops give up waiting after this, like those of mmal.c. */
+#define POLL_US    20000
+
+struct frame {
+    uint64_t seq;
+    double captured;
+};
+
+/* FIFO of frames with blocking pop. */
+struct queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct frame *items[NUM_RAW + NUM_OUT];
+    int head, len;
+};
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void queue_init(struct queue *q)
+{
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->head = q->len = 0;
+}
+
+static void queue_push(struct queue *q, struct frame *f)
+{
+    const int cap = sizeof(q->items) / sizeof(q->items[0]);
+
+    pthread_mutex_lock(&q->mutex);
+    q->items[(q->head + q->len ++) % cap] = f;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static struct frame* queue_pop(struct queue *q, const _Bool wait)
+{
+    const int cap = sizeof(q->items) / sizeof(q->items[0]);
+    struct frame *f = NULL;
+
+    pthread_mutex_lock(&q->mutex);
+    while (wait && q->len == 0)
+        pthread_cond_wait(&q->cond, &q->mutex);
+    if (q->len != 0) {
+        f = q->items[q->head];
+        q->head = (q->head + 1) % cap;
+        q->len --;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return f;
+}
+
+/* Pop waiting for up to POLL_US, or return NULL. */
+static struct frame* queue_pop_timed(struct queue *q)
+{
+    struct timespec t;
+    _Bool is_empty;
+
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_nsec += POLL_US * 1000;
+    t.tv_sec += t.tv_nsec / 1000000000;
+    t.tv_nsec %= 1000000000;
+    pthread_mutex_lock(&q->mutex);
+    while (q->len == 0)
+        if (pthread_cond_timedwait(&q->cond, &q->mutex, &t) == ETIMEDOUT)
+            break;
+    is_empty = q->len == 0;
+    pthread_mutex_unlock(&q->mutex);
+    /* The pipeline thread is the only one which pops. */
+    return is_empty ? NULL : queue_pop(q, 0);
+}
+
+static struct {
+    struct frame raw[NUM_RAW], out[NUM_OUT];
+    struct queue raw_free, raw_full, out_free, out_done;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    /* The sensor sends nothing if is_stalled. */
+    _Bool quit, is_stalled;
+    uint64_t num_sent, num_dropped;
+} sim;
+
+static void* sensor_main(void *arg)
+{
+    double next = get_time();
+
+    (void) arg;
+    for (; ; ) {
+        struct frame *f;
+        double now;
+
+        next += PERIOD_US * 1e-6;
+        now = get_time();
+        if (next > now)
+            usleep((next - now) * 1e6);
+
+        pthread_mutex_lock(&sim.mutex);
+        if (sim.quit) {
+            pthread_mutex_unlock(&sim.mutex);
+            break;
+        }
+        if (sim.is_stalled) {
+            pthread_mutex_unlock(&sim.mutex);
+            continue;
+        }
+        f = queue_pop(&sim.raw_free, 0);
+        if (f == NULL) {
+            sim.num_dropped ++;
+        } else {
+            f->seq = sim.num_sent;
+            f->captured = get_time();
+            queue_push(&sim.raw_full, f);
+        }
+        sim.num_sent ++;
+        pthread_mutex_unlock(&sim.mutex);
+    }
+    return NULL;
+}
+
+static int op_get_input(void *user, void **inputp)
+{
+    (void) user;
+    *inputp = queue_pop_timed(&sim.raw_full);
+    return (*inputp == NULL) ? RPIGRAFX_TIMED_OUT : 0;
+}
+
+static int op_get_output(void *user, void **outputp)
+{
+    (void) user;
+    *outputp = queue_pop_timed(&sim.out_free);
+    return (*outputp == NULL) ? RPIGRAFX_TIMED_OUT : 0;
+}
+
+static int op_process(void *user, void *input, void *output)
+{
+    (void) user;
+    usleep(PROCESS_US);
+    memcpy(output, input, sizeof(struct frame));
+    return 0;
+}
+
+static void op_release_input(void *user, void *input)
+{
+    (void) user;
+    queue_push(&sim.raw_free, input);
+}
+
+static int op_put_output(void *user, void *output)
+{
+    struct frame *f;
+
+    (void) user;
+    queue_push(&sim.out_done, output);
+    pthread_mutex_lock(&sim.out_done.mutex);
+    while (sim.out_done.len > 1) {
+        pthread_mutex_unlock(&sim.out_done.mutex);
+        if ((f = queue_pop(&sim.out_done, 0)) != NULL)
+            queue_push(&sim.out_free, f);
+        pthread_mutex_lock(&sim.out_done.mutex);
+    }
+    pthread_mutex_unlock(&sim.out_done.mutex);
+    return 0;
+}
+
+static void op_release_output(void *user, void *output)
+{
+    (void) user;
+    queue_push(&sim.out_free, output);
+}
+
+static const struct priv_rpigrafx_pipeline_ops ops = {
+    .get_input = op_get_input,
+    .get_output = op_get_output,
+    .process = op_process,
+    .release_input = op_release_input,
+    .put_output = op_put_output,
+    .release_output = op_release_output,
+};
+
+/* Wait for a finished frame and give back all but the newest one. */
+static struct frame* take_newest(void)
+{
+    struct frame *f = queue_pop(&sim.out_done, !0), *newer;
+
+    while ((newer = queue_pop(&sim.out_done, 0)) != NULL) {
+        queue_push(&sim.out_free, f);
+        f = newer;
+    }
+    return f;
+}
+
+static void sim_start(const _Bool is_stalled)
+{
+    int i;
+
+    queue_init(&sim.raw_free);
+    queue_init(&sim.raw_full);
+    queue_init(&sim.out_free);
+    queue_init(&sim.out_done);
+    for (i = 0; i < NUM_RAW; i ++)
+        queue_push(&sim.raw_free, &sim.raw[i]);
+    for (i = 0; i < NUM_OUT; i ++)
+        queue_push(&sim.out_free, &sim.out[i]);
+    pthread_mutex_init(&sim.mutex, NULL);
+    sim.quit = 0;
+    sim.is_stalled = is_stalled;
+    sim.num_sent = sim.num_dropped = 0;
+    _check(pthread_create(&sim.thread, NULL, sensor_main, NULL));
+}
+
+static void sim_stop(struct priv_rpigrafx_pipeline *pl)
+{
+    struct frame *f;
+
+    /* Leave free buffers so that the pipeline thread can finish its frame. */
+    while ((f = queue_pop(&sim.out_done, 0)) != NULL)
+        queue_push(&sim.out_free, f);
+    priv_rpigrafx_pipeline_destroy(pl);
+
+    pthread_mutex_lock(&sim.mutex);
+    sim.quit = !0;
+    pthread_mutex_unlock(&sim.mutex);
+    pthread_join(sim.thread, NULL);
+}
+
+/*
+ * Take NUM_TAKES frames spending work_us on each. The frames must be taken in
+ * order and must be the newest ones: at most one frame newer than the taken
+ * one may be in processing. Return the mean interval between the takes.
+ */
+static double run(const int work_us, uint64_t *num_processedp)
+{
+    struct priv_rpigrafx_pipeline *pl = NULL;
+    double start, max_latency = 0;
+    int64_t prev_seq = -1;
+    int i;
+
+    sim_start(0);
+    _check(priv_rpigrafx_pipeline_create(&pl, &ops, NULL));
+
+    /* Let the pipeline fill up. */
+    usleep(PERIOD_US * 5);
+    queue_push(&sim.out_free, take_newest());
+
+    start = get_time();
+    for (i = 0; i < NUM_TAKES; i ++) {
+        struct frame *f = take_newest();
+        const double latency = get_time() - f->captured;
+
+        if ((int64_t) f->seq <= prev_seq) {
+            fprintf(stderr, "error: Frame %llu taken after %lld\n",
+                    (unsigned long long) f->seq, (long long) prev_seq);
+            exit(EXIT_FAILURE);
+        }
+        prev_seq = f->seq;
+        if (latency > max_latency)
+            max_latency = latency;
+
+        usleep(work_us);
+        queue_push(&sim.out_free, f);
+    }
+    start = get_time() - start;
+
+    _check(priv_rpigrafx_pipeline_status(pl));
+    *num_processedp = priv_rpigrafx_pipeline_num_frames(pl);
+    sim_stop(pl);
+
+    printf("work %5.1f ms: %5.1f ms/frame, max latency %5.1f ms, "
+           "%llu sent, %llu dropped by sensor, %llu processed\n",
+           work_us * 1e-3, start / NUM_TAKES * 1e3, max_latency * 1e3,
+           (unsigned long long) sim.num_sent,
+           (unsigned long long) sim.num_dropped,
+           (unsigned long long) *num_processedp);
+
+    /* Captured, processed, then waiting for at most one period. */
+    if (max_latency > (PROCESS_US + 2 * PERIOD_US) * 1e-6) {
+        fprintf(stderr, "error: A stale frame was taken\n");
+        exit(EXIT_FAILURE);
+    }
+    return start / NUM_TAKES;
+}
+
+/* The pipeline stops soon even if the sensor never sends a frame. */
+static void run_stalled(void)
+{
+    struct priv_rpigrafx_pipeline *pl = NULL;
+    double start;
+
+    sim_start(!0);
+    _check(priv_rpigrafx_pipeline_create(&pl, &ops, NULL));
+    usleep(POLL_US * 3);
+    _check(priv_rpigrafx_pipeline_status(pl));
+
+    start = get_time();
+    sim_stop(pl);
+    start = get_time() - start;
+    printf("stalled sensor: stopped in %5.1f ms\n", start * 1e3);
+    if (start > (2 * POLL_US + PERIOD_US) * 1e-6) {
+        fprintf(stderr, "error: The pipeline hung on a stalled sensor\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main()
+{
+    uint64_t num_processed;
+    double interval;
+
+    /*
+     * Processing and the user's work take longer than a period in total but
+     * overlap, so every frame reaches the user.
+     */
+    interval = run(PERIOD_US * 6 / 10, &num_processed);
+    if (interval > PERIOD_US * 1.2e-6) {
+        fprintf(stderr, "error: Processing does not overlap the user\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * A slow user gets the newest frames and the pipeline keeps processing at
+     * the sensor rate instead of stalling.
+     */
+    interval = run(PERIOD_US * 35 / 10, &num_processed);
+    if (num_processed < (sim.num_sent - sim.num_dropped) * 8 / 10) {
+        fprintf(stderr, "error: The pipeline stalled on the user\n");
+        exit(EXIT_FAILURE);
+    }
+
+    run_stalled();
+
+    fprintf(stderr, "OK\n");
+    return 0;
+}
@@ -0,0 +1,237 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include "raw_pack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define WIDTH    640
+#define HEIGHT   480
+#define NTHREADS 3
+
+static const char *pattern_names[] = {"BGGR", "GRBG", "GBRG", "RGGB"};
+
+/* Samples of random colors in blocks, with some saturated ones. */
+static void make_samples(uint16_t *v)
+{
+    int x, y;
+
+    srand(1);
+    for (y = 0; y < HEIGHT; y ++)
+        for (x = 0; x < WIDTH; x ++)
+            v[y * WIDTH + x] = (rand() % 50 == 0) ? 1023
+                               : (x / 7 * 37 + y / 5 * 91 + (x & 1) * 300
+                                  + (y & 1) * 500 + rand() % 16) % 1024;
+}
+
+/* Samples flipped horizontally if fx and vertically if fy. */
+static void flip_samples(uint16_t *dst, const uint16_t *src, const int fx,
+                         const int fy)
+{
+    int x, y;
+
+    for (y = 0; y < HEIGHT; y ++)
+        for (x = 0; x < WIDTH; x ++)
+            dst[y * WIDTH + x] = src[(fy ? HEIGHT - 1 - y : y) * WIDTH
+                                     + (fx ? WIDTH - 1 - x : x)];
+}
+
+static const struct {
+    const char *name;
+    unsigned nbits;
+    MMAL_FOURCC_T encoding;
+    rpigrafx_demosaic_mode_t mode;
+    _Bool superpixel, calib;
+} cases[] = {
+    {"fused10",    10, MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+     0,  0},
+    {"fused12",    12, MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+     0,  0},
+    {"fused-i420", 10, MMAL_ENCODING_I420,      RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+     0,  0},
+    {"fused-cal",  10, MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+     0, !0},
+    {"nearest",    10, RPIGRAFX_ENCODING_RGB48, RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+     0,  0},
+    {"bilinear",   10, MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_BILINEAR,
+     0, !0},
+    {"edge-aware", 12, RPIGRAFX_ENCODING_RGB48,
+     RPIGRAFX_DEMOSAIC_MODE_EDGE_AWARE, 0, 0},
+    {"superpixel", 10, MMAL_ENCODING_I420,      RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+     !0, !0},
+};
+
+/* Compare plane a with plane b flipped, of w x h samples of size bytes. */
+static void check_flipped(const char *name, const char *pattern,
+                          const uint8_t *a, const uint8_t *b,
+                          const int32_t stride, const int32_t w,
+                          const int32_t h, const int size, const int fx,
+                          const int fy)
+{
+    int32_t x, y;
+
+    for (y = 0; y < h; y ++) {
+        for (x = 0; x < w; x ++) {
+            const uint8_t *p = a + y * stride + x * size,
+                          *q = b + (fy ? h - 1 - y : y) * stride
+                                 + (fx ? w - 1 - x : x) * size;
+            if (memcmp(p, q, size)) {
+                fprintf(stderr, "error: %s: %s: (%d, %d) differs from the "
+                                "flipped BGGR frame\n", name, pattern, x, y);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+/*
+ * Flipping a BGGR frame gives a frame of each of the other patterns. Each
+ * of them must be processed into the flipped output of the BGGR frame with
+ * the same statistics, which is only true if every kernel takes R, G and B
+ * from the right places.
+ */
+int main()
+{
+    const int32_t y_stride = WIDTH, y_height = HEIGHT;
+    struct priv_rpigrafx_raw_scratch scratch = {0};
+    struct priv_rpigrafx_pool *pool = NULL;
+    struct priv_rpigrafx_calib calib;
+    struct priv_rpigrafx_calib_map maps[4];
+    uint16_t *v, *vf;
+    uint8_t *raw, *ref, *dst;
+    int raw_stride, i, p, k;
+
+    v = malloc(sizeof(uint16_t) * WIDTH * HEIGHT);
+    vf = malloc(sizeof(uint16_t) * WIDTH * HEIGHT);
+    raw_stride = priv_rpigrafx_raw_stride(WIDTH, 12);
+    raw = malloc(raw_stride * HEIGHT);
+    ref = malloc(WIDTH * HEIGHT * 6);
+    dst = malloc(WIDTH * HEIGHT * 6);
+    if (v == NULL || vf == NULL || raw == NULL || ref == NULL || dst == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    _check(priv_rpigrafx_pool_create(&pool, NTHREADS, 0));
+    _check(priv_rpigrafx_raw_scratch_reserve(&scratch,
+                              priv_rpigrafx_raw_scratch_size(WIDTH, NTHREADS)));
+    priv_rpigrafx_unpack_init();
+    make_samples(v);
+
+    /* Flat gains which differ by channel, so that they follow the pattern. */
+    priv_rpigrafx_calib_init(&calib);
+    calib.black_level = 32;
+    calib.black_level_bits = 10;
+    calib.grid_width = calib.grid_height = 2;
+    for (i = 0; i < 3; i ++) {
+        calib.grid[i] = malloc(sizeof(float) * 4);
+        if (calib.grid[i] == NULL) {
+            fprintf(stderr, "error: Failed to allocate the grid\n");
+            exit(EXIT_FAILURE);
+        }
+        calib.grid[i][0] = calib.grid[i][1] = calib.grid[i][2]
+                         = calib.grid[i][3] = 1.0f + 0.4f * i;
+    }
+    for (p = 0; p < 4; p ++) {
+        priv_rpigrafx_calib_map_init(&maps[p]);
+        _check(priv_rpigrafx_calib_map_build(&maps[p], &calib, WIDTH, HEIGHT,
+                                             10, p));
+    }
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i ++) {
+        const _Bool is_rgb48 = cases[i].encoding == RPIGRAFX_ENCODING_RGB48,
+                    is_yuv = cases[i].encoding == MMAL_ENCODING_I420;
+        const int32_t out_width = cases[i].superpixel ? WIDTH / 2 : WIDTH,
+                      out_height = cases[i].superpixel ? HEIGHT / 2 : HEIGHT,
+                      size = is_yuv ? 1 : is_rgb48 ? 6 : 3;
+        uint32_t sat_ref = 0, hist_ref[3][256];
+        struct priv_rpigrafx_awb_stats awb_ref;
+
+        raw_stride = priv_rpigrafx_raw_stride(WIDTH, cases[i].nbits);
+        for (p = 0; p < 4; p ++) {
+            /* B is at (bx, by) of the quads of pattern p. */
+            const int bx = p == RPIGRAFX_BAYER_PATTERN_GBRG
+                           || p == RPIGRAFX_BAYER_PATTERN_RGGB,
+                      by = p == RPIGRAFX_BAYER_PATTERN_GRBG
+                           || p == RPIGRAFX_BAYER_PATTERN_RGGB;
+            uint8_t *out = (p == 0) ? ref : dst;
+            uint32_t sat = 0, hist[3][256];
+            struct priv_rpigrafx_awb_stats awb;
+            struct priv_rpigrafx_raw_job job = {
+                .src = raw,
+                .src_stride = raw_stride,
+                .nbits = cases[i].nbits,
+                .width = WIDTH,
+                .height = HEIGHT,
+                .bayer_pattern = p,
+                .demosaic_mode = cases[i].mode,
+                .superpixel = cases[i].superpixel,
+                .calib = cases[i].calib ? &maps[p] : NULL,
+                .gain_r = 1.5, .gain_g = 1, .gain_b = 1.6,
+                .encoding = cases[i].encoding,
+                .dst = out,
+                .dst_stride = out_width * size,
+                .dst_cb = out + y_stride * y_height,
+                .dst_cr = out + y_stride * y_height * 5 / 4,
+                .dst_chroma_stride = out_width / 2,
+                .num_saturated = &sat,
+                .awb_stats = &awb,
+                .hist_r = hist[0], .hist_g = hist[1], .hist_b = hist[2]
+            };
+
+            flip_samples(vf, v, bx, by);
+            /* RAW12 of the same samples with 2 more bits. */
+            if (cases[i].nbits == 12)
+                for (k = 0; k < WIDTH * HEIGHT; k ++)
+                    vf[k] = vf[k] << 2 | (vf[k] & 3);
+            pack_raw(raw, raw_stride, vf, WIDTH, HEIGHT, cases[i].nbits);
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+            if (p == 0) {
+                sat_ref = sat;
+                awb_ref = awb;
+                memcpy(hist_ref, hist, sizeof(hist));
+                continue;
+            }
+
+            check_flipped(cases[i].name, pattern_names[p], dst, ref,
+                          out_width * size, out_width, out_height, size,
+                          bx, by);
+            if (is_yuv) {
+                check_flipped(cases[i].name, pattern_names[p], job.dst_cb,
+                              ref + (job.dst_cb - dst), out_width / 2,
+                              out_width / 2, out_height / 2, 1, bx, by);
+                check_flipped(cases[i].name, pattern_names[p], job.dst_cr,
+                              ref + (job.dst_cr - dst), out_width / 2,
+                              out_width / 2, out_height / 2, 1, bx, by);
+            }
+            if (sat != sat_ref || memcmp(&awb, &awb_ref, sizeof(awb))
+                    || memcmp(hist, hist_ref, sizeof(hist))) {
+                fprintf(stderr, "error: %s: %s: Statistics differ from "
+                                "BGGR\n", cases[i].name, pattern_names[p]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        printf("%-10s: OK\n", cases[i].name);
+    }
+
+    for (p = 0; p < 4; p ++)
+        priv_rpigrafx_calib_map_free(&maps[p]);
+    priv_rpigrafx_calib_free(&calib);
+    priv_rpigrafx_raw_scratch_free(&scratch);
+    priv_rpigrafx_pool_destroy(pool);
+    free(v);
+    free(vf);
+    free(raw);
+    free(ref);
+    free(dst);
+    fprintf(stderr, "OK\n");
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include "raw_pack.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define WIDTH    1280
+#define HEIGHT   720
+#define BORDER   4
+#define NRUNS    10
+#define NTHREADS 3
+
+static const char *mode_names[] = {
+    [RPIGRAFX_DEMOSAIC_MODE_NEAREST]    = "nearest",
+    [RPIGRAFX_DEMOSAIC_MODE_BILINEAR]   = "bilinear",
+    [RPIGRAFX_DEMOSAIC_MODE_EDGE_AWARE] = "edge-aware",
+};
+
+/* Minimum PSNR in dB which each mode must achieve on the test scene. */
+static const double min_psnr[] = {
+    [RPIGRAFX_DEMOSAIC_MODE_NEAREST]    = 28.0,
+    [RPIGRAFX_DEMOSAIC_MODE_BILINEAR]   = 32.0,
+    [RPIGRAFX_DEMOSAIC_MODE_EDGE_AWARE] = 36.0,
+};
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * Ground-truth RGB scene. Like natural images the channels are correlated: a
+ * luminance pattern of a sine wave, sharp-edged boxes and a disc which are not
+ * aligned to the 2x2 Bayer quads, modulated by a slowly varying tint.
+ */
+static void make_scene(uint8_t *rgb, const int width, const int height)
+{
+    int x, y, c;
+
+    for (y = 0; y < height; y ++) {
+        for (x = 0; x < width; x ++) {
+            const int dx = x - width / 2, dy = y - height / 2;
+            const double tint[3] = {
+                0.6 + 0.4 * x / width,
+                0.8,
+                0.6 + 0.4 * y / height,
+            };
+            double l = 140 + 60 * sin(x * 0.15) * cos(y * 0.1);
+
+            if (((x + 13) / 61 + (y + 7) / 53) % 5 == 0)
+                l *= 0.4;
+            if (dx * dx + dy * dy < 150 * 150)
+                l = 255 - l;
+            for (c = 0; c < 3; c ++) {
+                const double v = l * tint[c];
+                rgb[(y * width + x) * 3 + c] = v < 0 ? 0 : v > 255 ? 255 : v;
+            }
+        }
+    }
+}
+
+/* Sample rgb through a BGGR CFA as 10-bit samples. */
+static void mosaic(uint16_t *v, const uint8_t *rgb, const int width,
+                   const int height)
+{
+    int x, y;
+
+    for (y = 0; y < height; y ++)
+        for (x = 0; x < width; x ++)
+            v[y * width + x] =
+                    rgb[(y * width + x) * 3 + bggr_channel(x, y)] << 2;
+}
+
+static double calc_psnr(const uint8_t *ref, const uint8_t *img,
+                        const int width, const int height)
+{
+    double sse = 0;
+    long n = 0;
+    int x, y, c;
+
+    for (y = BORDER; y < height - BORDER; y ++) {
+        for (x = BORDER; x < width - BORDER; x ++) {
+            for (c = 0; c < 3; c ++) {
+                const double d = (double) ref[(y * width + x) * 3 + c]
+                                 - img[(y * width + x) * 3 + c];
+                sse += d * d;
+                n ++;
+            }
+        }
+    }
+    if (sse == 0)
+        return INFINITY;
+    return 10 * log10(255.0 * 255.0 * n / sse);
+}
+
+int main()
+{
+    const int raw_stride = ALIGN_UP(WIDTH * 5 / 4, 32);
+    uint16_t *v;
+    uint8_t *ref, *raw, *rgb, *rgb_mt;
+    uint32_t hist[3][256], hist_mt[3][256];
+    struct priv_rpigrafx_raw_scratch scratch = {0};
+    struct priv_rpigrafx_pool *pool = NULL;
+    double prev_psnr = 0;
+    int mode, i;
+
+    v = malloc(sizeof(*v) * WIDTH * HEIGHT);
+    ref = malloc(WIDTH * HEIGHT * 3);
+    raw = calloc(raw_stride, HEIGHT);
+    rgb = malloc(WIDTH * HEIGHT * 3);
+    rgb_mt = malloc(WIDTH * HEIGHT * 3);
+    if (v == NULL || ref == NULL || raw == NULL || rgb == NULL
+            || rgb_mt == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    _check(priv_rpigrafx_pool_create(&pool, NTHREADS, 0));
+    _check(priv_rpigrafx_raw_scratch_reserve(&scratch,
+                             priv_rpigrafx_raw_scratch_size(WIDTH, NTHREADS)));
+
+    make_scene(ref, WIDTH, HEIGHT);
+    mosaic(v, ref, WIDTH, HEIGHT);
+    pack_raw(raw, raw_stride, v, WIDTH, HEIGHT, 10);
+    free(v);
+
+    for (mode = RPIGRAFX_DEMOSAIC_MODE_NEAREST;
+            mode <= RPIGRAFX_DEMOSAIC_MODE_EDGE_AWARE; mode ++) {
+        const struct priv_rpigrafx_raw_job job = {
+            .src = raw,
+            .src_stride = raw_stride,
+            .nbits = 10,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .demosaic_mode = mode,
+            .encoding = MMAL_ENCODING_RGB24,
+            .gain_r = 1.0,
+            .gain_g = 1.0,
+            .gain_b = 1.0,
+            .dst = rgb,
+            .dst_stride = WIDTH * 3,
+            .hist_r = hist[0],
+            .hist_g = hist[1],
+            .hist_b = hist[2],
+        };
+        struct priv_rpigrafx_raw_job job_mt = job;
+        double start, psnr;
+
+        start = get_time();
+        for (i = 0; i < NRUNS; i ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, NULL));
+        start = get_time() - start;
+
+        psnr = calc_psnr(ref, rgb, WIDTH, HEIGHT);
+        printf("%-10s: PSNR %6.2f dB, %8.2f Mpx/s\n", mode_names[mode], psnr,
+               (double) WIDTH * HEIGHT * NRUNS / start * 1e-6);
+
+        if (psnr < min_psnr[mode]) {
+            fprintf(stderr, "error: PSNR of %s is below %.1f dB\n",
+                    mode_names[mode], min_psnr[mode]);
+            exit(EXIT_FAILURE);
+        }
+        if (psnr <= prev_psnr) {
+            fprintf(stderr, "error: %s is not better than the previous mode\n",
+                    mode_names[mode]);
+            exit(EXIT_FAILURE);
+        }
+        prev_psnr = psnr;
+
+        /* Splitting into bands must not change the result. */
+        job_mt.dst = rgb_mt;
+        job_mt.hist_r = hist_mt[0];
+        job_mt.hist_g = hist_mt[1];
+        job_mt.hist_b = hist_mt[2];
+        _check(priv_rpigrafx_raw_process(&job_mt, scratch.base, pool));
+        if (memcmp(rgb, rgb_mt, WIDTH * HEIGHT * 3)
+                || memcmp(hist, hist_mt, sizeof(hist))) {
+            fprintf(stderr, "error: %s differs with %d threads\n",
+                    mode_names[mode], NTHREADS);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    priv_rpigrafx_pool_destroy(pool);
+    priv_rpigrafx_raw_scratch_free(&scratch);
+    free(ref);
+    free(raw);
+    free(rgb);
+    free(rgb_mt);
+    fprintf(stderr, "OK\n");
+    return 0;
+}
@@ -0,0 +1,305 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include "raw_pack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define WIDTH     640
+#define HEIGHT    480
+#define NTHREADS  3
+#define NRUNS     10
+#define THRESHOLD 64
+#define PATH      "test_raw_dpc.txt"
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * RAW10 samples of smooth gradients with noise, a vertical edge and a bright
+ * line of two pixels wide, none of which are saturated or are defects.
+ */
+static void make_samples(uint16_t *v)
+{
+    static const int base[3] = {200, 300, 150};
+    int x, y;
+
+    srand(1);
+    for (y = 0; y < HEIGHT; y ++) {
+        for (x = 0; x < WIDTH; x ++) {
+            const int c = bggr_channel(x, y);
+            int s = base[c] + x * 200 / WIDTH + y * 150 / HEIGHT
+                    + rand() % 7 - 3;
+            if (x >= 400)
+                s += 250;
+            if (x == 200 || x == 201)
+                s = 850;
+            v[y * WIDTH + x] = s;
+        }
+    }
+}
+
+/*
+ * Hot and dead pixels, isolated from each other and from the bright line,
+ * including some at the borders. Returns the number of them.
+ */
+static int make_defects(uint16_t *v, uint16_t defects[][2])
+{
+    int i, j, n = 0;
+
+    for (j = 0; 5 + 12 * j < HEIGHT; j ++) {
+        for (i = 0; 7 + 16 * i + 3 < WIDTH; i ++) {
+            const int x = 7 + 16 * i + (j & 3), y = 5 + 12 * j;
+            if (x >= 196 && x <= 205)
+                continue;
+            defects[n][0] = x;
+            defects[n][1] = y;
+            n ++;
+        }
+    }
+    defects[n][0] = 0;           defects[n ++][1] = 101;
+    defects[n][0] = WIDTH - 1;   defects[n ++][1] = 203;
+    defects[n][0] = 300;         defects[n ++][1] = 0;
+    defects[n][0] = 301;         defects[n ++][1] = HEIGHT - 1;
+    for (i = 0; i < n; i ++)
+        v[defects[i][1] * WIDTH + defects[i][0]] = (i % 3 == 2) ? 0 : 1023;
+    return n;
+}
+
+/* A calibration of no black level and no lens shading, of the defects. */
+static void write_calibration(const uint16_t defects[][2], const int n)
+{
+    FILE *fp = fopen(PATH, "w");
+    int i;
+
+    if (fp == NULL) {
+        fprintf(stderr, "error: Failed to open %s\n", PATH);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "# Defects of test_raw_dpc\nblack_level 0 10\n");
+    for (i = 0; i < n; i ++)
+        fprintf(fp, "defect %u %u\n", defects[i][0], defects[i][1]);
+    /* Given twice and outside the frame, which must be harmless. */
+    fprintf(fp, "defect %u %u\ndefect %d 0\n", defects[0][0], defects[0][1],
+            WIDTH);
+    fclose(fp);
+}
+
+static const struct {
+    const char *name;
+    MMAL_FOURCC_T encoding;
+    rpigrafx_demosaic_mode_t mode;
+    _Bool superpixel;
+    /* Largest difference from the frame without defects. */
+    int tolerance;
+} cases[] = {
+    {"fused",      MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+     0,  2},
+    {"bilinear",   MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_BILINEAR,
+     0,  4},
+    {"edge-aware", RPIGRAFX_ENCODING_RGB48, RPIGRAFX_DEMOSAIC_MODE_EDGE_AWARE,
+     0, 24},
+    {"superpixel", MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+     !0, 2},
+};
+
+/* Return the largest difference of the samples of the output frames a and b. */
+static int compare(const uint8_t *a, const uint8_t *b, const int32_t stride,
+                   const int32_t width, const int32_t height,
+                   const _Bool is_rgb48)
+{
+    int32_t x, y;
+    int worst = 0;
+
+    for (y = 0; y < height; y ++) {
+        for (x = 0; x < width * 3; x ++) {
+            const int p = is_rgb48 ? ((const uint16_t*) (a + y * stride))[x]
+                                   : a[y * stride + x],
+                      q = is_rgb48 ? ((const uint16_t*) (b + y * stride))[x]
+                                   : b[y * stride + x],
+                      e = abs(p - q);
+            worst = (e > worst) ? e : worst;
+        }
+    }
+    return worst;
+}
+
+/*
+ * Frames without defects must come out unchanged with the dynamic correction,
+ * and frames with defects must come out close to them with either the
+ * dynamic or the static correction, with no saturated samples left.
+ */
+int main()
+{
+    const int raw_stride = priv_rpigrafx_raw_stride(WIDTH, 10);
+    struct priv_rpigrafx_raw_scratch scratch = {0};
+    struct priv_rpigrafx_pool *pool = NULL;
+    struct priv_rpigrafx_calib calib;
+    struct priv_rpigrafx_calib_map map;
+    static uint16_t defects[WIDTH * HEIGHT / 100][2];
+    uint16_t *v;
+    uint8_t *clean, *dirty, *ref, *dst;
+    int i, num_defects;
+
+    v = malloc(sizeof(uint16_t) * WIDTH * HEIGHT);
+    clean = malloc(raw_stride * HEIGHT);
+    dirty = malloc(raw_stride * HEIGHT);
+    ref = malloc(WIDTH * HEIGHT * 6);
+    dst = malloc(WIDTH * HEIGHT * 6);
+    if (v == NULL || clean == NULL || dirty == NULL || ref == NULL
+            || dst == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    _check(priv_rpigrafx_pool_create(&pool, NTHREADS, 0));
+    _check(priv_rpigrafx_raw_scratch_reserve(&scratch,
+                              priv_rpigrafx_raw_scratch_size(WIDTH, NTHREADS)));
+    priv_rpigrafx_unpack_init();
+
+    make_samples(v);
+    pack_raw(clean, raw_stride, v, WIDTH, HEIGHT, 10);
+    num_defects = make_defects(v, defects);
+    pack_raw(dirty, raw_stride, v, WIDTH, HEIGHT, 10);
+
+    write_calibration(defects, num_defects);
+    priv_rpigrafx_calib_init(&calib);
+    priv_rpigrafx_calib_map_init(&map);
+    _check(priv_rpigrafx_calib_load(&calib, PATH));
+    remove(PATH);
+    if (calib.num_defects != num_defects + 2) {
+        fprintf(stderr, "error: %d defects were loaded, expected %d\n",
+                calib.num_defects, num_defects + 2);
+        exit(EXIT_FAILURE);
+    }
+    _check(priv_rpigrafx_calib_map_build(&map, &calib, WIDTH, HEIGHT, 10,
+                                         RPIGRAFX_BAYER_PATTERN_BGGR));
+    if (map.defect_index[HEIGHT] != (uint32_t) num_defects) {
+        fprintf(stderr, "error: %u defects are in the map, expected %d\n",
+                map.defect_index[HEIGHT], num_defects);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i ++) {
+        const _Bool is_rgb48 = cases[i].encoding == RPIGRAFX_ENCODING_RGB48;
+        const int32_t out_width = cases[i].superpixel ? WIDTH / 2 : WIDTH,
+                      out_height = cases[i].superpixel ? HEIGHT / 2 : HEIGHT,
+                      out_stride = out_width * (is_rgb48 ? 6 : 3);
+        uint32_t sat_ref = 0, sat = 0;
+        struct priv_rpigrafx_raw_job job = {
+            .src = clean,
+            .src_stride = raw_stride,
+            .nbits = 10,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .demosaic_mode = cases[i].mode,
+            .superpixel = cases[i].superpixel,
+            .gain_r = 1, .gain_g = 1, .gain_b = 1,
+            .encoding = cases[i].encoding,
+            .dst = ref,
+            .dst_stride = out_stride,
+            .num_saturated = &sat_ref
+        };
+        int e, e_dynamic, e_static, k;
+        double t_off, t_on;
+
+        t_off = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+        t_off = get_time() - t_off;
+
+        /* Nothing in the clean frame must be taken for a defect. */
+        job.dst = dst;
+        job.num_saturated = &sat;
+        job.dpc_threshold = THRESHOLD;
+        _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+        if ((e = compare(dst, ref, out_stride, out_width, out_height,
+                         is_rgb48)) != 0) {
+            fprintf(stderr, "error: %s: The clean frame is changed by %d\n",
+                    cases[i].name, e);
+            exit(EXIT_FAILURE);
+        }
+
+        /* The defects must matter without the correction. */
+        job.src = dirty;
+        job.dpc_threshold = 0;
+        _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+        if (sat <= sat_ref) {
+            fprintf(stderr, "error: %s: Hot pixels are not saturated\n",
+                    cases[i].name);
+            exit(EXIT_FAILURE);
+        }
+
+        job.dpc_threshold = THRESHOLD;
+        t_on = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+        t_on = get_time() - t_on;
+        e_dynamic = compare(dst, ref, out_stride, out_width, out_height,
+                            is_rgb48);
+        if (e_dynamic > cases[i].tolerance || sat != sat_ref) {
+            fprintf(stderr, "error: %s: Dynamic correction is off by %d with "
+                            "%u saturated\n", cases[i].name, e_dynamic, sat);
+            exit(EXIT_FAILURE);
+        }
+
+        job.dpc_threshold = 0;
+        job.calib = &map;
+        _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+        e_static = compare(dst, ref, out_stride, out_width, out_height,
+                           is_rgb48);
+        if (e_static > cases[i].tolerance || sat != sat_ref) {
+            fprintf(stderr, "error: %s: Static correction is off by %d with "
+                            "%u saturated\n", cases[i].name, e_static, sat);
+            exit(EXIT_FAILURE);
+        }
+
+        printf("%-10s: off by at most %2d (dynamic) %2d (static); "
+               "%5.2f ms without, %5.2f ms with dynamic\n", cases[i].name,
+               e_dynamic, e_static, t_off / NRUNS * 1e3, t_on / NRUNS * 1e3);
+    }
+
+    {
+        struct priv_rpigrafx_raw_job job = {
+            .src = clean,
+            .src_stride = raw_stride,
+            .nbits = 10,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .dpc_threshold = 1024,
+            .gain_r = 1, .gain_g = 1, .gain_b = 1,
+            .encoding = MMAL_ENCODING_RGB24,
+            .dst = dst,
+            .dst_stride = WIDTH * 3
+        };
+        if (!priv_rpigrafx_raw_process(&job, scratch.base, pool)) {
+            fprintf(stderr, "error: A threshold of 1024 was accepted\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    priv_rpigrafx_calib_map_free(&map);
+    priv_rpigrafx_calib_free(&calib);
+    priv_rpigrafx_raw_scratch_free(&scratch);
+    priv_rpigrafx_pool_destroy(pool);
+    free(v);
+    free(clean);
+    free(dirty);
+    free(ref);
+    free(dst);
+    fprintf(stderr, "OK\n");
+    return 0;
+}
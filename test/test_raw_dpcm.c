@@ -0,0 +1,261 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include "raw_pack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define WIDTH    1280
+#define HEIGHT   720
+#define NTHREADS 3
+#define NRUNS    10
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * RAW10 samples of smooth gradients with noise, sharp vertical edges and
+ * some saturated samples, so that every kind of code is used.
+ */
+static void make_samples(uint16_t *v)
+{
+    int x, y;
+
+    srand(1);
+    for (y = 0; y < HEIGHT; y ++) {
+        for (x = 0; x < WIDTH; x ++) {
+            int s = (x * 700 / WIDTH + y * 300 / HEIGHT) + rand() % 9 - 4;
+            if ((x / 64) % 4 == 3)
+                s = 1023 - s;
+            if (rand() % 50 == 0)
+                s = 1023;
+            v[y * WIDTH + x] = (s < 0) ? 0 : (s > 1023) ? 1023 : s;
+        }
+    }
+}
+
+/*
+ * 10-8-10 DPCM encoder with Predictor1 of the MIPI CSI-2 specification. It
+ * predicts from decoded samples as the decoder does and stores them to dec.
+ */
+static void encode_line(uint8_t *dst, uint16_t *dec, const uint16_t *src,
+                        const int32_t width)
+{
+    int32_t x;
+
+    for (x = 0; x < width; x ++) {
+        int32_t pred, diff, mag, v;
+        if (x < 2) {
+            dst[x] = src[x] >> 2;
+            dec[x] = dst[x] * 4 + 2;
+            continue;
+        }
+        pred = dec[x - 2];
+        diff = src[x] - pred;
+        mag = (diff < 0) ? -diff : diff;
+        if (mag < 32) {
+            dst[x] = ((diff < 0) << 5) | mag;
+            v = pred + ((diff < 0) ? -mag : mag);
+        } else if (mag < 64) {
+            dst[x] = 0x40 | ((diff < 0) << 4) | ((mag - 32) >> 1);
+            mag = 32 + ((mag - 32) >> 1 << 1);
+            v = pred + ((diff < 0) ? -mag : mag);
+        } else if (mag < 128) {
+            dst[x] = 0x60 | ((diff < 0) << 4) | ((mag - 64) >> 2);
+            mag = 65 + ((mag - 64) >> 2 << 2);
+            v = pred + ((diff < 0) ? -mag : mag);
+        } else {
+            dst[x] = 0x80 | (src[x] >> 3);
+            v = (src[x] >> 3 << 3) + (((src[x] >> 3 << 3) > pred) ? 3 : 4);
+        }
+        dec[x] = (v < 0) ? 0 : (v > 1023) ? 1023 : v;
+    }
+}
+
+static const struct {
+    const char *name;
+    MMAL_FOURCC_T encoding;
+    rpigrafx_demosaic_mode_t mode;
+    _Bool superpixel;
+} cases[] = {
+    /* Not RGB24, of which RAW10 goes to the fused kernel of 8-bit input. */
+    {"nearest",    RPIGRAFX_ENCODING_RGB48, RPIGRAFX_DEMOSAIC_MODE_NEAREST,  0},
+    {"bilinear",   MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_BILINEAR, 0},
+    {"rgb48",      RPIGRAFX_ENCODING_RGB48, RPIGRAFX_DEMOSAIC_MODE_BILINEAR, 0},
+    {"superpixel", MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_NEAREST, !0},
+};
+
+/*
+ * Lines must decode to what the encoder reconstructed, within the error of
+ * the codes, and frames must come out as their decoded samples do as RAW10.
+ */
+int main()
+{
+    const int dpcm_stride = priv_rpigrafx_raw_stride(WIDTH, 8),
+              raw_stride = priv_rpigrafx_raw_stride(WIDTH, 10);
+    struct priv_rpigrafx_raw_scratch scratch = {0};
+    struct priv_rpigrafx_pool *pool = NULL;
+    uint16_t *orig, *dec, line[WIDTH];
+    uint8_t *dpcm, *raw, *dst, *ref;
+    int32_t x, y, worst = 0, num_pcm = 0;
+    double t;
+    int i;
+
+    orig = malloc(sizeof(uint16_t) * WIDTH * HEIGHT);
+    dec = malloc(sizeof(uint16_t) * WIDTH * HEIGHT);
+    dpcm = malloc(dpcm_stride * HEIGHT);
+    raw = malloc(raw_stride * HEIGHT);
+    dst = malloc(WIDTH * HEIGHT * 6);
+    ref = malloc(WIDTH * HEIGHT * 6);
+    if (orig == NULL || dec == NULL || dpcm == NULL || raw == NULL
+            || dst == NULL || ref == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    _check(priv_rpigrafx_pool_create(&pool, NTHREADS, 0));
+    _check(priv_rpigrafx_raw_scratch_reserve(&scratch,
+                              priv_rpigrafx_raw_scratch_size(WIDTH, NTHREADS)));
+    priv_rpigrafx_unpack_init();
+
+    make_samples(orig);
+    for (y = 0; y < HEIGHT; y ++)
+        encode_line(dpcm + y * dpcm_stride, dec + y * WIDTH, orig + y * WIDTH,
+                    WIDTH);
+    pack_raw(raw, raw_stride, dec, WIDTH, HEIGHT, 10);
+
+    t = get_time();
+    for (i = 0; i < NRUNS; i ++)
+        for (y = 0; y < HEIGHT; y ++)
+            priv_rpigrafx_dpcm10_decode_line(line, dpcm + y * dpcm_stride,
+                                             WIDTH);
+    t = get_time() - t;
+    for (y = 0; y < HEIGHT; y ++) {
+        priv_rpigrafx_dpcm10_decode_line(line, dpcm + y * dpcm_stride, WIDTH);
+        for (x = 0; x < WIDTH; x ++) {
+            const int32_t e = abs(orig[y * WIDTH + x] - line[x]);
+            if (line[x] != dec[y * WIDTH + x]) {
+                fprintf(stderr, "error: (%d, %d) decoded to %u, expected %u\n",
+                        x, y, line[x], dec[y * WIDTH + x]);
+                exit(EXIT_FAILURE);
+            }
+            if (e > ((dpcm[y * dpcm_stride + x] & 0x80) ? 4 : 2)) {
+                fprintf(stderr, "error: (%d, %d) is off by %d\n", x, y, e);
+                exit(EXIT_FAILURE);
+            }
+            worst = (e > worst) ? e : worst;
+            num_pcm += x >= 2 && (dpcm[y * dpcm_stride + x] & 0x80);
+        }
+    }
+    printf("decoding: off by at most %d, %.1f%% PCM; %.2f ms\n", worst,
+           num_pcm * 100.0 / (WIDTH * HEIGHT), t / NRUNS * 1e3);
+    if (num_pcm == 0) {
+        fprintf(stderr, "error: PCM codes are not covered\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i ++) {
+        const _Bool is_rgb48 = cases[i].encoding == RPIGRAFX_ENCODING_RGB48;
+        const int32_t out_width = cases[i].superpixel ? WIDTH / 2 : WIDTH,
+                      out_height = cases[i].superpixel ? HEIGHT / 2 : HEIGHT,
+                      out_stride = out_width * (is_rgb48 ? 6 : 3);
+        uint32_t sat_ref = 0, sat_dpcm = 0;
+        struct priv_rpigrafx_raw_job job = {
+            .src = raw,
+            .src_stride = raw_stride,
+            .nbits = 10,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .demosaic_mode = cases[i].mode,
+            .superpixel = cases[i].superpixel,
+            .gain_r = 1.5, .gain_g = 1, .gain_b = 1.6,
+            .encoding = cases[i].encoding,
+            .dst = ref,
+            .dst_stride = out_stride,
+            .num_saturated = &sat_ref
+        };
+        double t_raw10, t_dpcm;
+        int k;
+
+        t_raw10 = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+        t_raw10 = get_time() - t_raw10;
+
+        job.src = dpcm;
+        job.src_stride = dpcm_stride;
+        job.is_dpcm = !0;
+        job.dst = dst;
+        job.num_saturated = &sat_dpcm;
+        t_dpcm = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+        t_dpcm = get_time() - t_dpcm;
+
+        for (y = 0; y < out_height; y ++) {
+            for (x = 0; x < out_width * 3; x ++) {
+                const int32_t a = is_rgb48
+                                  ? ((uint16_t*) (dst + y * out_stride))[x]
+                                  : dst[y * out_stride + x],
+                              b = is_rgb48
+                                  ? ((uint16_t*) (ref + y * out_stride))[x]
+                                  : ref[y * out_stride + x];
+                if (a != b) {
+                    fprintf(stderr, "error: %s: (%d, %d) is %d, expected %d\n",
+                            cases[i].name, x / 3, y, a, b);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+        if (sat_dpcm != sat_ref) {
+            fprintf(stderr, "error: %s: Saturation count differs\n",
+                    cases[i].name);
+            exit(EXIT_FAILURE);
+        }
+        printf("%-10s: %5.2f ms RAW10, %5.2f ms DPCM\n", cases[i].name,
+               t_raw10 / NRUNS * 1e3, t_dpcm / NRUNS * 1e3);
+    }
+
+    {
+        struct priv_rpigrafx_raw_job job = {
+            .src = dpcm,
+            .src_stride = dpcm_stride,
+            .nbits = 8,
+            .is_dpcm = !0,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .gain_r = 1, .gain_g = 1, .gain_b = 1,
+            .encoding = MMAL_ENCODING_RGB24,
+            .dst = dst,
+            .dst_stride = WIDTH * 3
+        };
+        if (!priv_rpigrafx_raw_process(&job, scratch.base, pool)) {
+            fprintf(stderr, "error: DPCM of 8 bits was accepted\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    priv_rpigrafx_raw_scratch_free(&scratch);
+    priv_rpigrafx_pool_destroy(pool);
+    free(orig);
+    free(dec);
+    free(dpcm);
+    free(raw);
+    free(dst);
+    free(ref);
+    fprintf(stderr, "OK\n");
+    return 0;
+}
@@ -0,0 +1,210 @@
+#include <rpigrafx.h>
+#include <rpiraw.h>
+#include "local.h"
+#include "raw_pack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define MAX_WIDTH 3280
+
+/*
+ * Convert a packed BGGR frame to RGB888 with the fused kernel, which is what
+ * priv_rpigrafx_raw_process picks for nearest-neighbor RGB24 output.
+ */
+static void to_rgb888(uint8_t *dst, const int32_t dst_stride,
+                      const uint8_t *src, const int32_t src_stride,
+                      const unsigned nbits, const int32_t width,
+                      const int32_t height, uint32_t hist_r[256],
+                      uint32_t hist_g[256], uint32_t hist_b[256],
+                      void *scratch)
+{
+    const struct priv_rpigrafx_raw_job job = {
+        .src = src,
+        .src_stride = src_stride,
+        .nbits = nbits,
+        .width = width,
+        .height = height,
+        .bayer_pattern = RPIGRAFX_BAYER_PATTERN_BGGR,
+        .demosaic_mode = RPIGRAFX_DEMOSAIC_MODE_NEAREST,
+        .gain_r = 1.55, .gain_g = 1.0, .gain_b = 1.5,
+        .encoding = MMAL_ENCODING_RGB24,
+        .dst = dst,
+        .dst_stride = dst_stride,
+        .hist_r = hist_r, .hist_g = hist_g, .hist_b = hist_b
+    };
+
+    _check(priv_rpigrafx_raw_process(&job, scratch, NULL));
+}
+
+/*
+ * Compare the fused kernel against the four-stage librpiraw chain which was
+ * used in rpigrafx_capture_next_frame before.
+ */
+static int test_size(const int width, const int height, const unsigned seed,
+                     void *scratch)
+{
+    const int raw_width = rpiraw_width_raw8_to_raw10_rpi(width),
+              stride = ALIGN_UP(width, 32);
+    uint8_t *raw10 = NULL, *raw8 = NULL, *rgb_ref = NULL, *rgb = NULL;
+    uint32_t ref_r[256], ref_g[256], ref_b[256], hist_r[256], hist_g[256],
+             hist_b[256];
+    int x, y;
+    int ret = 0;
+
+    raw10 = malloc(raw_width * height);
+    raw8 = malloc(width * height);
+    rgb_ref = calloc(stride * height, 3);
+    rgb = calloc(stride * height, 3);
+    if (raw10 == NULL || raw8 == NULL || rgb_ref == NULL || rgb == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Synthetic Bayer frame: gradients plus noise, with some clipped areas. */
+    srand(seed);
+    for (y = 0; y < height; y ++) {
+        for (x = 0; x < raw_width; x ++) {
+            const int v = (x * 3 + y * 2) % 256 + rand() % 64 - 32;
+            raw10[y * raw_width + x] = (v < 0) ? 0 : (v > 255) ? 255 : v;
+        }
+        for (x = 0; x < raw_width / 8; x ++)
+            raw10[y * raw_width + x] = 0xff;
+    }
+
+    _check(rpiraw_convert_raw10_to_raw8(raw8, raw10, width, height,
+                                        raw_width));
+    _check(rpiraw_raw8bggr_component_gain(raw8, width, raw8, width,
+                                          width, height, 1.55, 1.0, 1.5));
+    _check(rpiraw_raw8bggr_to_rgb888_nearest_neighbor(rgb_ref, stride,
+                                                      raw8, width,
+                                                      width, height));
+    _check(rpiraw_calc_histogram_rgb888(ref_r, ref_g, ref_b, rgb_ref, stride,
+                                        width, height));
+
+    to_rgb888(rgb, stride * 3, raw10, raw_width, 10, width, height,
+              hist_r, hist_g, hist_b, scratch);
+
+    for (y = 0; y < height; y ++) {
+        if (memcmp(rgb_ref + y * stride * 3, rgb + y * stride * 3,
+                   width * 3)) {
+            fprintf(stderr, "%dx%d: RGB differs at line %d\n",
+                    width, height, y);
+            ret = 1;
+            break;
+        }
+    }
+    if (memcmp(ref_r, hist_r, sizeof(ref_r))
+            || memcmp(ref_g, hist_g, sizeof(ref_g))
+            || memcmp(ref_b, hist_b, sizeof(ref_b))) {
+        fprintf(stderr, "%dx%d: Histogram differs\n", width, height);
+        ret = 1;
+    }
+
+    free(raw10);
+    free(raw8);
+    free(rgb_ref);
+    free(rgb);
+    return ret;
+}
+
+/*
+ * RAW12 with the same upper 8 bits as a RAW10 frame must give the same result
+ * as RAW10, whatever the lower bits are.
+ */
+static int test_raw12(const int width, const int height, const unsigned seed,
+                      void *scratch)
+{
+    const int raw10_stride = priv_rpigrafx_raw_stride(width, 10),
+              raw12_stride = priv_rpigrafx_raw_stride(width, 12),
+              stride = ALIGN_UP(width, 32);
+    uint8_t *raw10 = NULL, *raw12 = NULL, *rgb10 = NULL, *rgb12 = NULL;
+    uint16_t *v10 = NULL, *v12 = NULL;
+    uint32_t hist10_r[256], hist10_g[256], hist10_b[256],
+             hist12_r[256], hist12_g[256], hist12_b[256];
+    int x, y;
+    int ret = 0;
+
+    if (raw12_stride < (width * 12 + 7) / 8 || raw12_stride % 32 != 0) {
+        fprintf(stderr, "%dx%d: Wrong RAW12 stride %d\n",
+                width, height, raw12_stride);
+        return 1;
+    }
+
+    raw10 = calloc(raw10_stride, height);
+    raw12 = calloc(raw12_stride, height);
+    rgb10 = calloc(stride * height, 3);
+    rgb12 = calloc(stride * height, 3);
+    v10 = malloc(sizeof(*v10) * width * height);
+    v12 = malloc(sizeof(*v12) * width * height);
+    if (raw10 == NULL || raw12 == NULL || rgb10 == NULL || rgb12 == NULL
+            || v10 == NULL || v12 == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(seed);
+    for (y = 0; y < height; y ++) {
+        for (x = 0; x < width; x ++) {
+            const unsigned hi = (x * 3 + y * 2 + rand() % 64) % 256;
+            v10[y * width + x] = hi << 2 | (rand() & 0x3);
+            v12[y * width + x] = hi << 4 | (rand() & 0xf);
+        }
+    }
+    pack_raw(raw10, raw10_stride, v10, width, height, 10);
+    pack_raw(raw12, raw12_stride, v12, width, height, 12);
+
+    to_rgb888(rgb10, stride * 3, raw10, raw10_stride, 10, width, height,
+              hist10_r, hist10_g, hist10_b, scratch);
+    to_rgb888(rgb12, stride * 3, raw12, raw12_stride, 12, width, height,
+              hist12_r, hist12_g, hist12_b, scratch);
+
+    if (memcmp(rgb10, rgb12, stride * height * 3)) {
+        fprintf(stderr, "%dx%d: RAW12 RGB differs from RAW10\n",
+                width, height);
+        ret = 1;
+    }
+    if (memcmp(hist10_r, hist12_r, sizeof(hist10_r))
+            || memcmp(hist10_g, hist12_g, sizeof(hist10_g))
+            || memcmp(hist10_b, hist12_b, sizeof(hist10_b))) {
+        fprintf(stderr, "%dx%d: RAW12 histogram differs from RAW10\n",
+                width, height);
+        ret = 1;
+    }
+
+    free(raw10);
+    free(raw12);
+    free(rgb10);
+    free(rgb12);
+    free(v10);
+    free(v12);
+    return ret;
+}
+
+int main()
+{
+    struct priv_rpigrafx_raw_scratch scratch = {0};
+
+    _check(priv_rpigrafx_raw_scratch_reserve(&scratch,
+                                priv_rpigrafx_raw_scratch_size(MAX_WIDTH, 1)));
+    _check(test_size(64, 32, 1, scratch.base));
+    _check(test_size(640, 480, 2, scratch.base));
+    _check(test_size(1002, 6, 3, scratch.base));
+    _check(test_size(2048, 2048, 4, scratch.base));
+    _check(test_raw12(64, 32, 5, scratch.base));
+    _check(test_raw12(1002, 6, 6, scratch.base));
+    _check(test_raw12(MAX_WIDTH, 2464, 7, scratch.base));
+    priv_rpigrafx_raw_scratch_free(&scratch);
+
+    fprintf(stderr, "OK\n");
+    return 0;
+}
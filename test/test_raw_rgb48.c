@@ -0,0 +1,202 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include "raw_pack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define WIDTH  640
+#define HEIGHT 480
+
+/*
+ * The samples must come out at full bit depth with the fixed-point gains
+ * applied, and RGB16P must have the same contents as RGB48.
+ */
+static int test_nbits(const unsigned nbits, void *scratch)
+{
+    const int raw_stride = ALIGN_UP(WIDTH * nbits / 8, 32);
+    const unsigned maxv = (1 << nbits) - 1;
+    const float gains[3] = {2.0, 1.0, 0.5};
+    uint16_t *samples = NULL, *rgb48 = NULL, *planar = NULL;
+    uint8_t *raw = NULL;
+    int mode, x, y, c;
+    int ret = 0;
+
+    samples = malloc(sizeof(*samples) * WIDTH * HEIGHT);
+    raw = calloc(raw_stride, HEIGHT);
+    rgb48 = malloc(sizeof(*rgb48) * WIDTH * HEIGHT * 3);
+    planar = malloc(sizeof(*planar) * WIDTH * HEIGHT * 3);
+    if (samples == NULL || raw == NULL || rgb48 == NULL || planar == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(nbits);
+    for (x = 0; x < WIDTH * HEIGHT; x ++)
+        samples[x] = rand() & maxv;
+    pack_raw(raw, raw_stride, samples, WIDTH, HEIGHT, nbits);
+
+    for (mode = RPIGRAFX_DEMOSAIC_MODE_NEAREST;
+            mode <= RPIGRAFX_DEMOSAIC_MODE_EDGE_AWARE; mode ++) {
+        struct priv_rpigrafx_raw_job job = {
+            .src = raw,
+            .src_stride = raw_stride,
+            .nbits = nbits,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .demosaic_mode = mode,
+            .gain_r = gains[0],
+            .gain_g = gains[1],
+            .gain_b = gains[2],
+            .encoding = RPIGRAFX_ENCODING_RGB48,
+            .dst = (uint8_t*) rgb48,
+            .dst_stride = WIDTH * 6,
+        };
+
+        _check(priv_rpigrafx_raw_process(&job, scratch, NULL));
+        job.encoding = RPIGRAFX_ENCODING_RGB16P;
+        job.dst = (uint8_t*) planar;
+        job.dst_stride = WIDTH * 2;
+        _check(priv_rpigrafx_raw_process(&job, scratch, NULL));
+
+        for (y = 0; y < HEIGHT; y ++) {
+            for (x = 0; x < WIDTH; x ++) {
+                const int ch = bggr_channel(x, y);
+                const uint32_t v = samples[y * WIDTH + x] * gains[ch],
+                               expected = (v > maxv) ? maxv : v;
+                const uint16_t got = rgb48[(y * WIDTH + x) * 3 + ch];
+
+                if (got != expected) {
+                    fprintf(stderr, "%u bits, mode %d: (%d,%d) is %u, "
+                                    "expected %u\n",
+                            nbits, mode, x, y, got, expected);
+                    ret = 1;
+                    goto end;
+                }
+                for (c = 0; c < 3; c ++) {
+                    if (rgb48[(y * WIDTH + x) * 3 + c]
+                            != planar[(c * HEIGHT + y) * WIDTH + x]) {
+                        fprintf(stderr, "%u bits, mode %d: "
+                                        "RGB16P differs at (%d,%d,%d)\n",
+                                nbits, mode, x, y, c);
+                        ret = 1;
+                        goto end;
+                    }
+                    if (rgb48[(y * WIDTH + x) * 3 + c] > maxv) {
+                        fprintf(stderr, "%u bits, mode %d: "
+                                        "(%d,%d,%d) exceeds %u\n",
+                                nbits, mode, x, y, c, maxv);
+                        ret = 1;
+                        goto end;
+                    }
+                }
+            }
+        }
+    }
+
+end:
+    free(samples);
+    free(raw);
+    free(rgb48);
+    free(planar);
+    return ret;
+}
+
+/* Each quad must become one pixel of its R, mean G and B. */
+static int test_superpixel(const unsigned nbits, void *scratch)
+{
+    const int raw_stride = ALIGN_UP(WIDTH * nbits / 8, 32);
+    const unsigned maxv = (1 << nbits) - 1;
+    uint16_t *samples = NULL, *rgb48 = NULL;
+    uint8_t *raw = NULL;
+    uint32_t hist_r[256], hist_g[256], hist_b[256], total = 0;
+    int x, y;
+    int ret = 0;
+
+    samples = malloc(sizeof(*samples) * WIDTH * HEIGHT);
+    raw = calloc(raw_stride, HEIGHT);
+    rgb48 = malloc(sizeof(*rgb48) * WIDTH / 2 * HEIGHT / 2 * 3);
+    if (samples == NULL || raw == NULL || rgb48 == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    srand(nbits + 100);
+    for (x = 0; x < WIDTH * HEIGHT; x ++)
+        samples[x] = rand() & maxv;
+    pack_raw(raw, raw_stride, samples, WIDTH, HEIGHT, nbits);
+
+    {
+        const struct priv_rpigrafx_raw_job job = {
+            .src = raw,
+            .src_stride = raw_stride,
+            .nbits = nbits,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .superpixel = !0,
+            .gain_r = 1.0,
+            .gain_g = 1.0,
+            .gain_b = 1.0,
+            .encoding = RPIGRAFX_ENCODING_RGB48,
+            .dst = (uint8_t*) rgb48,
+            .dst_stride = WIDTH / 2 * 6,
+            .hist_r = hist_r,
+            .hist_g = hist_g,
+            .hist_b = hist_b,
+        };
+        _check(priv_rpigrafx_raw_process(&job, scratch, NULL));
+    }
+
+    for (y = 0; y < HEIGHT / 2; y ++) {
+        for (x = 0; x < WIDTH / 2; x ++) {
+            const uint16_t *s0 = samples + 2 * y * WIDTH + 2 * x,
+                           *s1 = s0 + WIDTH,
+                           *p = rgb48 + (y * WIDTH / 2 + x) * 3;
+            if (p[0] != s1[1] || p[1] != (s0[1] + s1[0] + 1) / 2
+                    || p[2] != s0[0]) {
+                fprintf(stderr, "%u bits: superpixel (%d,%d) differs\n",
+                        nbits, x, y);
+                ret = 1;
+                goto end;
+            }
+        }
+    }
+    for (x = 0; x < 256; x ++)
+        total += hist_g[x];
+    if (total != WIDTH * HEIGHT) {
+        fprintf(stderr, "%u bits: histogram counts %u pixels\n",
+                nbits, total);
+        ret = 1;
+    }
+
+end:
+    free(samples);
+    free(raw);
+    free(rgb48);
+    return ret;
+}
+
+int main()
+{
+    struct priv_rpigrafx_raw_scratch scratch = {0};
+
+    _check(priv_rpigrafx_raw_scratch_reserve(&scratch,
+                                    priv_rpigrafx_raw_scratch_size(WIDTH, 1)));
+    _check(test_nbits(10, scratch.base));
+    _check(test_nbits(12, scratch.base));
+    _check(test_superpixel(10, scratch.base));
+    _check(test_superpixel(12, scratch.base));
+    priv_rpigrafx_raw_scratch_free(&scratch);
+
+    fprintf(stderr, "OK\n");
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include "raw_pack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define WIDTH    1280
+#define HEIGHT   720
+#define NTHREADS 3
+#define NRUNS    10
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Random 10-bit samples of which about a fifth are saturated. */
+static void make_samples(uint16_t *v)
+{
+    int i;
+
+    srand(1);
+    for (i = 0; i < WIDTH * HEIGHT; i ++)
+        v[i] = (rand() % 5 == 0) ? 1023 : rand() % 1024;
+}
+
+static const struct {
+    const char *name;
+    MMAL_FOURCC_T encoding;
+    rpigrafx_demosaic_mode_t mode;
+    _Bool superpixel;
+} cases[] = {
+    {"fused",      MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_NEAREST,  0},
+    {"bilinear",   MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_BILINEAR, 0},
+    {"rgb48",      RPIGRAFX_ENCODING_RGB48, RPIGRAFX_DEMOSAIC_MODE_BILINEAR, 0},
+    {"superpixel", MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_NEAREST, !0},
+};
+
+/*
+ * The saturation count on every pixel must equal the 255 bins of the
+ * histograms, must not depend on the number of threads, and on a grid must
+ * estimate it closely.
+ */
+int main()
+{
+    const int raw_stride = ALIGN_UP(WIDTH * 5 / 4, 32);
+    struct priv_rpigrafx_raw_scratch scratch = {0};
+    struct priv_rpigrafx_pool *pool = NULL;
+    uint32_t hist[3][256];
+    uint16_t *v;
+    uint8_t *raw, *dst;
+    int i;
+
+    v = malloc(sizeof(*v) * WIDTH * HEIGHT);
+    raw = calloc(raw_stride, HEIGHT);
+    dst = malloc(WIDTH * HEIGHT * 6);
+    if (v == NULL || raw == NULL || dst == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    make_samples(v);
+    pack_raw(raw, raw_stride, v, WIDTH, HEIGHT, 10);
+    free(v);
+    _check(priv_rpigrafx_pool_create(&pool, NTHREADS, 0));
+    _check(priv_rpigrafx_raw_scratch_reserve(&scratch,
+                             priv_rpigrafx_raw_scratch_size(WIDTH, NTHREADS)));
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i ++) {
+        const int32_t out_width = cases[i].superpixel ? WIDTH / 2 : WIDTH;
+        uint32_t num_sat, num_sat_mt, num_sat_grid, expected;
+        struct priv_rpigrafx_raw_job job = {
+            .src = raw,
+            .src_stride = raw_stride,
+            .nbits = 10,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .demosaic_mode = cases[i].mode,
+            .superpixel = cases[i].superpixel,
+            .gain_r = 1.5, .gain_g = 1.0, .gain_b = 0.8,
+            .encoding = cases[i].encoding,
+            .dst = dst,
+            .dst_stride = out_width
+                    * (cases[i].encoding == MMAL_ENCODING_RGB24 ? 3 : 6),
+            .num_saturated = &num_sat,
+            .hist_r = hist[0], .hist_g = hist[1], .hist_b = hist[2],
+        };
+        double t_hist, t_sat;
+        int k;
+
+        t_hist = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, NULL));
+        t_hist = get_time() - t_hist;
+        expected = hist[0][255] + hist[1][255] + hist[2][255];
+        if (num_sat != expected) {
+            fprintf(stderr, "error: %s: %u saturated, histograms say %u\n",
+                    cases[i].name, num_sat, expected);
+            exit(EXIT_FAILURE);
+        }
+
+        job.hist_r = job.hist_g = job.hist_b = NULL;
+        t_sat = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, NULL));
+        t_sat = get_time() - t_sat;
+
+        job.num_saturated = &num_sat_mt;
+        _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+        if (num_sat_mt != expected) {
+            fprintf(stderr, "error: %s: %u saturated with %d threads, "
+                            "expected %u\n",
+                    cases[i].name, num_sat_mt, NTHREADS, expected);
+            exit(EXIT_FAILURE);
+        }
+
+        job.num_saturated = &num_sat_grid;
+        job.sat_step = 4;
+        _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+        printf("%-10s: %7u saturated, %7u on a 4x4 grid; "
+               "%6.2f ms with histograms, %6.2f ms without\n",
+               cases[i].name, expected, num_sat_grid,
+               t_hist / NRUNS * 1e3, t_sat / NRUNS * 1e3);
+        if (num_sat_grid < expected * 0.9 || num_sat_grid > expected * 1.1) {
+            fprintf(stderr, "error: %s: the grid estimate is off\n",
+                    cases[i].name);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    priv_rpigrafx_pool_destroy(pool);
+    priv_rpigrafx_raw_scratch_free(&scratch);
+    free(raw);
+    free(dst);
+    fprintf(stderr, "OK\n");
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define MAX_WIDTH 4100
+
+/* Check the vectorized unpackers against the scalar one. */
+static int test_variant(const struct priv_rpigrafx_unpacker *up,
+                        const struct priv_rpigrafx_unpacker *ref,
+                        const int width)
+{
+    static uint8_t src[MAX_WIDTH * 2], ref8[MAX_WIDTH], out8[MAX_WIDTH];
+    static uint16_t ref16[MAX_WIDTH], out16[MAX_WIDTH];
+    int i;
+    int ret = 0;
+
+    for (i = 0; i < (int) sizeof(src); i ++)
+        src[i] = rand();
+
+#define CHECK(func, refbuf, outbuf) \
+    do { \
+        memset(refbuf, 0xa5, sizeof(refbuf)); \
+        memset(outbuf, 0xa5, sizeof(outbuf)); \
+        ref->func(refbuf, src, width); \
+        up->func(outbuf, src, width); \
+        if (memcmp(refbuf, outbuf, sizeof(refbuf))) { \
+            fprintf(stderr, "%s: %s differs for width %d\n", \
+                    up->name, #func, width); \
+            ret = 1; \
+        } \
+    } while (0)
+
+    CHECK(raw10_to_raw8,  ref8,  out8);
+    CHECK(raw10_to_raw16, ref16, out16);
+    CHECK(raw12_to_raw8,  ref8,  out8);
+    CHECK(raw12_to_raw16, ref16, out16);
+
+#undef CHECK
+
+    return ret;
+}
+
+int main()
+{
+    static const uint8_t raw10[5] = {0x12, 0x34, 0x56, 0x78, 0xe4},
+                         raw12[3] = {0x12, 0x34, 0xa5};
+    const struct priv_rpigrafx_unpacker *ref = priv_rpigrafx_unpack_variant(0);
+    uint16_t px[4];
+    int i, width;
+
+    /* The scalar reference itself. */
+    ref->raw10_to_raw16(px, raw10, 4);
+    if (px[0] != (0x12 << 2 | 0) || px[1] != (0x34 << 2 | 1)
+            || px[2] != (0x56 << 2 | 2) || px[3] != (0x78 << 2 | 3)) {
+        fprintf(stderr, "scalar raw10_to_raw16 is wrong\n");
+        exit(EXIT_FAILURE);
+    }
+    ref->raw12_to_raw16(px, raw12, 2);
+    if (px[0] != 0x125 || px[1] != 0x34a) {
+        fprintf(stderr, "scalar raw12_to_raw16 is wrong\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 1; i < priv_rpigrafx_unpack_num_variants(); i ++) {
+        const struct priv_rpigrafx_unpacker *up =
+                                            priv_rpigrafx_unpack_variant(i);
+        if (up == NULL)
+            continue;
+        fprintf(stderr, "Testing %s\n", up->name);
+        for (width = 2; width <= 130; width += 2)
+            _check(test_variant(up, ref, width));
+        _check(test_variant(up, ref, 3280));
+        _check(test_variant(up, ref, 4096));
+    }
+
+    priv_rpigrafx_unpack_init();
+    fprintf(stderr, "Selected %s\n", priv_rpigrafx_unpacker->name);
+
+    fprintf(stderr, "OK\n");
+    return 0;
+}
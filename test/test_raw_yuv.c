@@ -0,0 +1,224 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include "raw_pack.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+/* Not a multiple of 4 pairs, so that bands split at odd pairs. */
+#define WIDTH    1280
+#define HEIGHT   712
+#define NTHREADS 3
+#define NRUNS    10
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* 10-bit smooth color gradients with some saturated samples. */
+static void make_samples(uint16_t *v)
+{
+    int x, y;
+
+    srand(1);
+    for (y = 0; y < HEIGHT; y ++) {
+        for (x = 0; x < WIDTH; x ++) {
+            const int c = bggr_channel(x, y);
+            const unsigned s = (c == 0) ? x * 1023 / WIDTH
+                             : (c == 1) ? y * 1023 / HEIGHT
+                             : (x + y) * 1023 / (WIDTH + HEIGHT);
+            v[y * WIDTH + x] = (rand() % 50 == 0) ? 1023 : s;
+        }
+    }
+}
+
+static const struct {
+    const char *name;
+    rpigrafx_demosaic_mode_t mode;
+    _Bool superpixel;
+} cases[] = {
+    {"fused",      RPIGRAFX_DEMOSAIC_MODE_NEAREST,  0},
+    {"bilinear",   RPIGRAFX_DEMOSAIC_MODE_BILINEAR, 0},
+    {"superpixel", RPIGRAFX_DEMOSAIC_MODE_NEAREST, !0},
+};
+
+/* BT.601 limited range of the RGB888 output. */
+static float ref_y(const uint8_t *p)
+{
+    return 16 + (65.738f * p[0] + 129.057f * p[1] + 25.064f * p[2]) / 256;
+}
+
+static float ref_cb(const float r, const float g, const float b)
+{
+    return 128 + (-37.945f * r - 74.494f * g + 112.439f * b) / 256;
+}
+
+static float ref_cr(const float r, const float g, const float b)
+{
+    return 128 + (112.439f * r - 94.154f * g - 18.285f * b) / 256;
+}
+
+/*
+ * Check YUV output against the RGB24 output of the same job. Returns the
+ * largest error.
+ */
+static float check_yuv(const char *name, const uint8_t *rgb,
+                       const struct priv_rpigrafx_raw_job *job,
+                       const int32_t width, const int32_t height)
+{
+    const int step = (job->encoding == MMAL_ENCODING_NV12) ? 2 : 1;
+    float worst = 0;
+    int32_t x, y;
+
+    for (y = 0; y < height; y ++) {
+        for (x = 0; x < width; x ++) {
+            const float e = fabsf(job->dst[y * job->dst_stride + x]
+                                  - ref_y(rgb + (y * width + x) * 3));
+            worst = (e > worst) ? e : worst;
+        }
+    }
+    for (y = 0; y < height / 2; y ++) {
+        for (x = 0; x < width / 2; x ++) {
+            const uint8_t *p = rgb + (2 * y * width + 2 * x) * 3,
+                          *q = p + width * 3;
+            const float r = (p[0] + p[3] + q[0] + q[3]) / 4.0f,
+                        g = (p[1] + p[4] + q[1] + q[4]) / 4.0f,
+                        b = (p[2] + p[5] + q[2] + q[5]) / 4.0f,
+                        ecb = fabsf(job->dst_cb[y * job->dst_chroma_stride
+                                                + x * step]
+                                    - ref_cb(r, g, b)),
+                        ecr = fabsf(job->dst_cr[y * job->dst_chroma_stride
+                                                + x * step]
+                                    - ref_cr(r, g, b));
+            worst = (ecb > worst) ? ecb : worst;
+            worst = (ecr > worst) ? ecr : worst;
+            if (ecb > 1.5f || ecr > 1.5f) {
+                fprintf(stderr, "error: %s: Chroma (%d, %d) is off by "
+                                "%.1f, %.1f\n", name, x, y, ecb, ecr);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (worst > 1.5f) {
+        fprintf(stderr, "error: %s: Off by %.1f\n", name, worst);
+        exit(EXIT_FAILURE);
+    }
+    return worst;
+}
+
+/*
+ * I420 and NV12 output must be the RGB24 output converted to BT.601 limited
+ * range, with the same statistics, also when the frame is split into bands.
+ */
+int main()
+{
+    const int raw_stride = ALIGN_UP(WIDTH * 5 / 4, 32),
+              y_stride = ALIGN_UP(WIDTH, 32),
+              y_height = ALIGN_UP(HEIGHT, 16);
+    struct priv_rpigrafx_raw_scratch scratch = {0};
+    struct priv_rpigrafx_pool *pool = NULL;
+    uint16_t *v;
+    uint8_t *raw, *rgb, *yuv;
+    int i;
+
+    v = malloc(sizeof(*v) * WIDTH * HEIGHT);
+    raw = calloc(raw_stride, HEIGHT);
+    rgb = malloc(WIDTH * HEIGHT * 3);
+    yuv = malloc(y_stride * y_height * 3 / 2);
+    if (v == NULL || raw == NULL || rgb == NULL || yuv == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    _check(priv_rpigrafx_pool_create(&pool, NTHREADS, 0));
+    _check(priv_rpigrafx_raw_scratch_reserve(&scratch,
+                              priv_rpigrafx_raw_scratch_size(WIDTH, NTHREADS)));
+    make_samples(v);
+    pack_raw(raw, raw_stride, v, WIDTH, HEIGHT, 10);
+    free(v);
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i ++) {
+        const int32_t out_width = cases[i].superpixel ? WIDTH / 2 : WIDTH,
+                      out_height = cases[i].superpixel ? HEIGHT / 2 : HEIGHT;
+        struct priv_rpigrafx_awb_stats awb_rgb, awb_yuv;
+        uint32_t sat_rgb = 0, sat_yuv = 0;
+        struct priv_rpigrafx_raw_job job = {
+            .src = raw,
+            .src_stride = raw_stride,
+            .nbits = 10,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .demosaic_mode = cases[i].mode,
+            .superpixel = cases[i].superpixel,
+            .gain_r = 1.5, .gain_g = 1, .gain_b = 1.6,
+            .encoding = MMAL_ENCODING_RGB24,
+            .dst = rgb,
+            .dst_stride = out_width * 3,
+            .num_saturated = &sat_rgb,
+            .awb_stats = &awb_rgb,
+            .awb_step = 4
+        };
+        double t_rgb, t_i420, t_nv12;
+        float e_i420, e_nv12;
+        int k;
+
+        t_rgb = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+        t_rgb = get_time() - t_rgb;
+
+        job.encoding = MMAL_ENCODING_I420;
+        job.dst = yuv;
+        job.dst_stride = y_stride;
+        job.dst_cb = yuv + y_stride * y_height;
+        job.dst_cr = job.dst_cb + y_stride / 2 * y_height / 2;
+        job.dst_chroma_stride = y_stride / 2;
+        job.num_saturated = &sat_yuv;
+        job.awb_stats = &awb_yuv;
+        t_i420 = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+        t_i420 = get_time() - t_i420;
+        e_i420 = check_yuv(cases[i].name, rgb, &job, out_width, out_height);
+        if (sat_yuv != sat_rgb || memcmp(&awb_yuv, &awb_rgb, sizeof(awb_rgb))) {
+            fprintf(stderr, "error: %s: Statistics differ from RGB24\n",
+                    cases[i].name);
+            exit(EXIT_FAILURE);
+        }
+
+        job.encoding = MMAL_ENCODING_NV12;
+        job.dst_cr = job.dst_cb + 1;
+        job.dst_chroma_stride = y_stride;
+        t_nv12 = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, pool));
+        t_nv12 = get_time() - t_nv12;
+        e_nv12 = check_yuv(cases[i].name, rgb, &job, out_width, out_height);
+
+        printf("%-10s: off by at most %.2f (I420) %.2f (NV12); "
+               "%5.2f ms RGB24, %5.2f ms I420, %5.2f ms NV12\n",
+               cases[i].name, e_i420, e_nv12, t_rgb / NRUNS * 1e3,
+               t_i420 / NRUNS * 1e3, t_nv12 / NRUNS * 1e3);
+    }
+
+    priv_rpigrafx_raw_scratch_free(&scratch);
+    priv_rpigrafx_pool_destroy(pool);
+    free(raw);
+    free(rgb);
+    free(yuv);
+    fprintf(stderr, "OK\n");
+    return 0;
+}
@@ -1,6 +1,9 @@
 #include <rpigrafx.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #define _check(x) \
     do { \
@@ -18,35 +21,113 @@ static double get_time()
     return (double) tv.tv_sec + tv.tv_usec * 1e-6;
 }
 
-int main()
+/* Render each frame on the library thread and count it in *user. */
+static void render_callback(rpigrafx_frame_config_t *fcp, void *user)
 {
-    int i;
+    int *num_framesp = user;
+
+    _check(rpigrafx_render_frame(fcp));
+    __atomic_add_fetch(num_framesp, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pass -p to capture and process frames in the pipelined mode, -b2 or -b4
+ * to bin them on the sensor, -r to read out only a 1024x256 strip of it,
+ * -f<fps> to set the frame rate, -a to use the mean AE and wait for it to
+ * converge before capturing, -t<ms> to give up on frames which take longer
+ * than that, and -c with -p to have the frames delivered to a callback.
+ */
+int main(int argc, char *argv[])
+{
+    _Bool is_pipelined = 0, is_strip = 0, is_ae_mean = 0, use_callback = 0;
+    rpigrafx_rawcam_imx219_binning_mode_t binning_mode =
+                                      RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE;
+    int32_t width = 2048, height = 2048, bin = 1;
+    float framerate = 0, frame_period_us;
+    int i, timeout_ms = -1, num_timeouts = 0, num_callback_frames = 0;
     const int nframes = 100;
     int screen_width, screen_height;
     rpigrafx_frame_config_t fc;
     double start, end, time;
 
+    for (i = 1; i < argc; i ++) {
+        if (!strcmp(argv[i], "-p"))
+            is_pipelined = !0;
+        else if (!strcmp(argv[i], "-r"))
+            is_strip = !0;
+        else if (!strcmp(argv[i], "-a"))
+            is_ae_mean = !0;
+        else if (!strcmp(argv[i], "-c"))
+            use_callback = !0;
+        else if (!strncmp(argv[i], "-f", 2))
+            framerate = atof(argv[i] + 2);
+        else if (!strncmp(argv[i], "-t", 2))
+            timeout_ms = atoi(argv[i] + 2);
+        else if (!strcmp(argv[i], "-b2")) {
+            binning_mode = RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_2X2;
+            width = 1640;
+            height = 1232;
+            bin = 2;
+        } else if (!strcmp(argv[i], "-b4")) {
+            binning_mode = RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_4X4;
+            width = 820;
+            height = 616;
+            bin = 4;
+        }
+    }
+    if (is_strip) {
+        width = 1024 / bin;
+        height = 256 / bin;
+    }
+
     rpigrafx_set_verbose(1);
     _check(rpigrafx_get_screen_size(&screen_width, &screen_height));
-    _check(rpigrafx_config_camera_frame(0, 2048, 2048,
+    _check(rpigrafx_config_camera_frame(0, width, height,
                                         MMAL_ENCODING_RGB24, 0, &fc));
     _check(rpigrafx_config_rawcam(RPIGRAFX_RAWCAM_CAMERA_MODEL_IMX219,
                                   MMAL_CAMERA_RX_CONFIG_DECODE_NONE,
                                   MMAL_CAMERA_RX_CONFIG_ENCODE_NONE,
                                   MMAL_CAMERA_RX_CONFIG_UNPACK_NONE,
                                   MMAL_CAMERA_RX_CONFIG_PACK_NONE,
-                                  2, 10, RPIGRAFX_BAYER_PATTERN_BGGR, &fc));
-    _check(rpigrafx_config_rawcam_imx219(24.0, 0, 0, 1, 1,
-                                       RPIGRAFX_RAWCAM_IMX219_BINNING_MODE_NONE,
+                                  2, 10, RPIGRAFX_BAYER_PATTERN_BGGR,
+                                  RPIGRAFX_DEMOSAIC_MODE_NEAREST, &fc));
+    _check(rpigrafx_config_rawcam_imx219(24.0, 0, 0, 1, 1, binning_mode,
                                          &fc));
+    if (is_strip)
+        _check(rpigrafx_config_rawcam_roi(1128, 1104, 1024, 256, &fc));
+    _check(rpigrafx_config_rawcam_workers(4, 1, &fc));
+    _check(rpigrafx_config_rawcam_pipelined(is_pipelined, &fc));
+    if (is_ae_mean) {
+        _check(rpigrafx_config_rawcam_ae(RPIGRAFX_AE_MODE_MEAN,
+                                         RPIGRAFX_AE_METERING_CENTER, 0.18,
+                                         &fc));
+        _check(rpigrafx_config_rawcam_ae_wait(30, &fc));
+    }
     _check(rpigrafx_config_camera_frame_render(0, 0, 0, screen_width, screen_height, 0, &fc));
+    if (use_callback)
+        _check(rpigrafx_config_frame_callback(render_callback,
+                                              &num_callback_frames, &fc));
     _check(rpigrafx_finish_config());
+    _check(rpigrafx_set_rawcam_framerate(framerate, &frame_period_us, &fc));
+    fprintf(stderr, "Frame period: %f [us]\n", frame_period_us);
 
     start = get_time();
-    for (i = 0; i < nframes; i ++) {
+    while (use_callback && __atomic_load_n(&num_callback_frames,
+                                           __ATOMIC_ACQUIRE) < nframes)
+        usleep(1000);
+    for (i = 0; i < nframes && !use_callback; i ++) {
         void *p = NULL;
         fprintf(stderr, "#%d\n", i);
-        _check(rpigrafx_capture_next_frame(&fc));
+        if (timeout_ms >= 0) {
+            const int status = rpigrafx_capture_next_frame_timeout(&fc,
+                                                                timeout_ms);
+            if (status == RPIGRAFX_TIMED_OUT) {
+                num_timeouts ++;
+                continue;
+            }
+            _check(status);
+        } else
+            _check(rpigrafx_capture_next_frame(&fc));
         p = rpigrafx_get_frame(&fc);
         _check(rpigrafx_render_frame(&fc));
     }
@@ -54,6 +135,48 @@ int main()
 
     time = end - start;
     fprintf(stderr, "%f [s], %f [frame/s]\n", time, nframes / time);
+    if (timeout_ms >= 0)
+        fprintf(stderr, "%d frames timed out after %d [ms]\n", num_timeouts,
+                timeout_ms);
+    if (use_callback) {
+        uint64_t num_delivered, num_dropped;
+        _check(rpigrafx_get_frame_callback_stats(&fc, &num_delivered,
+                                                 &num_dropped));
+        fprintf(stderr, "%llu frames delivered to the callback, "
+                        "%llu dropped\n",
+                (unsigned long long) num_delivered,
+                (unsigned long long) num_dropped);
+    }
+
+    {
+        rpigrafx_rawcam_stats_t stats;
+        _check(rpigrafx_get_rawcam_stats(&fc, &stats));
+        fprintf(stderr, "%llu frames, %llu scratch allocs, "
+                        "%llu allocs while capturing, "
+                        "%u saturated in the last frame, "
+                        "white balance gains %.3f %.3f %.3f, "
+                        "%llu tone map builds\n",
+                (unsigned long long) stats.num_frames,
+                (unsigned long long) stats.num_scratch_allocs,
+                (unsigned long long) stats.num_frame_allocs,
+                stats.num_saturated, stats.gain_r, stats.gain_g, stats.gain_b,
+                (unsigned long long) stats.num_tone_builds);
+        if (is_ae_mean)
+            fprintf(stderr, "AE: waited %u frames, luminance %.3f, %s\n",
+                    stats.num_ae_wait_frames, stats.ae_luma,
+                    stats.is_ae_converged ? "converged" : "not converged");
+    }
+    {
+        rpigrafx_rawcam_metadata_t md;
+        _check(rpigrafx_get_rawcam_metadata(&fc, &md));
+        if (md.is_valid)
+            fprintf(stderr, "Last frame: %u, exposure %f [us], "
+                            "frame period %f [us], gains %.3f %.3f\n",
+                    md.frame_count, md.exposure_us, md.frame_period_us,
+                    md.analog_gain, md.digital_gain);
+        else
+            fprintf(stderr, "Last frame: no embedded data\n");
+    }
 
     return 0;
 }
@@ -0,0 +1,188 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include "raw_pack.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define WIDTH  1280
+#define HEIGHT 720
+#define GAMMA  2.2f
+#define NRUNS  10
+
+static const float gains[3] = {1.55, 1.0, 1.5};
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Random 10-bit samples. */
+static void make_samples(uint16_t *v)
+{
+    int i;
+
+    srand(1);
+    for (i = 0; i < WIDTH * HEIGHT; i ++)
+        v[i] = rand() % 1024;
+}
+
+/* Samples of which every one is s. */
+static void make_flat_samples(uint16_t *v, const unsigned s)
+{
+    int i;
+
+    for (i = 0; i < WIDTH * HEIGHT; i ++)
+        v[i] = s;
+}
+
+/* The maps must be rebuilt only when a parameter changes. */
+static void test_cache(struct priv_rpigrafx_tone *tone)
+{
+    priv_rpigrafx_tone_init(tone);
+    if (!priv_rpigrafx_tone_update(tone, 1.5, 1, 1.5, 1, 10, 8)
+            || priv_rpigrafx_tone_update(tone, 1.5, 1, 1.5, 1, 10, 8)
+            || !priv_rpigrafx_tone_update(tone, 1.5, 1, 1.6, 1, 10, 8)
+            || !priv_rpigrafx_tone_update(tone, 1.5, 1, 1.6, GAMMA, 10, 8)
+            || !priv_rpigrafx_tone_update(tone, 1.5, 1, 1.6, GAMMA, 10, 10)
+            || priv_rpigrafx_tone_update(tone, 1.5, 1, 1.6, GAMMA, 10, 10)
+            || tone->num_builds != 4) {
+        fprintf(stderr, "error: The maps were not cached\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static const struct {
+    const char *name;
+    MMAL_FOURCC_T encoding;
+    rpigrafx_demosaic_mode_t mode;
+} cases[] = {
+    {"fused",    MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_NEAREST},
+    {"bilinear", MMAL_ENCODING_RGB24,     RPIGRAFX_DEMOSAIC_MODE_BILINEAR},
+    {"rgb48",    RPIGRAFX_ENCODING_RGB48, RPIGRAFX_DEMOSAIC_MODE_BILINEAR},
+};
+
+int main()
+{
+    const int raw_stride = ALIGN_UP(WIDTH * 5 / 4, 32);
+    struct priv_rpigrafx_raw_scratch scratch = {0};
+    static struct priv_rpigrafx_tone tone;
+    uint16_t *v;
+    uint8_t *raw, *dst, *ref;
+    double t;
+    int i;
+
+    v = malloc(sizeof(*v) * WIDTH * HEIGHT);
+    raw = calloc(raw_stride, HEIGHT);
+    dst = malloc(WIDTH * HEIGHT * 6);
+    ref = malloc(WIDTH * HEIGHT * 6);
+    if (v == NULL || raw == NULL || dst == NULL || ref == NULL) {
+        fprintf(stderr, "error: Failed to allocate buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    _check(priv_rpigrafx_raw_scratch_reserve(&scratch,
+                                     priv_rpigrafx_raw_scratch_size(WIDTH, 1)));
+
+    test_cache(&tone);
+
+    t = get_time();
+    for (i = 0; i < NRUNS; i ++) {
+        priv_rpigrafx_tone_init(&tone);
+        priv_rpigrafx_tone_update(&tone, gains[0], gains[1], gains[2], GAMMA,
+                                  10, 8);
+    }
+    printf("building maps with gamma: %.3f ms\n",
+           (get_time() - t) / NRUNS * 1e3);
+
+    for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i ++) {
+        const unsigned out_bits =
+                        (cases[i].encoding == MMAL_ENCODING_RGB24) ? 8 : 10;
+        const int bpp = (out_bits == 8) ? 3 : 6;
+        struct priv_rpigrafx_raw_job job = {
+            .src = raw,
+            .src_stride = raw_stride,
+            .nbits = 10,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .demosaic_mode = cases[i].mode,
+            .gain_r = gains[0], .gain_g = gains[1], .gain_b = gains[2],
+            .encoding = cases[i].encoding,
+            .dst = dst,
+            .dst_stride = WIDTH * bpp,
+        };
+        double t_linear, t_gamma;
+        int32_t maxv = (1 << out_bits) - 1, k;
+
+        /* Linear maps give the same output as the plain gains. */
+        make_samples(v);
+        pack_raw(raw, raw_stride, v, WIDTH, HEIGHT, 10);
+        job.dst = ref;
+        _check(priv_rpigrafx_raw_process(&job, scratch.base, NULL));
+        priv_rpigrafx_tone_init(&tone);
+        priv_rpigrafx_tone_update(&tone, gains[0], gains[1], gains[2], 1,
+                                  10, out_bits);
+        job.tone = &tone;
+        job.dst = dst;
+        t_linear = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, NULL));
+        t_linear = get_time() - t_linear;
+        if (memcmp(dst, ref, WIDTH * HEIGHT * bpp)) {
+            fprintf(stderr, "error: %s: Linear maps differ from the gains\n",
+                    cases[i].name);
+            exit(EXIT_FAILURE);
+        }
+
+        priv_rpigrafx_tone_update(&tone, gains[0], gains[1], gains[2], GAMMA,
+                                  10, out_bits);
+        t_gamma = get_time();
+        for (k = 0; k < NRUNS; k ++)
+            _check(priv_rpigrafx_raw_process(&job, scratch.base, NULL));
+        t_gamma = get_time() - t_gamma;
+        printf("%-8s: %6.2f ms linear, %6.2f ms with gamma\n", cases[i].name,
+               t_linear / NRUNS * 1e3, t_gamma / NRUNS * 1e3);
+
+        /* A flat frame comes out at the gamma of the gained value. */
+        make_flat_samples(v, 300);
+        pack_raw(raw, raw_stride, v, WIDTH, HEIGHT, 10);
+        _check(priv_rpigrafx_raw_process(&job, scratch.base, NULL));
+        for (k = 0; k < 3; k ++) {
+            /* The fused kernel takes the upper 8 bits. */
+            const float in = (cases[i].mode == RPIGRAFX_DEMOSAIC_MODE_NEAREST)
+                             ? (300 >> 2) : 300 / 4.0f * (1 << (out_bits - 8));
+            const float lin = fminf(in * gains[k], maxv),
+                        expected = maxv * powf(lin / maxv, 1 / GAMMA);
+            const float got = (out_bits == 8)
+                    ? dst[(HEIGHT / 2 * WIDTH + WIDTH / 2) * 3 + k]
+                    : ((uint16_t*) dst)[(HEIGHT / 2 * WIDTH + WIDTH / 2) * 3
+                                        + k];
+            if (fabsf(got - expected) > 1) {
+                fprintf(stderr, "error: %s: Channel %d is %.0f, "
+                                "expected %.1f\n",
+                        cases[i].name, k, got, expected);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    priv_rpigrafx_raw_scratch_free(&scratch);
+    free(v);
+    free(raw);
+    free(dst);
+    free(ref);
+    fprintf(stderr, "OK\n");
+    return 0;
+}
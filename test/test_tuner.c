@@ -0,0 +1,195 @@
+#include <rpigrafx.h>
+#include "local.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define _check(x) \
+    do { \
+        const int ret = ((x)); \
+        if (ret) { \
+            fprintf(stderr, "%s:%d: error: %d\n", __FILE__, __LINE__, ret); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+/*
+ * A synthetic sensor whose tuner takes tune_us and whose state is changed by
+ * each run. Frames are posted every FRAME_US, which is long enough for the
+ * tuner to finish before the next one unless tune_us is longer.
+ */
+#define FRAME_US 2000
+
+struct sensor {
+    int tune_us;
+    int num_tunes, num_updates;
+    int ret;
+    /* Changed by every run of the tuner. */
+    float exposure_us;
+};
+
+static double get_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int sensor_update(void *user)
+{
+    struct sensor *sensor = user;
+
+    sensor->num_updates ++;
+    return 0;
+}
+
+static int sensor_tune(void *user,
+                       const struct priv_rpigrafx_tuner_stats *stats)
+{
+    struct sensor *sensor = user;
+
+    (void) stats;
+    usleep(sensor->tune_us);
+    sensor->num_tunes ++;
+    sensor->exposure_us += 100;
+    return sensor->ret;
+}
+
+static const struct priv_rpigrafx_tuner_ops ops = {
+    .update = sensor_update,
+    .tune = sensor_tune,
+};
+
+/*
+ * Post num_frames frames with num_saturated and, if has_metadata, the state
+ * of the sensor, which is changed by the tuner only if is_reported. Return
+ * the longest time which a post took in us.
+ */
+static float post_frames(struct priv_rpigrafx_tuner *tn, struct sensor *sensor,
+                         const int num_frames, const uint32_t num_saturated,
+                         const _Bool has_metadata, const _Bool is_reported)
+{
+    struct priv_rpigrafx_tuner_stats stats;
+    float max_us = 0;
+    int i;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.num_saturated = num_saturated;
+    stats.metadata.is_valid = has_metadata;
+    stats.metadata.analog_gain = stats.metadata.digital_gain = 1;
+    for (i = 0; i < num_frames; i ++) {
+        double start;
+        float us;
+
+        stats.metadata.exposure_us = is_reported ? sensor->exposure_us : 0;
+        start = get_time();
+        priv_rpigrafx_tuner_post(tn, &stats);
+        us = (get_time() - start) * 1e6;
+        if (us > max_us)
+            max_us = us;
+        usleep(FRAME_US);
+    }
+    return max_us;
+}
+
+static uint64_t num_runs(struct priv_rpigrafx_tuner *tn)
+{
+    uint64_t n;
+    float latency_us, max_latency_us;
+
+    priv_rpigrafx_tuner_get_stats(tn, &n, &latency_us, &max_latency_us);
+    return n;
+}
+
+static void expect_runs(const char *name, struct priv_rpigrafx_tuner *tn,
+                        const uint64_t expected)
+{
+    const uint64_t n = num_runs(tn);
+
+    printf("%-24s: %llu runs\n", name, (unsigned long long) n);
+    if (n != expected) {
+        fprintf(stderr, "error: %s: %llu runs, expected %llu\n", name,
+                (unsigned long long) n, (unsigned long long) expected);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main()
+{
+    struct priv_rpigrafx_tuner *tn = NULL;
+    struct sensor sensor = {.tune_us = 100};
+    uint64_t n;
+    float post_us, latency_us, max_latency_us;
+
+    /* Every 4th frame; the first one is always due. */
+    _check(priv_rpigrafx_tuner_create(&tn, &ops, &sensor, 4, 0));
+    post_frames(tn, &sensor, 41, 100, 0, 0);
+    expect_runs("every 4th frame", tn, 11);
+
+    /* Only a significant change of the saturated samples is due earlier. */
+    priv_rpigrafx_tuner_set_cadence(tn, 1000, 0.5);
+    post_frames(tn, &sensor, 10, 110, 0, 0);
+    expect_runs("small change", tn, 11);
+    post_frames(tn, &sensor, 1, 200, 0, 0);
+    expect_runs("large change", tn, 12);
+
+    /*
+     * Every frame, but wait up to 3 frames for the sensor to report the
+     * settings of the last run.
+     */
+    priv_rpigrafx_tuner_set_cadence(tn, 1, 0);
+    post_frames(tn, &sensor, 2, 200, 1, 0);
+    expect_runs("first report", tn, 13);
+    post_frames(tn, &sensor, 12, 200, 1, 0);
+    expect_runs("settings not reported", tn, 16);
+    post_frames(tn, &sensor, 12, 200, 1, 1);
+    expect_runs("settings reported", tn, 28);
+
+    /* Manual settings are written, and the tuner doesn't run meanwhile. */
+    priv_rpigrafx_tuner_update(tn, 0);
+    post_frames(tn, &sensor, 5, 200, 0, 0);
+    expect_runs("disabled", tn, 28);
+    priv_rpigrafx_tuner_update(tn, !0);
+    post_frames(tn, &sensor, 5, 200, 0, 0);
+    expect_runs("enabled", tn, 33);
+    if (sensor.num_updates != 2) {
+        fprintf(stderr, "error: %d updates, expected 2\n",
+                sensor.num_updates);
+        exit(EXIT_FAILURE);
+    }
+    priv_rpigrafx_tuner_destroy(tn);
+
+    /*
+     * A tuner slower than frames never delays posting them. Statistics are
+     * dropped instead, and the latency includes the wait for the thread.
+     */
+    sensor.tune_us = 5 * FRAME_US;
+    sensor.num_tunes = 0;
+    _check(priv_rpigrafx_tuner_create(&tn, &ops, &sensor, 1, 0));
+    post_us = post_frames(tn, &sensor, 20, 100, 0, 0);
+    usleep(3 * sensor.tune_us);
+    priv_rpigrafx_tuner_get_stats(tn, &n, &latency_us, &max_latency_us);
+    printf("slow tuner              : %llu runs for 20 frames, "
+           "latency %.0f us at most, post %.0f us at most\n",
+           (unsigned long long) n, max_latency_us, post_us);
+    if (n >= 10 || n != (uint64_t) sensor.num_tunes
+            || max_latency_us < sensor.tune_us || post_us > FRAME_US) {
+        fprintf(stderr, "error: Slow tuner delayed frames\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* A failing run stops the thread. */
+    sensor.tune_us = 0;
+    sensor.ret = 1;
+    post_frames(tn, &sensor, 2, 100, 0, 0);
+    if (!priv_rpigrafx_tuner_status(tn)) {
+        fprintf(stderr, "error: Tuner is still running after a failure\n");
+        exit(EXIT_FAILURE);
+    }
+    priv_rpigrafx_tuner_destroy(tn);
+
+    fprintf(stderr, "OK\n");
+    return 0;
+}